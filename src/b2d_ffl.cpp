@@ -14,16 +14,24 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <boost/bind.hpp>
+
 #include "asserts.hpp"
 #include "b2d_ffl.hpp"
+#include "foreach.hpp"
+#include "frame_timings.hpp"
 #include "graphics.hpp"			// -- needed for debug functions
 #include "json_parser.hpp"
 #include "level.hpp"
+#include "preferences.hpp"
 #include "raster.hpp"
+#include "thread.hpp"
 #include "variant_utils.hpp"
 
 #ifdef USE_BOX2D
 
+PREF_BOOL(box2d_background_step, false, "Step the Box2D world on a worker thread while objects are processed. Objects see bodies as they were at the start of the step and changes to them wait until it's finished.");
+
 namespace box2d
 {
 	class joint_factory
@@ -62,7 +70,14 @@ namespace box2d
 			// if the world has destructed the body will already have been destroyed.
 			if(current_world != NULL) {
 				std::cerr << "body_destructor: " << b << std::endl;
-				current_world->DestroyBody(b);
+				if(world::stepping_in_background()) {
+					// the body this belonged to is gone, but other bodies
+					// may still be touching this until it's destroyed.
+					b->SetUserData(NULL);
+					world::defer(boost::bind(&b2World::DestroyBody, current_world, b));
+				} else {
+					current_world->DestroyBody(b);
+				}
 			}
 		}
 	};
@@ -149,7 +164,14 @@ namespace box2d
 	world::~world()
 	{
 		std::cerr << "DESTRUCTING WORLD" << std::endl;
+		if(step_thread_) {
+			step_thread_->join();
+		}
 		clear_current_world();
+
+		// Anything still queued goes with the world, so bodies released
+		// now mustn't try to destroy themselves.
+		deferred_.clear();
 	}
 
 	const world& world::our_world()
@@ -170,8 +192,82 @@ namespace box2d
 
 	void world::step(float time_step)
 	{
+		finish_step();
 		set_dt(time_step);
-		get_world().Step(time_step, velocity_iterations_, position_iterations_);
+		if(!g_box2d_background_step) {
+			run_step(time_step);
+			return;
+		}
+
+		record_body_states();
+		step_thread_.reset(new threading::thread("box2d_step", boost::bind(&world::run_step, this, time_step)));
+	}
+
+	void world::run_step(float time_step)
+	{
+		const frame_timings::scope timing("box2d::world::step");
+		world_.Step(time_step, velocity_iterations_, position_iterations_);
+	}
+
+	void world::finish_step()
+	{
+		if(!step_thread_) {
+			return;
+		}
+
+		{
+			const frame_timings::scope timing("box2d::world::finish_step");
+			step_thread_->join();
+			step_thread_.reset();
+		}
+
+		// Changes are made in the order they were asked for, so running
+		// the same level again gives the same results.
+		std::vector<boost::function<void()> > deferred;
+		deferred.swap(deferred_);
+		foreach(const boost::function<void()>& fn, deferred) {
+			fn();
+		}
+		frame_timings::add_counter("box2d deferred changes", deferred.size());
+	}
+
+	bool world::stepping_in_background()
+	{
+		return this_world && this_world->step_thread_;
+	}
+
+	void world::defer(boost::function<void()> fn)
+	{
+		ASSERT_LOG(this_world, "world::defer() called with no world");
+		this_world->deferred_.push_back(fn);
+	}
+
+	void world::record_body_states()
+	{
+		body_states_.clear();
+		for(const b2Body* b = world_.GetBodyList(); b != NULL; b = b->GetNext()) {
+			body_state& s = body_states_[b];
+			s.position = b->GetPosition();
+			s.angle = b->GetAngle();
+			s.linear_velocity = b->GetLinearVelocity();
+			s.angular_velocity = b->GetAngularVelocity();
+			s.active = b->IsActive();
+			s.awake = b->IsAwake();
+			s.bullet = b->IsBullet();
+			s.fixed_rotation = b->IsFixedRotation();
+			s.allow_sleeping = b->IsSleepingAllowed();
+			for(const b2ContactEdge* ce = b->GetContactList(); ce != NULL; ce = ce->next) {
+				if(ce->contact->IsTouching()) {
+					s.touching.push_back(ce->other);
+				}
+			}
+		}
+	}
+
+	const world::body_state* world::get_body_state(const b2Body* b) const
+	{
+		boost::unordered_map<const b2Body*, body_state>::const_iterator itor = body_states_.find(b);
+		return itor != body_states_.end() ? &itor->second : NULL;
 	}
 
 	void world::finish_loading()
@@ -236,6 +332,11 @@ namespace box2d
 
 	void world::set_value(const std::string& key, const variant& value)
 	{
+		if(stepping_in_background()) {
+			defer(boost::bind(&world::set_value, world_ptr(this), key, value));
+			return;
+		}
+
 		if(key == "gravity") {
 			ASSERT_LOG(value.is_list() && value.num_elements() == 2, 
 				"gravity must be a list of two elements");
@@ -503,21 +604,102 @@ namespace box2d
 		body_def_.position.x /= wp->scale();
 		body_def_.position.y /= wp->scale();
 
-		body_ = boost::shared_ptr<b2Body>(wp->create_body(this), body_destructor());
+		if(world::stepping_in_background()) {
+			body_.reset();
+			world::defer(boost::bind(&body::create_body, body_ptr(this)));
+		} else {
+			create_body();
+		}
+	}
+
+	void body::create_body()
+	{
+		body_ = boost::shared_ptr<b2Body>(world::our_world_ptr()->create_body(this), body_destructor());
 		foreach(const boost::shared_ptr<b2FixtureDef> fix_def, fix_defs_) {
 			body_->CreateFixture(fix_def.get());
 		}
 		body_->ResetMassData();
 	}
 
+	namespace
+	{
+		// What a body is like while the world steps in the background.
+		// Bodies made since it started are as they were defined.
+		world::body_state get_stepping_state(const b2Body* b, const b2BodyDef& def)
+		{
+			const world::body_state* state = b ? world::our_world().get_body_state(b) : NULL;
+			if(state) {
+				return *state;
+			}
+
+			world::body_state s;
+			s.position = def.position;
+			s.angle = def.angle;
+			s.linear_velocity = def.linearVelocity;
+			s.angular_velocity = def.angularVelocity;
+			s.active = def.active;
+			s.awake = def.awake;
+			s.bullet = def.bullet;
+			s.fixed_rotation = def.fixedRotation;
+			s.allow_sleeping = def.allowSleep;
+			return s;
+		}
+	}
+
+	b2Vec2 body::position() const
+	{
+		if(world::stepping_in_background()) {
+			return get_stepping_state(body_.get(), body_def_).position;
+		}
+		return body_->GetPosition();
+	}
+
+	float body::angle() const
+	{
+		if(world::stepping_in_background()) {
+			return get_stepping_state(body_.get(), body_def_).angle;
+		}
+		return body_->GetAngle();
+	}
+
+	void body::get_touching(std::vector<b2Body*>* bodies) const
+	{
+		if(world::stepping_in_background()) {
+			const world::body_state* state = body_ ? world::our_world().get_body_state(body_.get()) : NULL;
+			if(state) {
+				// bodies waiting to be destroyed have no user data, and
+				// aren't touching anything any more.
+				foreach(b2Body* other, state->touching) {
+					if(other->GetUserData() != NULL) {
+						bodies->push_back(other);
+					}
+				}
+			}
+			return;
+		}
+
+		for(b2ContactEdge* ce = body_->GetContactList(); ce != NULL; ce = ce->next) {
+			if(ce->contact->IsTouching() && ce->other->GetUserData() != NULL) {
+				bodies->push_back(ce->other);
+			}
+		}
+	}
+
 	bool body::active() const
 	{
+		if(world::stepping_in_background()) {
+			return get_stepping_state(body_.get(), body_def_).active;
+		}
 		ASSERT_LOG(body_ != NULL, "body_ is NULL in active()");
 		return body_->IsActive();
 	}
 
 	void body::set_active(bool actv)
 	{
+		if(world::stepping_in_background()) {
+			world::defer(boost::bind(&body::set_active, body_ptr(this), actv));
+			return;
+		}
 		ASSERT_LOG(body_ != NULL, "body_ is NULL in set_active()");
 		body_->SetActive(actv);
 	}
@@ -525,6 +707,42 @@ namespace box2d
 
 	variant body::get_value(const std::string& key) const
 	{
+		if(world::stepping_in_background()) {
+			// Step changes these, so they come from before it started.
+			const world::body_state s = get_stepping_state(body_.get(), body_def_);
+			if(key == "active") {
+				return variant::from_bool(s.active);
+			} else if(key == "angle") {
+				return variant(s.angle);
+			} else if(key == "angular_velocity") {
+				return variant(s.angular_velocity);
+			} else if(key == "allow_sleeping") {
+				return variant::from_bool(s.allow_sleeping);
+			} else if(key == "awake") {
+				return variant::from_bool(s.awake);
+			} else if(key == "bullet") {
+				return variant::from_bool(s.bullet);
+			} else if(key == "fixed_rotation") {
+				return variant::from_bool(s.fixed_rotation);
+			} else if(key == "linear_velocity") {
+				std::vector<variant> v;
+				v.push_back(variant(s.linear_velocity.x));
+				v.push_back(variant(s.linear_velocity.y));
+				return variant(&v);
+			} else if(key == "position") {
+				std::vector<variant> v;
+				v.push_back(variant(s.position.x));
+				v.push_back(variant(s.position.y));
+				return variant(&v);
+			}
+
+			// The rest aren't changed by stepping, but a body which is
+			// still waiting to be made needs the step to finish first.
+			if(body_ == NULL) {
+				world::our_world_ptr()->finish_step();
+			}
+		}
+
 		ASSERT_LOG(body_ != NULL, "Can't set parameters on this body. body_ == NULL");
 		if(key == "active") {
 			return variant::from_bool(body_->IsActive());
@@ -583,6 +801,11 @@ namespace box2d
 
 	void body::set_value(const std::string& key, const variant& value)
 	{
+		if(world::stepping_in_background()) {
+			world::defer(boost::bind(&body::set_value, body_ptr(this), key, value));
+			return;
+		}
+
 		ASSERT_LOG(body_ != NULL, "Can't set parameters on this body. body_ == NULL");
 		if(key == "active") {
 			body_->SetActive(value.as_bool());
@@ -1118,6 +1341,12 @@ namespace box2d
 
 	variant joint::get_value(const std::string& key) const
 	{
+		// Joints are read and changed rarely, so they just wait for the
+		// step rather than being kept track of.
+		if(world::stepping_in_background()) {
+			world::our_world_ptr()->finish_step();
+		}
+
 		ASSERT_LOG(joint_ != NULL, "Internal joint has been destroyed.");
 		if(key == "a") {
 			return variant((body*)joint_->GetBodyA()->GetUserData());
@@ -1428,6 +1657,10 @@ namespace box2d
 
 	void joint::set_value(const std::string& key, const variant& value)
 	{
+		if(world::stepping_in_background()) {
+			world::our_world_ptr()->finish_step();
+		}
+
 		ASSERT_LOG(joint_ != NULL, "Internal joint has been destroyed.");
 		if(joint_->GetType() == e_revoluteJoint) {
 			b2RevoluteJoint* revolute = (b2RevoluteJoint*)joint_;
@@ -21,8 +21,11 @@
 #ifdef USE_BOX2D
 
 #include <Box2D/Box2D.h>
+#include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/intrusive_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <vector>
 #include <map>
@@ -32,6 +35,11 @@
 #include "geometry.hpp"
 #include "variant.hpp"
 
+namespace threading
+{
+	class thread;
+}
+
 namespace box2d
 {
 	class manager
@@ -95,11 +103,21 @@ namespace box2d
 		void finish_loading(entity_ptr e=NULL);
 		boost::shared_ptr<b2FixtureDef> create_fixture(const variant& fix);
 
+		// Where the body is, and the bodies it's touching, in the order
+		// Box2D keeps its contacts. While the world steps in the
+		// background these are as they were when the step started. Bodies
+		// with no object, or waiting to be destroyed, aren't counted.
+		b2Vec2 position() const;
+		float angle() const;
+		void get_touching(std::vector<b2Body*>* bodies) const;
+
 		variant write();
 		variant fix_write();
 		variant shape_write(const b2Shape* shape);
 	protected:
 	private:
+		void create_body();
+
 		b2BodyDef body_def_;
 		std::vector<boost::shared_ptr<b2FixtureDef> > fix_defs_;
 		std::vector<boost::shared_ptr<b2Shape> > shape_list_;
@@ -132,6 +150,28 @@ namespace box2d
 		void finish_loading();
 		void step(float time_step);
 
+		// Waits for a step running in the background, then makes the
+		// changes which were queued while it ran.
+		void finish_step();
+
+		// While a step runs in the background nothing may touch the
+		// b2World, so changes are queued with defer() and made when it's
+		// finished, and bodies are read from what they were like when it
+		// started.
+		static bool stepping_in_background();
+		static void defer(boost::function<void()> fn);
+
+		struct body_state
+		{
+			b2Vec2 position;
+			float angle;
+			b2Vec2 linear_velocity;
+			float angular_velocity;
+			bool active, awake, bullet, fixed_rotation, allow_sleeping;
+			std::vector<b2Body*> touching;
+		};
+		const body_state* get_body_state(const b2Body* b) const;
+
 		joint_ptr find_joint_by_id(const std::string& key) const;
 
 		float x1() const { return world_x1_; }
@@ -178,6 +218,13 @@ namespace box2d
 		debug_draw debug_draw_;
 
 		destruction_listener destruction_listener_;
+
+		void run_step(float time_step);
+		void record_body_states();
+
+		boost::scoped_ptr<threading::thread> step_thread_;
+		std::vector<boost::function<void()> > deferred_;
+		boost::unordered_map<const b2Body*, body_state> body_states_;
 	};
 }
 
@@ -17,11 +17,14 @@
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <vector>
 
 #include "background_task_pool.hpp"
 #include "foreach.hpp"
+#include "frame_timings.hpp"
 #include "thread.hpp"
 
 namespace background_task_pool
@@ -43,16 +46,95 @@ std::map<int, task> task_map;
 
 void run_task(boost::function<void()> job, int task_id)
 {
-	job();
-	threading::lock(*completed_tasks_mutex);
+	{
+		const frame_timings::scope timing("background_task");
+		job();
+	}
+
+	threading::lock lck(*completed_tasks_mutex);
 	completed_tasks.push_back(task_id);
 }
 
+//a call to parallel_for(). The ranges are taken in order by the caller
+//and the worker threads until none are left.
+struct parallel_job {
+	boost::function<void(int,int)> fn;
+	int n, nranges;
+	int next_range, ranges_left;
+};
+
+//the below is protected by parallel_mutex.
+threading::mutex parallel_mutex;
+threading::condition parallel_work_cond, parallel_done_cond;
+
+//jobs which still have ranges to be taken.
+std::deque<parallel_job*> parallel_jobs;
+bool quit_parallel_workers = false;
+
+//the threads ranges are run on, kept for as long as the manager is.
+std::vector<boost::shared_ptr<threading::thread> > parallel_workers;
+
+//takes the next range of the job, returning false if they've all been
+//taken. Must be called with parallel_mutex held.
+bool take_range(parallel_job& job, int* begin, int* end)
+{
+	if(job.next_range == job.nranges) {
+		return false;
+	}
+
+	const int i = job.next_range++;
+	if(job.next_range == job.nranges) {
+		parallel_jobs.erase(std::find(parallel_jobs.begin(), parallel_jobs.end(), &job));
+	}
+
+	*begin = (job.n*i)/job.nranges;
+	*end = (job.n*(i+1))/job.nranges;
+	return true;
+}
+
+void finish_range(parallel_job& job)
+{
+	threading::lock lck(parallel_mutex);
+	if(--job.ranges_left == 0) {
+		parallel_done_cond.notify_all();
+	}
+}
+
+void parallel_worker()
+{
+	for(;;) {
+		parallel_job* job = NULL;
+		int begin = 0, end = 0;
+		{
+			threading::lock lck(parallel_mutex);
+			while(parallel_jobs.empty() && !quit_parallel_workers) {
+				parallel_work_cond.wait(parallel_mutex);
+			}
+
+			if(parallel_jobs.empty()) {
+				return;
+			}
+
+			job = parallel_jobs.front();
+			take_range(*job, &begin, &end);
+		}
+
+		job->fn(begin, end);
+		finish_range(*job);
+	}
+}
+
 }
 
 manager::manager()
 {
 	completed_tasks_mutex = new threading::mutex;
+
+	//the thread calling parallel_for() runs ranges too.
+	quit_parallel_workers = false;
+	for(int n = 1; n < SDL_GetCPUCount(); ++n) {
+		parallel_workers.push_back(boost::shared_ptr<threading::thread>(new threading::thread("parallel_for", parallel_worker)));
+	}
 }
 
 manager::~manager()
@@ -60,6 +142,15 @@ manager::~manager()
 	while(task_map.empty() == false) {
 		pump();
 	}
+
+	{
+		threading::lock lck(parallel_mutex);
+		quit_parallel_workers = true;
+		parallel_work_cond.notify_all();
+	}
+
+	//the threads are joined as they are destroyed.
+	parallel_workers.clear();
 }
 
 void submit(boost::function<void()> job, boost::function<void()> on_complete)
@@ -73,7 +164,7 @@ void pump()
 {
 	std::vector<int> completed;
 	{
-		threading::lock(*completed_tasks_mutex);
+		threading::lock lck(*completed_tasks_mutex);
 		completed.swap(completed_tasks);
 	}
 
@@ -83,4 +174,40 @@ void pump()
 	}
 }
 
+void parallel_for(int n, boost::function<void(int,int)> fn, int min_range)
+{
+	const int nranges = std::max(1, std::min<int>(parallel_workers.size() + 1, n/std::max(1, min_range)));
+	if(nranges == 1) {
+		fn(0, n);
+		return;
+	}
+
+	parallel_job job = { fn, n, nranges, 0, nranges };
+	{
+		threading::lock lck(parallel_mutex);
+		parallel_jobs.push_back(&job);
+		parallel_work_cond.notify_all();
+	}
+
+	//take ranges ourselves until they've all been taken, then wait for
+	//the workers to finish theirs.
+	for(;;) {
+		int begin = 0, end = 0;
+		{
+			threading::lock lck(parallel_mutex);
+			if(!take_range(job, &begin, &end)) {
+				break;
+			}
+		}
+
+		fn(begin, end);
+		finish_range(job);
+	}
+
+	threading::lock lck(parallel_mutex);
+	while(job.ranges_left > 0) {
+		parallel_done_cond.wait(parallel_mutex);
+	}
+}
+
 }
@@ -31,6 +31,13 @@ void pump();
 
 void submit(boost::function<void()> job, boost::function<void()> on_complete);
 
+//Splits [0, n) into ranges and calls fn(begin, end) for each of them, in
+//parallel on the calling thread and worker threads the manager keeps,
+//returning once they're all done. No range is made smaller than
+//min_range, so small jobs run on the calling thread, as does everything
+//if there's no manager.
+void parallel_for(int n, boost::function<void(int,int)> fn, int min_range=1);
+
 }
 
 #endif
@@ -209,6 +209,23 @@ BEGIN_DEFINE_FN(screen_to_world, "(int,int,int=0,int=0) -> [decimal,decimal,deci
 	return vec3_to_variant(obj.screen_to_world(FN_ARG(0).as_int(), FN_ARG(1).as_int(),wx,wy));
 END_DEFINE_FN
 
+BEGIN_DEFINE_FN(screen_to_ray, "(int,int,int=0,int=0) -> {origin: [decimal,decimal,decimal], direction: [decimal,decimal,decimal]}")
+	int wx = preferences::actual_screen_width();
+	int wy = preferences::actual_screen_height();
+	if(NUM_FN_ARGS > 2) {
+		wx = FN_ARG(2).as_int();
+		if(NUM_FN_ARGS > 3) {
+			wy = FN_ARG(3).as_int();
+		}
+	}
+	glm::vec3 origin, direction;
+	obj.screen_to_ray(FN_ARG(0).as_int(), FN_ARG(1).as_int(), wx, wy, &origin, &direction);
+	variant_builder res;
+	res.add("origin", vec3_to_variant(origin));
+	res.add("direction", vec3_to_variant(direction));
+	return res.build();
+END_DEFINE_FN
+
 DEFINE_FIELD(position, "[decimal,decimal,decimal]")
 	std::vector<variant> v;
 	v.push_back(variant(obj.position().x));
@@ -393,6 +410,16 @@ glm::vec3 camera_callable::screen_to_world(int x, int y, int wx, int wy) const
 	return glm::unProject(screen, view_, projection_, view_port);
 }
 
+// The ray through a screen position, from the near plane to the far plane.
+// Unlike screen_to_world this doesn't read back the depth buffer, so it
+// doesn't have to wait for the frame to finish drawing.
+void camera_callable::screen_to_ray(int x, int y, int wx, int wy, glm::vec3* origin, glm::vec3* direction) const
+{
+	glm::vec4 view_port(0, 0, wx, wy);
+	*origin = glm::unProject(glm::vec3(x, wy - y, 0.0f), view_, projection_, view_port);
+	*direction = glm::unProject(glm::vec3(x, wy - y, 1.0f), view_, projection_, view_port) - *origin;
+}
+
 
 namespace
 {
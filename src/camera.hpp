@@ -63,6 +63,7 @@ public:
 	const graphics::frustum& frustum() { return frustum_; }
 
 	glm::vec3 screen_to_world(int x, int y, int wx, int wy) const;
+	void screen_to_ray(int x, int y, int wx, int wy, glm::vec3* origin, glm::vec3* direction) const;
 	glm::ivec3 get_facing(const glm::vec3& coords) const;
 
 	variant write();
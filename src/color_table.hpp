@@ -0,0 +1,130 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+	
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef COLOR_TABLE_HPP_INCLUDED
+#define COLOR_TABLE_HPP_INCLUDED
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace graphics
+{
+
+//A mapping of pixel values compiled into an open addressing hash table, for
+//remapping the colors of whole images. Most pixels usually aren't in the
+//mapping, so lookups first check a small bit filter which rejects nearly
+//all of those without touching the table.
+class color_table
+{
+public:
+	color_table() : shift_(32), empty_key_(0)
+	{}
+
+	void init(const std::map<uint32_t, uint32_t>& mapping)
+	{
+		std::fill(filter_, filter_ + FilterWords, 0);
+
+		int bits = 1;
+		while((1 << bits) < static_cast<int>(mapping.size())*2) {
+			++bits;
+		}
+
+		shift_ = 32 - bits;
+
+		//find a value to mark empty slots with that isn't a key.
+		empty_key_ = 0xFFFFFFFF;
+		while(mapping.count(empty_key_)) {
+			--empty_key_;
+		}
+
+		keys_.assign(1 << bits, empty_key_);
+		values_.assign(1 << bits, 0);
+
+		for(std::map<uint32_t, uint32_t>::const_iterator i = mapping.begin(); i != mapping.end(); ++i) {
+			const uint32_t h = hash(i->first);
+			filter_[(h >> FilterShift)/64] |= uint64_t(1) << ((h >> FilterShift)%64);
+
+			uint32_t slot = h >> shift_;
+			while(keys_[slot] != empty_key_) {
+				slot = (slot + 1) & (keys_.size() - 1);
+			}
+
+			keys_[slot] = i->first;
+			values_[slot] = i->second;
+		}
+	}
+
+	bool empty() const { return keys_.empty(); }
+
+	bool lookup(uint32_t key, uint32_t* value) const
+	{
+		const uint32_t h = hash(key);
+		if((filter_[(h >> FilterShift)/64] & (uint64_t(1) << ((h >> FilterShift)%64))) == 0) {
+			return false;
+		}
+
+		for(uint32_t slot = h >> shift_; keys_[slot] != empty_key_; slot = (slot + 1) & (keys_.size() - 1)) {
+			if(keys_[slot] == key) {
+				*value = values_[slot];
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	uint32_t map(uint32_t key) const
+	{
+		uint32_t value;
+		return lookup(key, &value) ? value : key;
+	}
+
+	//maps a row of pixels. Sprite sheets are mostly long runs of the same
+	//color, so the last result is reused while the color doesn't change.
+	void map_row(const uint32_t* src, uint32_t* dst, int width) const
+	{
+		if(width <= 0) {
+			return;
+		}
+
+		uint32_t last_src = *src, last_dst = map(*src);
+		for(const uint32_t* end = src + width; src != end; ++src, ++dst) {
+			if(*src != last_src) {
+				last_src = *src;
+				last_dst = map(last_src);
+			}
+
+			*dst = last_dst;
+		}
+	}
+
+private:
+	static uint32_t hash(uint32_t key) { return key*2654435761U; }
+
+	enum { FilterBits = 12, FilterWords = (1 << FilterBits)/64, FilterShift = 32 - FilterBits };
+	uint64_t filter_[FilterWords];
+
+	int shift_;
+	uint32_t empty_key_;
+	std::vector<uint32_t> keys_, values_;
+};
+
+}
+
+#endif
@@ -89,6 +89,23 @@ std::vector<char> decompress_known_size(const std::vector<char>& data, int size)
 	return output;
 }
 
+bool try_decompress_known_size(const std::vector<char>& data, int size, std::vector<char>* output)
+{
+	output->clear();
+	if(size <= 0 || data.empty()) {
+		return size == 0 && data.empty();
+	}
+
+	output->resize(size);
+
+	Bytef* dst = reinterpret_cast<Bytef*>(&(*output)[0]);
+	uLongf dst_len = output->size();
+	const Bytef* src = reinterpret_cast<const Bytef*>(&data[0]);
+
+	const int result = uncompress(dst, &dst_len, src, data.size());
+	return result == Z_OK && dst_len == output->size();
+}
+
 }
 
 UNIT_TEST(compression_test)
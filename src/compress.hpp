@@ -34,6 +34,10 @@ std::vector<char> compress(const std::vector<char>& data, int compression_level=
 std::vector<char> decompress(const std::vector<char>& data);
 std::vector<char> decompress_known_size(const std::vector<char>& data, int size);
 
+//like decompress_known_size, but returns false if the data doesn't
+//decompress to exactly size bytes rather than asserting.
+bool try_decompress_known_size(const std::vector<char>& data, int size, std::vector<char>* output);
+
 class compressed_data : public game_logic::formula_callable {
 	std::vector<char> data_;
 public:
@@ -37,6 +37,7 @@ uint32_t htonl(uint32_t nl)
 
 #include <stdio.h>
 
+#include <algorithm>
 #include <stack>
 #include <vector>
 
@@ -53,6 +54,10 @@ uint32_t htonl(uint32_t nl)
 
 namespace controls {
 
+PREF_BOOL(multiplayer_rollback, false, "Predict missing remote input and resimulate when it arrives instead of waiting on a fixed input delay");
+PREF_INT(multiplayer_rollback_window, 30, "Maximum number of cycles to simulate ahead of confirmed remote input in rollback mode");
+PREF_INT(multiplayer_rollback_input_delay, 1, "Input delay in cycles used in rollback mode");
+
 const char** control_names()
 {
 	static const char* names[] = { "up", "down", "left", "right", "attack", "jump", "tongue", NULL };
@@ -66,6 +71,10 @@ variant g_user_ctrl_output;
 int npackets_received;
 int ngood_packets;
 int last_packet_size_;
+int ndesyncs;
+
+//Keep packets small enough to fit in a single receive buffer.
+const int MaxControlPacketSize = 4000;
 
 const int MAX_PLAYERS = 8;
 
@@ -93,6 +102,10 @@ int32_t remote_highest_confirmed[MAX_PLAYERS];
 
 std::map<int, int> our_checksums;
 
+//checksums remote players sent for cycles they had confirmed input for,
+//waiting until we have confirmed input for the cycle too.
+std::map<int, int> remote_checksums;
+
 int starting_cycles;
 int nplayers = 1;
 int local_player;
@@ -142,6 +155,11 @@ int32_t our_highest_confirmed() {
 }
 
 std::stack<ControlFrame> local_control_locks;
+
+//controls being played back in place of the local player's input.
+bool playback_active;
+std::vector<ControlFrame> playback_controls;
+int playback_pos;
 }
 
 struct control_backup_scope_impl {
@@ -221,6 +239,9 @@ void new_level(int level_starting_cycles, int level_nplayers, int level_local_pl
 	foreach(int32_t& highest, remote_highest_confirmed) {
 		highest = 0;
 	}
+
+	our_checksums.clear();
+	remote_checksums.clear();
 }
 
 
@@ -254,6 +275,27 @@ void ignore_current_keypresses()
 	}
 }
 
+namespace {
+void push_local_controls(const ControlFrame& state)
+{
+	controls[local_player].push_back(state);
+	highest_confirmed[local_player]++;
+
+	//advance networked player's controls based on the assumption that they
+	//just did the same thing as last time; incoming packets will correct
+	//any assumptions.
+	for(int n = 0; n != nplayers; ++n) {
+		while(n != local_player && controls[n].size() < controls[local_player].size()) {
+			if(controls[n].empty()) {
+				controls[n].push_back(ControlFrame());
+			} else {
+				controls[n].push_back(controls[n].back());
+			}
+		}
+	}
+}
+}
+
 void read_until(int ncycle)
 {
 	if(local_player < 0 || local_player >= nplayers) {
@@ -284,11 +326,23 @@ void read_local_controls()
 		return;
 	}
 
+	ControlFrame state;
+	if(playback_active) {
+		//once the recording runs out, nothing is held down.
+		if(playback_pos < playback_controls.size()) {
+			state = playback_controls[playback_pos];
+		}
+
+		++playback_pos;
+		g_user_ctrl_output = variant();
+		push_local_controls(state);
+		return;
+	}
+
 	if(preferences::no_iphone_controls() == false && level::current().allow_touch_controls() == true) {
 		iphone_controls::read_controls();
 	}
 
-	ControlFrame state;
 	if(local_control_locks.empty()) {
 #if !defined(__ANDROID__)
 		bool ignore_keypresses = false;
@@ -350,21 +404,7 @@ void read_local_controls()
 
 	g_user_ctrl_output = variant();
 
-	controls[local_player].push_back(state);
-	highest_confirmed[local_player]++;
-
-	//advance networked player's controls based on the assumption that they
-	//just did the same thing as last time; incoming packets will correct
-	//any assumptions.
-	for(int n = 0; n != nplayers; ++n) {
-		while(n != local_player && controls[n].size() < controls[local_player].size()) {
-			if(controls[n].empty()) {
-				controls[n].push_back(ControlFrame());
-			} else {
-				controls[n].push_back(controls[n].back());
-			}
-		}
-	}
+	push_local_controls(state);
 }
 
 void unread_local_controls()
@@ -375,6 +415,10 @@ void unread_local_controls()
 
 	controls[local_player].pop_back();
 	highest_confirmed[local_player]--;
+
+	if(playback_active && playback_pos > 0) {
+		--playback_pos;
+	}
 }
 
 void get_control_status(int cycle, int player, bool* output, const std::string** user)
@@ -405,9 +449,43 @@ void get_control_status(int cycle, int player, bool* output, const std::string**
 
 void set_delay(int value)
 {
+	if(g_multiplayer_rollback && value > g_multiplayer_rollback_input_delay) {
+		value = g_multiplayer_rollback_input_delay;
+	}
+
 	delay = value;
 }
 
+namespace {
+//compare checksums for cycles both we and the remote players have
+//simulated with confirmed input. Our checksum for a cycle isn't final
+//until any pending rollback past it has been replayed.
+void verify_checksums()
+{
+	const int confirmed = our_highest_confirmed();
+	for(std::map<int, int>::iterator i = remote_checksums.begin(); i != remote_checksums.end(); ) {
+		const int cycle = i->first;
+		if(cycle > confirmed || (first_invalid_cycle_var != -1 && cycle >= first_invalid_cycle_var)) {
+			break;
+		}
+
+		std::map<int, int>::const_iterator ours = our_checksums.find(cycle);
+		if(ours != our_checksums.end() && ours->second != i->second) {
+			++ndesyncs;
+			std::cerr << "DESYNC DETECTED AT CYCLE " << cycle << ": " << i->second << " VS " << ours->second << "\n";
+		}
+
+		remote_checksums.erase(i++);
+	}
+
+	//we will never be asked about checksums this old again.
+	const int oldest_needed = their_highest_confirmed() - 1;
+	while(!our_checksums.empty() && our_checksums.begin()->first < oldest_needed && our_checksums.begin()->first < confirmed) {
+		our_checksums.erase(our_checksums.begin());
+	}
+}
+}
+
 void read_control_packet(const char* buf, size_t len)
 {
 	++npackets_received;
@@ -446,20 +524,17 @@ void read_control_packet(const char* buf, size_t len)
 	checksum = ntohl(checksum);
 	buf += 4;
 
-	if(checksum && our_checksums[current_cycle-1]) {
-		if(checksum == our_checksums[current_cycle-1]) {
-			std::cerr << "CHECKSUM MATCH FOR " << current_cycle << ": " << checksum << "\n";
-		} else {
-			std::cerr << "CHECKSUM DID NOT MATCH FOR " << current_cycle << ": " << checksum << " VS " << our_checksums[current_cycle-1] << "\n";
-		}
-
-	}
-
 	int32_t highest_cycle;
 	memcpy(&highest_cycle, buf, 4);
 	highest_cycle = ntohl(highest_cycle);
 	buf += 4;
 
+	//their checksum is only final if they had confirmed input from
+	//everyone for that cycle.
+	if(checksum && current_cycle-1 <= highest_cycle) {
+		remote_checksums[current_cycle-1] = checksum;
+	}
+
 	if(highest_cycle > remote_highest_confirmed[slot]) {
 		remote_highest_confirmed[slot] = highest_cycle;
 	}
@@ -542,6 +617,8 @@ void read_control_packet(const char* buf, size_t len)
 	assert(buf == end_buf);
 
 	++ngood_packets;
+
+	verify_checksums();
 }
 
 void write_control_packet(std::vector<char>& v)
@@ -551,17 +628,39 @@ void write_control_packet(std::vector<char>& v)
 		return;
 	}
 
+	int32_t ncycles_to_write = static_cast<int>(controls[local_player].size()) - their_highest_confirmed();
+
+	last_packet_size_ = ncycles_to_write;
+	if(ncycles_to_write > controls[local_player].size()) {
+		ncycles_to_write = controls[local_player].size();
+	}
+
+	//every packet repeats all the input the other side hasn't confirmed
+	//yet, so lost packets don't matter. If that's too much to fit in one
+	//packet, send the oldest input first so they can confirm it.
+	const int first_index = controls[local_player].size() - ncycles_to_write;
+	int packet_size = v.size() + 17;
+	for(int n = 0; n != ncycles_to_write; ++n) {
+		packet_size += 2 + controls[local_player][first_index + n].user.size();
+		if(packet_size > MaxControlPacketSize && n > 0) {
+			ncycles_to_write = n;
+			break;
+		}
+	}
+
 	//write our slot to the packet
 	v.push_back(local_player);
 
-	//write our current cycle
-	int32_t current_cycle = controls[local_player].size()-1;
+	//write the last cycle in this packet
+	int32_t current_cycle = first_index + ncycles_to_write - 1;
 	int32_t current_cycle_net = htonl(current_cycle);
 	v.resize(v.size() + 4);
 	memcpy(&v[v.size()-4], &current_cycle_net, 4);
 
-	//write our checksum of game state
-	int32_t checksum = our_checksums[current_cycle-1];
+	//write our checksum of game state, or 0 if we no longer have one for
+	//that cycle, which the other side ignores.
+	std::map<int, int>::const_iterator our_checksum = our_checksums.find(current_cycle-1);
+	int32_t checksum = our_checksum != our_checksums.end() ? our_checksum->second : 0;
 	int32_t checksum_net = htonl(checksum);
 	v.resize(v.size() + 4);
 	memcpy(&v[v.size()-4], &checksum_net, 4);
@@ -571,19 +670,12 @@ void write_control_packet(std::vector<char>& v)
 	v.resize(v.size() + 4);
 	memcpy(&v[v.size()-4], &highest_cycle, 4);
 
-	int32_t ncycles_to_write = 1+current_cycle - their_highest_confirmed();
-
-	last_packet_size_ = ncycles_to_write;
-	if(ncycles_to_write > controls[local_player].size()) {
-		ncycles_to_write = controls[local_player].size();
-	}
-
 	int32_t ncycles_to_write_net = htonl(ncycles_to_write);
 	v.resize(v.size() + 4);
 	memcpy(&v[v.size()-4], &ncycles_to_write_net, 4);
 
 	for(int n = 0; n != ncycles_to_write; ++n) {
-		const int index = (controls[local_player].size() - ncycles_to_write) + n;
+		const int index = first_index + n;
 		v.push_back(controls[local_player][index].keys);
 		const char* user = controls[local_player][index].user.c_str();
 		v.insert(v.end(), user, user + controls[local_player][index].user.size()+1);
@@ -610,6 +702,7 @@ int first_invalid_cycle()
 void mark_valid()
 {
 	first_invalid_cycle_var = -1;
+	verify_checksums();
 }
 
 int num_players()
@@ -646,6 +739,77 @@ void set_checksum(int cycle, int sum)
 	our_checksums[cycle] = sum;
 }
 
+int get_checksum(int cycle)
+{
+	std::map<int, int>::const_iterator i = our_checksums.find(cycle);
+	return i != our_checksums.end() ? i->second : 0;
+}
+
+variant serialize_local_controls()
+{
+	std::vector<variant> result;
+	if(local_player >= 0 && local_player < nplayers) {
+		foreach(const ControlFrame& frame, controls[local_player]) {
+			if(frame.user.empty()) {
+				result.push_back(variant(static_cast<int>(frame.keys)));
+			} else {
+				std::vector<variant> v;
+				v.push_back(variant(static_cast<int>(frame.keys)));
+				v.push_back(variant(frame.user));
+				result.push_back(variant(&v));
+			}
+		}
+	}
+
+	return variant(&result);
+}
+
+void play_back_controls(const variant& v)
+{
+	playback_controls.clear();
+	playback_pos = 0;
+	playback_active = !v.is_null();
+	if(!playback_active) {
+		return;
+	}
+
+	for(int n = 0; n != v.num_elements(); ++n) {
+		const variant& item = v[n];
+		ControlFrame frame;
+		if(item.is_list()) {
+			frame.keys = static_cast<unsigned char>(item[0].as_int());
+			frame.user = item[1].as_string();
+		} else {
+			frame.keys = static_cast<unsigned char>(item.as_int());
+		}
+
+		playback_controls.push_back(frame);
+	}
+}
+
+bool rollback_enabled()
+{
+	return g_multiplayer_rollback;
+}
+
+bool prediction_window_full()
+{
+	//without rollback the fixed input delay does the waiting.
+	if(!g_multiplayer_rollback || nplayers <= 1 || local_player < 0 || local_player >= nplayers) {
+		return false;
+	}
+
+	//level backups only go back so far, so we can't roll back further
+	//than this.
+	const int MaxWindow = 200;
+	return cycles_behind() >= std::min<int>(g_multiplayer_rollback_window, MaxWindow);
+}
+
+int num_desyncs()
+{
+	return ndesyncs;
+}
+
 void debug_dump_controls()
 {
 	fprintf(stderr, "CONTROLS:");
@@ -103,6 +103,29 @@ int last_packet_size();
 
 void set_checksum(int cycle, int sum);
 
+//the checksum of game state recorded for a cycle, or 0 if there isn't one.
+int get_checksum(int cycle);
+
+//the local player's controls since the level started, as a list with an
+//entry for each cycle. play_back_controls() takes such a list and makes
+//the local player's controls come from it rather than from the keyboard
+//until it runs out, after which no keys are held. Pass null to stop.
+variant serialize_local_controls();
+void play_back_controls(const variant& v);
+
+//In rollback mode input delay is kept minimal: missing remote input is
+//predicted, and the level is replayed from first_invalid_cycle() when the
+//real input arrives.
+bool rollback_enabled();
+
+//true if we are so far ahead of confirmed remote input that we can't
+//predict any further and have to wait for their packets. Always false
+//when rollback isn't enabled.
+bool prediction_window_full();
+
+//number of confirmed cycles whose checksum didn't match a remote player's.
+int num_desyncs();
+
 void debug_dump_controls();
 
 }
@@ -42,6 +42,7 @@
 #include "formula_callable_visitor.hpp"
 #include "formula_object.hpp"
 #include "formula_profiler.hpp"
+#include "frame_timings.hpp"
 #include "geometry.hpp"
 #include "graphical_font.hpp"
 #include "json_parser.hpp"
@@ -52,6 +53,7 @@
 #include "playable_custom_object.hpp"
 #include "preferences.hpp"
 #include "raster.hpp"
+#include "sprite_batch.hpp"
 #include "string_utils.hpp"
 #include "surface_formula.hpp"
 #include "variant.hpp"
@@ -1205,6 +1207,43 @@ void custom_object::draw_later(int xx, int yy) const
 	}
 }
 
+bool custom_object::draw_batched(graphics::sprite_batch& batch, int xx, int yy) const
+{
+	//only objects which draw nothing but their current frame can be
+	//batched. Anything else goes through draw().
+	if(frame_ == NULL || use_absolute_screen_coordinates_ || !attached_objects().empty() ||
+	   clip_area_ || type_->is_shadow() || driver_ || blur_ || text_ ||
+	   (draw_color_ && !draw_color_->fits_in_color()) ||
+	   !custom_draw_xy_.empty() || custom_draw_.get() != NULL || draw_area_.get() != NULL ||
+	   !widgets_.empty() || !vector_text_.empty() || !particle_systems_.empty() ||
+	   preferences::show_debug_hitboxes() || !level::current().debug_properties().empty()) {
+		return false;
+	}
+
+#if defined(USE_SHADERS)
+	if(shader_ || !effects_.empty() || !draw_primitives_.empty()) {
+		return false;
+	}
+#endif
+
+	if(type_->hidden_in_game() && !level::current().in_editor()) {
+		return true;
+	}
+
+	if(type_->blend_mode()) {
+		batch.set_blend_mode(type_->blend_mode()->sfactor, type_->blend_mode()->dfactor);
+	} else {
+		batch.set_blend_mode(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
+
+	batch.set_color(draw_color_ ? draw_color_->to_color() : graphics::color(255, 255, 255, 255));
+
+	const int draw_x = x();
+	const int draw_y = y();
+	frame_->draw_into_sprite_batch(batch, draw_x-draw_x%2, draw_y-draw_y%2, face_right(), upside_down(), time_in_frame_, GLfloat(rotate_z_.as_float()), draw_scale_ ? GLfloat(draw_scale_->as_float()) : 1.0f);
+	return true;
+}
+
 void custom_object::draw(int xx, int yy) const
 {
 	if(frame_ == NULL) {
@@ -1365,8 +1404,22 @@ void custom_object::draw(int xx, int yy) const
 	}
 	glPopMatrix();
 
-	for(std::map<std::string, particle_system_ptr>::const_iterator i = particle_systems_.begin(); i != particle_systems_.end(); ++i) {
-		i->second->draw(rect(last_draw_position().x/100, last_draw_position().y/100, graphics::screen_width(), graphics::screen_height()), *this);
+	if(!particle_systems_.empty()) {
+		//particles can be drawn later with others using the same texture,
+		//unless the way this object is drawn would change how they look.
+		bool batch_particles = particle_system_manager::batching() && !use_absolute_screen_coordinates_ &&
+		                       !parallax_scale_millis() && !type_->blend_mode() && !draw_color_ &&
+		                       !clip_area_ && !type_->is_shadow();
+#if defined(USE_SHADERS)
+		batch_particles = batch_particles && !shader_;
+#endif
+
+		const rect screen_area(last_draw_position().x/100, last_draw_position().y/100, graphics::screen_width(), graphics::screen_height());
+		for(std::map<std::string, particle_system_ptr>::const_iterator i = particle_systems_.begin(); i != particle_systems_.end(); ++i) {
+			if(!batch_particles || !i->second->draw_batched(screen_area, *this)) {
+				i->second->draw(screen_area, *this);
+			}
+		}
 	}
 
 	if(text_ && text_->font && text_->alpha) {
@@ -1526,8 +1579,8 @@ void custom_object::process(level& lvl)
 #if defined(USE_BOX2D)
 	box2d::world_ptr world = box2d::world::our_world_ptr();
 	if(body_) {
-		const b2Vec2 v = body_->get_body_ptr()->GetPosition();
-		const float a = body_->get_body_ptr()->GetAngle();
+		const b2Vec2 v = body_->position();
+		const float a = body_->angle();
 		rotate_z_ = decimal(double(a) * 180.0 / M_PI);
 		set_x(int(v.x * world->scale() - (solid_rect().w() ? (solid_rect().w()/2) : current_frame().width()/2)));
 		set_y(int(v.y * world->scale() - (solid_rect().h() ? (solid_rect().h()/2) : current_frame().height()/2)));
@@ -2302,20 +2355,13 @@ void custom_object::process(level& lvl)
 
 #if defined(USE_BOX2D)
 	if(body_) {
-		for(b2ContactEdge* ce = body_->get_body_ptr()->GetContactList(); ce != NULL; ce = ce->next) {
-			b2Contact* c = ce->contact;
-			// process c
-			if(c->IsTouching()) {
-				using namespace game_logic;
-				//std::cerr << "bodies touching: 0x" << std::hex << uint32_t(body_->get_body_ptr()) << " 0x" << uint32_t(ce->other) << std::dec << std::endl;
-				//b2WorldManifold wmf;
-				//c->GetWorldManifold(&wmf);
-				//std::cerr << "Collision points: " << wmf.points[0].x << ", " << wmf.points[0].y << "; " << wmf.points[1].x << "," << wmf.points[1].y << "; " << wmf.normal.x << "," << wmf.normal.y << std::endl;
-				map_formula_callable_ptr fc = map_formula_callable_ptr(new map_formula_callable);
-				fc->add("collide_with", variant((box2d::body*)ce->other->GetUserData()));
-				handle_event("b2collide", fc.get());
-			}
-			//c->GetManifold()->
+		std::vector<b2Body*> touching;
+		body_->get_touching(&touching);
+		foreach(b2Body* other, touching) {
+			using namespace game_logic;
+			map_formula_callable_ptr fc = map_formula_callable_ptr(new map_formula_callable);
+			fc->add("collide_with", variant((box2d::body*)other->GetUserData()));
+			handle_event("b2collide", fc.get());
 		}
 	}
 #endif
@@ -5152,11 +5198,13 @@ bool custom_object::handle_event_internal(int event, const formula_callable* con
 #endif
 
 		++events_handled_per_second;
+		frame_timings::add_counter("events_handled");
 
 		variant var;
 		
 		try {
 			formula_profiler::instrument instrumentation("FFL");
+			const frame_timings::scope timing("ffl");
 			var = handler->execute(*this);
 		} catch(validation_failure_exception& e) {
 #ifndef DISABLE_FORMULA_PROFILER
@@ -5175,6 +5223,7 @@ bool custom_object::handle_event_internal(int event, const formula_callable* con
 		try {
 			if(execute_commands_now) {
 				formula_profiler::instrument instrumentation("COMMANDS");
+				const frame_timings::scope timing("commands");
 				result = execute_command(var);
 			} else {
 				delayed_commands_.push_back(var);
@@ -78,6 +78,7 @@ public:
 	virtual variant write() const;
 	virtual void setup_drawing() const;
 	virtual void draw(int x, int y) const;
+	virtual bool draw_batched(graphics::sprite_batch& batch, int x, int y) const;
 	virtual void draw_later(int x, int y) const;
 	virtual void draw_group() const;
 	virtual void process(level& lvl);
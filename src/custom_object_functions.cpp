@@ -41,10 +41,12 @@
 #include "entity.hpp"
 #include "fbo_scene.hpp"
 #include "filesystem.hpp"
+#include "flow_field.hpp"
 #include "formatter.hpp"
 #include "formula_callable_definition.hpp"
 #include "formula_function_registry.hpp"
 #include "formula_profiler.hpp"
+#include "frame_timings.hpp"
 #include "haptic.hpp"
 #include "i18n.hpp"
 #include "input.hpp"
@@ -53,6 +55,7 @@
 #include "level_runner.hpp"
 #include "load_level.hpp"
 #include "object_events.hpp"
+#include "path_service.hpp"
 #include "pause_game_dialog.hpp"
 #include "player_info.hpp"
 #include "raster.hpp"
@@ -192,6 +195,32 @@ FUNCTION_DEF(performance, 0, 0, "performance(): returns an object with current p
 RETURN_TYPE("object")
 END_FUNCTION_DEF(performance)
 
+class capture_trace_command : public game_logic::command_callable
+{
+	std::string fname_;
+	int nframes_;
+public:
+	capture_trace_command(const std::string& fname, int nframes) : fname_(fname), nframes_(nframes)
+	{}
+
+	virtual void execute(game_logic::formula_callable& ob) const {
+		frame_timings::capture_trace(fname_, nframes_);
+	}
+};
+
+FUNCTION_DEF(capture_trace, 1, 2, "capture_trace(string filename, int nframes=60): records the timings of every scope for the next nframes frames and writes them to the file as a Chrome trace")
+	const std::string fname = args()[0]->evaluate(variables).as_string();
+	const int nframes = args().size() > 1 ? args()[1]->evaluate(variables).as_int() : 60;
+	capture_trace_command* cmd = new capture_trace_command(fname, nframes);
+	cmd->set_expression(this);
+	return variant(cmd);
+
+FUNCTION_ARGS_DEF
+	ARG_TYPE("string")
+	ARG_TYPE("int")
+RETURN_TYPE("commands")
+END_FUNCTION_DEF(capture_trace)
+
 FUNCTION_DEF(texture, 2, 3, "texture(objects, rect, bool half_size=false): render a texture")
 	variant objects = args()[0]->evaluate(variables);
 	variant area = args()[1]->evaluate(variables);
@@ -1772,6 +1801,91 @@ FUNCTION_ARGS_DEF
 RETURN_TYPE("commands")
 END_FUNCTION_DEF(set_solid)
 
+class request_path_command : public entity_command_callable {
+	point src_, dst_;
+	int tile_size_x_, tile_size_y_;
+public:
+	request_path_command(const point& src, const point& dst, int tile_size_x, int tile_size_y)
+	  : src_(src), dst_(dst), tile_size_x_(tile_size_x), tile_size_y_(tile_size_y)
+	{}
+
+	virtual void execute(level& lvl, entity& ob) const {
+		pathfinding::path_service::request(lvl, entity_ptr(&ob), src_, dst_, tile_size_x_, tile_size_y_);
+	}
+};
+
+FUNCTION_DEF(request_path, 4, 6, "request_path(from_x, from_y, to_x, to_y, (optional) tile_size_x, (optional) tile_size_y): asks for a path like plot_path gives to be found in the background. It arrives next cycle or later in a path_found event, as the list 'path', or else a path_not_found event is sent. Asking again for a path to the same place carries on from the last search rather than starting again.")
+	int tile_size_x = TileSize;
+	int tile_size_y = TileSize;
+	if(args().size() == 5) {
+		tile_size_y = tile_size_x = args()[4]->evaluate(variables).as_int();
+	} else if(args().size() == 6) {
+		tile_size_x = args()[4]->evaluate(variables).as_int();
+		tile_size_y = args()[5]->evaluate(variables).as_int();
+	}
+	ASSERT_LOG((tile_size_x%2)==0 && (tile_size_y%2)==0, "The tile_size_x and tile_size_y values *must* be even. (" << tile_size_x << "," << tile_size_y << ")");
+
+	request_path_command* cmd = new request_path_command(
+	  point(args()[0]->evaluate(variables).as_int(), args()[1]->evaluate(variables).as_int()),
+	  point(args()[2]->evaluate(variables).as_int(), args()[3]->evaluate(variables).as_int()),
+	  tile_size_x, tile_size_y);
+	cmd->set_expression(this);
+	return variant(cmd);
+FUNCTION_ARGS_DEF
+	ARG_TYPE("int")
+	ARG_TYPE("int")
+	ARG_TYPE("int")
+	ARG_TYPE("int")
+	ARG_TYPE("int")
+	ARG_TYPE("int")
+RETURN_TYPE("commands")
+END_FUNCTION_DEF(request_path)
+
+FUNCTION_DEF(flow_field, 1, 3, "flow_field(target, (optional) tile_size_x, (optional) tile_size_y) -> flow field: gives the flow field towards target, which is an object or an [x,y] point in the level. Its direction_at(x, y) gives the step in tiles, [dx,dy], to take from x,y to get to the target by the shortest path, or null if it can't be reached, and cost_at(x, y) gives how far away it is. Any number of objects heading for the same target share one field, which follows the target as it moves and is kept up to date as the level changes.")
+	formula::fail_if_static_context();
+
+	int tile_size_x = TileSize;
+	int tile_size_y = TileSize;
+	if(args().size() == 2) {
+		tile_size_y = tile_size_x = args()[1]->evaluate(variables).as_int();
+	} else if(args().size() == 3) {
+		tile_size_x = args()[1]->evaluate(variables).as_int();
+		tile_size_y = args()[2]->evaluate(variables).as_int();
+	}
+	ASSERT_LOG((tile_size_x%2)==0 && (tile_size_y%2)==0, "The tile_size_x and tile_size_y values *must* be even. (" << tile_size_x << "," << tile_size_y << ")");
+
+	const variant target = args()[0]->evaluate(variables);
+	entity_ptr target_obj;
+	point target_pos;
+	if(target.is_list()) {
+		target_pos = point(target[0].as_int(), target[1].as_int());
+	} else {
+		target_obj = target.convert_to<entity>();
+	}
+
+	return variant(pathfinding::flow_fields::get(level::current(), target_obj, target_pos, tile_size_x, tile_size_y).get());
+FUNCTION_ARGS_DEF
+	ARG_TYPE("custom_obj|[int,int]")
+	ARG_TYPE("int")
+	ARG_TYPE("int")
+RETURN_TYPE("builtin flow_field_callable|null")
+END_FUNCTION_DEF(flow_field)
+
+class cancel_path_request_command : public entity_command_callable {
+public:
+	virtual void execute(level& lvl, entity& ob) const {
+		pathfinding::path_service::cancel(ob);
+	}
+};
+
+FUNCTION_DEF(cancel_path_request, 0, 0, "cancel_path_request(): forgets the path asked for with request_path, so no event is sent for it.")
+	cancel_path_request_command* cmd = new cancel_path_request_command;
+	cmd->set_expression(this);
+	return variant(cmd);
+FUNCTION_ARGS_DEF
+RETURN_TYPE("commands")
+END_FUNCTION_DEF(cancel_path_request)
+
 FUNCTION_DEF(group_size, 2, 2, "group_size(level, int group_id) -> int: gives the number of objects in the object group given by group_id")
 	level* lvl = args()[0]->evaluate(variables).convert_to<level>();
 	return variant(lvl->group_size(args()[1]->evaluate(variables).as_int()));
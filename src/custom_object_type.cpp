@@ -1235,6 +1235,10 @@ custom_object_type::custom_object_type(const std::string& id, variant node, cons
 		anim_list = json::parse_from_file("data/default-animation.cfg");
 	}
 
+	//shaders are given texture co-ordinates in the frame's own texture, so
+	//objects with their own shaders can't be drawn from an atlas.
+	const bool custom_shader = node.has_key("shader") || node.has_key("effects");
+
 	foreach(variant anim, anim_list.as_list()) {
 		boost::intrusive_ptr<frame> f;
 		try {
@@ -1243,6 +1247,10 @@ custom_object_type::custom_object_type(const std::string& id, variant node, cons
 			ASSERT_LOG(false, "ERROR LOADING FRAME IN OBJECT '" << id_ << "'");
 		}
 
+		if(custom_shader) {
+			f->disable_atlas();
+		}
+
 		if(use_image_for_collisions_) {
 			f->set_image_as_solid();
 		}
@@ -1,21 +1,94 @@
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <algorithm>
+
+#include "asserts.hpp"
 #include "db_client.hpp"
+#include "foreach.hpp"
+#include "formatter.hpp"
+#include "preferences.hpp"
+#include "unit_test.hpp"
+#include "variant_utils.hpp"
+
+namespace {
+
+#ifdef USE_DB_CLIENT
+PREF_STRING(db_backend, "couchbase", "Database backend for servers to use: couchbase or local");
+#else
+PREF_STRING(db_backend, "local", "Database backend for servers to use: couchbase or local");
+#endif
+
+PREF_STRING(db_local_path, "db", "Directory the local database backend keeps its data in");
+
+struct multi_op_state {
+	int remaining;
+	bool failed;
+	std::vector<variant> results;
+};
+
+}
 
 db_client::error::error(const std::string& message) : msg(message)
 {}
 
 db_client::~db_client() {}
 
-#ifndef USE_DB_CLIENT
+void db_client::put_multi(const std::vector<std::pair<std::string, variant> >& docs, std::function<void()> on_done, std::function<void()> on_error, PUT_OPERATION op)
+{
+	if(docs.empty()) {
+		if(on_done) {
+			on_done();
+		}
+		return;
+	}
 
-db_client_ptr db_client::create() {
-	throw error("No db_client supported");
+	boost::shared_ptr<multi_op_state> state(new multi_op_state);
+	state->remaining = docs.size();
+	state->failed = false;
+
+	std::function<void()> finish = [=]() {
+		if(--state->remaining == 0) {
+			if(state->failed && on_error) {
+				on_error();
+			} else if(!state->failed && on_done) {
+				on_done();
+			}
+		}
+	};
+
+	typedef std::pair<std::string, variant> doc_pair;
+	foreach(const doc_pair& doc, docs) {
+		put(doc.first, doc.second, finish, [=]() { state->failed = true; finish(); }, op);
+	}
 }
 
-#else
+void db_client::get_multi(const std::vector<std::string>& keys, std::function<void(std::vector<variant>)> on_done)
+{
+	if(keys.empty()) {
+		if(on_done) {
+			on_done(std::vector<variant>());
+		}
+		return;
+	}
+
+	boost::shared_ptr<multi_op_state> state(new multi_op_state);
+	state->remaining = keys.size();
+	state->results.resize(keys.size());
+
+	for(int n = 0; n != keys.size(); ++n) {
+		get(keys[n], [=](variant doc) {
+			state->results[n] = doc;
+			if(--state->remaining == 0 && on_done) {
+				on_done(state->results);
+			}
+		});
+	}
+}
+
+#ifdef USE_DB_CLIENT
 
 #include "json_parser.hpp"
-#include "preferences.hpp"
-#include "unit_test.hpp"
 
 #include <libcouchbase/couchbase.h>
 
@@ -199,22 +272,99 @@ void timer_callback(lcb_timer_t timer, lcb_t instance, const void* cookie)
 	lcb_breakout(instance);
 }
 
-COMMAND_LINE_UTILITY(test_db)
-{
-	db_client_ptr client = db_client::create();
+}
+
+#endif //USE_DB_CLIENT
 
-	client->get("abc", [](variant value) { fprintf(stderr, "RESULT: %s\n", value.write_json().c_str()); });
-	client->process();
+db_client_ptr db_client::create() {
+	if(g_db_backend == "local") {
+		return create_local(g_db_local_path);
+	}
 
-	client->put("abc", variant(54), []() { fprintf(stderr, "DONE\n"); }, []() { fprintf(stderr, "ERROR\n"); } );
+#ifdef USE_DB_CLIENT
+	if(g_db_backend == "couchbase") {
+		return db_client_ptr(new couchbase_db_client);
+	}
+#endif
 
-	client->process();
+	throw error("Unsupported db backend: " + g_db_backend);
 }
 
+namespace {
+int elapsed_ms(const boost::posix_time::ptime& start)
+{
+	return (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
 }
 
-db_client_ptr db_client::create() {
-	return db_client_ptr(new couchbase_db_client);
+void report_timing(const char* name, int ndocs, int ms)
+{
+	fprintf(stderr, "%s: %d docs in %dms (%d/sec)\n", name, ndocs, ms, ms > 0 ? static_cast<int>(ndocs*1000LL/ms) : 0);
+}
 }
 
-#endif //USE_DB_CLIENT
+//Benchmarks the db backend, e.g.
+//  test_db --backend local --path /tmp/testdb --docs 100000 --batch 100
+COMMAND_LINE_UTILITY(test_db)
+{
+	int ndocs = 10000, batch_size = 100;
+	for(int n = 0; n < args.size(); ++n) {
+		const std::string& arg = args[n];
+		ASSERT_LOG(n+1 < args.size(), "Argument needs a value: " << arg);
+		if(arg == "--backend") {
+			g_db_backend = args[++n];
+		} else if(arg == "--path") {
+			g_db_local_path = args[++n];
+		} else if(arg == "--docs") {
+			ndocs = atoi(args[++n].c_str());
+		} else if(arg == "--batch") {
+			batch_size = std::max(1, atoi(args[++n].c_str()));
+		} else {
+			ASSERT_LOG(false, "Unrecognized argument: " << arg);
+		}
+	}
+
+	db_client_ptr client = db_client::create();
+
+	int errors = 0;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	for(int n = 0; n < ndocs; n += batch_size) {
+		std::vector<std::pair<std::string, variant> > docs;
+		for(int i = n; i < ndocs && i < n + batch_size; ++i) {
+			variant_builder doc;
+			doc.add("id", i);
+			doc.add("user", formatter() << "user" << i);
+			doc.add("info", std::string(100, 'x'));
+			docs.push_back(std::pair<std::string, variant>(formatter() << "test_db:" << i, doc.build()));
+		}
+
+		client->put_multi(docs, std::function<void()>(), [&errors]() { ++errors; });
+		client->process();
+	}
+
+	report_timing("put", ndocs, elapsed_ms(start));
+
+	//the second pass is served from the backend's cache where it has one.
+	for(int pass = 0; pass != 2; ++pass) {
+		int found = 0;
+		start = boost::posix_time::microsec_clock::universal_time();
+		for(int n = 0; n < ndocs; n += batch_size) {
+			std::vector<std::string> keys;
+			for(int i = n; i < ndocs && i < n + batch_size; ++i) {
+				keys.push_back(formatter() << "test_db:" << i);
+			}
+
+			client->get_multi(keys, [&found](std::vector<variant> docs) {
+				foreach(const variant& doc, docs) {
+					found += doc.is_null() ? 0 : 1;
+				}
+			});
+			client->process();
+		}
+
+		report_timing(pass == 0 ? "get" : "get again", ndocs, elapsed_ms(start));
+		ASSERT_LOG(found == ndocs, "Only found " << found << "/" << ndocs << " docs");
+	}
+
+	ASSERT_LOG(errors == 0, errors << " batches failed to be stored");
+}
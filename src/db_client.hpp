@@ -3,6 +3,7 @@
 
 #include <string>
 #include <functional>
+#include <vector>
 
 #include <boost/shared_ptr.hpp>
 
@@ -12,7 +13,8 @@ class db_client;
 typedef boost::shared_ptr<db_client> db_client_ptr;
 
 // Class representing a client to the Anura backend database. Designed to be
-// used by server processes. Use USE_DB_CLIENT to compile this functionality in.
+// used by server processes. Use USE_DB_CLIENT to compile Couchbase support in.
+// The local backend is always available.
 class db_client
 {
 public:
@@ -21,9 +23,14 @@ public:
 		std::string msg;
 	};
 
-	// Create an instance to connect to the database.
+	// Create an instance to connect to the database, using the backend chosen
+	// in the db_backend preference.
 	static db_client_ptr create();
 
+	// Create an instance of the embedded backend, which keeps its data in
+	// the given directory rather than talking to a database server.
+	static db_client_ptr create_local(const std::string& dir);
+
 	virtual ~db_client();
 
 	// Call this function to process all remaining outstanding operations.
@@ -42,6 +49,14 @@ public:
 	// Function to get the given document from the database. Will call on_done
 	// with the document on completion (null if no document is found).
 	virtual void get(const std::string& key, std::function<void(variant)> on_done, int lock_seconds=0) = 0;
+
+	// Puts several documents at once. on_done is called once all of them have
+	// been stored, or on_error if any of them couldn't be.
+	virtual void put_multi(const std::vector<std::pair<std::string, variant> >& docs, std::function<void()> on_done, std::function<void()> on_error, PUT_OPERATION op=PUT_SET);
+
+	// Gets several documents at once. on_done is called with the documents in
+	// the same order as the keys.
+	virtual void get_multi(const std::vector<std::string>& keys, std::function<void(std::vector<variant>)> on_done);
 };
 
 #endif
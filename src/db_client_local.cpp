@@ -0,0 +1,890 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//An embedded log-structured store which lets servers run without an
+//external database.
+//
+//Writes go to an in-memory table and are appended to a write-ahead log.
+//All the writes made in one call to process() go to the log together. When
+//the table grows too big it is frozen, a new log is started, and a
+//background thread writes it out as a sorted segment file. When there are
+//too many segments the background thread merges them into one.
+//
+//The directory holds wal.<n>.log files, seg.<n>.dat files and a MANIFEST
+//listing the live segments from oldest to newest. Every key in a segment is
+//indexed in memory, and values are read from disk on demand.
+
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <list>
+#include <map>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "asserts.hpp"
+#include "db_client.hpp"
+#include "filesystem.hpp"
+#include "foreach.hpp"
+#include "formatter.hpp"
+#include "json_parser.hpp"
+#include "preferences.hpp"
+#include "string_utils.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+#include "zlib.h"
+
+namespace {
+
+PREF_INT(db_local_memtable_kb, 4096, "Size the local db's in-memory table may reach before it is written out to a segment");
+PREF_INT(db_local_max_segments, 4, "Number of segments the local db keeps before merging them into one");
+PREF_INT(db_local_cache_entries, 4096, "Number of parsed documents the local db keeps in its read cache");
+PREF_BOOL(db_local_sync, false, "Sync the local db's write-ahead log to disk after every batch of writes");
+
+//Records in logs and segments are [crc][key length][value length][key][value]
+//with the numbers stored as little-endian 32-bit values and the crc covering
+//everything after it.
+void append_u32(std::string& buf, unsigned int n)
+{
+	for(int i = 0; i != 4; ++i) {
+		buf.push_back(static_cast<char>((n >> (i*8))&0xFF));
+	}
+}
+
+unsigned int read_u32(const char* p)
+{
+	const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+	return u[0] | (u[1] << 8) | (u[2] << 16) | (static_cast<unsigned int>(u[3]) << 24);
+}
+
+void encode_record(std::string& buf, const std::string& key, const std::string& value)
+{
+	const size_t start = buf.size();
+	append_u32(buf, 0);
+	append_u32(buf, key.size());
+	append_u32(buf, value.size());
+	buf += key;
+	buf += value;
+
+	const unsigned int crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(buf.c_str() + start + 4), buf.size() - start - 4);
+	for(int i = 0; i != 4; ++i) {
+		buf[start + i] = static_cast<char>((crc >> (i*8))&0xFF);
+	}
+}
+
+//decodes the record at p, advancing p past it. Returns false at the end of
+//the data, or if the record is truncated or corrupt, which is what a crash
+//part way through appending to a log leaves behind.
+bool decode_record(const char*& p, const char* end, std::string* key, std::string* value, const char** value_pos=NULL)
+{
+	if(end - p < 12) {
+		return false;
+	}
+
+	const unsigned int crc = read_u32(p);
+	const unsigned int key_len = read_u32(p + 4);
+	const unsigned int value_len = read_u32(p + 8);
+	if(static_cast<size_t>(end - p - 12) < static_cast<size_t>(key_len) + value_len) {
+		return false;
+	}
+
+	if(crc != crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(p + 4), 8 + key_len + value_len)) {
+		return false;
+	}
+
+	key->assign(p + 12, p + 12 + key_len);
+	value->assign(p + 12 + key_len, p + 12 + key_len + value_len);
+	if(value_pos) {
+		*value_pos = p + 12 + key_len;
+	}
+
+	p += 12 + key_len + value_len;
+	return true;
+}
+
+typedef std::map<std::string, std::string> memtable;
+typedef boost::shared_ptr<const memtable> const_memtable_ptr;
+
+//where each value lives in a segment file.
+typedef std::map<std::string, std::pair<long, unsigned int> > segment_index;
+
+class segment
+{
+public:
+	segment(const std::string& fname, const segment_index& index)
+	  : fname_(fname), index_(index), file_(fopen(fname.c_str(), "rb"))
+	{
+		ASSERT_LOG(file_, "Could not open db segment " << fname);
+	}
+
+	~segment()
+	{
+		fclose(file_);
+	}
+
+	const std::string& fname() const { return fname_; }
+
+	bool contains(const std::string& key) const
+	{
+		return index_.count(key) != 0;
+	}
+
+	bool get(const std::string& key, std::string* value) const
+	{
+		segment_index::const_iterator itor = index_.find(key);
+		if(itor == index_.end()) {
+			return false;
+		}
+
+		value->resize(itor->second.second);
+		if(value->empty()) {
+			return true;
+		}
+
+		const bool ok = fseek(file_, itor->second.first, SEEK_SET) == 0 &&
+		                fread(&(*value)[0], 1, value->size(), file_) == value->size();
+		ASSERT_LOG(ok, "Error reading db segment " << fname_);
+		return true;
+	}
+
+private:
+	segment(const segment&);
+	void operator=(const segment&);
+
+	std::string fname_;
+	segment_index index_;
+	FILE* file_;
+};
+
+typedef boost::shared_ptr<segment> segment_ptr;
+
+//writes a table out as a segment. Called on the background thread.
+segment_ptr write_segment(const std::string& fname, const memtable& table)
+{
+	std::string buf;
+	segment_index index;
+	for(memtable::const_iterator i = table.begin(); i != table.end(); ++i) {
+		encode_record(buf, i->first, i->second);
+		index[i->first] = std::make_pair(static_cast<long>(buf.size() - i->second.size()), static_cast<unsigned int>(i->second.size()));
+	}
+
+	const std::string tmp_fname = fname + ".tmp";
+	sys::write_file(tmp_fname, buf);
+	sys::move_file(tmp_fname, fname);
+
+	return segment_ptr(new segment(fname, index));
+}
+
+//reads a segment file, adding its records to table, replacing what's there,
+//and/or building an index of where they are in the file.
+void read_segment(const std::string& fname, memtable* table, segment_index* index)
+{
+	const std::string contents = sys::read_file(fname);
+	const char* p = contents.c_str();
+	const char* end = p + contents.size();
+
+	std::string key, value;
+	const char* value_pos = NULL;
+	while(decode_record(p, end, &key, &value, &value_pos)) {
+		if(index) {
+			(*index)[key] = std::make_pair(static_cast<long>(value_pos - contents.c_str()), static_cast<unsigned int>(value.size()));
+		}
+
+		if(table) {
+			(*table)[key].swap(value);
+		}
+	}
+
+	ASSERT_LOG(p == end, "Corrupt db segment: " << fname);
+}
+
+int file_number(const std::string& fname)
+{
+	const std::string::size_type dot = fname.find('.');
+	return dot == std::string::npos ? -1 : atoi(fname.c_str() + dot + 1);
+}
+
+bool compare_file_numbers(const std::string& a, const std::string& b)
+{
+	return file_number(a) < file_number(b);
+}
+
+class local_db_client : public db_client
+{
+public:
+	explicit local_db_client(const std::string& dir)
+	  : dir_(dir), next_file_(0), wal_(NULL),
+	    memtable_(new memtable), memtable_bytes_(0),
+	    job_done_(false), exiting_(false), job_running_(false)
+	{
+		ASSERT_LOG(sys::dir_exists(dir) || !sys::get_dir(dir).empty(), "Could not create db directory " << dir);
+
+		std::vector<std::string> files;
+		sys::get_files_in_dir(dir_, &files);
+		foreach(const std::string& fname, files) {
+			next_file_ = std::max(next_file_, file_number(fname) + 1);
+		}
+
+		//load the segments listed in the manifest. Any others were written
+		//by a job that didn't finish, so are removed.
+		std::vector<std::string> manifest;
+		if(sys::file_exists(path("MANIFEST"))) {
+			manifest = util::split(sys::read_file(path("MANIFEST")), '\n');
+		}
+
+		foreach(const std::string& fname, manifest) {
+			segment_index index;
+			read_segment(path(fname), NULL, &index);
+			segments_.push_back(segment_ptr(new segment(path(fname), index)));
+		}
+
+		std::vector<std::string> wals;
+		foreach(const std::string& fname, files) {
+			if(fname.size() > 4 && std::string(fname.end() - 4, fname.end()) == ".tmp") {
+				sys::remove_file(path(fname));
+			} else if(fname.compare(0, 4, "seg.") == 0 && std::count(manifest.begin(), manifest.end(), fname) == 0) {
+				sys::remove_file(path(fname));
+			} else if(fname.compare(0, 4, "wal.") == 0) {
+				wals.push_back(fname);
+			}
+		}
+
+		//replay logs that hadn't made it into a segment yet.
+		std::sort(wals.begin(), wals.end(), compare_file_numbers);
+		foreach(const std::string& fname, wals) {
+			const std::string contents = sys::read_file(path(fname));
+			const char* p = contents.c_str();
+			std::string key, value;
+			while(decode_record(p, contents.c_str() + contents.size(), &key, &value)) {
+				memtable_bytes_ += key.size() + value.size();
+				(*memtable_)[key].swap(value);
+			}
+
+			if(p != contents.c_str() + contents.size()) {
+				fprintf(stderr, "db: discarding %d bytes of incomplete log at end of %s\n", static_cast<int>(contents.c_str() + contents.size() - p), fname.c_str());
+			}
+
+			memtable_wals_.push_back(path(fname));
+		}
+
+		open_wal();
+
+		thread_.reset(new threading::thread("db_compaction", boost::bind(&local_db_client::background_loop, this)));
+	}
+
+	~local_db_client()
+	{
+		{
+			threading::lock lck(mutex_);
+			exiting_ = true;
+			cond_.notify_one();
+		}
+
+		//joins the thread, letting any job in progress finish. If it
+		//doesn't get installed, the logs are still there to replay.
+		thread_.reset();
+
+		if(wal_) {
+			fclose(wal_);
+		}
+	}
+
+	void put(const std::string& key, variant doc, std::function<void()> on_done, std::function<void()> on_error, PUT_OPERATION op)
+	{
+		operation o;
+		o.is_put = true;
+		o.key = key;
+		o.doc = doc.write_json();
+		o.on_done = on_done;
+		o.on_error = on_error;
+		o.op = op;
+		ops_.push_back(o);
+	}
+
+	void get(const std::string& key, std::function<void(variant)> on_done, int lock_seconds)
+	{
+		operation o;
+		o.is_put = false;
+		o.key = key;
+		o.on_get = on_done;
+		o.lock_seconds = lock_seconds;
+		ops_.push_back(o);
+	}
+
+	void process(int timeout_us)
+	{
+		const int start_ticks = SDL_GetTicks();
+		for(;;) {
+			poll_background_job();
+			run_operations();
+
+			if(ops_.empty() && waiting_ops_.empty()) {
+				break;
+			}
+
+			if(timeout_us > 0 && (SDL_GetTicks() - start_ticks)*1000 >= timeout_us) {
+				break;
+			}
+
+			if(ops_.empty()) {
+				//only gets waiting on locks are left.
+				SDL_Delay(1);
+			}
+		}
+
+		start_background_job();
+	}
+
+private:
+	struct operation {
+		operation() : is_put(false), op(PUT_SET), lock_seconds(0) {}
+		bool is_put;
+		std::string key;
+		std::string doc;
+		std::function<void()> on_done, on_error;
+		std::function<void(variant)> on_get;
+		PUT_OPERATION op;
+		int lock_seconds;
+	};
+
+	std::string path(const std::string& fname) const {
+		return dir_ + "/" + fname;
+	}
+
+	std::string next_fname(const std::string& prefix, const std::string& ext) {
+		return formatter() << prefix << "." << next_file_++ << ext;
+	}
+
+	void open_wal()
+	{
+		const std::string fname = path(next_fname("wal", ".log"));
+		wal_ = fopen(fname.c_str(), "ab");
+		ASSERT_LOG(wal_, "Could not open db log " << fname);
+		memtable_wals_.push_back(fname);
+	}
+
+	//runs all queued operations, writing the puts to the log in one go
+	//before any of their callbacks are called.
+	void run_operations()
+	{
+		std::vector<operation> ops;
+		ops.swap(waiting_ops_);
+		ops.insert(ops.end(), ops_.begin(), ops_.end());
+		ops_.clear();
+
+		const time_t now = time(NULL);
+
+		std::string log;
+		std::vector<std::function<void()> > callbacks;
+
+		foreach(operation& o, ops) {
+			if(o.is_put) {
+				//only adds and replaces care whether the document is there.
+				const bool refused = o.op == PUT_ADD ? exists(o.key) : o.op == PUT_REPLACE && !exists(o.key);
+				if(refused) {
+					if(o.on_error) {
+						callbacks.push_back(o.on_error);
+					}
+					continue;
+				}
+
+				//a write releases any lock held on the document.
+				locks_.erase(o.key);
+
+				encode_record(log, o.key, o.doc);
+
+				remove_from_cache(o.key);
+				memtable::iterator itor = memtable_->find(o.key);
+				if(itor == memtable_->end()) {
+					memtable_bytes_ += o.key.size() + o.doc.size();
+					(*memtable_)[o.key].swap(o.doc);
+				} else {
+					memtable_bytes_ += static_cast<int>(o.doc.size()) - static_cast<int>(itor->second.size());
+					itor->second.swap(o.doc);
+				}
+
+				if(o.on_done) {
+					callbacks.push_back(o.on_done);
+				}
+			} else {
+				std::map<std::string, time_t>::iterator lock_itor = locks_.find(o.key);
+				if(lock_itor != locks_.end() && lock_itor->second <= now) {
+					locks_.erase(lock_itor);
+					lock_itor = locks_.end();
+				}
+
+				if(o.lock_seconds > 0) {
+					if(lock_itor != locks_.end()) {
+						//somebody else holds the lock, wait for them to
+						//write the document or for the lock to expire.
+						waiting_ops_.push_back(o);
+						continue;
+					}
+
+					locks_[o.key] = now + o.lock_seconds;
+				}
+
+				if(o.on_get) {
+					callbacks.push_back(boost::bind(o.on_get, get_document(o.key)));
+				}
+			}
+		}
+
+		if(!log.empty()) {
+			const bool ok = fwrite(log.c_str(), 1, log.size(), wal_) == log.size() && fflush(wal_) == 0;
+			ASSERT_LOG(ok, "Error writing db log");
+			if(g_db_local_sync) {
+#if defined(_MSC_VER)
+				_commit(_fileno(wal_));
+#else
+				fsync(fileno(wal_));
+#endif
+			}
+		}
+
+		foreach(const std::function<void()>& fn, callbacks) {
+			fn();
+		}
+
+		if(memtable_bytes_ >= g_db_local_memtable_kb*1024 && !immutable_) {
+			freeze_memtable();
+		}
+	}
+
+	bool lookup(const std::string& key, std::string* value) const
+	{
+		memtable::const_iterator itor = memtable_->find(key);
+		if(itor != memtable_->end()) {
+			*value = itor->second;
+			return true;
+		}
+
+		if(immutable_) {
+			itor = immutable_->find(key);
+			if(itor != immutable_->end()) {
+				*value = itor->second;
+				return true;
+			}
+		}
+
+		for(std::vector<segment_ptr>::const_reverse_iterator i = segments_.rbegin(); i != segments_.rend(); ++i) {
+			if((*i)->get(key, value)) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	//like lookup(), but doesn't read the document.
+	bool exists(const std::string& key) const
+	{
+		if(memtable_->count(key) || (immutable_ && immutable_->count(key))) {
+			return true;
+		}
+
+		foreach(const segment_ptr& s, segments_) {
+			if(s->contains(key)) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	variant get_document(const std::string& key)
+	{
+		std::map<std::string, cache_list::iterator>::iterator itor = cache_index_.find(key);
+		if(itor != cache_index_.end()) {
+			cache_.splice(cache_.begin(), cache_, itor->second);
+			return itor->second->second;
+		}
+
+		variant result;
+		std::string doc;
+		if(lookup(key, &doc)) {
+			result = json::parse(doc);
+		}
+
+		if(g_db_local_cache_entries > 0) {
+			cache_.push_front(std::make_pair(key, result));
+			cache_index_[key] = cache_.begin();
+			if(static_cast<int>(cache_index_.size()) > g_db_local_cache_entries) {
+				cache_index_.erase(cache_.back().first);
+				cache_.pop_back();
+			}
+		}
+
+		return result;
+	}
+
+	void remove_from_cache(const std::string& key)
+	{
+		std::map<std::string, cache_list::iterator>::iterator itor = cache_index_.find(key);
+		if(itor != cache_index_.end()) {
+			cache_.erase(itor->second);
+			cache_index_.erase(itor);
+		}
+	}
+
+	//moves the current table aside to be written out, and starts a new log
+	//for writes that come in meanwhile.
+	void freeze_memtable()
+	{
+		immutable_ = memtable_;
+		memtable_.reset(new memtable);
+		memtable_bytes_ = 0;
+
+		fclose(wal_);
+		immutable_wals_.swap(memtable_wals_);
+		memtable_wals_.clear();
+		open_wal();
+	}
+
+	void start_background_job()
+	{
+		if(job_running_) {
+			return;
+		}
+
+		if(immutable_) {
+			const std::string fname = next_fname("seg", ".dat");
+			job_running_ = true;
+			job_result_.reset();
+			start_job(boost::bind(&local_db_client::flush_job, this, path(fname), immutable_));
+		} else if(static_cast<int>(segments_.size()) > g_db_local_max_segments) {
+			std::vector<std::string> inputs;
+			foreach(const segment_ptr& s, segments_) {
+				inputs.push_back(s->fname());
+			}
+
+			const std::string fname = next_fname("seg", ".dat");
+			job_running_ = true;
+			job_result_.reset();
+			compacting_ = segments_;
+			start_job(boost::bind(&local_db_client::compact_job, this, path(fname), inputs));
+		}
+	}
+
+	void start_job(boost::function<void()> job)
+	{
+		threading::lock lck(mutex_);
+		job_ = job;
+		cond_.notify_one();
+	}
+
+	void flush_job(const std::string& fname, const_memtable_ptr table)
+	{
+		job_result_ = write_segment(fname, *table);
+	}
+
+	void compact_job(const std::string& fname, const std::vector<std::string>& inputs)
+	{
+		//later segments override earlier ones.
+		memtable merged;
+		foreach(const std::string& input, inputs) {
+			read_segment(input, &merged, NULL);
+		}
+
+		job_result_ = write_segment(fname, merged);
+	}
+
+	void background_loop()
+	{
+		for(;;) {
+			boost::function<void()> job;
+			{
+				threading::lock lck(mutex_);
+				while(!job_ && !exiting_) {
+					cond_.wait(mutex_);
+				}
+
+				if(!job_) {
+					return;
+				}
+
+				job.swap(job_);
+			}
+
+			job();
+
+			threading::lock lck(mutex_);
+			job_done_ = true;
+		}
+	}
+
+	//installs the result of a finished background job.
+	void poll_background_job()
+	{
+		{
+			threading::lock lck(mutex_);
+			if(!job_done_) {
+				return;
+			}
+
+			job_done_ = false;
+		}
+
+		job_running_ = false;
+
+		std::vector<std::string> obsolete;
+		if(compacting_.empty()) {
+			segments_.push_back(job_result_);
+			immutable_.reset();
+			obsolete.swap(immutable_wals_);
+		} else {
+			//segments flushed while we were compacting come after it.
+			std::vector<segment_ptr> segments;
+			segments.push_back(job_result_);
+			segments.insert(segments.end(), segments_.begin() + compacting_.size(), segments_.end());
+			segments_.swap(segments);
+
+			foreach(const segment_ptr& s, compacting_) {
+				obsolete.push_back(s->fname());
+			}
+
+			compacting_.clear();
+		}
+
+		job_result_.reset();
+		write_manifest();
+
+		//compacted segments have been closed by now, so this is safe even on
+		//platforms that won't remove open files.
+		foreach(const std::string& fname, obsolete) {
+			sys::remove_file(fname);
+		}
+	}
+
+	void write_manifest()
+	{
+		std::string manifest;
+		foreach(const segment_ptr& s, segments_) {
+			const std::string::size_type slash = s->fname().rfind('/');
+			manifest += s->fname().substr(slash + 1) + "\n";
+		}
+
+		sys::write_file(path("MANIFEST.tmp"), manifest);
+		sys::move_file(path("MANIFEST.tmp"), path("MANIFEST"));
+	}
+
+	std::string dir_;
+	int next_file_;
+
+	FILE* wal_;
+
+	//the tables documents are looked up in, newest first: the one being
+	//written to, the one being written out to a segment, and the segments.
+	boost::shared_ptr<memtable> memtable_;
+	int memtable_bytes_;
+	const_memtable_ptr immutable_;
+	std::vector<segment_ptr> segments_;
+
+	//logs holding the contents of memtable_ and immutable_.
+	std::vector<std::string> memtable_wals_, immutable_wals_;
+
+	std::vector<operation> ops_, waiting_ops_;
+	std::map<std::string, time_t> locks_;
+
+	typedef std::list<std::pair<std::string, variant> > cache_list;
+	cache_list cache_;
+	std::map<std::string, cache_list::iterator> cache_index_;
+
+	//state shared with the background thread.
+	threading::mutex mutex_;
+	threading::condition cond_;
+	boost::function<void()> job_;
+	bool job_done_, exiting_;
+
+	//owned by the main thread, except job_result_, which belongs to the
+	//background thread while a job is running.
+	bool job_running_;
+	segment_ptr job_result_;
+	std::vector<segment_ptr> compacting_;
+
+	boost::shared_ptr<threading::thread> thread_;
+};
+
+}
+
+db_client_ptr db_client::create_local(const std::string& dir)
+{
+	return db_client_ptr(new local_db_client(dir));
+}
+
+UNIT_TEST(db_local_record_encoding)
+{
+	std::string buf;
+	encode_record(buf, "abc", "{\"x\": 5}");
+	encode_record(buf, "", "");
+	encode_record(buf, "def", std::string(1000, 'z'));
+
+	const char* p = buf.c_str();
+	const char* end = p + buf.size();
+	std::string key, value;
+	CHECK(decode_record(p, end, &key, &value), "");
+	CHECK_EQ(key, "abc");
+	CHECK_EQ(value, "{\"x\": 5}");
+	CHECK(decode_record(p, end, &key, &value), "");
+	CHECK_EQ(key, "");
+	CHECK(decode_record(p, end, &key, &value), "");
+	CHECK_EQ(value.size(), 1000);
+	CHECK(p == end, "");
+
+	//a torn or damaged record is rejected.
+	p = buf.c_str();
+	CHECK(!decode_record(p, buf.c_str() + 15, &key, &value), "");
+	buf[14] ^= 1;
+	CHECK(!decode_record(p, end, &key, &value), "");
+}
+
+namespace {
+
+//a fresh directory for a test to keep a db in.
+std::string unit_test_db_dir(const std::string& name)
+{
+	const std::string dir = std::string(preferences::user_data_path()) + "unit-test-db-" + name;
+	if(sys::dir_exists(dir)) {
+		sys::rmdir_recursive(dir);
+	}
+
+	return dir;
+}
+
+variant unit_test_db_get(db_client& db, const std::string& key)
+{
+	variant result;
+	db.get(key, [&result](variant doc) { result = doc; });
+	db.process();
+	return result;
+}
+
+void unit_test_db_put(db_client& db, const std::string& key, int n)
+{
+	std::map<variant,variant> doc;
+	doc[variant("n")] = variant(n);
+	db.put(key, variant(&doc), std::function<void()>(), std::function<void()>());
+	db.process();
+}
+
+}
+
+UNIT_TEST(db_local_wal_replay)
+{
+	const std::string dir = unit_test_db_dir("wal");
+	{
+		db_client_ptr db = db_client::create_local(dir);
+		unit_test_db_put(*db, "a", 1);
+		unit_test_db_put(*db, "b", 2);
+		unit_test_db_put(*db, "a", 3);
+	}
+
+	//nothing was written to a segment, so it all comes back from the log.
+	db_client_ptr db = db_client::create_local(dir);
+	CHECK_EQ(unit_test_db_get(*db, "a")["n"].as_int(), 3);
+	CHECK_EQ(unit_test_db_get(*db, "b")["n"].as_int(), 2);
+	CHECK(unit_test_db_get(*db, "c").is_null(), "");
+
+	db.reset();
+	sys::rmdir_recursive(dir);
+}
+
+UNIT_TEST(db_local_truncated_wal)
+{
+	const std::string dir = unit_test_db_dir("truncated");
+	{
+		db_client_ptr db = db_client::create_local(dir);
+		unit_test_db_put(*db, "a", 1);
+		unit_test_db_put(*db, "b", 2);
+	}
+
+	//tear the last record, as a crash part way through a write would.
+	std::vector<std::string> files;
+	sys::get_files_in_dir(dir, &files);
+	foreach(const std::string& fname, files) {
+		if(fname.compare(0, 4, "wal.") == 0) {
+			const std::string contents = sys::read_file(dir + "/" + fname);
+			if(!contents.empty()) {
+				sys::write_file(dir + "/" + fname, contents.substr(0, contents.size() - 3));
+			}
+		}
+	}
+
+	{
+		db_client_ptr db = db_client::create_local(dir);
+		CHECK_EQ(unit_test_db_get(*db, "a")["n"].as_int(), 1);
+		CHECK(unit_test_db_get(*db, "b").is_null(), "torn record was replayed");
+		unit_test_db_put(*db, "b", 4);
+	}
+
+	//writes made after recovering aren't lost behind the discarded bytes.
+	db_client_ptr db = db_client::create_local(dir);
+	CHECK_EQ(unit_test_db_get(*db, "a")["n"].as_int(), 1);
+	CHECK_EQ(unit_test_db_get(*db, "b")["n"].as_int(), 4);
+
+	db.reset();
+	sys::rmdir_recursive(dir);
+}
+
+UNIT_TEST(db_local_compaction)
+{
+	const int memtable_kb = g_db_local_memtable_kb;
+	const int max_segments = g_db_local_max_segments;
+	g_db_local_memtable_kb = 1;
+	g_db_local_max_segments = 2;
+
+	const std::string dir = unit_test_db_dir("compaction");
+	const int NumKeys = 20;
+	{
+		db_client_ptr db = db_client::create_local(dir);
+		for(int n = 0; n != 500; ++n) {
+			unit_test_db_put(*db, formatter() << "key" << (n%NumKeys), n);
+		}
+
+		//let the last flushes and merges finish and be installed.
+		for(int n = 0; n != 200; ++n) {
+			db->process();
+			SDL_Delay(1);
+		}
+
+		for(int n = 0; n != NumKeys; ++n) {
+			CHECK_EQ(unit_test_db_get(*db, formatter() << "key" << n)["n"].as_int(), 480 + n);
+		}
+	}
+
+	const std::vector<std::string> manifest = util::split(sys::read_file(dir + "/MANIFEST"), '\n');
+	CHECK_LE(manifest.size(), g_db_local_max_segments + 1);
+
+	db_client_ptr db = db_client::create_local(dir);
+	for(int n = 0; n != NumKeys; ++n) {
+		CHECK_EQ(unit_test_db_get(*db, formatter() << "key" << n)["n"].as_int(), 480 + n);
+	}
+
+	db.reset();
+	sys::rmdir_recursive(dir);
+
+	g_db_local_memtable_kb = memtable_kb;
+	g_db_local_max_segments = max_segments;
+}
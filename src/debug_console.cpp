@@ -137,10 +137,10 @@ void draw_graph()
 	graphics::draw_rect(graph_area, graphics::color(255, 255, 255, 64));
 
 	graphics::draw_rect(rect(graph_area.x(), graph_area.y(), graph_area.w(), 2), graphics::color(255,255,255,255));
-	graphics::blit_texture(font::render_text_uncached(formatter() << max_value.as_int(), graphics::color_white(), 14), graph_area.x2() + 4, graph_area.y());
+	font::text_layout(formatter() << max_value.as_int(), graphics::color_white(), 14).draw(graph_area.x2() + 4, graph_area.y());
 
 	graphics::draw_rect(rect(graph_area.x(), graph_area.y2(), graph_area.w(), 2), graphics::color(255,255,255,255));
-	graphics::blit_texture(font::render_text_uncached(formatter() << min_value.as_int(), graphics::color_white(), 14), graph_area.x2() + 4, graph_area.y2() - 12);
+	font::text_layout(formatter() << min_value.as_int(), graphics::color_white(), 14).draw(graph_area.x2() + 4, graph_area.y2() - 12);
 
 	graphics::color GraphColors[] = {
 		graphics::color(255,255,255,255),
@@ -214,7 +214,7 @@ void draw_graph()
 		glEnable(GL_TEXTURE_2D);
 #endif
 
-		graphics::blit_texture(font::render_text_uncached(p.first, graph_color.as_sdl_color(), 14), points[points.size()-2] + 4, mean_ypos - 6);
+		font::text_layout(p.first, graph_color.as_sdl_color(), 14).draw(points[points.size()-2] + 4, mean_ypos - 6);
 
 		++colors_index;
 	}
@@ -225,8 +225,8 @@ void draw_graph()
 namespace {
 static bool screen_output_enabled = true;
 
-std::list<graphics::texture>& messages() {
-	static std::list<graphics::texture> message_queue;
+std::list<font::text_layout>& messages() {
+	static std::list<font::text_layout> message_queue;
 	return message_queue;
 }
 
@@ -262,7 +262,7 @@ void add_message(const std::string& msg)
 
 	const SDL_Color col = {255, 255, 255, 255};
 	try {
-		messages().push_back(font::render_text_uncached(msg, col, 14));
+		messages().push_back(font::text_layout(msg, col, 14));
 	} catch(font::error& e) {
 
 		std::cerr << "FAILED TO ADD MESSAGE DUE TO FONT RENDERING FAILURE\n";
@@ -283,10 +283,10 @@ void draw()
 	}
 
 	int ypos = 100;
-	foreach(const graphics::texture& t, messages()) {
+	foreach(const font::text_layout& t, messages()) {
 		const SDL_Rect area = {0, ypos-2, int(t.width() + 10), int(t.height() + 5)};
 		graphics::draw_rect(area, graphics::color_black(), 128);
-		graphics::blit_texture(t, 5, ypos);
+		t.draw(5, ypos);
 		ypos += t.height() + 5;
 	}
 }
@@ -32,17 +32,23 @@
 #include "font.hpp"
 #include "foreach.hpp"
 #include "formula_profiler.hpp"
+#include "frame_scheduler.hpp"
+#include "frame_timings.hpp"
 #include "globals.h"
 #include "graphical_font.hpp"
 #include "gui_section.hpp"
 #include "i18n.hpp"
+#include "image_loader.hpp"
 #include "level.hpp"
 #include "message_dialog.hpp"
+#include "particle_system.hpp"
 #include "player_info.hpp"
 #include "preferences.hpp"
 #include "raster.hpp"
 #include "speech_dialog.hpp"
+#include "sprite_batch.hpp"
 #include "texture.hpp"
+#include "texture_atlas.hpp"
 #include "texture_frame_buffer.hpp"
 
 #include "tooltip.hpp"
@@ -360,6 +366,7 @@ bool update_camera_position(const level& lvl, screen_position& pos, const entity
 
 void render_scene(const level& lvl, const screen_position& pos) {
 		formula_profiler::instrument instrumentation("DRAW");
+	const frame_timings::scope timing("draw");
 #ifndef NO_EDITOR
 	const int sidebar_width = editor::sidebar_width();
 #else
@@ -584,6 +591,57 @@ variant performance_data::get_value(const std::string& key) const
 	PERF_ATTR(nevents);
 #undef PERF_ATTR
 
+	//stats for the objects drawn in the last frame.
+	const graphics::sprite_batch::stats& batch_stats = graphics::sprite_batch::last_frame_stats();
+	if(key == "draw_calls") {
+		return variant(batch_stats.draw_calls + batch_stats.unbatched);
+	} else if(key == "state_changes") {
+		return variant(batch_stats.state_changes);
+	} else if(key == "batched_sprites") {
+		return variant(batch_stats.sprites);
+	} else if(key == "unbatched_draws") {
+		return variant(batch_stats.unbatched);
+	}
+
+	const particle_system_manager::stats& particle_stats = particle_system_manager::get_stats();
+	if(key == "particles") {
+		return variant(particle_stats.particles);
+	} else if(key == "particle_systems") {
+		return variant(particle_stats.systems);
+	} else if(key == "particle_spawn_scale") {
+		return variant(particle_stats.spawn_scale_millis);
+	} else if(key == "particle_draw_calls") {
+		return variant(particle_stats.draw_calls);
+	}
+
+	if(key == "level_load_ms") {
+		return variant(graphics::image_loader::get_stats().level_load_ms);
+	} else if(key == "image_sync_load_ms") {
+		return variant(graphics::image_loader::get_stats().last_frame_sync_ms);
+	} else if(key == "first_frames_sync_load_ms") {
+		return variant(graphics::image_loader::get_stats().first_frames_sync_ms);
+	}
+
+	const frame_scheduler::stats& frame_stats = frame_scheduler::get_stats();
+	if(key == "frame_time_histogram") {
+		std::vector<variant> v;
+		foreach(int count, frame_stats.histogram) {
+			v.push_back(variant(count));
+		}
+
+		return variant(&v);
+	} else if(key == "late_cycles") {
+		return variant(frame_stats.late_cycles);
+	} else if(key == "dropped_cycles") {
+		return variant(frame_stats.dropped_cycles);
+	}
+
+	if(key == "timings") {
+		return frame_timings::get_timings();
+	} else if(key == "counters") {
+		return frame_timings::get_counters();
+	}
+
 	return variant();
 }
 
@@ -598,6 +656,22 @@ void performance_data::get_inputs(std::vector<game_logic::formula_input>* inputs
 	PERF_ATTR(flip);
 	PERF_ATTR(cycle);
 	PERF_ATTR(nevents);
+	PERF_ATTR(draw_calls);
+	PERF_ATTR(state_changes);
+	PERF_ATTR(batched_sprites);
+	PERF_ATTR(unbatched_draws);
+	PERF_ATTR(particles);
+	PERF_ATTR(particle_systems);
+	PERF_ATTR(particle_spawn_scale);
+	PERF_ATTR(particle_draw_calls);
+	PERF_ATTR(level_load_ms);
+	PERF_ATTR(image_sync_load_ms);
+	PERF_ATTR(first_frames_sync_load_ms);
+	PERF_ATTR(frame_time_histogram);
+	PERF_ATTR(late_cycles);
+	PERF_ATTR(dropped_cycles);
+	PERF_ATTR(timings);
+	PERF_ATTR(counters);
 #undef PERF_ATTR
 }
 
@@ -626,10 +700,70 @@ void draw_fps(const level& lvl, const performance_data& data)
 
 	rect area = font->draw(10, 60, s.str());
 
+	{
+		//texture binds since we were last drawn, i.e. over the last frame.
+		static unsigned int last_bind_count = 0;
+		const unsigned int bind_count = graphics::texture::get_bind_count();
+		const graphics::texture_atlas::stats atlas = graphics::texture_atlas::get_stats();
+
+		std::ostringstream s;
+		const graphics::sprite_batch::stats& batch_stats = graphics::sprite_batch::last_frame_stats();
+
+		s << (batch_stats.draw_calls + batch_stats.unbatched) << " object draw calls (" << batch_stats.sprites << " batched in " << batch_stats.draw_calls << "); " << batch_stats.state_changes << " state changes; " << (bind_count - last_bind_count) << " texture binds; " << atlas.pages << " atlas pages; " << atlas.regions << " atlas regions; " << static_cast<int>(atlas.occupancy*100) << "% atlas occupancy; " << atlas.evictions << " evictions";
+		last_bind_count = bind_count;
+
+		area = font->draw(10, area.y2() + 5, s.str());
+	}
+
+	{
+		const particle_system_manager::stats& particles = particle_system_manager::get_stats();
+
+		std::ostringstream s;
+		s << particles.particles << " particles in " << particles.systems << " systems; " << particles.culled << " systems off screen; " << particles.draw_calls << " particle draw calls; " << (particles.spawn_scale_millis/10) << "% spawn rate";
+
+		area = font->draw(10, area.y2() + 5, s.str());
+	}
+
+	{
+		//text drawn since we were last drawn, i.e. over the last frame.
+		static font::stats last_font_stats = font::get_stats();
+		const font::stats font_stats = font::get_stats();
+
+		std::ostringstream s;
+		s << (font_stats.text_textures - last_font_stats.text_textures) << " text textures made; " << (font_stats.text_layouts - last_font_stats.text_layouts) << " text layouts; " << font_stats.render_cache_bytes/1024 << "KB text texture cache; " << font_stats.glyphs << " glyphs in " << font_stats.glyph_pages << " pages, " << font_stats.glyph_atlas_bytes/1024 << "KB";
+		last_font_stats = font_stats;
+
+		area = font->draw(10, area.y2() + 5, s.str());
+	}
+
+	{
+		const graphics::image_loader::stats images = graphics::image_loader::get_stats();
+
+		std::ostringstream s;
+		s << "level loaded in " << images.level_load_ms << "ms; " << images.sync_loads << " images loaded while playing, " << images.first_frames_sync_ms << "ms in first frames, worst frame " << images.worst_frame_sync_ms << "ms; " << images.decoded << " decoded in background; " << images.disk_cache_hits << " image cache hits; " << images.pending << " pending";
+
+		area = font->draw(10, area.y2() + 5, s.str());
+	}
+
+	{
+		const frame_scheduler::stats& frame_stats = frame_scheduler::get_stats();
+
+		//the frame time most frames were drawn within.
+		int p99 = 0, count = 0;
+		while(p99 < frame_stats.histogram.size() && count < frame_stats.frames*99/100) {
+			count += frame_stats.histogram[p99++];
+		}
+
+		std::ostringstream s;
+		s << p99 << "ms 99th percentile frame time over " << frame_stats.frames << " frames; " << frame_stats.late_cycles << " late cycles; " << frame_stats.dropped_cycles << " dropped cycles";
+
+		area = font->draw(10, area.y2() + 5, s.str());
+	}
+
 	if(controls::num_players() > 1) {
 		//draw networking stats
 		std::ostringstream s;
-		s << controls::packets_received() << " packets received; " << controls::num_errors() << " errors; " << controls::cycles_behind() << " behind; " << controls::their_highest_confirmed() << " remote cycles " << controls::last_packet_size() << " packet";
+		s << controls::packets_received() << " packets received; " << controls::num_errors() << " errors; " << controls::cycles_behind() << " behind; " << controls::their_highest_confirmed() << " remote cycles " << controls::last_packet_size() << " packet; " << controls::num_desyncs() << " desyncs";
 
 		area = font->draw(10, area.y2() + 5, s.str());
 	}
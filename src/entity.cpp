@@ -63,6 +63,53 @@ entity::entity(int x, int y, bool face_right)
 	}
 }
 
+namespace {
+unsigned world_position_change_count = 0;
+unsigned truez_change_count = 0;
+}
+
+void entity::set_truez(bool en)
+{
+	if(true_z_ != en) {
+		true_z_ = en;
+		++truez_change_count;
+	}
+}
+
+void entity::set_tx(double x)
+{
+	if(tx_ != x) {
+		tx_ = x;
+		++world_position_change_count;
+	}
+}
+
+void entity::set_ty(double y)
+{
+	if(ty_ != y) {
+		ty_ = y;
+		++world_position_change_count;
+	}
+}
+
+void entity::set_tz(double z)
+{
+	if(tz_ != z) {
+		tz_ = z;
+		++world_position_change_count;
+	}
+}
+
+unsigned entity::world_position_changes()
+{
+	return world_position_change_count;
+}
+
+unsigned entity::truez_changes()
+{
+	return truez_change_count;
+}
+
 void entity::add_to_level()
 {
 	last_move_x_ = last_move_y_ = 0;
@@ -34,6 +34,10 @@
 #include "wml_formula_callable.hpp"
 #include "variant.hpp"
 
+namespace graphics {
+class sprite_batch;
+}
+
 class character;
 class frame;
 class level;
@@ -57,6 +61,11 @@ public:
 	virtual variant write() const = 0;
 	virtual void setup_drawing() const {}
 	virtual void draw(int x, int y) const = 0;
+
+	//adds the entity to a sprite batch instead of drawing it, if it is
+	//simple enough. Returns false if it must be drawn using draw().
+	virtual bool draw_batched(graphics::sprite_batch& batch, int x, int y) const { return false; }
+
 	virtual void draw_later(int x, int y) const = 0;
 	virtual void draw_group() const = 0;
 	player_info* get_player_info() { return is_human(); }
@@ -307,10 +316,15 @@ public:
 	double tx() const { return tx_; }
 	double ty() const { return ty_; }
 	double tz() const { return tz_; }
-	void set_truez(bool en=false) { true_z_ = en; }
-	void set_tx(double x) { tx_ = x; }
-	void set_ty(double y) { ty_ = y; }
-	void set_tz(double z) { tz_ = z; }
+	void set_truez(bool en=false);
+	void set_tx(double x);
+	void set_ty(double y);
+	void set_tz(double z);
+
+	//count changes to any entity's 3d position, and to whether any entity
+	//has one, so caches of where entities are can tell when they're stale.
+	static unsigned world_position_changes();
+	static unsigned truez_changes();
 
 protected:
 	virtual const_solid_info_ptr calculate_solid() const = 0;
@@ -0,0 +1,271 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "background_task_pool.hpp"
+#include "entity.hpp"
+#include "flow_field.hpp"
+#include "foreach.hpp"
+#include "frame_timings.hpp"
+#include "level.hpp"
+#include "pathfinding.hpp"
+#include "preferences.hpp"
+
+PREF_INT(flow_field_budget, 20000, "Most cells each flow field whose target moved searches each cycle while working out its new field");
+PREF_INT(flow_field_timeout, 300, "Cycles a flow field nothing refers to is kept for, in case it's asked for again");
+
+namespace pathfinding {
+
+namespace {
+
+//how many cells away from the target the field's target may be, when the
+//cell the target is in is blocked.
+const int MaxTargetDistance = 2;
+
+}
+
+flow_field_grid::flow_field_grid(const level& lvl, const point& origin, int width, int height, int cell_width, int cell_height)
+  : grid(lvl, origin, width, height, cell_width, cell_height),
+    solid_state_id(lvl.solid_state_id())
+{}
+
+flow_field_callable::flow_field_callable(flow_field_grid_ptr grid, const std::string& target_label, const point& target, int cycle)
+  : grid_(grid), target_label_(target_label), last_request_cycle_(cycle)
+{
+	field_.reset(new flow_field(grid_->grid, target_cell(target)));
+
+	int expanded = 0;
+	field_->compute(std::numeric_limits<int>::max(), &expanded);
+}
+
+int flow_field_callable::target_cell(const point& p) const
+{
+	const int cell = grid().cell_at(p);
+	const int open = grid().nearest_open_cell(cell, MaxTargetDistance);
+	return open != -1 ? open : cell;
+}
+
+variant flow_field_callable::direction_at(const point& p) const
+{
+	int dx = 0, dy = 0;
+	if(!field_->direction(grid().cell_at(p), &dx, &dy)) {
+		return variant();
+	}
+
+	std::vector<variant> v;
+	v.push_back(variant(dx));
+	v.push_back(variant(dy));
+	return variant(&v);
+}
+
+variant flow_field_callable::cost_at(const point& p) const
+{
+	const float cost = field_->cost(grid().cell_at(p));
+	if(cost < 0.0f) {
+		return variant();
+	}
+
+	return variant(decimal(double(cost)));
+}
+
+void flow_field_callable::prepare(const level& lvl, const std::vector<int>& changed)
+{
+	if(!changed.empty()) {
+		field_->cells_changed(changed);
+		if(next_) {
+			next_->cells_changed(changed);
+		}
+	}
+
+	//if the target moves again while its new field is being worked out,
+	//that field is finished first so a target which never stops still
+	//gets fields which follow it.
+	const_entity_ptr target_obj = target_label_.empty() ? const_entity_ptr() : lvl.get_entity_by_label(target_label_);
+	if(target_obj && !next_) {
+		const int target = target_cell(target_obj->midpoint());
+		if(target != field_->target()) {
+			next_.reset(new flow_field(grid(), target));
+		}
+	}
+}
+
+void flow_field_callable::compute(int budget, int* expanded)
+{
+	//repairs only visit the cells whose cost changed, so the field in use
+	//is always repaired completely.
+	field_->compute(std::numeric_limits<int>::max(), expanded);
+
+	if(next_ && next_->compute(budget, expanded)) {
+		field_.swap(next_);
+		next_.reset();
+	}
+}
+
+BEGIN_DEFINE_CALLABLE_NOBASE(flow_field_callable)
+BEGIN_DEFINE_FN(direction_at, "(int,int) -> [int,int]|null")
+	return obj.direction_at(point(FN_ARG(0).as_int(), FN_ARG(1).as_int()));
+END_DEFINE_FN
+
+BEGIN_DEFINE_FN(cost_at, "(int,int) -> decimal|null")
+	return obj.cost_at(point(FN_ARG(0).as_int(), FN_ARG(1).as_int()));
+END_DEFINE_FN
+
+DEFINE_FIELD(target, "[int,int]")
+	return point_as_variant_list(obj.grid().cell_pos(obj.field_->target()));
+
+DEFINE_FIELD(tile_size, "[int,int]")
+	std::vector<variant> v;
+	v.push_back(variant(obj.grid().cell_width()));
+	v.push_back(variant(obj.grid().cell_height()));
+	return variant(&v);
+END_DEFINE_CALLABLE(flow_field_callable)
+
+namespace flow_fields {
+
+namespace {
+
+const level* current_level = NULL;
+std::map<std::vector<int>, flow_field_grid_ptr> grids;
+
+//fields towards an object are keyed by its label, and fields towards a
+//place by an empty label and the cell it's in.
+typedef std::pair<std::string, std::vector<int> > field_key;
+std::map<field_key, flow_field_callable_ptr> fields;
+
+//the fields being computed this cycle.
+std::vector<flow_field_callable*> computing;
+std::vector<int> computing_expanded;
+
+void compute_fields(int begin, int end)
+{
+	for(int n = begin; n != end; ++n) {
+		computing[n]->compute(g_flow_field_budget, &computing_expanded[n]);
+	}
+}
+
+}
+
+flow_field_callable_ptr get(level& lvl, entity_ptr target_obj, const point& target, int tile_size_x, int tile_size_y)
+{
+	if(current_level != &lvl) {
+		clear();
+		current_level = &lvl;
+	}
+
+	point origin;
+	int width, height;
+	if(!get_midpoint_grid_layout(lvl.boundaries(), tile_size_x, tile_size_y, &origin, &width, &height)) {
+		return flow_field_callable_ptr();
+	}
+
+	std::vector<int> layout;
+	layout.push_back(origin.x);
+	layout.push_back(origin.y);
+	layout.push_back(width);
+	layout.push_back(height);
+	layout.push_back(tile_size_x);
+	layout.push_back(tile_size_y);
+
+	flow_field_grid_ptr& grid = grids[layout];
+	if(!grid) {
+		grid.reset(new flow_field_grid(lvl, origin, width, height, tile_size_x, tile_size_y));
+	}
+
+	//fields towards a place are shared by everything asking for a field
+	//towards the same cell. An object with no label can't be found again,
+	//so it's treated as the place it's at.
+	const std::string label = target_obj ? target_obj->label() : "";
+	const point target_pos = target_obj ? target_obj->midpoint() : target;
+	field_key key(label, layout);
+	if(label.empty()) {
+		key.second.push_back(grid->grid.cell_at(target_pos));
+	}
+
+	flow_field_callable_ptr& field = fields[key];
+	if(!field) {
+		field.reset(new flow_field_callable(grid, label, target_pos, lvl.cycle()));
+	}
+
+	field->set_last_request_cycle(lvl.cycle());
+	return field;
+}
+
+void process(level& lvl)
+{
+	if(current_level != &lvl) {
+		clear();
+		current_level = &lvl;
+		return;
+	}
+
+	std::map<const flow_field_grid*, std::vector<int> > changes;
+	typedef std::pair<const std::vector<int>, flow_field_grid_ptr> grid_pair;
+	foreach(grid_pair& p, grids) {
+		update_grid(lvl, &p.second->grid, &p.second->solid_state_id, &changes[p.second.get()]);
+	}
+
+	computing.clear();
+	std::vector<field_key> expired;
+	typedef std::pair<const field_key, flow_field_callable_ptr> field_pair;
+	foreach(field_pair& p, fields) {
+		if(p.second->refcount() == 1 && lvl.cycle() - p.second->last_request_cycle() > g_flow_field_timeout) {
+			expired.push_back(p.first);
+			continue;
+		}
+
+		p.second->prepare(lvl, changes[p.second->shared_grid().get()]);
+		computing.push_back(p.second.get());
+	}
+
+	foreach(const field_key& key, expired) {
+		fields.erase(key);
+	}
+
+	std::vector<std::vector<int> > unused_grids;
+	foreach(grid_pair& p, grids) {
+		if(p.second.use_count() == 1) {
+			unused_grids.push_back(p.first);
+		}
+	}
+
+	foreach(const std::vector<int>& layout, unused_grids) {
+		grids.erase(layout);
+	}
+
+	computing_expanded.assign(computing.size(), 0);
+	background_task_pool::parallel_for(computing.size(), compute_fields, 1);
+
+	foreach(int expanded, computing_expanded) {
+		frame_timings::add_counter("flow_field_cells_searched", expanded);
+	}
+
+	computing.clear();
+}
+
+void clear()
+{
+	fields.clear();
+	grids.clear();
+	current_level = NULL;
+}
+
+}
+
+}
@@ -0,0 +1,118 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FLOW_FIELD_HPP_INCLUDED
+#define FLOW_FIELD_HPP_INCLUDED
+
+#include <boost/intrusive_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+#include <vector>
+
+#include "entity_fwd.hpp"
+#include "formula_callable.hpp"
+#include "formula_callable_definition.hpp"
+#include "geometry.hpp"
+#include "grid_pathfinder.hpp"
+
+class level;
+
+namespace pathfinding {
+
+//a grid read from the level, shared by the flow fields which use the same
+//size of tile.
+struct flow_field_grid
+{
+	flow_field_grid(const level& lvl, const point& origin, int width, int height, int cell_width, int cell_height);
+
+	grid_map grid;
+	int solid_state_id;
+};
+
+typedef boost::shared_ptr<flow_field_grid> flow_field_grid_ptr;
+
+//The flow field towards an object, or a fixed place, in the level, as
+//given to FFL by flow_field(). Everything which asks for a field towards
+//the same target shares one, and reads the way to go from it with
+//direction_at(x, y).
+//
+//It's kept up to date once a cycle. Changes to the level's solidity are
+//repaired straight away. When the target moves into another cell, the
+//field for where it is now is worked out over the next few cycles, and
+//the old one is used until it's ready. The field leads to the open cell
+//nearest the target, since an object standing on the ground often has
+//its midpoint in a cell which reaches into the floor.
+//
+//A target object is known by its label, so the field follows it across
+//level backups being restored.
+class flow_field_callable : public game_logic::formula_callable
+{
+	DECLARE_CALLABLE(flow_field_callable);
+public:
+	flow_field_callable(flow_field_grid_ptr grid, const std::string& target_label, const point& target, int cycle);
+
+	const flow_field_grid_ptr& shared_grid() const { return grid_; }
+	const grid_map& grid() const { return grid_->grid; }
+
+	//the step to take from p towards the target, in cells, as [dx,dy], or
+	//null if the target can't be reached from p.
+	variant direction_at(const point& p) const;
+
+	//the distance in level pixels from p to the target, or null.
+	variant cost_at(const point& p) const;
+
+	int last_request_cycle() const { return last_request_cycle_; }
+	void set_last_request_cycle(int cycle) { last_request_cycle_ = cycle; }
+
+	//applies cells which changed in the grid and notices if the target
+	//moved, ready for compute().
+	void prepare(const level& lvl, const std::vector<int>& changed);
+
+	//repairs the field, and spends up to budget cells on a new field for
+	//a target which moved. Fields can be computed on different threads.
+	void compute(int budget, int* expanded);
+
+private:
+	int target_cell(const point& p) const;
+
+	flow_field_grid_ptr grid_;
+	std::string target_label_;
+	boost::scoped_ptr<flow_field> field_, next_;
+	int last_request_cycle_;
+};
+
+typedef boost::intrusive_ptr<flow_field_callable> flow_field_callable_ptr;
+
+namespace flow_fields {
+
+//the field towards target_obj, or towards target if target_obj is null,
+//through tiles of the given size. Returns null if the level is too small
+//to have any tiles.
+flow_field_callable_ptr get(level& lvl, entity_ptr target_obj, const point& target, int tile_size_x, int tile_size_y);
+
+//called by the level once a cycle to bring the fields up to date, and to
+//forget ones nothing has used for a while.
+void process(level& lvl);
+
+void clear();
+
+}
+
+}
+
+#endif
@@ -14,8 +14,10 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <iostream>
 #include <map>
+#include <string.h>
 
 #include <boost/tuple/tuple.hpp>
 #include <boost/filesystem.hpp>
@@ -27,8 +29,14 @@
 #include "foreach.hpp"
 #include "formatter.hpp"
 #include "module.hpp"
+#include "preferences.hpp"
 #include "string_utils.hpp"
 #include "surface.hpp"
+#include "unit_test.hpp"
+
+#if defined(USE_SHADERS)
+#include "gles2.hpp"
+#endif
 
 /*  This manages the TTF loading library, and allows you to use fonts.
 	The only thing one will normally need to use is render_text(), and 
@@ -111,8 +119,203 @@ RenderCache& cache() {
 	return instance;
 }
 
+int g_text_textures = 0;
+int g_text_layouts = 0;
+
 bool fonts_initialized = false;
 
+//decodes the next character of a UTF-8 string. Invalid sequences give
+//the replacement character.
+Uint32 next_utf8_char(std::string::const_iterator& i, std::string::const_iterator end)
+{
+	const unsigned char c = *i++;
+	int ntrailing = 0;
+	Uint32 result = c;
+	if(c < 0x80) {
+		return c;
+	} else if((c&0xE0) == 0xC0) {
+		ntrailing = 1;
+		result = c&0x1F;
+	} else if((c&0xF0) == 0xE0) {
+		ntrailing = 2;
+		result = c&0x0F;
+	} else if((c&0xF8) == 0xF0) {
+		ntrailing = 3;
+		result = c&0x07;
+	} else {
+		return 0xFFFD;
+	}
+
+	while(ntrailing--) {
+		if(i == end || (static_cast<unsigned char>(*i)&0xC0) != 0x80) {
+			return 0xFFFD;
+		}
+
+		result = (result << 6) | (static_cast<unsigned char>(*i++)&0x3F);
+	}
+
+	return result;
+}
+
+#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_HARMATTAN && !TARGET_OS_IPHONE
+//all glyphs share pages of this size, packed in shelves.
+const int GlyphPageSize = 512;
+const int GlyphPadding = 1;
+
+struct glyph_page {
+	glyph_page() : dirty(false), shelf_x(0), shelf_y(0), shelf_h(0)
+	{
+		surf = graphics::surface(SDL_CreateRGBSurface(0, GlyphPageSize, GlyphPageSize, 32, SURFACE_MASK));
+		SDL_FillRect(surf.get(), NULL, 0);
+	}
+
+	//the pixels are kept so glyphs can be added after the page has been
+	//made into a texture.
+	graphics::surface surf;
+	graphics::texture tex;
+	bool dirty;
+
+	int shelf_x, shelf_y, shelf_h;
+};
+
+std::vector<glyph_page> glyph_pages;
+
+struct glyph {
+	//page the glyph is in, or -1 if it has no pixels, like a space.
+	int page;
+	int x, y, w, h;
+
+	//offset from the pen position and the top of the line.
+	int minx, yoffset;
+
+	int maxx, advance;
+};
+
+//the glyphs of a font at one size.
+struct glyph_set {
+	glyph_set() : font(NULL), height(0), kerning(false)
+	{}
+
+	TTF_Font* font;
+	int height;
+	bool kerning;
+	std::map<Uint16, glyph> glyphs;
+	std::map<std::pair<Uint16, Uint16>, int> kerning_pairs;
+};
+
+std::map<TTF_Font*, glyph_set> glyph_sets;
+int num_glyphs = 0;
+
+//finds space in a page for a w x h glyph, adding a page if need be.
+void place_glyph(int w, int h, int* page, int* x, int* y)
+{
+	w += GlyphPadding*2;
+	h += GlyphPadding*2;
+	ASSERT_LOG(w <= GlyphPageSize && h <= GlyphPageSize, "Glyph too big for the glyph atlas: " << w << "x" << h);
+
+	if(glyph_pages.empty() == false) {
+		glyph_page& p = glyph_pages.back();
+		if(p.shelf_x + w > GlyphPageSize) {
+			p.shelf_x = 0;
+			p.shelf_y += p.shelf_h;
+			p.shelf_h = 0;
+		}
+
+		if(p.shelf_y + h <= GlyphPageSize) {
+			*page = glyph_pages.size() - 1;
+			*x = p.shelf_x + GlyphPadding;
+			*y = p.shelf_y + GlyphPadding;
+			p.shelf_x += w;
+			p.shelf_h = std::max(p.shelf_h, h);
+			return;
+		}
+	}
+
+	glyph_pages.push_back(glyph_page());
+	glyph_page& p = glyph_pages.back();
+	*page = glyph_pages.size() - 1;
+	*x = GlyphPadding;
+	*y = GlyphPadding;
+	p.shelf_x = w;
+	p.shelf_h = h;
+}
+
+glyph_set& get_glyph_set(TTF_Font* font)
+{
+	glyph_set& set = glyph_sets[font];
+	if(set.font == NULL) {
+		set.font = font;
+		set.height = TTF_FontHeight(font);
+		set.kerning = TTF_GetFontKerning(font) && !TTF_FontFaceIsFixedWidth(font);
+	}
+
+	return set;
+}
+
+const glyph& get_glyph(glyph_set& set, Uint16 ch)
+{
+	std::map<Uint16, glyph>::iterator itor = set.glyphs.find(ch);
+	if(itor != set.glyphs.end()) {
+		return itor->second;
+	}
+
+	glyph& g = set.glyphs[ch];
+	int miny = 0, maxy = 0;
+	if(TTF_GlyphMetrics(set.font, ch, &g.minx, &g.maxx, &miny, &maxy, &g.advance) != 0) {
+		g.minx = g.maxx = g.advance = 0;
+	}
+
+	g.yoffset = TTF_FontAscent(set.font) - maxy;
+	g.page = -1;
+	g.x = g.y = g.w = g.h = 0;
+
+	//rasterize in white, so the glyph can be drawn in any color.
+	const SDL_Color white = {255, 255, 255, 255};
+	graphics::surface s(TTF_RenderGlyph_Blended(set.font, ch, white));
+	if(s.get() != NULL && s->w > 0 && s->h > 0) {
+		place_glyph(s->w, s->h, &g.page, &g.x, &g.y);
+		g.w = s->w;
+		g.h = s->h;
+
+		glyph_page& p = glyph_pages[g.page];
+		SDL_Rect dst = { g.x, g.y, s->w, s->h };
+		SDL_SetSurfaceBlendMode(s.get(), SDL_BLENDMODE_NONE);
+		SDL_BlitSurface(s.get(), NULL, p.surf.get(), &dst);
+		p.dirty = true;
+	}
+
+	++num_glyphs;
+	return g;
+}
+
+//SDL_ttf only gives kerning by FreeType glyph index, which we don't have,
+//so we find it from how much wider the pair is than the glyphs alone.
+int get_kerning(glyph_set& set, Uint16 a, Uint16 b)
+{
+	if(!set.kerning) {
+		return 0;
+	}
+
+	const std::pair<Uint16, Uint16> key(a, b);
+	std::map<std::pair<Uint16, Uint16>, int>::const_iterator itor = set.kerning_pairs.find(key);
+	if(itor != set.kerning_pairs.end()) {
+		return itor->second;
+	}
+
+	const Uint16 pair[] = { a, b, 0 };
+	int w = 0, h = 0;
+	int result = 0;
+	if(TTF_SizeUNICODE(set.font, pair, &w, &h) == 0) {
+		const glyph& ga = get_glyph(set, a);
+		const glyph& gb = get_glyph(set, b);
+		result = w - ga.advance - std::max(gb.advance, gb.maxx) + std::min(0, ga.minx);
+	}
+
+	set.kerning_pairs[key] = result;
+	return result;
+}
+#endif
+
 }
 
 bool is_init() {
@@ -136,6 +339,9 @@ manager::manager()
 manager::~manager()
 {
 #if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_HARMATTAN && !TARGET_OS_IPHONE
+	glyph_sets.clear();
+	glyph_pages.clear();
+
 	font_map::iterator it = font_table.begin();
 	while(it != font_table.end()) {
 		TTF_CloseFont(it->second);
@@ -186,6 +392,7 @@ graphics::texture render_text_uncached(const std::string& text,
 #else
 	graphics::surface s;
 #endif
+	++g_text_textures;
 	return graphics::texture::get_no_cache(s);
 }
 
@@ -211,6 +418,159 @@ graphics::texture render_text(const std::string& text,
 	return res;
 }
 
+text_layout::text_layout() : width_(0), height_(0)
+{
+	color_.r = color_.g = color_.b = color_.a = 255;
+}
+
+text_layout::text_layout(const std::string& text, const SDL_Color& color, int size, const std::string& font_name)
+  : color_(color), width_(0), height_(0)
+{
+	//render_text() ignores alpha, so we do too.
+	color_.a = 255;
+	if(text.empty()) {
+		return;
+	}
+
+	++g_text_layouts;
+
+#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_HARMATTAN && !TARGET_OS_IPHONE
+	glyph_set& set = get_glyph_set(get_font(size, font_name));
+
+	std::string::const_iterator i = text.begin();
+	int ypos = 0;
+	for(;;) {
+		//lay out one line, in the same way SDL_ttf does, with the pen
+		//starting at 0 and the line's extent in minx..maxx.
+		const int first_quad = quads_.size();
+		int pen = 0, minx = 0, maxx = 0;
+		Uint16 prev = 0;
+		while(i != text.end() && *i != '\n') {
+			Uint32 c = next_utf8_char(i, text.end());
+			if(c > 0xFFFF) {
+				//SDL_ttf only handles the basic multilingual plane.
+				c = 0xFFFD;
+			}
+
+			const Uint16 ch = static_cast<Uint16>(c);
+			if(prev) {
+				pen += get_kerning(set, prev, ch);
+			}
+
+			const glyph& g = get_glyph(set, ch);
+			minx = std::min(minx, pen + g.minx);
+			maxx = std::max(maxx, pen + std::max(g.advance, g.maxx));
+
+			if(g.page >= 0) {
+				quad q = { g.page, GLshort(pen + g.minx), GLshort(ypos + g.yoffset), GLshort(g.w), GLshort(g.h),
+				           GLfloat(g.x)/GlyphPageSize, GLfloat(g.y)/GlyphPageSize,
+				           GLfloat(g.x + g.w)/GlyphPageSize, GLfloat(g.y + g.h)/GlyphPageSize };
+				quads_.push_back(q);
+			}
+
+			pen += g.advance;
+			prev = ch;
+		}
+
+		//the image of the line starts at its leftmost pixel.
+		for(int n = first_quad; n != quads_.size(); ++n) {
+			quads_[n].x -= minx;
+		}
+
+		width_ = std::max(width_, maxx - minx);
+		ypos += set.height;
+
+		if(i == text.end()) {
+			break;
+		}
+
+		++i;
+	}
+
+	height_ = ypos;
+
+	//draw the glyphs in each page together.
+	std::stable_sort(quads_.begin(), quads_.end());
+#endif
+}
+
+void text_layout::draw(int x, int y) const
+{
+#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_HARMATTAN && !TARGET_OS_IPHONE
+	if(quads_.empty()) {
+		return;
+	}
+
+	x &= preferences::xypos_draw_mask;
+	y &= preferences::xypos_draw_mask;
+
+	static std::vector<GLshort> varray;
+	static std::vector<GLfloat> tcarray;
+
+	//the text's color is modulated by the current color, like that of a
+	//texture is, then the current color is restored.
+	GLfloat current_color[4];
+#if defined(USE_SHADERS)
+	memcpy(current_color, gles2::get_color(), sizeof(current_color));
+#else
+	glGetFloatv(GL_CURRENT_COLOR, current_color);
+#endif
+	glColor4f(current_color[0]*color_.r/255.0f, current_color[1]*color_.g/255.0f, current_color[2]*color_.b/255.0f, current_color[3]);
+
+	std::vector<quad>::const_iterator i = quads_.begin();
+	while(i != quads_.end()) {
+		glyph_page& p = glyph_pages[i->page];
+		if(p.dirty) {
+			p.tex = graphics::texture::get_no_cache(p.surf);
+			p.dirty = false;
+		}
+
+		p.tex.set_as_current_texture();
+
+		varray.clear();
+		tcarray.clear();
+		const int page = i->page;
+		for(; i != quads_.end() && i->page == page; ++i) {
+			const GLshort x1 = x + i->x, y1 = y + i->y, x2 = x1 + i->w, y2 = y1 + i->h;
+			const GLshort vertices[] = { x1, y1, x2, y1, x1, y2, x2, y1, x1, y2, x2, y2 };
+			const GLfloat u1 = p.tex.translate_coord_x(i->u1), v1 = p.tex.translate_coord_y(i->v1);
+			const GLfloat u2 = p.tex.translate_coord_x(i->u2), v2 = p.tex.translate_coord_y(i->v2);
+			const GLfloat coords[] = { u1, v1, u2, v1, u1, v2, u2, v1, u1, v2, u2, v2 };
+			varray.insert(varray.end(), vertices, vertices + 12);
+			tcarray.insert(tcarray.end(), coords, coords + 12);
+		}
+
+#if defined(USE_SHADERS)
+		gles2::active_shader()->prepare_draw();
+		gles2::active_shader()->shader()->vertex_array(2, GL_SHORT, 0, 0, &varray.front());
+		gles2::active_shader()->shader()->texture_array(2, GL_FLOAT, 0, 0, &tcarray.front());
+#else
+		glVertexPointer(2, GL_SHORT, 0, &varray.front());
+		glTexCoordPointer(2, GL_FLOAT, 0, &tcarray.front());
+#endif
+		glDrawArrays(GL_TRIANGLES, 0, varray.size()/2);
+	}
+
+	glColor4f(current_color[0], current_color[1], current_color[2], current_color[3]);
+#endif
+}
+
+stats get_stats()
+{
+	stats result;
+	result.text_textures = g_text_textures;
+	result.render_cache_bytes = g_render_cache_size;
+	result.text_layouts = g_text_layouts;
+#if !TARGET_IPHONE_SIMULATOR && !TARGET_OS_HARMATTAN && !TARGET_OS_IPHONE
+	result.glyphs = num_glyphs;
+	result.glyph_pages = glyph_pages.size();
+	result.glyph_atlas_bytes = glyph_pages.size()*GlyphPageSize*GlyphPageSize*4;
+#else
+	result.glyphs = result.glyph_pages = result.glyph_atlas_bytes = 0;
+#endif
+	return result;
+}
+
 int char_width(int size, const std::string& fn)
 {
 	static std::map<std::string, std::map<int, int> > size_cache;
@@ -266,3 +626,17 @@ std::string get_default_monospace_font()
 }
 
 }
+
+UNIT_TEST(font_next_utf8_char)
+{
+	const std::string s = "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\xc3";
+	std::string::const_iterator i = s.begin();
+	CHECK_EQ(font::next_utf8_char(i, s.end()), 'a');
+	CHECK_EQ(font::next_utf8_char(i, s.end()), 0xE9);
+	CHECK_EQ(font::next_utf8_char(i, s.end()), 0x20AC);
+	CHECK_EQ(font::next_utf8_char(i, s.end()), 0x1F600);
+
+	//a truncated sequence.
+	CHECK_EQ(font::next_utf8_char(i, s.end()), 0xFFFD);
+	CHECK(i == s.end(), "Did not reach the end of the string");
+}
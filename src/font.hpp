@@ -40,6 +40,53 @@ graphics::texture render_text(const std::string& text,
 graphics::texture render_text_uncached(const std::string& text,
                                        const SDL_Color& color, int size, const std::string& font_name="");
 
+//A string laid out as quads over the glyph atlas for its font and size.
+//Glyphs are rasterized once and shared by all text, so unlike
+//render_text() this doesn't make a texture for each string, and is the
+//way to draw text which changes often. Supports UTF-8, new lines and
+//kerning, and takes up the same space render_text() would.
+class text_layout
+{
+public:
+	text_layout();
+	text_layout(const std::string& text, const SDL_Color& color, int size, const std::string& font_name="");
+
+	int width() const { return width_; }
+	int height() const { return height_; }
+	bool empty() const { return quads_.empty(); }
+
+	void draw(int x, int y) const;
+
+private:
+	struct quad {
+		int page;
+		GLshort x, y, w, h;
+		GLfloat u1, v1, u2, v2;
+
+		bool operator<(const quad& q) const { return page < q.page; }
+	};
+
+	std::vector<quad> quads_;
+	SDL_Color color_;
+	int width_, height_;
+};
+
+struct stats {
+	//textures made for whole strings by render_text() and
+	//render_text_uncached() since we started.
+	int text_textures;
+
+	//bytes held by textures in the render_text() cache.
+	int render_cache_bytes;
+
+	//text laid out through the glyph atlas since we started.
+	int text_layouts;
+
+	int glyphs, glyph_pages, glyph_atlas_bytes;
+};
+
+stats get_stats();
+
 int char_width(int size, const std::string& fn="");
 int char_height(int size, const std::string& fn="");
 
@@ -65,6 +65,7 @@
 #include "unit_test.hpp"
 #include "variant_callable.hpp"
 #include "controls.hpp"
+#include "grid_pathfinder.hpp"
 #include "pathfinding.hpp"
 #include "preferences.hpp"
 #include "random.hpp"
@@ -1730,15 +1731,23 @@ FUNCTION_DEF(create_graph_from_level, 1, 3, "create_graph_from_level(level, (opt
 	std::vector<variant> vertex_list;
 	const rect& b_rect = level::current().boundaries();
 
-	for(int y = b.y(); y < b.y2(); y += tile_size_y) {
-		for(int x = b.x(); x < b.x2(); x += tile_size_x) {
-			if(!lvl->solid(x, y, tile_size_x, tile_size_y)) {
-				variant l(pathfinding::point_as_variant_list(point(x,y)));
+	// Work out which tiles are solid once, rather than for every edge.
+	pathfinding::level_grid_ptr lg = pathfinding::get_level_grid(*lvl, point(b.x(), b.y()), 
+		(b.w() + tile_size_x - 1)/tile_size_x, (b.h() + tile_size_y - 1)/tile_size_y, tile_size_x, tile_size_y);
+	const pathfinding::grid_map& grid = lg->grid;
+
+	for(int y = 0; y < grid.height(); ++y) {
+		for(int x = 0; x < grid.width(); ++x) {
+			if(!grid.blocked(x, y)) {
+				point po(grid.cell_pos(grid.id(x, y)));
+				variant l(pathfinding::point_as_variant_list(po));
 				vertex_list.push_back(l);
 				std::vector<variant> e;
-				point po(x,y);
 				foreach(const point& p, pathfinding::get_neighbours_from_rect(po, tile_size_x, tile_size_y, b_rect)) {
-					if(!lvl->solid(p.x, p.y, tile_size_x, tile_size_y)) {
+					const int px = (p.x - b.x())/tile_size_x;
+					const int py = (p.y - b.y())/tile_size_y;
+					const bool solid = p.x >= b.x() && p.y >= b.y() && grid.in_bounds(px, py) ? grid.blocked(px, py) : lvl->solid(p.x, p.y, tile_size_x, tile_size_y);
+					if(!solid) {
 						e.push_back(pathfinding::point_as_variant_list(p));
 					}
 				}
@@ -35,6 +35,7 @@
 #include "rectangle_rotator.hpp"
 #include "solid_map.hpp"
 #include "sound.hpp"
+#include "sprite_batch.hpp"
 #include "string_utils.hpp"
 #include "surface_cache.hpp"
 #include "surface_formula.hpp"
@@ -188,7 +189,8 @@ frame::frame(variant node)
 	 no_remove_alpha_borders_(node["no_remove_alpha_borders"].as_bool(false)),
 	 collision_areas_inside_frame_(true),
 	 current_palette_(-1), 
-	 back_face_culling_(node["cull"].as_bool(false))
+	 back_face_culling_(node["cull"].as_bool(false)),
+	 use_atlas_(!node.has_key("obj") && !node.has_key("fbo") && node["atlas"].as_bool(true))
 {
 	if(node.has_key("obj") == false) {
 		image_ = node["image"].as_string();
@@ -480,6 +482,10 @@ frame::frame(variant node)
 
 		dd3d_array_.push_back(dd3d);
 	}
+
+	//requested last, since the 3d texture co-ordinates above are for
+	//texture_ and mustn't be mapped into an atlas page.
+	request_atlas_region();
 }
 
 frame::~frame()
@@ -508,12 +514,43 @@ void frame::set_palettes(unsigned int palettes)
 		if(current_palette_ != -1) {
 			texture_ = graphics::texture::get(image_);
 			current_palette_ = -1;
+			request_atlas_region();
 		}
 		return;
 	}
 
 	texture_ = graphics::texture::get_palette_mapped(image_, npalette);
 	current_palette_ = npalette;
+	request_atlas_region();
+}
+
+void frame::request_atlas_region()
+{
+	atlas_region_.reset();
+	if(!use_atlas_ || !texture_.valid() || frames_.empty()) {
+		return;
+	}
+
+	rect area = frames_.front().area;
+	foreach(const frame_info& info, frames_) {
+		area = rect_union(area, info.area);
+	}
+
+	if(graphics::texture_atlas::accepts(area.w(), area.h())) {
+		atlas_region_ = graphics::texture_atlas::request(texture_, area);
+	}
+}
+
+const graphics::texture& frame::draw_texture() const
+{
+	if(atlas_region_) {
+		atlas_region_->touch();
+		if(atlas_region_->placed()) {
+			return atlas_region_->page_texture();
+		}
+	}
+
+	return texture_;
 }
 
 void frame::set_color_palette(unsigned int palettes)
@@ -529,6 +566,12 @@ void frame::set_image_as_solid()
 	solid_ = solid_info::create_from_texture(texture_, img_rect_);
 }
 
+void frame::disable_atlas()
+{
+	use_atlas_ = false;
+	atlas_region_.reset();
+}
+
 void frame::play_sound(const void* object) const
 {
 	if (sounds_.empty() == false){
@@ -738,12 +781,13 @@ void frame::draw_into_blit_queue(graphics::blit_queue& blit, int x, int y, bool
 	const int w = info->area.w()*scale_*(face_right ? 1 : -1);
 	const int h = info->area.h()*scale_*(upside_down ? -1 : 1);
 
-	rect[0] = texture_.translate_coord_x(rect[0]);
-	rect[1] = texture_.translate_coord_y(rect[1]);
-	rect[2] = texture_.translate_coord_x(rect[2]);
-	rect[3] = texture_.translate_coord_y(rect[3]);
+	const graphics::texture& tex = draw_texture();
+	rect[0] = tex.translate_coord_x(rect[0]);
+	rect[1] = tex.translate_coord_y(rect[1]);
+	rect[2] = tex.translate_coord_x(rect[2]);
+	rect[3] = tex.translate_coord_y(rect[3]);
 
-	blit.set_texture(texture_.get_id());
+	blit.set_texture(tex.get_id());
 
 
 	blit.add(x, y, rect[0], rect[1]);
@@ -765,12 +809,12 @@ void frame::draw(int x, int y, bool face_right, bool upside_down, int time, GLfl
 
 	if(rotate == 0) {
 		//if there is no rotation, then we can make a much simpler call
-		graphics::queue_blit_texture(texture_, x, y, w, h, rect[0], rect[1], rect[2], rect[3]);
+		graphics::queue_blit_texture(draw_texture(), x, y, w, h, rect[0], rect[1], rect[2], rect[3]);
 		graphics::flush_blit_texture();
 		return;
 	}
 
-	graphics::queue_blit_texture(texture_, x, y, w, h, rotate, rect[0], rect[1], rect[2], rect[3]);
+	graphics::queue_blit_texture(draw_texture(), x, y, w, h, rotate, rect[0], rect[1], rect[2], rect[3]);
 	graphics::flush_blit_texture();
 }
 
@@ -793,15 +837,38 @@ void frame::draw(int x, int y, bool face_right, bool upside_down, int time, GLfl
 
 	if(rotate == 0) {
 		//if there is no rotation, then we can make a much simpler call
-		graphics::queue_blit_texture(texture_, x, y, w, h, rect[0], rect[1], rect[2], rect[3]);
+		graphics::queue_blit_texture(draw_texture(), x, y, w, h, rect[0], rect[1], rect[2], rect[3]);
 		graphics::flush_blit_texture();
 		return;
 	}
 
-	graphics::queue_blit_texture(texture_, x, y, w, h, rotate, rect[0], rect[1], rect[2], rect[3]);
+	graphics::queue_blit_texture(draw_texture(), x, y, w, h, rotate, rect[0], rect[1], rect[2], rect[3]);
 	graphics::flush_blit_texture();
 }
 
+void frame::draw_into_sprite_batch(graphics::sprite_batch& batch, int x, int y, bool face_right, bool upside_down, int time, GLfloat rotate, GLfloat scale) const
+{
+	const frame_info* info = NULL;
+	GLfloat rect[4];
+	get_rect_in_texture(time, &rect[0], info);
+
+	x += (face_right ? info->x_adjust : info->x2_adjust)*scale_;
+	y += info->y_adjust*scale_;
+	const int w = info->area.w()*scale_*scale*(face_right ? 1 : -1);
+	const int h = info->area.h()*scale_*scale*(upside_down ? -1 : 1);
+
+	//adjust x,y to accomodate scaling so that we scale from the center.
+	const int width_delta = img_rect_.w()*scale_*scale - img_rect_.w()*scale_;
+	const int height_delta = img_rect_.h()*scale_*scale - img_rect_.h()*scale_;
+	x -= width_delta/2;
+	y -= height_delta/2;
+
+	const graphics::texture& tex = draw_texture();
+	batch.add(tex, x, y, w, h, rotate,
+	          tex.translate_coord_x(rect[0]), tex.translate_coord_y(rect[1]),
+	          tex.translate_coord_x(rect[2]), tex.translate_coord_y(rect[3]));
+}
+
 void frame::draw(int x, int y, const rect& area, bool face_right, bool upside_down, int time, GLfloat rotate) const
 {
 	const frame_info* info = NULL;
@@ -816,13 +883,14 @@ void frame::draw(int x, int y, const rect& area, bool face_right, bool upside_do
 	const int w = info->area.w()*scale_*(face_right ? 1 : -1);
 	const int h = info->area.h()*scale_*(upside_down ? -1 : 1);
 
-	rect[0] += GLfloat(x_adjust)/GLfloat(texture_.width());
-	rect[1] += GLfloat(y_adjust)/GLfloat(texture_.height());
-	rect[2] += GLfloat(x_adjust + w_adjust)/GLfloat(texture_.width());
-	rect[3] += GLfloat(y_adjust + h_adjust)/GLfloat(texture_.height());
+	const graphics::texture& tex = draw_texture();
+	rect[0] += GLfloat(x_adjust)/GLfloat(tex.width());
+	rect[1] += GLfloat(y_adjust)/GLfloat(tex.height());
+	rect[2] += GLfloat(x_adjust + w_adjust)/GLfloat(tex.width());
+	rect[3] += GLfloat(y_adjust + h_adjust)/GLfloat(tex.height());
 
 	//the last 4 params are the rectangle of the single, specific frame
-	graphics::blit_texture(texture_, x, y, (w + w_adjust*scale_)*(face_right ? 1 : -1), (h + h_adjust*scale_)*(upside_down ? -1 : 1), rotate + (face_right ? rotate_ : -rotate_),
+	graphics::blit_texture(tex, x, y, (w + w_adjust*scale_)*(face_right ? 1 : -1), (h + h_adjust*scale_)*(upside_down ? -1 : 1), rotate + (face_right ? rotate_ : -rotate_),
 	                       rect[0], rect[1], rect[2], rect[3]);
 }
 
@@ -894,15 +962,16 @@ void frame::draw3(int time, GLint va, GLint tc) const
 
 void frame::draw_custom(int x, int y, const std::vector<CustomPoint>& points, const rect* area, bool face_right, bool upside_down, int time, GLfloat rotate) const
 {
-	texture_.set_as_current_texture();
+	const graphics::texture& tex = draw_texture();
+	tex.set_as_current_texture();
 
 	const frame_info* info = NULL;
 	GLfloat rect[4];
 	get_rect_in_texture(time, &rect[0], info);
-	rect[0] = texture_.translate_coord_x(rect[0]);
-	rect[1] = texture_.translate_coord_y(rect[1]);
-	rect[2] = texture_.translate_coord_x(rect[2]);
-	rect[3] = texture_.translate_coord_y(rect[3]);
+	rect[0] = tex.translate_coord_x(rect[0]);
+	rect[1] = tex.translate_coord_y(rect[1]);
+	rect[2] = tex.translate_coord_x(rect[2]);
+	rect[3] = tex.translate_coord_y(rect[3]);
 
 	x += (face_right ? info->x_adjust : info->x2_adjust)*scale_;
 	y += info->y_adjust*scale_;
@@ -925,10 +994,10 @@ void frame::draw_custom(int x, int y, const std::vector<CustomPoint>& points, co
 		const int w_adjust = area->w() - img_rect_.w();
 		const int h_adjust = area->h() - img_rect_.h();
 
-		rect[0] += GLfloat(x_adjust)/GLfloat(texture_.width());
-		rect[1] += GLfloat(y_adjust)/GLfloat(texture_.height());
-		rect[2] += GLfloat(x_adjust + w_adjust)/GLfloat(texture_.width());
-		rect[3] += GLfloat(y_adjust + h_adjust)/GLfloat(texture_.height());
+		rect[0] += GLfloat(x_adjust)/GLfloat(tex.width());
+		rect[1] += GLfloat(y_adjust)/GLfloat(tex.height());
+		rect[2] += GLfloat(x_adjust + w_adjust)/GLfloat(tex.width());
+		rect[3] += GLfloat(y_adjust + h_adjust)/GLfloat(tex.height());
 
 		w += w_adjust*scale_;
 		h += h_adjust*scale_;
@@ -1019,15 +1088,16 @@ PREF_BOOL(debug_custom_draw, false, "Show debug visualization of custom drawing"
 
 void frame::draw_custom(int x, int y, const GLfloat* xy, const GLfloat* uv, int nelements, bool face_right, bool upside_down, int time, GLfloat rotate, int cycle) const
 {
-	texture_.set_as_current_texture();
+	const graphics::texture& tex = draw_texture();
+	tex.set_as_current_texture();
 
 	const frame_info* info = NULL;
 	GLfloat rect[4];
 	get_rect_in_texture(time, &rect[0], info);
-	rect[0] = texture_.translate_coord_x(rect[0]);
-	rect[1] = texture_.translate_coord_y(rect[1]);
-	rect[2] = texture_.translate_coord_x(rect[2]);
-	rect[3] = texture_.translate_coord_y(rect[3]);
+	rect[0] = tex.translate_coord_x(rect[0]);
+	rect[1] = tex.translate_coord_y(rect[1]);
+	rect[2] = tex.translate_coord_x(rect[2]);
+	rect[3] = tex.translate_coord_y(rect[3]);
 
 	x += (face_right ? info->x_adjust : info->x2_adjust)*scale_;
 	y += info->y_adjust*scale_;
@@ -1112,25 +1182,31 @@ void frame::get_rect_in_frame_number(int nframe, GLfloat* output_rect, const fra
 	const frame_info& info = frames_[nframe];
 	info_result = &info;
 
-	if(info.draw_rect_init) {
-		memcpy(output_rect, info.draw_rect, sizeof(*output_rect)*4);
-		return;
+	if(!info.draw_rect_init) {
+		compute_draw_rect(info);
 	}
 
-	const int current_col = (nframes_per_row_ > 0) ? (nframe % nframes_per_row_) : nframe ;
-	const int current_row = (nframes_per_row_ > 0) ? (nframe/nframes_per_row_) : 0 ;
+	memcpy(output_rect, info.draw_rect, sizeof(*output_rect)*4);
 
+	if(atlas_region_ && atlas_region_->placed()) {
+		output_rect[0] = atlas_region_->map_x(output_rect[0]);
+		output_rect[1] = atlas_region_->map_y(output_rect[1]);
+		output_rect[2] = atlas_region_->map_x(output_rect[2]);
+		output_rect[3] = atlas_region_->map_y(output_rect[3]);
+	}
+}
+
+void frame::compute_draw_rect(const frame_info& info) const
+{
 	//a tiny amount we subtract from the right/bottom side of the texture,
 	//to avoid rounding errors in floating point going over the edge.
 	//This seems like a kludge but I don't know of a better way to do it. :(
 	const GLfloat TextureEpsilon = 0.1;
 
-	output_rect[0] = GLfloat(info.area.x() + TextureEpsilon)/GLfloat(texture_.width());
-	output_rect[1] = GLfloat(info.area.y() + TextureEpsilon) / GLfloat(texture_.height());
-	output_rect[2] = GLfloat(info.area.x() + info.area.w() - TextureEpsilon)/GLfloat(texture_.width());
-	output_rect[3] = GLfloat(info.area.y() + info.area.h() - TextureEpsilon)/GLfloat(texture_.height());
-
-	memcpy(info.draw_rect, output_rect, sizeof(*output_rect)*4);
+	info.draw_rect[0] = GLfloat(info.area.x() + TextureEpsilon)/GLfloat(texture_.width());
+	info.draw_rect[1] = GLfloat(info.area.y() + TextureEpsilon) / GLfloat(texture_.height());
+	info.draw_rect[2] = GLfloat(info.area.x() + info.area.w() - TextureEpsilon)/GLfloat(texture_.width());
+	info.draw_rect[3] = GLfloat(info.area.y() + info.area.h() - TextureEpsilon)/GLfloat(texture_.height());
 	info.draw_rect_init = true;
 }
 
@@ -27,11 +27,13 @@
 #include "obj_reader.hpp"
 #include "solid_map_fwd.hpp"
 #include "raster.hpp"
+#include "texture_atlas.hpp"
 #include "variant.hpp"
 #include <glm/glm.hpp>
 
 namespace graphics {
 class blit_queue;
+class sprite_batch;
 }
 
 class frame : public game_logic::formula_callable
@@ -75,6 +77,10 @@ public:
 	void draw(int x, int y, bool face_right=true, bool upside_down=false, int time=0, GLfloat rotate=0) const;
 	void draw(int x, int y, bool face_right, bool upside_down, int time, GLfloat rotate, GLfloat scale) const;
 	void draw(int x, int y, const rect& area, bool face_right=true, bool upside_down=false, int time=0, GLfloat rotate=0) const;
+
+	//adds the frame to a sprite batch rather than drawing it now. Draws the
+	//same thing as draw() with the same arguments.
+	void draw_into_sprite_batch(graphics::sprite_batch& batch, int x, int y, bool face_right, bool upside_down, int time, GLfloat rotate, GLfloat scale=1.0) const;
 	void draw3(int time, GLint va, GLint tc) const;
 
 	struct CustomPoint {
@@ -87,6 +93,10 @@ public:
 
 	void draw_custom(int x, int y, const GLfloat* xy, const GLfloat* uv, int nelements, bool face_right, bool upside_down, int time, GLfloat rotate, int cycle) const;
 	void set_image_as_solid();
+
+	//keeps the frame out of texture atlases, for frames drawn with shaders
+	//which expect the frame's own texture co-ordinates.
+	void disable_atlas();
 	const_solid_info_ptr solid() const { return solid_; }
 	int collide_x() const { return collide_rect_.x()*scale_; }
 	int collide_y() const { return collide_rect_.y()*scale_; }
@@ -147,6 +157,13 @@ private:
 
 	void get_rect_in_texture(int time, GLfloat* output_rect, const frame_info*& info) const;
 	void get_rect_in_frame_number(int nframe, GLfloat* output_rect, const frame_info*& info) const;
+	void compute_draw_rect(const frame_info& info) const;
+
+	//the texture to draw with. This is the atlas page we have been packed
+	//into if there is one, otherwise our own texture.
+	const graphics::texture& draw_texture() const;
+	void request_atlas_region();
+
 	std::string id_, image_;
 
 	//ID as a variant, useful to be able to get a variant of the ID
@@ -210,6 +227,12 @@ private:
 	variant get_value(const std::string& key) const;
 
 	bool back_face_culling_;
+
+	//whether this frame may be drawn from a texture atlas, and the area of
+	//the atlas we have been given.
+	bool use_atlas_;
+	graphics::texture_atlas::region_ptr atlas_region_;
+
 	struct draw_data_3d
 	{
 		size_t num_vertices;
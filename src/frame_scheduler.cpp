@@ -0,0 +1,184 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+
+#include "frame_scheduler.hpp"
+#include "preferences.hpp"
+#include "unit_test.hpp"
+
+namespace {
+//how many cycles we may fall behind by and still catch up on.
+const int MaxCyclesBehind = 3;
+
+frame_scheduler::stats g_stats;
+
+Uint64 performance_counter()
+{
+	return SDL_GetPerformanceCounter();
+}
+}
+
+frame_scheduler::frame_scheduler()
+  : clock_(performance_counter), frequency_(SDL_GetPerformanceFrequency()), cycle_ticks_(0),
+    cycle_start_(0), next_cycle_(0), last_frame_(0), last_frame_ms_(0.0)
+{
+	reset();
+}
+
+frame_scheduler::frame_scheduler(clock_fn clock, Uint64 frequency)
+  : clock_(clock), frequency_(frequency), cycle_ticks_(0),
+    cycle_start_(0), next_cycle_(0), last_frame_(0), last_frame_ms_(0.0)
+{
+	reset();
+}
+
+void frame_scheduler::reset()
+{
+	cycle_ticks_ = (frequency_*preferences::frame_time_millis())/1000;
+	cycle_start_ = next_cycle_ = clock_();
+
+	//the time we were away shouldn't count as a long frame.
+	last_frame_ = 0;
+}
+
+void frame_scheduler::begin_cycle(bool allow_drop)
+{
+	//the frame time can change between cycles.
+	cycle_ticks_ = std::max<Uint64>(1, (frequency_*preferences::frame_time_millis())/1000);
+
+	const Uint64 now = clock_();
+	if(now > next_cycle_ + cycle_ticks_) {
+		++g_stats.late_cycles;
+
+		if(allow_drop && now > next_cycle_ + MaxCyclesBehind*cycle_ticks_) {
+			//this cycle was due at next_cycle_, and one more is due each
+			//cycle_ticks_ up to now. This one is run now, and the next is
+			//due a cycle from now, so the rest are never run.
+			g_stats.dropped_cycles += static_cast<int>((now - next_cycle_)/cycle_ticks_);
+			next_cycle_ = now;
+		}
+	}
+
+	cycle_start_ = next_cycle_;
+	next_cycle_ += cycle_ticks_;
+}
+
+bool frame_scheduler::behind() const
+{
+	return clock_() >= next_cycle_;
+}
+
+float frame_scheduler::cycle_fraction() const
+{
+	const Uint64 now = clock_();
+	if(now <= cycle_start_ || cycle_ticks_ == 0) {
+		return 0.0f;
+	}
+
+	return std::min<float>(1.0f, float(now - cycle_start_)/float(cycle_ticks_));
+}
+
+double frame_scheduler::ms_until_next_cycle() const
+{
+	const Uint64 now = clock_();
+	if(now >= next_cycle_) {
+		return -((now - next_cycle_)*1000.0)/frequency_;
+	}
+
+	return ((next_cycle_ - now)*1000.0)/frequency_;
+}
+
+int frame_scheduler::wait_for_next_cycle()
+{
+	const int wait_time = static_cast<int>(ms_until_next_cycle());
+	if(wait_time > 0) {
+		SDL_Delay(wait_time);
+	}
+
+	return std::max(0, wait_time);
+}
+
+void frame_scheduler::frame_presented()
+{
+	const Uint64 now = clock_();
+	if(last_frame_ != 0) {
+		last_frame_ms_ = ((now - last_frame_)*1000.0)/frequency_;
+
+		const int bucket = std::min<int>(static_cast<int>(last_frame_ms_), stats::NumHistogramBuckets - 1);
+		++g_stats.histogram[bucket];
+		++g_stats.frames;
+	}
+
+	last_frame_ = now;
+}
+
+const frame_scheduler::stats& frame_scheduler::get_stats()
+{
+	return g_stats;
+}
+
+namespace {
+Uint64 fake_clock_ticks = 0;
+
+Uint64 fake_clock()
+{
+	return fake_clock_ticks;
+}
+}
+
+UNIT_TEST(frame_scheduler_catches_up)
+{
+	//the fake clock ticks once a millisecond.
+	fake_clock_ticks = 0;
+	frame_scheduler scheduler(fake_clock, 1000);
+	const Uint64 cycle = std::max(1, preferences::frame_time_millis());
+
+	const int late = frame_scheduler::get_stats().late_cycles;
+	const int dropped = frame_scheduler::get_stats().dropped_cycles;
+
+	scheduler.begin_cycle(true);
+	CHECK(!scheduler.behind(), "behind at the start of the first cycle");
+	CHECK_EQ(scheduler.ms_until_next_cycle(), double(cycle));
+
+	fake_clock_ticks = cycle/2;
+	CHECK_EQ(scheduler.cycle_fraction(), float(cycle/2)/float(cycle));
+
+	fake_clock_ticks = cycle;
+	CHECK(scheduler.behind(), "not behind once the next cycle is due");
+
+	//two cycles late: the next cycles run straight away until we catch up.
+	fake_clock_ticks = cycle*3;
+	scheduler.begin_cycle(true);
+	CHECK_EQ(frame_scheduler::get_stats().late_cycles, late + 1);
+	CHECK(scheduler.behind(), "caught up too soon");
+	scheduler.begin_cycle(true);
+	CHECK(scheduler.behind(), "caught up too soon");
+	scheduler.begin_cycle(true);
+	CHECK(!scheduler.behind(), "didn't catch up");
+	CHECK_EQ(scheduler.ms_until_next_cycle(), double(cycle));
+	CHECK_EQ(frame_scheduler::get_stats().dropped_cycles, dropped);
+
+	//too far behind to catch up: the missed cycles are dropped. The cycle
+	//due at 4 cycles is run at 20, and the next is due at 21, so the 16
+	//due at 5 to 20 are never run.
+	fake_clock_ticks = cycle*20;
+	scheduler.begin_cycle(true);
+	CHECK_EQ(frame_scheduler::get_stats().late_cycles, late + 2);
+	CHECK_EQ(frame_scheduler::get_stats().dropped_cycles, dropped + 16);
+	CHECK(!scheduler.behind(), "behind after dropping cycles");
+	CHECK_EQ(scheduler.ms_until_next_cycle(), double(cycle));
+}
@@ -0,0 +1,98 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FRAME_SCHEDULER_HPP_INCLUDED
+#define FRAME_SCHEDULER_HPP_INCLUDED
+
+#include <boost/function.hpp>
+
+#include <vector>
+
+#include "graphics.hpp"
+
+//Decides when game cycles should run, using the high resolution
+//performance counter. Cycles are due every preferences::frame_time_millis(),
+//measured from when the scheduler was last reset, so that rounding errors
+//don't add up, and time we fall behind by is caught up on by running
+//cycles without drawing, up to a limit.
+class frame_scheduler
+{
+public:
+	frame_scheduler();
+
+	//uses the given clock, which counts frequency ticks a second, in place
+	//of the performance counter. Lets tests control time.
+	typedef boost::function<Uint64()> clock_fn;
+	frame_scheduler(clock_fn clock, Uint64 frequency);
+
+	//start timing from now, forgetting about any time we're behind by.
+	void reset();
+
+	//called at the start of each cycle. If we have fallen too far behind
+	//to catch up and allow_drop is set the missed cycles are dropped,
+	//otherwise they are run as quickly as possible.
+	void begin_cycle(bool allow_drop);
+
+	//true if the next cycle is already due, so drawing this one should be
+	//skipped if we can afford it.
+	bool behind() const;
+
+	//how far through the current cycle we are, from 0 to 1.
+	float cycle_fraction() const;
+
+	//time until the next cycle is due. Negative if it's overdue.
+	double ms_until_next_cycle() const;
+
+	//sleeps until the next cycle is due, returning how long we slept for.
+	int wait_for_next_cycle();
+
+	//records that a frame was put on the screen.
+	void frame_presented();
+
+	//the time between the last two frames presented.
+	double last_frame_ms() const { return last_frame_ms_; }
+
+	//stats since the game started. The histogram has a bucket for each
+	//millisecond of time between frames, with the last bucket taking
+	//everything longer.
+	struct stats {
+		stats() : frames(0), late_cycles(0), dropped_cycles(0), histogram(NumHistogramBuckets)
+		{}
+
+		enum { NumHistogramBuckets = 64 };
+
+		int frames;
+
+		//cycles which began more than a cycle after they were due, and
+		//cycles which were never run because we were too far behind.
+		int late_cycles, dropped_cycles;
+
+		std::vector<int> histogram;
+	};
+
+	static const stats& get_stats();
+
+private:
+	clock_fn clock_;
+	Uint64 frequency_, cycle_ticks_;
+
+	//when the current cycle was due to start, when the next one is, and
+	//when the last frame was presented.
+	Uint64 cycle_start_, next_cycle_, last_frame_;
+	double last_frame_ms_;
+};
+
+#endif
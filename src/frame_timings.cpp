@@ -0,0 +1,513 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <boost/scoped_ptr.hpp>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include "asserts.hpp"
+#include "filesystem.hpp"
+#include "foreach.hpp"
+#include "frame_timings.hpp"
+#include "http_server.hpp"
+#include "preferences.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+
+PREF_BOOL(frame_timings, true, "Record how long is spent in each part of every frame");
+PREF_INT(frame_timings_history, 120, "Number of frames of timings to keep");
+PREF_INT(frame_timings_port, 0, "Port on localhost to serve frame timings on as JSON, or 0 to not serve them");
+
+namespace frame_timings
+{
+
+namespace {
+
+//scopes nested deeper than this are recorded as if they were at this depth.
+const int MaxDepth = 32;
+
+//scopes, told apart by the address of their name and the scope they're
+//inside, so two literals with the same text may make two nodes.
+struct node {
+	int parent;
+	const char* name;
+};
+
+threading::mutex g_nodes_mutex;
+std::vector<node> g_nodes;
+std::map<std::pair<int, const char*>, int> g_node_index;
+
+int get_node(int parent, const char* name)
+{
+	threading::lock lck(g_nodes_mutex);
+	const std::pair<int, const char*> key(parent, name);
+	std::map<std::pair<int, const char*>, int>::const_iterator i = g_node_index.find(key);
+	if(i != g_node_index.end()) {
+		return i->second;
+	}
+
+	const node n = { parent, name };
+	g_nodes.push_back(n);
+	g_node_index[key] = g_nodes.size() - 1;
+	return g_nodes.size() - 1;
+}
+
+const char* node_name(int n)
+{
+	threading::lock lck(g_nodes_mutex);
+	return g_nodes[n].name;
+}
+
+std::string node_path(int n)
+{
+	threading::lock lck(g_nodes_mutex);
+	std::string result = g_nodes[n].name;
+	for(int parent = g_nodes[n].parent; parent != -1; parent = g_nodes[parent].parent) {
+		result = std::string(g_nodes[parent].name) + "/" + result;
+	}
+
+	return result;
+}
+
+//the scopes a thread is inside.
+struct thread_state {
+	thread_state() : depth(0)
+	{}
+
+	int parent() const { return depth > 0 ? stack[std::min(depth, MaxDepth) - 1] : -1; }
+
+	void push(int n) {
+		if(depth < MaxDepth) {
+			stack[depth] = n;
+		}
+		++depth;
+	}
+
+	int stack[MaxDepth];
+	int depth;
+
+	//nodes we've already looked up, by the scope they're in and their
+	//name, so the main thread doesn't need to lock to find them.
+	std::map<std::pair<int, const char*>, int> cache;
+};
+
+struct node_total {
+	node_total() : ticks(0), calls(0)
+	{}
+	Uint64 ticks;
+	int calls;
+};
+
+struct trace_event {
+	int node;
+	Uint32 thread;
+	Uint64 start, end;
+};
+
+//what's been recorded since the last end_frame().
+struct frame_buffer {
+	std::vector<node_total> totals;
+	std::map<const char*, int> counters;
+	std::vector<trace_event> trace;
+
+	void record(int n, Uint32 thread, Uint64 start, Uint64 end, bool tracing) {
+		if(n >= totals.size()) {
+			totals.resize(n + 1);
+		}
+
+		totals[n].ticks += end - start;
+		totals[n].calls++;
+
+		if(tracing) {
+			const trace_event e = { n, thread, start, end };
+			trace.push_back(e);
+		}
+	}
+};
+
+Uint32 g_main_thread = 0;
+thread_state g_main_state;
+frame_buffer g_main_buffer;
+
+//every other thread shares this one buffer, and the scope stacks, behind
+//the one mutex.
+threading::mutex g_other_threads_mutex;
+std::map<Uint32, thread_state> g_other_thread_states;
+frame_buffer g_other_threads_buffer;
+
+//the frames we keep.
+struct frame_record {
+	Uint64 end, ticks;
+	std::vector<std::pair<int, node_total> > totals;
+	std::map<const char*, int> counters;
+};
+
+std::deque<frame_record> g_history;
+Uint64 g_last_frame_end = 0;
+
+//trace being captured.
+bool g_tracing = false;
+int g_trace_frames_left = 0;
+std::string g_trace_fname;
+std::vector<trace_event> g_trace;
+std::vector<frame_record> g_trace_frames;
+
+bool is_main_thread()
+{
+	return g_main_thread != 0 && SDL_ThreadID() == g_main_thread;
+}
+
+void take_buffer(frame_buffer& buf, frame_record& rec)
+{
+	for(int n = 0; n != buf.totals.size(); ++n) {
+		node_total& total = buf.totals[n];
+		if(total.calls) {
+			rec.totals.push_back(std::pair<int, node_total>(n, total));
+			total = node_total();
+		}
+	}
+
+	for(std::map<const char*, int>::const_iterator i = buf.counters.begin(); i != buf.counters.end(); ++i) {
+		rec.counters[i->first] += i->second;
+	}
+
+	buf.counters.clear();
+
+	g_trace.insert(g_trace.end(), buf.trace.begin(), buf.trace.end());
+	buf.trace.clear();
+}
+
+double ticks_to_us(Uint64 ticks)
+{
+	return (ticks*1000000.0)/SDL_GetPerformanceFrequency();
+}
+
+void write_trace()
+{
+	Uint64 base = g_trace.empty() ? 0 : g_trace.front().start;
+	foreach(const trace_event& e, g_trace) {
+		base = std::min(base, e.start);
+	}
+
+	std::map<int, std::string> paths;
+
+	std::ostringstream s;
+	s << "{\"traceEvents\":[";
+	bool first = true;
+	foreach(const trace_event& e, g_trace) {
+		std::string& path = paths[e.node];
+		if(path.empty()) {
+			path = node_path(e.node);
+		}
+
+		s << (first ? "\n" : ",\n") << "{\"name\":\"" << node_name(e.node) << "\",\"cat\":\"" << path << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << e.thread << ",\"ts\":" << ticks_to_us(e.start - base) << ",\"dur\":" << ticks_to_us(e.end - e.start) << "}";
+		first = false;
+	}
+
+	foreach(const frame_record& frame, g_trace_frames) {
+		if(frame.counters.empty() || frame.end < base) {
+			continue;
+		}
+
+		s << (first ? "\n" : ",\n") << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":0,\"ts\":" << ticks_to_us(frame.end - base) << ",\"args\":{";
+		for(std::map<const char*, int>::const_iterator i = frame.counters.begin(); i != frame.counters.end(); ++i) {
+			s << (i == frame.counters.begin() ? "" : ",") << "\"" << i->first << "\":" << i->second;
+		}
+		s << "}}";
+		first = false;
+	}
+
+	s << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+	sys::write_file(g_trace_fname, s.str());
+	fprintf(stderr, "WROTE TRACE OF %d EVENTS TO %s\n", static_cast<int>(g_trace.size()), g_trace_fname.c_str());
+
+	g_trace.clear();
+	g_trace_frames.clear();
+}
+
+class timings_server : public http::web_server
+{
+public:
+	//only serves this machine; the timings aren't meant to be public.
+	timings_server(boost::asio::io_service& io_service, int port)
+	  : http::web_server(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port))
+	{}
+
+private:
+	void handle_post(socket_ptr socket, variant doc, const http::environment& env) {
+		disconnect(socket);
+	}
+
+	void handle_get(socket_ptr socket, const std::string& url, const std::map<std::string, std::string>& args) {
+		std::map<variant, variant> m;
+		m[variant("timings")] = get_timings();
+		m[variant("counters")] = get_counters();
+		send_msg(socket, "text/json", variant(&m).write_json(true, variant::JSON_COMPLIANT), "");
+	}
+};
+
+boost::scoped_ptr<boost::asio::io_service> g_io_service;
+boost::scoped_ptr<timings_server> g_server;
+
+}
+
+scope::scope(const char* name) : node_(-1)
+{
+	if(!g_frame_timings) {
+		return;
+	}
+
+	main_thread_ = is_main_thread();
+	if(main_thread_) {
+		thread_state& state = g_main_state;
+		const std::pair<int, const char*> key(state.parent(), name);
+		std::map<std::pair<int, const char*>, int>::const_iterator i = state.cache.find(key);
+		if(i != state.cache.end()) {
+			node_ = i->second;
+		} else {
+			node_ = state.cache[key] = get_node(key.first, name);
+		}
+
+		state.push(node_);
+	} else {
+		threading::lock lck(g_other_threads_mutex);
+		thread_state& state = g_other_thread_states[SDL_ThreadID()];
+		node_ = get_node(state.parent(), name);
+		state.push(node_);
+	}
+
+	start_ = SDL_GetPerformanceCounter();
+}
+
+scope::~scope()
+{
+	if(node_ == -1) {
+		return;
+	}
+
+	const Uint64 end = SDL_GetPerformanceCounter();
+	if(main_thread_) {
+		g_main_buffer.record(node_, g_main_thread, start_, end, g_tracing);
+		--g_main_state.depth;
+	} else {
+		const Uint32 thread = SDL_ThreadID();
+		threading::lock lck(g_other_threads_mutex);
+		g_other_threads_buffer.record(node_, thread, start_, end, g_tracing);
+
+		//forget about threads once they leave their outermost scope, since
+		//threads come and go.
+		thread_state& state = g_other_thread_states[thread];
+		if(--state.depth <= 0) {
+			g_other_thread_states.erase(thread);
+		}
+	}
+}
+
+void add_counter(const char* name, int amount)
+{
+	if(!g_frame_timings) {
+		return;
+	}
+
+	if(is_main_thread()) {
+		g_main_buffer.counters[name] += amount;
+	} else {
+		threading::lock lck(g_other_threads_mutex);
+		g_other_threads_buffer.counters[name] += amount;
+	}
+}
+
+manager::manager()
+{
+	g_main_thread = SDL_ThreadID();
+	g_last_frame_end = SDL_GetPerformanceCounter();
+
+	if(g_frame_timings_port > 0) {
+		try {
+			g_io_service.reset(new boost::asio::io_service);
+			g_server.reset(new timings_server(*g_io_service, g_frame_timings_port));
+			fprintf(stderr, "SERVING FRAME TIMINGS ON 127.0.0.1:%d\n", g_frame_timings_port);
+		} catch(boost::system::system_error& e) {
+			fprintf(stderr, "COULD NOT SERVE FRAME TIMINGS ON PORT %d: %s\n", g_frame_timings_port, e.what());
+			g_server.reset();
+			g_io_service.reset();
+		}
+	}
+}
+
+manager::~manager()
+{
+	if(g_tracing) {
+		write_trace();
+		g_tracing = false;
+	}
+
+	g_server.reset();
+	g_io_service.reset();
+	g_main_thread = 0;
+}
+
+void end_frame()
+{
+	if(g_io_service) {
+		g_io_service->poll();
+		g_io_service->reset();
+	}
+
+	if(!g_frame_timings) {
+		return;
+	}
+
+	frame_record rec;
+	rec.end = SDL_GetPerformanceCounter();
+	rec.ticks = rec.end - g_last_frame_end;
+	g_last_frame_end = rec.end;
+
+	take_buffer(g_main_buffer, rec);
+	{
+		threading::lock lck(g_other_threads_mutex);
+		take_buffer(g_other_threads_buffer, rec);
+	}
+
+	if(g_tracing) {
+		g_trace_frames.push_back(rec);
+		if(--g_trace_frames_left <= 0) {
+			g_tracing = false;
+			write_trace();
+		}
+	} else {
+		g_trace.clear();
+	}
+
+	g_history.push_back(rec);
+	while(static_cast<int>(g_history.size()) > std::max(1, g_frame_timings_history)) {
+		g_history.pop_front();
+	}
+}
+
+variant get_timings()
+{
+	std::map<int, node_total> totals;
+	std::map<int, Uint64> worst;
+	Uint64 frame_ticks = 0, worst_frame = 0;
+	foreach(const frame_record& frame, g_history) {
+		frame_ticks += frame.ticks;
+		worst_frame = std::max(worst_frame, frame.ticks);
+		for(std::vector<std::pair<int, node_total> >::const_iterator i = frame.totals.begin(); i != frame.totals.end(); ++i) {
+			node_total& total = totals[i->first];
+			total.ticks += i->second.ticks;
+			total.calls += i->second.calls;
+			worst[i->first] = std::max(worst[i->first], i->second.ticks);
+		}
+	}
+
+	std::map<variant, variant> result;
+	if(g_history.empty()) {
+		return variant(&result);
+	}
+
+	const int nframes = g_history.size();
+
+	std::map<variant, variant> frame;
+	frame[variant("avg_us")] = variant(static_cast<int>(ticks_to_us(frame_ticks)/nframes));
+	frame[variant("max_us")] = variant(static_cast<int>(ticks_to_us(worst_frame)));
+	frame[variant("calls")] = variant(1);
+	result[variant("frame")] = variant(&frame);
+
+	for(std::map<int, node_total>::const_iterator i = totals.begin(); i != totals.end(); ++i) {
+		std::map<variant, variant> m;
+		m[variant("avg_us")] = variant(static_cast<int>(ticks_to_us(i->second.ticks)/nframes));
+		m[variant("max_us")] = variant(static_cast<int>(ticks_to_us(worst[i->first])));
+		m[variant("calls")] = variant(i->second.calls/nframes);
+		result[variant(node_path(i->first))] = variant(&m);
+	}
+
+	return variant(&result);
+}
+
+variant get_counters()
+{
+	std::map<std::string, int> totals;
+	foreach(const frame_record& frame, g_history) {
+		for(std::map<const char*, int>::const_iterator i = frame.counters.begin(); i != frame.counters.end(); ++i) {
+			totals[i->first] += i->second;
+		}
+	}
+
+	std::map<variant, variant> result;
+	for(std::map<std::string, int>::const_iterator i = totals.begin(); i != totals.end(); ++i) {
+		int last = 0;
+		for(std::map<const char*, int>::const_iterator j = g_history.back().counters.begin(); j != g_history.back().counters.end(); ++j) {
+			if(i->first == j->first) {
+				last = j->second;
+			}
+		}
+
+		std::map<variant, variant> m;
+		m[variant("last")] = variant(last);
+		m[variant("avg")] = variant(i->second/static_cast<int>(g_history.size()));
+		result[variant(i->first)] = variant(&m);
+	}
+
+	return variant(&result);
+}
+
+void capture_trace(const std::string& fname, int nframes)
+{
+	ASSERT_LOG(nframes > 0, "Must capture at least one frame in a trace");
+	g_trace_fname = fname;
+	g_trace_frames_left = nframes;
+	g_trace.clear();
+	g_trace_frames.clear();
+	g_tracing = true;
+}
+
+}
+
+UNIT_TEST(frame_timings_nested_scopes)
+{
+	const Uint32 main_thread = frame_timings::g_main_thread;
+	frame_timings::g_main_thread = SDL_ThreadID();
+
+	frame_timings::end_frame();
+	{
+		frame_timings::scope outer("test_outer");
+		for(int n = 0; n != 3; ++n) {
+			frame_timings::scope inner("test_inner");
+			frame_timings::add_counter("test_counter", 2);
+		}
+	}
+	frame_timings::end_frame();
+
+	const variant timings = frame_timings::get_timings();
+	const variant counters = frame_timings::get_counters();
+	frame_timings::g_main_thread = main_thread;
+
+	if(!g_frame_timings) {
+		return;
+	}
+
+	CHECK(timings.has_key("test_outer"), "outer scope not recorded");
+	CHECK(timings.has_key("test_outer/test_inner"), "inner scope not recorded under outer scope");
+	CHECK_EQ(counters["test_counter"]["last"].as_int(), 6);
+}
@@ -0,0 +1,87 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FRAME_TIMINGS_HPP_INCLUDED
+#define FRAME_TIMINGS_HPP_INCLUDED
+
+#include <string>
+
+#include "graphics.hpp"
+#include "variant.hpp"
+
+//Records the time spent in named scopes, nested inside each other, and
+//named counters, for each frame. What's recorded is gathered up once a
+//frame and kept for a number of recent frames. It can be looked at from
+//FFL through performance(), fetched as JSON over HTTP, or written out
+//as a Chrome trace.
+//
+//The main thread records into its own buffer without taking any locks.
+//Other threads don't get buffers of their own: they all record into one
+//buffer behind a single mutex, so scopes on them should be coarse, such
+//as a whole background task.
+namespace frame_timings
+{
+
+//times the scope it's in. The name must be a string literal, or otherwise
+//live forever, since scopes are told apart by the address of their name.
+class scope
+{
+public:
+	explicit scope(const char* name);
+	~scope();
+
+private:
+	scope(const scope&);
+	void operator=(const scope&);
+
+	int node_;
+	bool main_thread_;
+	Uint64 start_;
+};
+
+//adds to a counter for this frame. The name must live forever, as with
+//scope names.
+void add_counter(const char* name, int amount=1);
+
+//runs the HTTP server for timings, if one was asked for.
+struct manager
+{
+	manager();
+	~manager();
+};
+
+//gathers up what was recorded during the frame. Called from the main
+//thread at the start of each frame.
+void end_frame();
+
+//a map of each scope, named by the names of the scopes it's inside joined
+//with '/', to its average and worst time per frame in microseconds and
+//the average number of times it was entered per frame, over the frames
+//kept.
+variant get_timings();
+
+//a map of each counter to its total for the last frame and its average
+//per frame.
+variant get_counters();
+
+//records every scope entered over the next nframes frames, then writes
+//them to a file in Chrome's trace event format, for loading in
+//chrome://tracing.
+void capture_trace(const std::string& fname, int nframes);
+
+}
+
+#endif
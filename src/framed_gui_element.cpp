@@ -21,6 +21,7 @@
 #include "framed_gui_element.hpp"
 #include "geometry.hpp"
 #include "raster.hpp"
+#include "texture_atlas.hpp"
 #include "variant_utils.hpp"
 
 namespace {
@@ -44,6 +45,8 @@ void framed_gui_element::init(variant node)
 		const std::string& id = obj["id"].as_string();
 		cache[id].reset(new framed_gui_element(obj));
 	}
+
+	graphics::texture_atlas::flush_pending();
 }
 
 const_framed_gui_element_ptr framed_gui_element::get(const std::string& key)
@@ -70,6 +73,10 @@ texture_(graphics::texture::get(node["image"].as_string()))
 	right_border_ = rect(area_.x2() - corner_height_, area_.y() + corner_height_,corner_height_,area_.h() - corner_height_ * 2);
 	
 	interior_fill_ = rect(area_.x() + corner_height_, area_.y() + corner_height_,area_.w() - corner_height_ * 2,area_.h() - corner_height_ * 2);
+
+	if(texture_.valid() && graphics::texture_atlas::accepts(area_.w(), area_.h())) {
+		atlas_region_ = graphics::texture_atlas::request(texture_, area_);
+	}
 }
 
 void framed_gui_element::blit(int x, int y, int w, int h, bool upscaled) const
@@ -105,10 +112,21 @@ void framed_gui_element::blit(int x, int y, int w, int h, bool upscaled) const
 
 void framed_gui_element::blit_subsection(rect subsection, int x, int y, int w, int h) const
 {
-	graphics::blit_texture(texture_, x, y, w, h, 0.0,
-	                       GLfloat(subsection.x())/GLfloat(texture_.width()),
-	                       GLfloat(subsection.y())/GLfloat(texture_.height()),
-	                       GLfloat(subsection.x2())/GLfloat(texture_.width()),
-	                       GLfloat(subsection.y2())/GLfloat(texture_.height()));
+	GLfloat x1 = GLfloat(subsection.x())/GLfloat(texture_.width());
+	GLfloat y1 = GLfloat(subsection.y())/GLfloat(texture_.height());
+	GLfloat x2 = GLfloat(subsection.x2())/GLfloat(texture_.width());
+	GLfloat y2 = GLfloat(subsection.y2())/GLfloat(texture_.height());
+
+	if(atlas_region_) {
+		atlas_region_->touch();
+		if(atlas_region_->placed()) {
+			graphics::blit_texture(atlas_region_->page_texture(), x, y, w, h, 0.0,
+			                       atlas_region_->map_x(x1), atlas_region_->map_y(y1),
+			                       atlas_region_->map_x(x2), atlas_region_->map_y(y2));
+			return;
+		}
+	}
+
+	graphics::blit_texture(texture_, x, y, w, h, 0.0, x1, y1, x2, y2);
 
 }
@@ -20,6 +20,7 @@
 #include <boost/shared_ptr.hpp>
 #include "geometry.hpp"
 #include "texture.hpp"
+#include "texture_atlas.hpp"
 #include "variant.hpp"
 
 class framed_gui_element;
@@ -44,6 +45,9 @@ private:
 	const rect area_;
 	const int corner_height_;
 	graphics::texture texture_;
+
+	//where our image is in a texture atlas, if it has been packed in one.
+	graphics::texture_atlas::region_ptr atlas_region_;
 	
 	rect  top_right_corner_;
 	rect  top_left_corner_;
@@ -0,0 +1,1220 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <boost/random/mersenne_twister.hpp>
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+
+#include "foreach.hpp"
+#include "grid_pathfinder.hpp"
+#include "level.hpp"
+#include "level_solid_map.hpp"
+#include "preferences.hpp"
+#include "unit_test.hpp"
+
+PREF_INT(pathfinding_cluster_size, 16, "Size in cells of the clusters long paths are planned over");
+PREF_INT(pathfinding_cluster_distance, 64, "Paths between cells at least this many cells apart are planned over clusters first. 0 to always search every cell");
+
+namespace pathfinding {
+
+namespace {
+
+//rounds down rather than towards zero.
+int floor_div(int a, int b)
+{
+	return a >= 0 ? a/b : -((-a + b - 1)/b);
+}
+
+int sign(int n)
+{
+	return n > 0 ? 1 : (n < 0 ? -1 : 0);
+}
+
+//the straight directions come first.
+const int Directions[8][2] = {
+	{1, 0}, {-1, 0}, {0, 1}, {0, -1},
+	{1, 1}, {-1, 1}, {1, -1}, {-1, -1},
+};
+
+bool inside(const rect& r, int x, int y)
+{
+	return x >= r.x() && y >= r.y() && x < r.x2() && y < r.y2();
+}
+
+}
+
+bool solid_map_rect_solid(const level_solid_map& map, const rect& r)
+{
+	if(r.w() <= 0 || r.h() <= 0) {
+		return false;
+	}
+
+	const int tx1 = floor_div(r.x(), TileSize);
+	const int ty1 = floor_div(r.y(), TileSize);
+	const int tx2 = floor_div(r.x2() - 1, TileSize);
+	const int ty2 = floor_div(r.y2() - 1, TileSize);
+
+	for(int ty = ty1; ty <= ty2; ++ty) {
+		for(int tx = tx1; tx <= tx2; ++tx) {
+			const tile_solid_info* info = map.find(tile_pos(tx, ty));
+			if(info == NULL) {
+				continue;
+			}
+
+			if(info->all_solid) {
+				return true;
+			}
+
+			const int xbegin = std::max(r.x() - tx*TileSize, 0);
+			const int xend = std::min(r.x2() - tx*TileSize, TileSize);
+			const int ybegin = std::max(r.y() - ty*TileSize, 0);
+			const int yend = std::min(r.y2() - ty*TileSize, TileSize);
+			if(xbegin == 0 && ybegin == 0 && xend == TileSize && yend == TileSize) {
+				if(info->bitmap.any()) {
+					return true;
+				}
+
+				continue;
+			}
+
+			for(int y = ybegin; y < yend; ++y) {
+				for(int x = xbegin; x < xend; ++x) {
+					if(info->bitmap.test(y*TileSize + x)) {
+						return true;
+					}
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+grid_map::grid_map(const level& lvl, const point& origin, int width, int height, int cell_width, int cell_height)
+  : origin_(origin), width_(width), height_(height),
+    cell_width_(cell_width), cell_height_(cell_height),
+    diagonal_(sqrt(float(cell_width*cell_width + cell_height*cell_height))),
+    blocked_(width*height)
+{
+	const level_solid_map& map = lvl.solid_map();
+	for(int y = 0; y != height_; ++y) {
+		for(int x = 0; x != width_; ++x) {
+			const rect area(origin_.x + x*cell_width_, origin_.y + y*cell_height_, cell_width_, cell_height_);
+			blocked_[id(x, y)] = solid_map_rect_solid(map, area);
+		}
+	}
+}
+
+grid_map::grid_map(int width, int height, int cell_width, int cell_height, const std::vector<unsigned char>& blocked)
+  : width_(width), height_(height),
+    cell_width_(cell_width), cell_height_(cell_height),
+    diagonal_(sqrt(float(cell_width*cell_width + cell_height*cell_height))),
+    blocked_(blocked)
+{
+	blocked_.resize(width*height);
+}
+
+float grid_map::distance(int a, int b) const
+{
+	const int dx = abs(x(a) - x(b));
+	const int dy = abs(y(a) - y(b));
+	const int diagonal = std::min(dx, dy);
+	return diagonal*diagonal_ + (dx - diagonal)*cell_width_ + (dy - diagonal)*cell_height_;
+}
+
+point grid_map::cell_pos(int id) const
+{
+	return point(origin_.x + x(id)*cell_width_, origin_.y + y(id)*cell_height_);
+}
+
+int grid_map::cell_at(const point& p) const
+{
+	const int x = std::max(0, std::min(width_ - 1, floor_div(p.x - origin_.x, cell_width_)));
+	const int y = std::max(0, std::min(height_ - 1, floor_div(p.y - origin_.y, cell_height_)));
+	return id(x, y);
+}
+
+int grid_map::nearest_open_cell(int id, int max_cells) const
+{
+	//looks at the cells in rings around id, taking the nearest open one
+	//in the first ring which has any.
+	const int x0 = x(id);
+	const int y0 = y(id);
+	for(int ring = 0; ring <= max_cells; ++ring) {
+		int best = -1;
+		for(int cy = y0 - ring; cy <= y0 + ring; ++cy) {
+			for(int cx = x0 - ring; cx <= x0 + ring; ++cx) {
+				if(std::max(abs(cx - x0), abs(cy - y0)) != ring || blocked(cx, cy)) {
+					continue;
+				}
+
+				const int cell = this->id(cx, cy);
+				if(best == -1 || distance(id, cell) < distance(id, best)) {
+					best = cell;
+				}
+			}
+		}
+
+		if(best != -1) {
+			return best;
+		}
+	}
+
+	return -1;
+}
+
+void grid_map::refresh(const level& lvl, const rect& r, std::vector<int>* changed)
+{
+	const int x1 = std::max(0, floor_div(r.x() - origin_.x, cell_width_));
+	const int y1 = std::max(0, floor_div(r.y() - origin_.y, cell_height_));
+	const int x2 = std::min(width_ - 1, floor_div(r.x2() - 1 - origin_.x, cell_width_));
+	const int y2 = std::min(height_ - 1, floor_div(r.y2() - 1 - origin_.y, cell_height_));
+
+	const level_solid_map& map = lvl.solid_map();
+	for(int y = y1; y <= y2; ++y) {
+		for(int x = x1; x <= x2; ++x) {
+			const rect area(origin_.x + x*cell_width_, origin_.y + y*cell_height_, cell_width_, cell_height_);
+			const unsigned char blocked = solid_map_rect_solid(map, area);
+			if(blocked != blocked_[id(x, y)]) {
+				blocked_[id(x, y)] = blocked;
+				if(changed) {
+					changed->push_back(id(x, y));
+				}
+			}
+		}
+	}
+}
+
+void update_grid(const level& lvl, grid_map* grid, int* solid_state_id, std::vector<int>* changed)
+{
+	if(*solid_state_id == lvl.solid_state_id()) {
+		return;
+	}
+
+	std::vector<rect> areas;
+	if(!lvl.get_solid_changes(*solid_state_id, &areas)) {
+		areas.assign(1, rect(grid->origin().x, grid->origin().y, grid->width()*grid->cell_width(), grid->height()*grid->cell_height()));
+	}
+
+	foreach(const rect& area, areas) {
+		grid->refresh(lvl, area, changed);
+	}
+
+	*solid_state_id = lvl.solid_state_id();
+}
+
+grid_search::grid_search(const grid_map& g)
+  : grid_(g),
+    g_(g.size()), parent_(g.size()), seen_(g.size()), closed_(g.size()),
+    generation_(0)
+{
+	open_.resize(g.size());
+}
+
+void grid_search::begin_search()
+{
+	open_.clear();
+	if(++generation_ == 0) {
+		std::fill(seen_.begin(), seen_.end(), 0);
+		std::fill(closed_.begin(), closed_.end(), 0);
+		generation_ = 1;
+	}
+}
+
+bool grid_search::search(int src, int dst, const rect& bounds)
+{
+	begin_search();
+
+	g_[src] = 0.0f;
+	parent_[src] = -1;
+	seen_[src] = generation_;
+	open_.push(src, dst == -1 ? 0.0f : distance(src, dst));
+
+	while(!open_.empty()) {
+		const int current = open_.pop();
+		if(current == dst) {
+			return true;
+		}
+
+		closed_[current] = generation_;
+
+		const int x = grid_.x(current);
+		const int y = grid_.y(current);
+		for(int n = 0; n != 8; ++n) {
+			const int dx = Directions[n][0];
+			const int dy = Directions[n][1];
+			if(grid_.blocked(x + dx, y + dy) || !inside(bounds, x + dx, y + dy)) {
+				continue;
+			}
+
+			const int next = grid_.id(x + dx, y + dy);
+			if(closed_[next] == generation_) {
+				continue;
+			}
+
+			const float g = g_[current] + grid_.move_cost(dx, dy);
+			if(seen_[next] != generation_ || g < g_[next]) {
+				seen_[next] = generation_;
+				g_[next] = g;
+				parent_[next] = current;
+				open_.push(next, dst == -1 ? g : g + distance(next, dst));
+			}
+		}
+	}
+
+	return false;
+}
+
+bool grid_search::a_star(int src, int dst, const rect& bounds, std::vector<int>* path)
+{
+	if(!search(src, dst, bounds)) {
+		return false;
+	}
+
+	build_path(src, dst, path);
+	return true;
+}
+
+void grid_search::dijkstra(int src, const rect& bounds)
+{
+	search(src, -1, bounds);
+}
+
+bool grid_search::jump_point_search(int src, int dst, std::vector<int>* path)
+{
+	begin_search();
+
+	g_[src] = 0.0f;
+	parent_[src] = -1;
+	seen_[src] = generation_;
+	open_.push(src, distance(src, dst));
+
+	while(!open_.empty()) {
+		const int current = open_.pop();
+		if(current == dst) {
+			build_path(src, dst, path);
+			return true;
+		}
+
+		closed_[current] = generation_;
+
+		const int x = grid_.x(current);
+		const int y = grid_.y(current);
+
+		//the directions worth jumping in: the ones a path coming from the
+		//parent wouldn't have been better off taking before it got here,
+		//and any the parent couldn't reach because of something blocked.
+		int dirs[8][2];
+		int ndirs = 0;
+		if(parent_[current] == -1) {
+			for(int n = 0; n != 8; ++n) {
+				dirs[n][0] = Directions[n][0];
+				dirs[n][1] = Directions[n][1];
+			}
+
+			ndirs = 8;
+		} else {
+			const int dx = sign(x - grid_.x(parent_[current]));
+			const int dy = sign(y - grid_.y(parent_[current]));
+
+#define ADD_DIRECTION(a, b) dirs[ndirs][0] = (a); dirs[ndirs][1] = (b); ++ndirs;
+			if(dx && dy) {
+				ADD_DIRECTION(dx, dy);
+				ADD_DIRECTION(dx, 0);
+				ADD_DIRECTION(0, dy);
+				if(grid_.blocked(x - dx, y)) {
+					ADD_DIRECTION(-dx, dy);
+				}
+
+				if(grid_.blocked(x, y - dy)) {
+					ADD_DIRECTION(dx, -dy);
+				}
+			} else if(dx) {
+				ADD_DIRECTION(dx, 0);
+				if(grid_.blocked(x, y + 1)) {
+					ADD_DIRECTION(dx, 1);
+				}
+
+				if(grid_.blocked(x, y - 1)) {
+					ADD_DIRECTION(dx, -1);
+				}
+			} else {
+				ADD_DIRECTION(0, dy);
+				if(grid_.blocked(x + 1, y)) {
+					ADD_DIRECTION(1, dy);
+				}
+
+				if(grid_.blocked(x - 1, y)) {
+					ADD_DIRECTION(-1, dy);
+				}
+			}
+#undef ADD_DIRECTION
+		}
+
+		for(int n = 0; n != ndirs; ++n) {
+			int next;
+			if(!jump(x, y, dirs[n][0], dirs[n][1], dst, &next) || closed_[next] == generation_) {
+				continue;
+			}
+
+			const float g = g_[current] + distance(current, next);
+			if(seen_[next] != generation_ || g < g_[next]) {
+				seen_[next] = generation_;
+				g_[next] = g;
+				parent_[next] = current;
+				open_.push(next, g + distance(next, dst));
+			}
+		}
+	}
+
+	return false;
+}
+
+//moves from (x,y) in the direction given until reaching a cell a path
+//might have to turn at: the destination, or a cell next to something
+//blocked which opens up a way the path couldn't have gone before.
+bool grid_search::jump(int x, int y, int dx, int dy, int dst, int* result) const
+{
+	for(;;) {
+		x += dx;
+		y += dy;
+		if(grid_.blocked(x, y)) {
+			return false;
+		}
+
+		const int id = grid_.id(x, y);
+		bool found = id == dst;
+		if(!found) {
+			if(dx && dy) {
+				found = (grid_.blocked(x - dx, y) && !grid_.blocked(x - dx, y + dy)) ||
+				        (grid_.blocked(x, y - dy) && !grid_.blocked(x + dx, y - dy)) ||
+				        jump_straight(x, y, dx, 0, dst) ||
+				        jump_straight(x, y, 0, dy, dst);
+			} else if(dx) {
+				found = (grid_.blocked(x, y + 1) && !grid_.blocked(x + dx, y + 1)) ||
+				        (grid_.blocked(x, y - 1) && !grid_.blocked(x + dx, y - 1));
+			} else {
+				found = (grid_.blocked(x + 1, y) && !grid_.blocked(x + 1, y + dy)) ||
+				        (grid_.blocked(x - 1, y) && !grid_.blocked(x - 1, y + dy));
+			}
+		}
+
+		if(found) {
+			*result = id;
+			return true;
+		}
+	}
+}
+
+//whether jumping in a straight line from (x,y) finds anywhere to stop.
+bool grid_search::jump_straight(int x, int y, int dx, int dy, int dst) const
+{
+	int result;
+	return jump(x, y, dx, dy, dst, &result);
+}
+
+void grid_search::build_path(int src, int dst, std::vector<int>* path) const
+{
+	std::vector<int> turns;
+	for(int n = dst; n != -1; n = parent_[n]) {
+		turns.push_back(n);
+	}
+
+	std::reverse(turns.begin(), turns.end());
+
+	//Jump Point Search only records where the path turns, so fill in the
+	//cells in between.
+	path->clear();
+	path->push_back(src);
+	for(int n = 1; n < turns.size(); ++n) {
+		int x = grid_.x(turns[n-1]);
+		int y = grid_.y(turns[n-1]);
+		const int dx = sign(grid_.x(turns[n]) - x);
+		const int dy = sign(grid_.y(turns[n]) - y);
+		while(grid_.id(x, y) != turns[n]) {
+			x += dx;
+			y += dy;
+			path->push_back(grid_.id(x, y));
+		}
+	}
+}
+
+namespace {
+const float Infinity = std::numeric_limits<float>::infinity();
+}
+
+incremental_grid_search::incremental_grid_search(const grid_map& g, int src, int dst)
+  : grid_(g), src_(src), last_src_(src), dst_(dst), km_(0.0f),
+    g_(g.size(), Infinity), rhs_(g.size(), Infinity)
+{
+	open_.resize(g.size());
+	rhs_[dst_] = 0.0f;
+	open_.push(dst_, calculate_key(dst_));
+}
+
+incremental_grid_search::key incremental_grid_search::calculate_key(int id) const
+{
+	const float cost = std::min(g_[id], rhs_[id]);
+	return key(cost + grid_.distance(src_, id) + km_, cost);
+}
+
+void incremental_grid_search::set_source(int src)
+{
+	if(src == src_) {
+		return;
+	}
+
+	km_ += grid_.distance(last_src_, src);
+	last_src_ = src_ = src;
+}
+
+//works out the cost of getting to the destination from a cell by looking
+//at its neighbours, putting it on the open list if that doesn't match
+//the cost we had for it.
+void incremental_grid_search::update_cell(int id)
+{
+	if(id != dst_) {
+		float best = Infinity;
+		if(!grid_.blocked(id)) {
+			const int x = grid_.x(id);
+			const int y = grid_.y(id);
+			for(int n = 0; n != 8; ++n) {
+				const int dx = Directions[n][0];
+				const int dy = Directions[n][1];
+				if(!grid_.blocked(x + dx, y + dy)) {
+					best = std::min(best, grid_.move_cost(dx, dy) + g_[grid_.id(x + dx, y + dy)]);
+				}
+			}
+		}
+
+		rhs_[id] = best;
+	}
+
+	if(g_[id] != rhs_[id]) {
+		open_.push(id, calculate_key(id));
+	} else {
+		open_.remove(id);
+	}
+}
+
+void incremental_grid_search::update_neighbours(int id)
+{
+	const int x = grid_.x(id);
+	const int y = grid_.y(id);
+	for(int n = 0; n != 8; ++n) {
+		if(grid_.in_bounds(x + Directions[n][0], y + Directions[n][1])) {
+			update_cell(grid_.id(x + Directions[n][0], y + Directions[n][1]));
+		}
+	}
+}
+
+void incremental_grid_search::cells_changed(const std::vector<int>& cells)
+{
+	foreach(int id, cells) {
+		update_cell(id);
+		update_neighbours(id);
+	}
+}
+
+incremental_grid_search::RESULT incremental_grid_search::compute(int max_expansions, int* expanded)
+{
+	int count = 0;
+	while(!open_.empty() && (open_.top_key() < calculate_key(src_) || rhs_[src_] != g_[src_])) {
+		if(count >= max_expansions) {
+			*expanded += count;
+			return INCOMPLETE;
+		}
+
+		++count;
+
+		const int id = open_.top();
+		const key new_key = calculate_key(id);
+		if(open_.top_key() < new_key) {
+			open_.push(id, new_key);
+		} else if(g_[id] > rhs_[id]) {
+			g_[id] = rhs_[id];
+			open_.remove(id);
+			update_neighbours(id);
+		} else {
+			g_[id] = Infinity;
+			update_cell(id);
+			update_neighbours(id);
+		}
+	}
+
+	*expanded += count;
+	return rhs_[src_] == Infinity ? NOT_FOUND : FOUND;
+}
+
+bool incremental_grid_search::get_path(std::vector<int>* path) const
+{
+	path->clear();
+	if(rhs_[src_] == Infinity) {
+		return false;
+	}
+
+	//walk downhill from the source, which can't take more steps than
+	//there are cells unless something's gone wrong.
+	int current = src_;
+	path->push_back(current);
+	while(current != dst_) {
+		if(path->size() > grid_.size()) {
+			return false;
+		}
+
+		const int x = grid_.x(current);
+		const int y = grid_.y(current);
+		int best = -1;
+		float best_cost = Infinity;
+		for(int n = 0; n != 8; ++n) {
+			const int dx = Directions[n][0];
+			const int dy = Directions[n][1];
+			if(grid_.blocked(x + dx, y + dy)) {
+				continue;
+			}
+
+			const int next = grid_.id(x + dx, y + dy);
+			const float cost = grid_.move_cost(dx, dy) + g_[next];
+			if(cost < best_cost) {
+				best = next;
+				best_cost = cost;
+			}
+		}
+
+		if(best == -1) {
+			return false;
+		}
+
+		current = best;
+		path->push_back(current);
+	}
+
+	return true;
+}
+
+flow_field::flow_field(const grid_map& g, int target)
+  : grid_(g), target_(target), g_(g.size(), Infinity), rhs_(g.size(), Infinity)
+{
+	open_.resize(g.size());
+	if(!grid_.blocked(target_)) {
+		rhs_[target_] = 0.0f;
+		open_.push(target_, 0.0f);
+	}
+}
+
+//this is incremental_grid_search::update_cell without the heuristic, so
+//a cell's key is just its cost.
+void flow_field::update_cell(int id)
+{
+	float best = Infinity;
+	if(id == target_) {
+		if(!grid_.blocked(id)) {
+			best = 0.0f;
+		}
+	} else if(!grid_.blocked(id)) {
+		const int x = grid_.x(id);
+		const int y = grid_.y(id);
+		for(int n = 0; n != 8; ++n) {
+			const int dx = Directions[n][0];
+			const int dy = Directions[n][1];
+			if(!grid_.blocked(x + dx, y + dy)) {
+				best = std::min(best, grid_.move_cost(dx, dy) + g_[grid_.id(x + dx, y + dy)]);
+			}
+		}
+	}
+
+	rhs_[id] = best;
+
+	if(g_[id] != rhs_[id]) {
+		open_.push(id, std::min(g_[id], rhs_[id]));
+	} else {
+		open_.remove(id);
+	}
+}
+
+void flow_field::update_neighbours(int id)
+{
+	const int x = grid_.x(id);
+	const int y = grid_.y(id);
+	for(int n = 0; n != 8; ++n) {
+		if(grid_.in_bounds(x + Directions[n][0], y + Directions[n][1])) {
+			update_cell(grid_.id(x + Directions[n][0], y + Directions[n][1]));
+		}
+	}
+}
+
+void flow_field::cells_changed(const std::vector<int>& cells)
+{
+	foreach(int id, cells) {
+		update_cell(id);
+		update_neighbours(id);
+	}
+}
+
+bool flow_field::compute(int max_expansions, int* expanded)
+{
+	int count = 0;
+	while(!open_.empty() && count < max_expansions) {
+		++count;
+
+		const int id = open_.pop();
+		if(g_[id] > rhs_[id]) {
+			g_[id] = rhs_[id];
+			update_neighbours(id);
+		} else {
+			g_[id] = Infinity;
+			update_cell(id);
+			update_neighbours(id);
+		}
+	}
+
+	*expanded += count;
+	return open_.empty();
+}
+
+float flow_field::cost(int id) const
+{
+	return g_[id] == Infinity ? -1.0f : g_[id];
+}
+
+bool flow_field::direction(int id, int* dx, int* dy) const
+{
+	if(g_[id] == Infinity || grid_.blocked(id)) {
+		return false;
+	}
+
+	*dx = *dy = 0;
+	if(id == target_) {
+		return true;
+	}
+
+	const int x = grid_.x(id);
+	const int y = grid_.y(id);
+	float best = Infinity;
+	for(int n = 0; n != 8; ++n) {
+		const int nx = x + Directions[n][0];
+		const int ny = y + Directions[n][1];
+		if(grid_.blocked(nx, ny)) {
+			continue;
+		}
+
+		const float cost = grid_.move_cost(Directions[n][0], Directions[n][1]) + g_[grid_.id(nx, ny)];
+		if(cost < best) {
+			best = cost;
+			*dx = Directions[n][0];
+			*dy = Directions[n][1];
+		}
+	}
+
+	return best != Infinity;
+}
+
+cluster_graph::cluster_graph(const grid_map& g, int cluster_size)
+  : grid_(g), cluster_size_(cluster_size),
+    clusters_wide_((g.width() + cluster_size - 1)/cluster_size),
+    search_(g), node_at_cell_(g.size(), -1)
+{
+	const int clusters_high = (g.height() + cluster_size - 1)/cluster_size;
+	cluster_nodes_.resize(clusters_wide_*clusters_high);
+
+	for(int cy = 0; cy != clusters_high; ++cy) {
+		const int y = cy*cluster_size_;
+		const int h = std::min(cluster_size_, g.height() - y);
+		for(int cx = 0; cx != clusters_wide_; ++cx) {
+			const int x = cx*cluster_size_;
+			const int w = std::min(cluster_size_, g.width() - x);
+			if(cx + 1 < clusters_wide_) {
+				find_entrances(x + w - 1, y, 0, 1, h);
+			}
+
+			if(cy + 1 < clusters_high) {
+				find_entrances(x, y + h - 1, 1, 0, w);
+			}
+		}
+	}
+
+	for(int cluster = 0; cluster != cluster_nodes_.size(); ++cluster) {
+		const std::vector<int>& nodes = cluster_nodes_[cluster];
+		for(int i = 0; i != nodes.size(); ++i) {
+			search_.dijkstra(nodes_[nodes[i]], cluster_bounds(cluster));
+			for(int j = 0; j != nodes.size(); ++j) {
+				const float cost = search_.cost(nodes_[nodes[j]]);
+				if(i != j && cost >= 0.0f) {
+					add_edge(nodes[i], nodes[j], cost);
+				}
+			}
+		}
+	}
+}
+
+int cluster_graph::cluster_of(int cell) const
+{
+	return (grid_.y(cell)/cluster_size_)*clusters_wide_ + grid_.x(cell)/cluster_size_;
+}
+
+rect cluster_graph::cluster_bounds(int cluster) const
+{
+	const int x = (cluster%clusters_wide_)*cluster_size_;
+	const int y = (cluster/clusters_wide_)*cluster_size_;
+	return rect(x, y, std::min(cluster_size_, grid_.width() - x), std::min(cluster_size_, grid_.height() - y));
+}
+
+int cluster_graph::add_node(int cell)
+{
+	if(node_at_cell_[cell] == -1) {
+		node_at_cell_[cell] = nodes_.size();
+		nodes_.push_back(cell);
+		edges_.resize(nodes_.size());
+		cluster_nodes_[cluster_of(cell)].push_back(node_at_cell_[cell]);
+	}
+
+	return node_at_cell_[cell];
+}
+
+void cluster_graph::add_edge(int from, int to, float cost)
+{
+	edge e = { to, cost };
+	edges_[from].push_back(e);
+}
+
+//finds where paths can cross the border which runs for length cells from
+//(x,y) in the direction given, between those cells and the ones on their
+//right or below. Each stretch of the border open on both sides gets a
+//crossing in the middle, or one at each end if it's long.
+void cluster_graph::find_entrances(int x, int y, int dx, int dy, int length)
+{
+	const int ox = dy;
+	const int oy = dx;
+	const float cost = ox ? grid_.cell_width() : grid_.cell_height();
+
+	int begin = -1;
+	for(int n = 0; n <= length; ++n) {
+		const int cx = x + dx*n;
+		const int cy = y + dy*n;
+		if(n < length && !grid_.blocked(cx, cy) && !grid_.blocked(cx + ox, cy + oy)) {
+			if(begin == -1) {
+				begin = n;
+			}
+
+			continue;
+		}
+
+		if(begin == -1) {
+			continue;
+		}
+
+		int crossings[2];
+		int ncrossings = 0;
+		if(n - begin < 6) {
+			crossings[ncrossings++] = (begin + n - 1)/2;
+		} else {
+			crossings[ncrossings++] = begin;
+			crossings[ncrossings++] = n - 1;
+		}
+
+		for(int i = 0; i != ncrossings; ++i) {
+			const int a = add_node(grid_.id(x + dx*crossings[i], y + dy*crossings[i]));
+			const int b = add_node(grid_.id(x + dx*crossings[i] + ox, y + dy*crossings[i] + oy));
+			add_edge(a, b, cost);
+			add_edge(b, a, cost);
+		}
+
+		begin = -1;
+	}
+}
+
+//finds the cost of getting between cell and each entrance of its cluster.
+void cluster_graph::link_entrance_to_cluster(int cell, std::vector<edge>* edges)
+{
+	const int cluster = cluster_of(cell);
+	search_.dijkstra(cell, cluster_bounds(cluster));
+	foreach(int node, cluster_nodes_[cluster]) {
+		const float cost = search_.cost(nodes_[node]);
+		if(cost >= 0.0f) {
+			edge e = { node, cost };
+			edges->push_back(e);
+		}
+	}
+}
+
+bool cluster_graph::find_path(int src, int dst, std::vector<int>* path)
+{
+	if(cluster_of(src) == cluster_of(dst)) {
+		return false;
+	}
+
+	//the start and end of the path are searched as two extra nodes,
+	//joined to the entrances of their clusters.
+	const int start = nodes_.size();
+	const int goal = start + 1;
+	std::vector<edge> start_edges, goal_edges;
+	link_entrance_to_cluster(src, &start_edges);
+	link_entrance_to_cluster(dst, &goal_edges);
+	if(start_edges.empty() || goal_edges.empty()) {
+		return false;
+	}
+
+	std::vector<float> goal_cost(nodes_.size(), -1.0f);
+	foreach(const edge& e, goal_edges) {
+		goal_cost[e.to] = e.cost;
+	}
+
+	const int nnodes = nodes_.size() + 2;
+	std::vector<float> g(nnodes, -1.0f);
+	std::vector<int> parent(nnodes, -1);
+	std::vector<bool> closed(nnodes);
+	indexed_heap<float> open;
+	open.resize(nnodes);
+
+	g[start] = 0.0f;
+	open.push(start, search_.distance(src, dst));
+
+	bool found = false;
+	while(!open.empty()) {
+		const int current = open.pop();
+		if(current == goal) {
+			found = true;
+			break;
+		}
+
+		closed[current] = true;
+
+		const std::vector<edge>& edges = current == start ? start_edges : edges_[current];
+		edge to_goal = { goal, current == start ? -1.0f : goal_cost[current] };
+		for(int n = 0; n <= edges.size(); ++n) {
+			const edge& e = n < edges.size() ? edges[n] : to_goal;
+			if(e.cost < 0.0f || closed[e.to]) {
+				continue;
+			}
+
+			const float cost = g[current] + e.cost;
+			if(g[e.to] < 0.0f || cost < g[e.to]) {
+				g[e.to] = cost;
+				parent[e.to] = current;
+				open.push(e.to, cost + (e.to == goal ? 0.0f : search_.distance(nodes_[e.to], dst)));
+			}
+		}
+	}
+
+	if(!found) {
+		return false;
+	}
+
+	std::vector<int> cells;
+	for(int n = goal; n != -1; n = parent[n]) {
+		cells.push_back(n == goal ? dst : (n == start ? src : nodes_[n]));
+	}
+
+	std::reverse(cells.begin(), cells.end());
+
+	//fill in the path a cluster at a time.
+	path->clear();
+	path->push_back(src);
+	std::vector<int> segment;
+	for(int n = 1; n < cells.size(); ++n) {
+		const int cluster = cluster_of(cells[n-1]);
+		if(cluster != cluster_of(cells[n])) {
+			path->push_back(cells[n]);
+			continue;
+		}
+
+		if(!search_.a_star(cells[n-1], cells[n], cluster_bounds(cluster), &segment)) {
+			return false;
+		}
+
+		path->insert(path->end(), segment.begin() + 1, segment.end());
+	}
+
+	return true;
+}
+
+bool get_midpoint_grid_layout(const rect& bounds, int tile_size_x, int tile_size_y, point* origin, int* width, int* height)
+{
+	*origin = point(floor_div(bounds.x() - tile_size_x/2 + tile_size_x - 1, tile_size_x)*tile_size_x + tile_size_x/2,
+	                floor_div(bounds.y() - tile_size_y/2 + tile_size_y - 1, tile_size_y)*tile_size_y + tile_size_y/2);
+	*width = std::max(0, (bounds.x2() - origin->x + tile_size_x - 1)/tile_size_x);
+	*height = std::max(0, (bounds.y2() - origin->y + tile_size_y - 1)/tile_size_y);
+	return *width > 0 && *height > 0;
+}
+
+level_grid::level_grid(const level& lvl, const point& origin, int width, int height, int cell_width, int cell_height)
+  : grid(lvl, origin, width, height, cell_width, cell_height),
+    search(grid),
+    solid_state_id(lvl.solid_state_id())
+{
+}
+
+namespace {
+typedef std::map<std::vector<int>, level_grid_ptr> level_grid_cache;
+level_grid_cache& get_level_grid_cache()
+{
+	static level_grid_cache cache;
+	return cache;
+}
+}
+
+level_grid_ptr get_level_grid(const level& lvl, const point& origin, int width, int height, int cell_width, int cell_height)
+{
+	std::vector<int> key;
+	key.push_back(origin.x);
+	key.push_back(origin.y);
+	key.push_back(width);
+	key.push_back(height);
+	key.push_back(cell_width);
+	key.push_back(cell_height);
+
+	level_grid_cache& cache = get_level_grid_cache();
+	level_grid_cache::iterator i = cache.find(key);
+	if(i != cache.end() && i->second->solid_state_id == lvl.solid_state_id()) {
+		return i->second;
+	}
+
+	if(i == cache.end() && cache.size() >= 8) {
+		cache.clear();
+	}
+
+	level_grid_ptr result(new level_grid(lvl, origin, width, height, cell_width, cell_height));
+	cache[key] = result;
+	return result;
+}
+
+bool find_grid_path(level_grid& lg, int src, int dst, std::vector<int>* path)
+{
+	if(g_pathfinding_cluster_size > 1 && g_pathfinding_cluster_distance > 0) {
+		const int dx = abs(lg.grid.x(src) - lg.grid.x(dst));
+		const int dy = abs(lg.grid.y(src) - lg.grid.y(dst));
+		if(std::max(dx, dy) >= g_pathfinding_cluster_distance) {
+			if(!lg.clusters) {
+				lg.clusters.reset(new cluster_graph(lg.grid, g_pathfinding_cluster_size));
+			}
+
+			if(lg.clusters->find_path(src, dst, path)) {
+				return true;
+			}
+		}
+	}
+
+	return lg.search.jump_point_search(src, dst, path);
+}
+
+}
+
+namespace {
+
+//about one cell in five blocked, and the edges left open.
+std::vector<unsigned char> random_blocked_cells(int width, int height, boost::random::mt19937& rng)
+{
+	std::vector<unsigned char> blocked(width*height);
+	for(int y = 1; y < height - 1; ++y) {
+		for(int x = 1; x < width - 1; ++x) {
+			blocked[y*width + x] = (rng()%5) == 0;
+		}
+	}
+
+	return blocked;
+}
+
+//a grid of random blocked cells, drawn from rng.
+pathfinding::grid_map random_grid(int width, int height, boost::random::mt19937& rng)
+{
+	return pathfinding::grid_map(width, height, 32, 32, random_blocked_cells(width, height, rng));
+}
+
+//a grid of random blocked cells, the same each time for a seed.
+pathfinding::grid_map random_grid(int width, int height, unsigned int seed=1)
+{
+	boost::random::mt19937 rng(seed);
+	return random_grid(width, height, rng);
+}
+
+//flips count random cells, other than keep_a and keep_b, adding them to
+//changed.
+void flip_random_cells(std::vector<unsigned char>* blocked, int count, boost::random::mt19937& rng, int keep_a, int keep_b, std::vector<int>* changed)
+{
+	for(int n = 0; n != count; ++n) {
+		const int id = rng()%blocked->size();
+		if(id != keep_a && id != keep_b) {
+			(*blocked)[id] = !(*blocked)[id];
+			changed->push_back(id);
+		}
+	}
+}
+
+//the cost of the path, or -1 if it isn't a path through open cells.
+float grid_path_cost(const pathfinding::grid_map& g, const std::vector<int>& path)
+{
+	float cost = 0.0f;
+	for(int n = 1; n < path.size(); ++n) {
+		const int dx = abs(g.x(path[n]) - g.x(path[n-1]));
+		const int dy = abs(g.y(path[n]) - g.y(path[n-1]));
+		if(g.blocked(path[n]) || dx > 1 || dy > 1 || dx + dy == 0) {
+			return -1.0f;
+		}
+
+		cost += dx && dy ? sqrt(float(g.cell_width()*g.cell_width() + g.cell_height()*g.cell_height())) : (dx ? g.cell_width() : g.cell_height());
+	}
+
+	return cost;
+}
+
+}
+
+UNIT_TEST(grid_jump_point_search) {
+	boost::random::mt19937 rng(1);
+	pathfinding::grid_map g = random_grid(48, 48, rng);
+	pathfinding::grid_search search(g);
+	const rect bounds(0, 0, g.width(), g.height());
+	std::vector<int> jps_path, astar_path;
+	for(int n = 0; n != 200; ++n) {
+		const int src = rng()%g.size();
+		const int dst = rng()%g.size();
+		if(g.blocked(src) || g.blocked(dst)) {
+			continue;
+		}
+
+		const bool found = search.jump_point_search(src, dst, &jps_path);
+		CHECK_EQ(found, search.a_star(src, dst, bounds, &astar_path));
+		if(found) {
+			CHECK_EQ(jps_path.front(), src);
+			CHECK_EQ(jps_path.back(), dst);
+			const float jps_cost = grid_path_cost(g, jps_path);
+			CHECK(jps_cost >= 0.0f, "jump point search path goes through a blocked cell");
+			CHECK(fabs(jps_cost - grid_path_cost(g, astar_path)) < 0.5f, "jump point search path costs " << jps_cost << " but A* found one costing " << grid_path_cost(g, astar_path));
+		}
+	}
+}
+
+UNIT_TEST(grid_cluster_path) {
+	boost::random::mt19937 rng(1);
+	pathfinding::grid_map g = random_grid(64, 64, rng);
+	pathfinding::grid_search search(g);
+	pathfinding::cluster_graph clusters(g, 8);
+	std::vector<int> path, best_path;
+	for(int n = 0; n != 100; ++n) {
+		const int src = rng()%g.size();
+		const int dst = rng()%g.size();
+		if(g.blocked(src) || g.blocked(dst) || !clusters.find_path(src, dst, &path)) {
+			continue;
+		}
+
+		CHECK_EQ(path.front(), src);
+		CHECK_EQ(path.back(), dst);
+		CHECK(grid_path_cost(g, path) >= 0.0f, "cluster path goes through a blocked cell");
+		CHECK(search.jump_point_search(src, dst, &best_path), "cluster path found where there is none");
+		CHECK(grid_path_cost(g, path) <= grid_path_cost(g, best_path)*1.5f, "cluster path costs " << grid_path_cost(g, path) << " but the best costs " << grid_path_cost(g, best_path));
+	}
+}
+
+UNIT_TEST(grid_nearest_open_cell) {
+	std::vector<unsigned char> blocked(8*8, 1);
+	blocked[3*8 + 6] = 0;
+	blocked[6*8 + 2] = 0;
+	pathfinding::grid_map g(8, 8, 32, 16, blocked);
+	CHECK_EQ(g.nearest_open_cell(g.id(2, 6), 2), g.id(2, 6));
+	CHECK_EQ(g.nearest_open_cell(g.id(4, 4), 2), g.id(6, 3));
+	CHECK_EQ(g.nearest_open_cell(g.id(0, 0), 2), -1);
+}
+
+UNIT_TEST(incremental_grid_search) {
+	boost::random::mt19937 rng(1);
+	std::vector<unsigned char> blocked = random_blocked_cells(40, 40, rng);
+	pathfinding::grid_map g(40, 40, 32, 16, blocked);
+	pathfinding::grid_search search(g);
+	const rect bounds(0, 0, g.width(), g.height());
+
+	pathfinding::incremental_grid_search inc(g, 0, g.size()-1);
+	std::vector<int> path, best_path;
+	for(int n = 0; n != 20; ++n) {
+		int expanded = 0;
+		const pathfinding::incremental_grid_search::RESULT result = inc.compute(1000000, &expanded);
+		const bool found = search.a_star(inc.source(), inc.destination(), bounds, &best_path);
+		CHECK_EQ(result == pathfinding::incremental_grid_search::FOUND, found);
+		if(found) {
+			CHECK(inc.get_path(&path), "no path from incremental search");
+			CHECK_EQ(path.front(), inc.source());
+			CHECK_EQ(path.back(), inc.destination());
+			CHECK(fabs(grid_path_cost(g, path) - grid_path_cost(g, best_path)) < 0.5f, "incremental search path costs " << grid_path_cost(g, path) << " but A* found one costing " << grid_path_cost(g, best_path));
+			if(path.size() > 2) {
+				inc.set_source(path[2]);
+			}
+		}
+
+		//change some cells, away from the ends of the path.
+		std::vector<int> changed;
+		flip_random_cells(&blocked, 10, rng, inc.source(), inc.destination(), &changed);
+
+		g = pathfinding::grid_map(40, 40, 32, 16, blocked);
+		inc.cells_changed(changed);
+	}
+}
+
+UNIT_TEST(flow_field) {
+	boost::random::mt19937 rng(1);
+	std::vector<unsigned char> blocked = random_blocked_cells(40, 40, rng);
+	pathfinding::grid_map g(40, 40, 32, 16, blocked);
+	pathfinding::grid_search search(g);
+	const rect bounds(0, 0, g.width(), g.height());
+	const int target = g.id(20, 20);
+
+	pathfinding::flow_field field(g, target);
+	for(int n = 0; n != 20; ++n) {
+		int expanded = 0;
+		while(!field.compute(50, &expanded)) {
+		}
+
+		search.dijkstra(target, bounds);
+		for(int id = 0; id != g.size(); ++id) {
+			const float best = g.blocked(target) || g.blocked(id) ? -1.0f : search.cost(id);
+			CHECK(fabs(field.cost(id) - best) < 0.5f, "flow field cost " << field.cost(id) << " but Dijkstra found " << best);
+
+			int dx = 0, dy = 0;
+			CHECK_EQ(field.direction(id, &dx, &dy), best >= 0.0f);
+			if(best > 0.0f) {
+				const int next = g.id(g.x(id) + dx, g.y(id) + dy);
+				CHECK(fabs(g.move_cost(dx, dy) + search.cost(next) - best) < 0.5f, "flow field direction doesn't lead to the target");
+			}
+		}
+
+		std::vector<int> changed;
+		flip_random_cells(&blocked, 10, rng, -1, -1, &changed);
+
+		g = pathfinding::grid_map(40, 40, 32, 16, blocked);
+		field.cells_changed(changed);
+	}
+}
+
+BENCHMARK(grid_jump_point_search) {
+	static pathfinding::grid_map g = random_grid(512, 512);
+	static pathfinding::grid_search search(g);
+	std::vector<int> path;
+	BENCHMARK_LOOP {
+		search.jump_point_search(g.id(1, 1), g.id(510, 510), &path);
+	}
+}
+
+BENCHMARK(grid_cluster_path) {
+	static pathfinding::grid_map g = random_grid(512, 512);
+	static pathfinding::cluster_graph clusters(g, 16);
+	std::vector<int> path;
+	BENCHMARK_LOOP {
+		clusters.find_path(g.id(1, 1), g.id(510, 510), &path);
+	}
+}
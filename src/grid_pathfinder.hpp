@@ -0,0 +1,442 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef GRID_PATHFINDER_HPP_INCLUDED
+#define GRID_PATHFINDER_HPP_INCLUDED
+
+#include <boost/shared_ptr.hpp>
+
+#include <utility>
+#include <vector>
+
+#include "geometry.hpp"
+
+class level;
+class level_solid_map;
+
+namespace pathfinding {
+
+//A binary heap of node ids, ordered by smallest key first, which keeps
+//track of where each id is so an id's key can be changed in place.
+template<typename Key>
+class indexed_heap
+{
+public:
+	void resize(int nnodes) { pos_.resize(nnodes, -1); }
+
+	bool empty() const { return heap_.empty(); }
+	int size() const { return heap_.size(); }
+	bool contains(int id) const { return pos_[id] != -1; }
+
+	int top() const { return heap_.front().second; }
+	const Key& top_key() const { return heap_.front().first; }
+	const Key& key(int id) const { return heap_[pos_[id]].first; }
+
+	//adds id with the given key, or moves it to the given key if it's
+	//already in the heap.
+	void push(int id, const Key& key) {
+		int n = pos_[id];
+		if(n == -1) {
+			n = heap_.size();
+			heap_.push_back(entry(key, id));
+			pos_[id] = n;
+			sift_up(n);
+		} else if(key < heap_[n].first) {
+			heap_[n].first = key;
+			sift_up(n);
+		} else {
+			heap_[n].first = key;
+			sift_down(n);
+		}
+	}
+
+	int pop() {
+		const int id = heap_.front().second;
+		remove(id);
+		return id;
+	}
+
+	void remove(int id) {
+		const int n = pos_[id];
+		if(n == -1) {
+			return;
+		}
+
+		pos_[id] = -1;
+		const entry last = heap_.back();
+		heap_.pop_back();
+		if(n == heap_.size()) {
+			return;
+		}
+
+		heap_[n] = last;
+		pos_[last.second] = n;
+		sift_up(n);
+		sift_down(pos_[last.second]);
+	}
+
+	//empties the heap, in time proportional to what was in it.
+	void clear() {
+		for(int n = 0; n != heap_.size(); ++n) {
+			pos_[heap_[n].second] = -1;
+		}
+
+		heap_.clear();
+	}
+
+private:
+	typedef std::pair<Key, int> entry;
+
+	void sift_up(int n) {
+		const entry e = heap_[n];
+		while(n > 0) {
+			const int parent = (n-1)/2;
+			if(!(e.first < heap_[parent].first)) {
+				break;
+			}
+
+			heap_[n] = heap_[parent];
+			pos_[heap_[n].second] = n;
+			n = parent;
+		}
+
+		heap_[n] = e;
+		pos_[e.second] = n;
+	}
+
+	void sift_down(int n) {
+		const entry e = heap_[n];
+		const int size = heap_.size();
+		for(;;) {
+			int child = n*2 + 1;
+			if(child >= size) {
+				break;
+			}
+
+			if(child+1 < size && heap_[child+1].first < heap_[child].first) {
+				++child;
+			}
+
+			if(!(heap_[child].first < e.first)) {
+				break;
+			}
+
+			heap_[n] = heap_[child];
+			pos_[heap_[n].second] = n;
+			n = child;
+		}
+
+		heap_[n] = e;
+		pos_[e.second] = n;
+	}
+
+	std::vector<entry> heap_;
+	std::vector<int> pos_;
+};
+
+//true if any pixel of the solid map inside r is solid. This gives the same
+//answer as level::solid(r) but looks at whole tiles at a time.
+bool solid_map_rect_solid(const level_solid_map& map, const rect& r);
+
+//A grid of equally sized cells, each either open or blocked, numbered
+//row by row so searches can keep their state in flat arrays. Anything
+//outside the grid counts as blocked.
+class grid_map
+{
+public:
+	//builds the grid from the level's solid map. origin is the top left
+	//of the first cell, in level coordinates, and a cell is blocked if any
+	//part of it is solid.
+	grid_map(const level& lvl, const point& origin, int width, int height, int cell_width, int cell_height);
+
+	//builds a grid with the given cells, which are non-zero where blocked.
+	grid_map(int width, int height, int cell_width, int cell_height, const std::vector<unsigned char>& blocked);
+
+	int width() const { return width_; }
+	int height() const { return height_; }
+	int size() const { return blocked_.size(); }
+	int cell_width() const { return cell_width_; }
+	int cell_height() const { return cell_height_; }
+	const point& origin() const { return origin_; }
+
+	int id(int x, int y) const { return y*width_ + x; }
+	int x(int id) const { return id%width_; }
+	int y(int id) const { return id/width_; }
+
+	bool in_bounds(int x, int y) const { return x >= 0 && y >= 0 && x < width_ && y < height_; }
+	bool blocked(int x, int y) const { return !in_bounds(x, y) || blocked_[id(x, y)]; }
+	bool blocked(int id) const { return blocked_[id] != 0; }
+
+	//what moving between neighbouring cells costs: their distance apart in
+	//level pixels.
+	float move_cost(int dx, int dy) const { return dx && dy ? diagonal_ : (dx ? cell_width_ : cell_height_); }
+
+	//the cost of the cheapest path between two cells if nothing were
+	//blocked.
+	float distance(int a, int b) const;
+
+	//the top left of the cell, in level coordinates.
+	point cell_pos(int id) const;
+
+	//the cell which contains the level position, clamped to the grid.
+	int cell_at(const point& p) const;
+
+	//the open cell nearest to id, looking up to max_cells cells away, or
+	//-1 if they're all blocked.
+	int nearest_open_cell(int id, int max_cells) const;
+
+	//reads the cells overlapping r, in level coordinates, from the level's
+	//solid map again, adding the ones which changed to changed.
+	void refresh(const level& lvl, const rect& r, std::vector<int>* changed=NULL);
+
+private:
+	point origin_;
+	int width_, height_;
+	int cell_width_, cell_height_;
+	float diagonal_;
+	std::vector<unsigned char> blocked_;
+};
+
+//brings a grid read from the level up to date with the level's solidity,
+//re-reading only the areas the level says have changed since
+//*solid_state_id where it can. The cells which changed are added to
+//changed.
+void update_grid(const level& lvl, grid_map* grid, int* solid_state_id, std::vector<int>* changed);
+
+//Searches a grid_map moving in eight directions. Diagonal moves may pass
+//between two blocked cells, as plot_path has always allowed. Moves cost
+//their length in level pixels, so a diagonal costs the length of a cell's
+//diagonal. Paths found are lists of cell ids from the start to the end,
+//with every cell on the way included.
+//
+//A grid_search keeps its working state between searches so it doesn't
+//have to allocate, which means each thread needs its own.
+class grid_search
+{
+public:
+	explicit grid_search(const grid_map& g);
+
+	const grid_map& grid() const { return grid_; }
+
+	float distance(int a, int b) const { return grid_.distance(a, b); }
+
+	//finds the cheapest path using Jump Point Search, which only puts the
+	//cells where a path may have to turn on the open list.
+	bool jump_point_search(int src, int dst, std::vector<int>* path);
+
+	//A* which only looks at cells inside bounds, given in cells.
+	bool a_star(int src, int dst, const rect& bounds, std::vector<int>* path);
+
+	//finds the cost to every cell inside bounds reachable from src, which
+	//can then be looked up with cost().
+	void dijkstra(int src, const rect& bounds);
+
+	//the cost to reach id in the last search, or -1 if it wasn't reached.
+	float cost(int id) const { return seen_[id] == generation_ ? g_[id] : -1.0f; }
+
+private:
+	grid_search(const grid_search&);
+	void operator=(const grid_search&);
+
+	void begin_search();
+	bool search(int src, int dst, const rect& bounds);
+	bool jump(int x, int y, int dx, int dy, int dst, int* result) const;
+	bool jump_straight(int x, int y, int dx, int dy, int dst) const;
+	void build_path(int src, int dst, std::vector<int>* path) const;
+
+	const grid_map& grid_;
+
+	std::vector<float> g_;
+	std::vector<int> parent_;
+	std::vector<unsigned int> seen_, closed_;
+	unsigned int generation_;
+	indexed_heap<float> open_;
+};
+
+//D* Lite, which finds paths to a fixed destination from a start that may
+//move, and when cells change repairs only the part of the search they
+//affect rather than starting again. It searches back from the
+//destination, so what it keeps is each cell's cost to get there.
+//
+//The search state is as big as the grid, and is kept for as long as
+//paths to the same destination are wanted.
+class incremental_grid_search
+{
+public:
+	incremental_grid_search(const grid_map& g, int src, int dst);
+
+	int source() const { return src_; }
+	int destination() const { return dst_; }
+
+	//moves the start of the path, which the search is then repaired for.
+	void set_source(int src);
+
+	//tells the search that these cells have changed between blocked and
+	//open in the grid since it last ran.
+	void cells_changed(const std::vector<int>& cells);
+
+	enum RESULT { FOUND, NOT_FOUND, INCOMPLETE };
+
+	//carries on the search, giving up with INCOMPLETE after expanding
+	//max_expansions cells, so it can be continued later. The number of
+	//cells expanded is added to expanded.
+	RESULT compute(int max_expansions, int* expanded);
+
+	//the path from the source to the destination, once compute() has
+	//returned FOUND.
+	bool get_path(std::vector<int>* path) const;
+
+private:
+	typedef std::pair<float, float> key;
+
+	key calculate_key(int id) const;
+	void update_cell(int id);
+	void update_neighbours(int id);
+
+	const grid_map& grid_;
+	int src_, last_src_, dst_;
+
+	//how far the source has moved since the search began, which is added
+	//to keys so the ones already in the open list stay valid.
+	float km_;
+
+	std::vector<float> g_, rhs_;
+	indexed_heap<key> open_;
+};
+
+//The cost of getting from every cell of a grid to one target cell, found
+//by a Dijkstra search out from the target, and the direction to move in
+//from each cell to get there, which can be read in constant time by any
+//number of objects heading for the same place.
+//
+//When cells change the field is repaired the same way as
+//incremental_grid_search repairs its search, only visiting the cells
+//whose cost changes, and the repair can be done a little at a time. While
+//it's being repaired, cost() and direction() may be wrong.
+class flow_field
+{
+public:
+	flow_field(const grid_map& g, int target);
+
+	const grid_map& grid() const { return grid_; }
+	int target() const { return target_; }
+
+	//tells the field that these cells have changed between blocked and
+	//open in the grid since it was last computed.
+	void cells_changed(const std::vector<int>& cells);
+
+	//carries on working out the field, stopping after expanding
+	//max_expansions cells. Returns true once the field is complete. The
+	//number of cells expanded is added to expanded.
+	bool compute(int max_expansions, int* expanded);
+	bool complete() const { return open_.empty(); }
+
+	//the cost to get from id to the target, or -1 if it can't be reached.
+	float cost(int id) const;
+
+	//the step, in cells, to take from id towards the target: the
+	//neighbour through which it's cheapest to get there. Returns false if
+	//the target can't be reached, and a step of 0,0 at the target.
+	bool direction(int id, int* dx, int* dy) const;
+
+private:
+	void update_cell(int id);
+	void update_neighbours(int id);
+
+	const grid_map& grid_;
+	int target_;
+
+	std::vector<float> g_, rhs_;
+	indexed_heap<float> open_;
+};
+
+//Splits a grid into square clusters of cells and finds the entrances
+//between neighbouring clusters, working out the cost of getting between
+//the entrances of each cluster ahead of time. Long paths are planned from
+//entrance to entrance and then filled in one cluster at a time, which is
+//much cheaper than searching the whole grid, at the cost of the path
+//being a little longer than the best one.
+class cluster_graph
+{
+public:
+	cluster_graph(const grid_map& g, int cluster_size);
+
+	//returns false if src and dst are in the same cluster, or if no path
+	//could be found through the entrances. Diagonal moves across the
+	//corners of clusters aren't entrances, so this can miss paths a full
+	//search would find.
+	bool find_path(int src, int dst, std::vector<int>* path);
+
+	int num_nodes() const { return nodes_.size(); }
+
+private:
+	struct edge {
+		int to;
+		float cost;
+	};
+
+	int cluster_of(int cell) const;
+	rect cluster_bounds(int cluster) const;
+	int add_node(int cell);
+	void add_edge(int from, int to, float cost);
+	void find_entrances(int x, int y, int dx, int dy, int length);
+	void link_entrance_to_cluster(int cell, std::vector<edge>* edges);
+
+	const grid_map& grid_;
+	int cluster_size_, clusters_wide_;
+	grid_search search_;
+
+	//the cell of each node, the node at each cell, if any, and the nodes
+	//in each cluster.
+	std::vector<int> nodes_;
+	std::vector<int> node_at_cell_;
+	std::vector<std::vector<int> > cluster_nodes_;
+	std::vector<std::vector<edge> > edges_;
+};
+
+//the layout of the grid plot_path searches for tiles of the given size:
+//a cell for each tile midpoint inside bounds, with the cell's area
+//starting at the midpoint. Returns false if there are no cells.
+bool get_midpoint_grid_layout(const rect& bounds, int tile_size_x, int tile_size_y, point* origin, int* width, int* height);
+
+//a grid over a level along with what's needed to search it, shared
+//between searches until the level's solidity changes.
+struct level_grid
+{
+	level_grid(const level& lvl, const point& origin, int width, int height, int cell_width, int cell_height);
+
+	grid_map grid;
+	grid_search search;
+
+	//built the first time a long path is asked for.
+	boost::shared_ptr<cluster_graph> clusters;
+
+	int solid_state_id;
+};
+
+typedef boost::shared_ptr<level_grid> level_grid_ptr;
+
+//returns the grid over the level with the given layout, reusing the one
+//made last time if the level hasn't changed since.
+level_grid_ptr get_level_grid(const level& lvl, const point& origin, int width, int height, int cell_width, int cell_height);
+
+//finds a path between two cells of a level grid, with Jump Point Search,
+//or over the grid's clusters if the cells are far apart.
+bool find_grid_path(level_grid& lg, int src, int dst, std::vector<int>* path);
+
+}
+
+#endif
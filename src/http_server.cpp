@@ -45,6 +45,12 @@ web_server::web_server(boost::asio::io_service& io_service, int port)
 	start_accept();
 }
 
+web_server::web_server(boost::asio::io_service& io_service, const tcp::endpoint& endpoint)
+  : acceptor_(io_service, endpoint)
+{
+	start_accept();
+}
+
 web_server::~web_server()
 {
 	acceptor_.close();
@@ -32,6 +32,9 @@ public:
 	typedef boost::shared_ptr<boost::array<char, 64*1024> > buffer_ptr;
 
 	explicit web_server(boost::asio::io_service& io_service, int port=23456);
+
+	//listens only on the given address rather than on all interfaces.
+	web_server(boost::asio::io_service& io_service, const boost::asio::ip::tcp::endpoint& endpoint);
 	virtual ~web_server();
 
 	static void disconnect_socket(socket_ptr socket);
@@ -0,0 +1,572 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <boost/shared_ptr.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string.h>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <SDL_image.h>
+
+#include "asserts.hpp"
+#include "custom_object_type.hpp"
+#include "filesystem.hpp"
+#include "foreach.hpp"
+#include "formatter.hpp"
+#include "image_loader.hpp"
+#include "json_parser.hpp"
+#include "load_level.hpp"
+#include "preferences.hpp"
+#include "surface_cache.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+#include "variant.hpp"
+#include "zlib.h"
+
+PREF_BOOL(async_image_loading, true, "Decode images on worker threads ahead of when they are needed");
+PREF_INT(image_decode_threads, 2, "Number of threads used to decode images in the background");
+PREF_BOOL(image_disk_cache, true, "Keep decoded images in a cache on disk so they don't need to be decoded again");
+PREF_BOOL(prefetch_level_images, true, "Decode the images used by levels we are likely to go to next in the background");
+PREF_INT(image_stage_budget_kb, 4096, "Most kilobytes of decoded images handed over from the background each frame");
+
+namespace graphics {
+namespace image_loader {
+
+namespace {
+
+//how many frames after a level loads count towards the first frames hitch.
+const int FirstFrames = 60;
+
+enum ENTRY_STATE { ENTRY_QUEUED, ENTRY_DECODING, ENTRY_READY, ENTRY_FAILED };
+
+struct entry {
+	entry() : state(ENTRY_QUEUED) {}
+	ENTRY_STATE state;
+	surface surf;
+	std::string fname;
+};
+
+struct job {
+	std::string key;
+
+	//if true the key is the path to a level file to look for images in.
+	bool level;
+};
+
+//all of the below is protected by loader_mutex.
+threading::mutex loader_mutex;
+threading::condition work_cond, done_cond;
+
+std::map<std::string, entry> entries;
+std::deque<job> jobs;
+
+//images which have finished decoding, in the order they finished.
+std::deque<std::string> ready_keys;
+
+std::vector<boost::shared_ptr<threading::thread> > workers;
+bool quit_workers = false;
+
+stats current_stats;
+int frame_sync_ms = 0;
+int frames_since_load = FirstFrames;
+
+SDL_threadID main_thread_id;
+
+bool running()
+{
+	return workers.empty() == false;
+}
+
+surface decode(const std::string& key, std::string* fname)
+{
+	*fname = surface_cache::find_image(key);
+	if(fname->empty()) {
+		return surface();
+	}
+
+	//images in the temporary directory are being edited, so aren't cached.
+	return load_file(*fname, key[0] != '#');
+}
+
+void find_images(const variant& node, std::set<std::string>* images)
+{
+	if(node.is_string()) {
+		const std::string& s = node.as_string();
+		if(s.size() > 4 && std::equal(s.end() - 4, s.end(), ".png")) {
+			images->insert(s);
+		}
+	} else if(node.is_list()) {
+		for(int n = 0; n != node.num_elements(); ++n) {
+			find_images(node[n], images);
+		}
+	} else if(node.is_map()) {
+		for(std::map<variant,variant>::const_iterator i = node.as_map().begin(); i != node.as_map().end(); ++i) {
+			find_images(i->second, images);
+		}
+	}
+}
+
+void scan_level(const std::string& path)
+{
+	std::set<std::string> images;
+	try {
+		const variant lvl = json::parse(sys::read_file(path), json::JSON_NO_PREPROCESSOR);
+		find_images(lvl, &images);
+
+		std::set<std::string> types;
+		const variant chars = lvl["character"];
+		for(int n = 0; chars.is_list() && n != chars.num_elements(); ++n) {
+			if(chars[n]["type"].is_string()) {
+				types.insert(chars[n]["type"].as_string());
+			}
+		}
+
+		foreach(const std::string& type, types) {
+			const std::string* obj_path = custom_object_type::get_object_path(type + ".cfg");
+			if(obj_path) {
+				find_images(json::parse(sys::read_file(*obj_path), json::JSON_NO_PREPROCESSOR), &images);
+			}
+		}
+	} catch(json::parse_error&) {
+		std::cerr << "Could not scan level " << path << " for images\n";
+		return;
+	}
+
+	foreach(const std::string& img, images) {
+		request(img);
+	}
+}
+
+void worker_thread()
+{
+	for(;;) {
+		job j;
+		{
+			threading::lock lck(loader_mutex);
+			while(jobs.empty() && !quit_workers) {
+				work_cond.wait(loader_mutex);
+			}
+
+			if(quit_workers) {
+				return;
+			}
+
+			j = jobs.front();
+			jobs.pop_front();
+
+			if(!j.level) {
+				//the image may have been taken and loaded synchronously
+				//since it was queued.
+				std::map<std::string, entry>::iterator i = entries.find(j.key);
+				if(i == entries.end() || i->second.state != ENTRY_QUEUED) {
+					continue;
+				}
+
+				i->second.state = ENTRY_DECODING;
+			}
+		}
+
+		if(j.level) {
+			scan_level(j.key);
+			continue;
+		}
+
+		std::string fname;
+		surface surf = decode(j.key, &fname);
+
+		threading::lock lck(loader_mutex);
+		std::map<std::string, entry>::iterator i = entries.find(j.key);
+		if(i != entries.end()) {
+			i->second.surf = surf;
+			i->second.fname = fname;
+			i->second.state = surf.null() ? ENTRY_FAILED : ENTRY_READY;
+			if(!surf.null()) {
+				ready_keys.push_back(j.key);
+			}
+		}
+
+		if(!surf.null()) {
+			++current_stats.decoded;
+		}
+		done_cond.notify_all();
+
+		//release our reference while we hold the lock, since the main
+		//thread may be copying the surface.
+		surf = surface();
+	}
+}
+
+//the decoded image cache. Each file holds a header, the name of the image
+//file, so collisions can be detected, and then the pixels, with no
+//padding between rows, so the file can be used directly once mapped.
+struct disk_cache_header {
+	char magic[4];
+	Uint32 version;
+	int64_t mod_time;
+	Uint32 w, h;
+	Uint32 masks[4];
+	Uint32 fname_len;
+};
+
+const char DiskCacheMagic[4] = { 'A', 'I', 'M', 'G' };
+const Uint32 DiskCacheVersion = 1;
+
+std::string disk_cache_fname(const std::string& fname)
+{
+	uLong crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, reinterpret_cast<const Bytef*>(fname.c_str()), fname.size());
+
+	char buf[64];
+	sprintf(buf, "%08x.rgba", static_cast<unsigned int>(crc));
+	return std::string(preferences::user_data_path()) + "/image_cache/" + buf;
+}
+
+surface surface_from_disk_cache(const char* data, size_t size, const std::string& fname, int64_t mod_time)
+{
+	disk_cache_header header;
+	if(size < sizeof(header)) {
+		return surface();
+	}
+
+	memcpy(&header, data, sizeof(header));
+	if(memcmp(header.magic, DiskCacheMagic, sizeof(DiskCacheMagic)) != 0 ||
+	   header.version != DiskCacheVersion || header.mod_time != mod_time ||
+	   header.fname_len != fname.size() ||
+	   size != sizeof(header) + header.fname_len + size_t(header.w)*header.h*4 ||
+	   memcmp(data + sizeof(header), fname.c_str(), fname.size()) != 0) {
+		return surface();
+	}
+
+	surface s(SDL_CreateRGBSurface(0, header.w, header.h, 32, header.masks[0], header.masks[1], header.masks[2], header.masks[3]));
+	if(s.null()) {
+		return surface();
+	}
+
+	const char* pixels = data + sizeof(header) + header.fname_len;
+	for(int y = 0; y < s->h; ++y) {
+		memcpy(reinterpret_cast<char*>(s->pixels) + y*s->pitch, pixels + y*s->w*4, s->w*4);
+	}
+
+	return s;
+}
+
+surface read_disk_cache(const std::string& fname, int64_t mod_time)
+{
+	const std::string cache_fname = disk_cache_fname(fname);
+#if !defined(_WIN32)
+	const int fd = open(cache_fname.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return surface();
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return surface();
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		return surface();
+	}
+
+	surface result = surface_from_disk_cache(reinterpret_cast<const char*>(data), st.st_size, fname, mod_time);
+	munmap(data, st.st_size);
+	return result;
+#else
+	if(!sys::file_exists(cache_fname)) {
+		return surface();
+	}
+
+	const std::string contents = sys::read_file(cache_fname);
+	return surface_from_disk_cache(contents.c_str(), contents.size(), fname, mod_time);
+#endif
+}
+
+void write_disk_cache(const std::string& fname, int64_t mod_time, const surface& s)
+{
+	disk_cache_header header;
+	memcpy(header.magic, DiskCacheMagic, sizeof(DiskCacheMagic));
+	header.version = DiskCacheVersion;
+	header.mod_time = mod_time;
+	header.w = s->w;
+	header.h = s->h;
+	header.masks[0] = s->format->Rmask;
+	header.masks[1] = s->format->Gmask;
+	header.masks[2] = s->format->Bmask;
+	header.masks[3] = s->format->Amask;
+	header.fname_len = fname.size();
+
+	std::string contents(reinterpret_cast<const char*>(&header), sizeof(header));
+	contents += fname;
+	contents.reserve(contents.size() + s->w*s->h*4);
+	for(int y = 0; y < s->h; ++y) {
+		contents.append(reinterpret_cast<const char*>(s->pixels) + y*s->pitch, s->w*4);
+	}
+
+	//write to a file of our own and move it into place, so another thread
+	//or process never reads a half written cache file.
+	const std::string cache_fname = disk_cache_fname(fname);
+	const std::string tmp_fname = formatter() << cache_fname << "." << SDL_ThreadID() << ".tmp";
+	sys::write_file(tmp_fname, contents);
+	sys::move_file(tmp_fname, cache_fname);
+}
+
+}
+
+manager::manager()
+{
+	main_thread_id = SDL_ThreadID();
+	if(!g_async_image_loading) {
+		return;
+	}
+
+	quit_workers = false;
+	for(int n = 0; n < std::max(1, g_image_decode_threads); ++n) {
+		workers.push_back(boost::shared_ptr<threading::thread>(new threading::thread("image_loader", worker_thread)));
+	}
+}
+
+manager::~manager()
+{
+	{
+		threading::lock lck(loader_mutex);
+		quit_workers = true;
+		work_cond.notify_all();
+	}
+
+	//the threads are joined as they are destroyed.
+	workers.clear();
+
+	entries.clear();
+	jobs.clear();
+	ready_keys.clear();
+}
+
+void request(const std::string& key)
+{
+	if(!running() || key.empty()) {
+		return;
+	}
+
+	threading::lock lck(loader_mutex);
+	if(entries.count(key) || surface_cache::is_staged(key)) {
+		return;
+	}
+
+	entries[key];
+	const job j = { key, false };
+	jobs.push_back(j);
+	++current_stats.requested;
+	work_cond.notify_one();
+}
+
+void prefetch_level(const std::string& lvl)
+{
+	if(!running() || !g_prefetch_level_images) {
+		return;
+	}
+
+	//look up the paths here, since the path tables are loaded on first use
+	//and that mustn't happen on a worker thread.
+	const job j = { get_level_path(lvl), true };
+	custom_object_type::get_object_path("");
+
+	threading::lock lck(loader_mutex);
+	jobs.push_back(j);
+	work_cond.notify_one();
+}
+
+surface take(const std::string& key, std::string* fname)
+{
+	if(!running()) {
+		return surface();
+	}
+
+	threading::lock lck(loader_mutex);
+	std::map<std::string, entry>::iterator i = entries.find(key);
+	while(i != entries.end() && i->second.state == ENTRY_DECODING) {
+		done_cond.wait(loader_mutex);
+		i = entries.find(key);
+	}
+
+	if(i == entries.end()) {
+		return surface();
+	}
+
+	surface result;
+	if(i->second.state == ENTRY_READY) {
+		result = i->second.surf;
+		if(fname) {
+			*fname = i->second.fname;
+		}
+	}
+
+	//if the image is still queued, the caller loads it themselves and the
+	//worker skips it.
+	entries.erase(i);
+	return result;
+}
+
+void stage_pending()
+{
+	if(!running()) {
+		return;
+	}
+
+	//hand over at least one image a frame, but stop once we're over the
+	//budget so a burst of decoded images doesn't cause a hitch.
+	const size_t budget = std::max(0, g_image_stage_budget_kb)*1024;
+	size_t bytes = 0;
+
+	threading::lock lck(loader_mutex);
+	while(ready_keys.empty() == false && (bytes == 0 || bytes < budget)) {
+		const std::string key = ready_keys.front();
+		ready_keys.pop_front();
+
+		std::map<std::string, entry>::iterator i = entries.find(key);
+		if(i == entries.end() || i->second.state != ENTRY_READY) {
+			continue;
+		}
+
+		const surface& surf = i->second.surf;
+		bytes += surf->h*surf->pitch;
+		surface_cache::stage(key, surf, i->second.fname);
+		entries.erase(i);
+		++current_stats.staged;
+	}
+}
+
+surface load_file(const std::string& fname, bool use_disk_cache)
+{
+	use_disk_cache = use_disk_cache && g_image_disk_cache;
+
+	int64_t mod_time = 0;
+	if(use_disk_cache) {
+		mod_time = sys::file_mod_time(fname);
+		surface s = read_disk_cache(fname, mod_time);
+		if(!s.null()) {
+			threading::lock lck(loader_mutex);
+			++current_stats.disk_cache_hits;
+			return s;
+		}
+	}
+
+	surface s(IMG_Load(fname.c_str()));
+	if(s.null() || s->w == 0) {
+		return surface();
+	}
+
+	//get the image in the format textures and palettes work with now, so
+	//that's what gets cached.
+	if(s->format->BytesPerPixel != 4 || s->format->Amask == 0) {
+		surface converted(SDL_CreateRGBSurface(0, s->w, s->h, 32, SURFACE_MASK));
+		SDL_SetSurfaceBlendMode(s.get(), SDL_BLENDMODE_NONE);
+		SDL_BlitSurface(s.get(), NULL, converted.get(), NULL);
+		s = converted;
+	}
+
+	if(use_disk_cache) {
+		write_disk_cache(fname, mod_time, s);
+	}
+
+	return s;
+}
+
+void record_sync_load(int ms)
+{
+	if(SDL_ThreadID() != main_thread_id) {
+		return;
+	}
+
+	threading::lock lck(loader_mutex);
+	++current_stats.sync_loads;
+	frame_sync_ms += ms;
+}
+
+void level_loaded(const std::string& lvl, int ms)
+{
+	threading::lock lck(loader_mutex);
+	current_stats.level_load_ms = ms;
+	current_stats.sync_loads = 0;
+	current_stats.worst_frame_sync_ms = 0;
+	current_stats.first_frames_sync_ms = 0;
+	frame_sync_ms = 0;
+	frames_since_load = 0;
+}
+
+void begin_frame()
+{
+	threading::lock lck(loader_mutex);
+	current_stats.last_frame_sync_ms = frame_sync_ms;
+	current_stats.worst_frame_sync_ms = std::max(current_stats.worst_frame_sync_ms, frame_sync_ms);
+	if(frames_since_load < FirstFrames) {
+		current_stats.first_frames_sync_ms += frame_sync_ms;
+		++frames_since_load;
+	}
+
+	frame_sync_ms = 0;
+}
+
+stats get_stats()
+{
+	threading::lock lck(loader_mutex);
+	stats result = current_stats;
+	result.pending = entries.size();
+	return result;
+}
+
+}
+}
+
+UNIT_TEST(image_loader_disk_cache)
+{
+	using namespace graphics;
+	surface s(SDL_CreateRGBSurface(0, 5, 3, 32, SURFACE_MASK));
+	for(int n = 0; n != s->w*s->h; ++n) {
+		reinterpret_cast<Uint32*>(s->pixels)[n] = n*0x01020304;
+	}
+
+	const std::string fname = "images/unit-test-image.png";
+	image_loader::write_disk_cache(fname, 1234, s);
+
+	surface loaded = image_loader::read_disk_cache(fname, 1234);
+	CHECK(!loaded.null(), "Image not read back from the disk cache");
+	CHECK_EQ(loaded->w, s->w);
+	CHECK_EQ(loaded->h, s->h);
+	CHECK_EQ(loaded->format->Amask, s->format->Amask);
+	for(int y = 0; y != s->h; ++y) {
+		CHECK_EQ(memcmp(reinterpret_cast<char*>(loaded->pixels) + y*loaded->pitch, reinterpret_cast<char*>(s->pixels) + y*s->pitch, s->w*4), 0);
+	}
+
+	//a changed source image must not be read from the cache.
+	CHECK(image_loader::read_disk_cache(fname, 1235).null(), "Stale image read from the disk cache");
+
+	sys::remove_file(image_loader::disk_cache_fname(fname));
+}
@@ -0,0 +1,95 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef IMAGE_LOADER_HPP_INCLUDED
+#define IMAGE_LOADER_HPP_INCLUDED
+
+#include <string>
+
+#include "surface.hpp"
+
+//Decodes images on worker threads ahead of when they're needed, so that
+//the first time something is drawn doesn't stall the frame. Decoded images
+//are also kept in a cache on disk, as raw pixels ready to go in a texture,
+//so later runs don't have to decode them at all.
+namespace graphics {
+namespace image_loader {
+
+//starts the worker threads. Until one of these exists requests are ignored
+//and all images are loaded synchronously.
+struct manager {
+	manager();
+	~manager();
+};
+
+//requests that the image with the given key (as passed to
+//surface_cache::get()) be decoded in the background.
+void request(const std::string& key);
+
+//requests every image referenced by a level and the objects in it. The
+//level file is read on a worker thread too.
+void prefetch_level(const std::string& lvl);
+
+//if the image has been requested, returns it, waiting for it to finish
+//decoding if need be. Returns a null surface if it was never requested.
+surface take(const std::string& key, std::string* fname);
+
+//hands images which have finished decoding to surface_cache, where
+//they're kept until something first loads them. Textures are only made
+//once they're used, with whatever palette or formula they're used with.
+//Only hands over image_stage_budget_kb worth each call, leaving the rest
+//for later frames. Called once a frame from the main thread.
+void stage_pending();
+
+//loads an image file, using the disk cache of decoded images if the file
+//hasn't changed since it was cached. The result is always 32bpp RGBA.
+surface load_file(const std::string& fname, bool use_disk_cache=true);
+
+//records the time taken to load an image on the main thread, since doing
+//that while the game is running causes a hitch.
+void record_sync_load(int ms);
+
+//called when a level has finished loading, with the time it took, and at
+//the start of every frame.
+void level_loaded(const std::string& lvl, int ms);
+void begin_frame();
+
+struct stats {
+	stats() : requested(0), decoded(0), disk_cache_hits(0), staged(0),
+	          pending(0), level_load_ms(0), sync_loads(0), last_frame_sync_ms(0),
+	          worst_frame_sync_ms(0), first_frames_sync_ms(0)
+	{}
+
+	int requested, decoded, disk_cache_hits, staged;
+
+	//requested images that haven't been handed to surface_cache yet.
+	int pending;
+
+	//time to load the last level.
+	int level_load_ms;
+
+	//images loaded synchronously since the level loaded, the time spent
+	//doing so in the last frame and the worst frame, and the total time
+	//spent doing so in the first frames after the level loaded.
+	int sync_loads, last_frame_sync_ms, worst_frame_sync_ms, first_frames_sync_ms;
+};
+
+stats get_stats();
+
+}
+}
+
+#endif
@@ -1,11 +1,15 @@
 #if defined(USE_ISOMAP)
 
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/shared_array.hpp>
 #include <boost/regex.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/shared_ptr.hpp>
+#include <stddef.h>
+#include <string.h>
 #include <limits>
 #include <sstream>
 #include <utility>
@@ -13,6 +17,7 @@
 #include <glm/gtc/noise.hpp>
 #include <glm/gtc/random.hpp>
 
+#include "background_task_pool.hpp"
 #include "base64.hpp"
 #include "compress.hpp"
 #include "foreach.hpp"
@@ -27,6 +32,8 @@
 #include "unit_test.hpp"
 #include "variant_utils.hpp"
 
+PREF_BOOL(isomap_background_remesh, true, "Rebuild the meshes of voxel chunks on worker threads after they're edited");
+
 namespace voxel{
 	namespace 
 	{
@@ -160,6 +167,7 @@ namespace voxel{
 					const variant& block = node["textured_blocks"][i];
 					textured_tile_info ti;
 					ti.faces = 0;
+					ti.transparent = false;
 					ASSERT_LOG(block.has_key("name") && block["name"].is_string(), 
 						"Each block in list must have a 'name' attribute of type string.");
 					ti.name = block["name"].as_string();
@@ -268,7 +276,7 @@ namespace voxel{
 
 	bool operator==(position const& p1, position const& p2)
 	{
-		return p1.x == p1.x && p1.y == p2.y && p1.z == p2.z;
+		return p1.x == p2.x && p1.y == p2.y && p1.z == p2.z;
 	}
 
 	std::size_t hash_value(position const& p)
@@ -282,7 +290,7 @@ namespace voxel{
 
 	chunk::chunk()
 		: u_mvp_matrix_(-1), u_normal_(-1), a_position_(-1), textured_(true), 
-		worldspace_position_(0.0f)
+		worldspace_position_(0.0f), mesh_vertex_size_(0), building_(false), build_pending_(false)
 	{
 		// Call init *before* doing anything else
 		init();
@@ -290,8 +298,8 @@ namespace voxel{
 
 	chunk::chunk(gles2::program_ptr shader, logical_world_ptr logic, const variant& node)
 		: u_mvp_matrix_(-1), u_normal_(-1), a_position_(-1), textured_(true), 
-		worldspace_position_(0.0f), scale_x_(logic->scale_x()), scale_y_(logic->scale_y()), 
-		scale_z_(logic->scale_z())
+		worldspace_position_(0.0f), scale_x_(logic ? logic->scale_x() : 1), scale_y_(logic ? logic->scale_y() : 1), 
+		scale_z_(logic ? logic->scale_z() : 1), mesh_vertex_size_(0), building_(false), build_pending_(false)
 	{
 		// Call init *before* doing anything else
 		init();
@@ -304,21 +312,33 @@ namespace voxel{
 		if(node.has_key("worldspace_position")) {
 			const variant& wp = node["worldspace_position"];
 			ASSERT_LOG(wp.is_list() && wp.num_elements() == 3, "'worldspace_position' attribute must be a list of 3 integers");
-			worldspace_position_.x = float(wp[0].as_decimal().as_float()) * logic->scale_x();
-			worldspace_position_.y = float(wp[1].as_decimal().as_float()) * logic->scale_y();
-			worldspace_position_.z = float(wp[2].as_decimal().as_float()) * logic->scale_z();
+			worldspace_position_.x = float(wp[0].as_decimal().as_float()) * scale_x_;
+			worldspace_position_.y = float(wp[1].as_decimal().as_float()) * scale_y_;
+			worldspace_position_.z = float(wp[2].as_decimal().as_float()) * scale_z_;
 		}
 	}
 
 	void chunk::init()
 	{
-		vbos_ = boost::shared_array<GLuint>(new GLuint[2], [](GLuint* id) {glDeleteBuffers(2,id); delete [] id;});
-		glGenBuffers(2, &vbos_[0]);
-
-		get_textured_terrain_info().clear();
-		get_textured_terrain_info().load(json::parse_from_file("data/terrain.cfg"));
-		get_colored_terrain_info().clear();
-		get_colored_terrain_info().load(json::parse_from_file("data/terrain.cfg"));
+		vbos_ = boost::shared_array<GLuint>(new GLuint[1], [](GLuint* id) {glDeleteBuffers(1,id); delete [] id;});
+		glGenBuffers(1, &vbos_[0]);
+		std::fill(mesh_face_begin_, mesh_face_begin_ + MAX_FACES + 1, 0);
+
+		// Palette index 0 is an empty voxel.
+		palette_.assign(1, variant());
+		palette_ids_.clear();
+		opaque_.assign(1, false);
+
+		// Streamed worlds make chunks every frame, so the terrain is only
+		// read the first time.
+		static bool terrain_loaded = false;
+		if(!terrain_loaded) {
+			get_textured_terrain_info().clear();
+			get_textured_terrain_info().load(json::parse_from_file("data/terrain.cfg"));
+			get_colored_terrain_info().clear();
+			get_colored_terrain_info().load(json::parse_from_file("data/terrain.cfg"));
+			terrain_loaded = true;
+		}
 
 		normals_.clear();
 		normals_.push_back(glm::vec3(0,0,1));	// front
@@ -362,90 +382,51 @@ namespace voxel{
 
 	void chunk::build()
 	{
-		varray_.clear();
-		vattrib_offsets_.clear();
-		num_vertices_.clear();
+		chunk_mesh mesh;
+		handle_prepare_build()(&mesh);
+		upload_mesh(mesh);
+	}
 
-		varray_.resize(MAX_FACES);
-		vattrib_offsets_.resize(MAX_FACES);
-		num_vertices_.resize(MAX_FACES);
+	void chunk::upload_mesh(const chunk_mesh& mesh)
+	{
+		mesh_vertex_size_ = mesh.vertex_size;
+		std::copy(mesh.face_begin, mesh.face_begin + MAX_FACES + 1, mesh_face_begin_);
 
-		handle_build();
+		glBindBuffer(GL_ARRAY_BUFFER, vbos_[0]);
+		glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size(), mesh.vertices.empty() ? NULL : &mesh.vertices[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
 
-	void chunk::add_vertex_data(int face, GLfloat x, GLfloat y, GLfloat z, GLfloat s, std::vector<GLfloat>& varray)
+	void chunk::build_in_background()
 	{
-		switch(face) {
-		case FRONT_FACE:
-			varray.push_back(x); varray.push_back(y); varray.push_back(z+scale_z());
-			varray.push_back(x+scale_x()); varray.push_back(y); varray.push_back(z+scale_z());
-			varray.push_back(x+scale_x()); varray.push_back(y+scale_y()); varray.push_back(z+scale_z());
-
-			varray.push_back(x+scale_x()); varray.push_back(y+scale_y()); varray.push_back(z+scale_z());
-			varray.push_back(x); varray.push_back(y+scale_y()); varray.push_back(z+scale_z());
-			varray.push_back(x); varray.push_back(y); varray.push_back(z+scale_z());
-			break;
-		case RIGHT_FACE:
-			varray.push_back(x+scale_x()); varray.push_back(y+scale_y()); varray.push_back(z+scale_z());
-			varray.push_back(x+scale_x()); varray.push_back(y); varray.push_back(z+scale_z());
-			varray.push_back(x+scale_x()); varray.push_back(y+scale_y()); varray.push_back(z);
-
-			varray.push_back(x+scale_x()); varray.push_back(y+scale_y()); varray.push_back(z);
-			varray.push_back(x+scale_x()); varray.push_back(y); varray.push_back(z+scale_z());
-			varray.push_back(x+scale_x()); varray.push_back(y); varray.push_back(z);
-			break;
-		case TOP_FACE:
-			varray.push_back(x+scale_x()); varray.push_back(y+scale_y()); varray.push_back(z+scale_z());
-			varray.push_back(x+scale_x()); varray.push_back(y+scale_y()); varray.push_back(z);
-			varray.push_back(x); varray.push_back(y+scale_y()); varray.push_back(z+scale_z());
-
-			varray.push_back(x); varray.push_back(y+scale_y()); varray.push_back(z+scale_z());
-			varray.push_back(x+scale_x()); varray.push_back(y+scale_y()); varray.push_back(z);
-			varray.push_back(x); varray.push_back(y+scale_y()); varray.push_back(z);
-			break;
-		case BACK_FACE:
-			varray.push_back(x+scale_x()); varray.push_back(y); varray.push_back(z);
-			varray.push_back(x); varray.push_back(y); varray.push_back(z);
-			varray.push_back(x); varray.push_back(y+scale_y()); varray.push_back(z);
-
-			varray.push_back(x); varray.push_back(y+scale_y()); varray.push_back(z);
-			varray.push_back(x+scale_x()); varray.push_back(y+scale_y()); varray.push_back(z);
-			varray.push_back(x+scale_x()); varray.push_back(y); varray.push_back(z);
-			break;
-		case LEFT_FACE:
-			varray.push_back(x); varray.push_back(y+scale_y()); varray.push_back(z+scale_z());
-			varray.push_back(x); varray.push_back(y+scale_y()); varray.push_back(z);
-			varray.push_back(x); varray.push_back(y); varray.push_back(z+scale_z());
-
-			varray.push_back(x); varray.push_back(y); varray.push_back(z+scale_z());
-			varray.push_back(x); varray.push_back(y+scale_y()); varray.push_back(z);
-			varray.push_back(x); varray.push_back(y); varray.push_back(z);
-			break;
-		case BOTTOM_FACE:
-			varray.push_back(x+scale_x()); varray.push_back(y); varray.push_back(z+scale_z());
-			varray.push_back(x); varray.push_back(y); varray.push_back(z+scale_z());
-			varray.push_back(x+scale_x()); varray.push_back(y); varray.push_back(z);
-
-			varray.push_back(x+scale_x()); varray.push_back(y); varray.push_back(z);
-			varray.push_back(x); varray.push_back(y); varray.push_back(z+scale_z());
-			varray.push_back(x); varray.push_back(y); varray.push_back(z);
-			break;
-		default: ASSERT_LOG(false, "isomap::add_vertex_data unexpected facing value: " << face);
+		if(!g_isomap_background_remesh) {
+			build();
+			return;
+		}
+
+		if(building_) {
+			build_pending_ = true;
+			return;
 		}
+
+		building_ = true;
+		const mesh_builder builder = handle_prepare_build();
+		const boost::shared_ptr<chunk_mesh> mesh(new chunk_mesh);
+		const chunk_ptr self(this);
+		background_task_pool::submit(
+			[builder, mesh]() { builder(mesh.get()); },
+			[self, mesh]() { self->finish_background_build(*mesh); });
 	}
 
-	void chunk::add_vertex_vbo_data()
+	void chunk::finish_background_build(const chunk_mesh& mesh)
 	{
-		size_t total_size = 0;
-		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
-			vattrib_offsets_[n] = total_size;
-			total_size += varray_[n].size() * sizeof(GLfloat);
-			num_vertices_[n] = varray_[n].size() / 3;
-		}
-		glBindBuffer(GL_ARRAY_BUFFER, vbos_[0]);
-		glBufferData(GL_ARRAY_BUFFER, total_size, NULL, GL_STATIC_DRAW);
-		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
-			glBufferSubData(GL_ARRAY_BUFFER, vattrib_offsets_[n], varray_[n].size()*sizeof(GLfloat), &varray_[n][0]);
+		building_ = false;
+		upload_mesh(mesh);
+
+		// The chunk was edited while this mesh was being built.
+		if(build_pending_) {
+			build_pending_ = false;
+			build_in_background();
 		}
 	}
 
@@ -459,16 +440,80 @@ namespace voxel{
 		return variant(); // -- todo
 	}
 
+	unsigned chunk::palette_index(const variant& type)
+	{
+		if(type.is_null() || (type.is_string() && type.as_string().empty())) {
+			return 0;
+		}
+
+		auto it = palette_ids_.find(type);
+		if(it == palette_ids_.end()) {
+			const bool opaque = handle_add_palette_entry(type);
+			it = palette_ids_.insert(std::make_pair(type, unsigned(palette_.size()))).first;
+			palette_.push_back(type);
+			opaque_.push_back(opaque);
+		}
+		return it->second;
+	}
+
+	void chunk::set_voxel(int x, int y, int z, const variant& type)
+	{
+		voxels_.set(x, y, z, palette_index(type));
+	}
+
+	void chunk::set_voxels(const dense_voxels& voxels, const std::vector<variant>& palette)
+	{
+		assign_voxels(voxels, palette);
+		build_in_background();
+	}
+
+	void chunk::assign_voxels(const dense_voxels& voxels, const std::vector<variant>& palette)
+	{
+		std::vector<unsigned> index(1, 0);
+		bool same = true;
+		foreach(const variant& type, palette) {
+			index.push_back(palette_index(type));
+			same = same && index.back() == index.size() - 1;
+		}
+
+		if(same) {
+			voxels_ = voxels;
+		} else {
+			voxels_ = dense_voxels();
+			if(!voxels.empty()) {
+				voxels_.reserve(voxels.min_x(), voxels.min_y(), voxels.min_z(), voxels.size_x(), voxels.size_y(), voxels.size_z());
+			}
+			for(int z = voxels.min_z(); z != voxels.min_z() + voxels.size_z(); ++z) {
+				for(int y = voxels.min_y(); y != voxels.min_y() + voxels.size_y(); ++y) {
+					for(int x = voxels.min_x(); x != voxels.min_x() + voxels.size_x(); ++x) {
+						voxels_.set(x, y, z, index[voxels.get(x, y, z)]);
+					}
+				}
+			}
+		}
+	}
+
+	void chunk::reserve_voxels(int min_x, int min_y, int min_z, int max_x, int max_y, int max_z)
+	{
+		if(min_x <= max_x && min_y <= max_y && min_z <= max_z) {
+			voxels_.reserve(min_x, min_y, min_z, max_x - min_x + 1, max_y - min_y + 1, max_z - min_z + 1);
+		}
+	}
+
 	void chunk::set_tile(int x, int y, int z, const variant& type)
 	{
-		handle_set_tile(x,y,z,type);
-		build();
+		set_voxel(x, y, z, type);
+		build_in_background();
 	}
 
 	void chunk::del_tile(int x, int y, int z)
 	{
-		handle_del_tile(x,y,z);
-		build();
+		if(voxels_.get(x, y, z) == 0) {
+			std::cerr << "chunk::del_tile(): No tile at " << x << "," << y << "," << z << " to delete" << std::endl;
+			return;
+		}
+		voxels_.set(x, y, z, 0);
+		build_in_background();
 	}
 
 	void chunk::set_size(int mx, int my, int mz)
@@ -483,6 +528,171 @@ namespace voxel{
 		return vec3_to_variant(glm::vec3(obj.size_x_, obj.size_y_, obj.size_z_));
 	END_DEFINE_CALLABLE(chunk)
 
+	void generate_terrain(const terrain_noise& noise, const glm::ivec3& worldspace_position, int size_x, int size_y, int size_z, dense_voxels* voxels)
+	{
+		voxels->reserve(0, 0, 0, size_x, size_y, size_z);
+		for(int x = 0; x != size_x; ++x) {
+			const float nx = float(worldspace_position.x + x)/noise.x_smoothness;
+			for(int z = 0; z != size_z; ++z) {
+				const float nz = float(worldspace_position.z + z)/noise.z_smoothness;
+				const int height = int(glm::simplex(glm::vec2(nx, nz)) * noise.height/2.0f) + 64;
+				const int h = std::min(height - worldspace_position.y, size_y);
+				for(int y = 0; y < h; ++y) {
+					voxels->set(x, y, z, 1);
+				}
+			}
+		}
+	}
+
+	namespace
+	{
+		struct colored_vertex
+		{
+			GLfloat position[3];
+			uint8_t color[4];
+		};
+
+		struct textured_vertex
+		{
+			GLfloat position[3];
+			GLfloat texcoord[2];
+		};
+
+		// Lays out the vertices of each face one after another.
+		template<typename Vertex>
+		void fill_mesh(const std::vector<Vertex>* faces, chunk_mesh* mesh)
+		{
+			mesh->vertex_size = sizeof(Vertex);
+			size_t total = 0;
+			for(int n = 0; n != MESH_NUM_FACES; ++n) {
+				mesh->face_begin[n] = int(total);
+				total += faces[n].size();
+			}
+			mesh->face_begin[MESH_NUM_FACES] = int(total);
+
+			mesh->vertices.resize(total * sizeof(Vertex));
+			for(int n = 0; n != MESH_NUM_FACES; ++n) {
+				if(faces[n].empty() == false) {
+					memcpy(&mesh->vertices[mesh->face_begin[n] * sizeof(Vertex)], &faces[n][0], faces[n].size() * sizeof(Vertex));
+				}
+			}
+		}
+
+		// Colored chunks have always drawn each voxel as a column reaching
+		// down to y = 0, so the space under a voxel is filled in with it
+		// before the mesh is built.
+		void fill_columns(dense_voxels* voxels)
+		{
+			if(voxels->empty()) {
+				return;
+			}
+			if(voxels->min_y() > 0) {
+				voxels->reserve(voxels->min_x(), 0, voxels->min_z(), voxels->size_x(), 1, voxels->size_z());
+			}
+
+			const int top = voxels->min_y() + voxels->size_y() - 1;
+			const int bottom = std::max(0, voxels->min_y());
+			for(int z = voxels->min_z(); z != voxels->min_z() + voxels->size_z(); ++z) {
+				for(int x = voxels->min_x(); x != voxels->min_x() + voxels->size_x(); ++x) {
+					unsigned above = 0;
+					for(int y = top; y >= bottom; --y) {
+						const unsigned index = voxels->get(x, y, z);
+						if(index) {
+							above = index;
+						} else if(above) {
+							voxels->set(x, y, z, above);
+						}
+					}
+				}
+			}
+		}
+
+		void build_colored_mesh(dense_voxels& voxels, const std::vector<bool>& opaque, const std::vector<chunk_colored::face_colors>& colors, const glm::vec3& scale, chunk_mesh* mesh)
+		{
+			fill_columns(&voxels);
+
+			std::vector<voxel_quad> quads;
+			greedy_mesh(voxels, opaque, true, &quads);
+
+			std::vector<colored_vertex> faces[MESH_NUM_FACES];
+			GLfloat varray[18];
+			foreach(const voxel_quad& q, quads) {
+				get_face_vertices(q.face, q.x * scale.x, q.y * scale.y, q.z * scale.z,
+					q.size[0] * scale.x, q.size[1] * scale.y, q.size[2] * scale.z, varray);
+				const uint8_t* color = colors[q.index].rgba[q.face];
+				for(int n = 0; n != 6; ++n) {
+					colored_vertex v;
+					std::copy(varray + n*3, varray + n*3 + 3, v.position);
+					std::copy(color, color + 4, v.color);
+					faces[q.face].push_back(v);
+				}
+			}
+
+			fill_mesh(faces, mesh);
+		}
+
+		// The texture coordinates for the vertices of each face, as the
+		// corners of the area: 0 for x1 or y1, 1 for x2 or y2.
+		const int face_texcoords[MESH_NUM_FACES][12] = {
+			{ 1,1, 0,1, 0,0, 0,0, 1,0, 1,1 },	// front
+			{ 1,0, 1,1, 0,0, 0,0, 1,1, 0,1 },	// right
+			{ 1,1, 1,0, 0,1, 0,1, 1,0, 0,0 },	// top
+			{ 0,1, 1,1, 1,0, 1,0, 0,0, 0,1 },	// back
+			{ 1,0, 0,0, 1,1, 1,1, 0,0, 0,1 },	// left
+			{ 1,1, 0,1, 1,0, 1,0, 0,1, 0,0 },	// bottom
+		};
+
+		// Textured faces aren't merged, since a face's texture comes from
+		// an area of the terrain image and can't be repeated across a
+		// larger quad. Textured chunks are built in unscaled voxel units.
+		void build_textured_mesh(const dense_voxels& voxels, const std::vector<bool>& opaque, const std::vector<chunk_textured::face_areas>& areas, chunk_mesh* mesh)
+		{
+			std::vector<voxel_quad> quads;
+			greedy_mesh(voxels, opaque, false, &quads);
+
+			std::vector<textured_vertex> faces[MESH_NUM_FACES];
+			GLfloat varray[18];
+			foreach(const voxel_quad& q, quads) {
+				get_face_vertices(q.face, GLfloat(q.x), GLfloat(q.y), GLfloat(q.z), 1.0f, 1.0f, 1.0f, varray);
+				const GLfloat* area = areas[q.index].area[q.face];
+				for(int n = 0; n != 6; ++n) {
+					textured_vertex v;
+					std::copy(varray + n*3, varray + n*3 + 3, v.position);
+					v.texcoord[0] = area[face_texcoords[q.face][n*2] ? 2 : 0];
+					v.texcoord[1] = area[face_texcoords[q.face][n*2+1] ? 3 : 1];
+					faces[q.face].push_back(v);
+				}
+			}
+
+			fill_mesh(faces, mesh);
+		}
+
+		variant write_voxels(const dense_voxels& voxels, const std::vector<variant>& palette)
+		{
+			std::map<variant,variant> vox;
+			for(int z = voxels.min_z(); z != voxels.min_z() + voxels.size_z(); ++z) {
+				for(int y = voxels.min_y(); y != voxels.min_y() + voxels.size_y(); ++y) {
+					for(int x = voxels.min_x(); x != voxels.min_x() + voxels.size_x(); ++x) {
+						const unsigned index = voxels.get(x, y, z);
+						if(index) {
+							std::vector<variant> v;
+							v.push_back(variant(x));
+							v.push_back(variant(y));
+							v.push_back(variant(z));
+							vox[variant(&v)] = palette[index];
+						}
+					}
+				}
+			}
+
+			variant_builder res;
+			std::string s = variant(&vox).write_json();
+			std::vector<char> enc_and_comp(base64::b64encode(zip::compress(std::vector<char>(s.begin(), s.end()))));
+			res.add("voxels", std::string(enc_and_comp.begin(), enc_and_comp.end()));
+			return res.build();
+		}
+	}
+
 
 	///////////////////////////////////////////////////////////////
 	// Colored chunk functions
@@ -507,6 +717,9 @@ namespace voxel{
 		a_color_ = shader->get_fixed_attribute("color");
 		ASSERT_LOG(a_color_ != -1, "chunk_colored: color == -1");	
 		
+		// Palette index 0 is an empty voxel.
+		colors_.resize(1);
+
 		if(node.has_key("random")) {
 			// Load in some random data.
 			int size_x = node["random"]["width"].as_int(32);
@@ -528,38 +741,15 @@ namespace voxel{
 				color = graphics::color(dist(rng), dist(rng), dist(rng), 255);
 			}
 
-			float x_smooth = node["random"]["x_smoothness"].as_decimal(decimal(128.0)).as_float();
-			float z_smooth = node["random"]["z_smoothness"].as_decimal(decimal(128.0)).as_float();
+			terrain_noise noise;
+			noise.height = noise_height;
+			noise.x_smoothness = node["random"]["x_smoothness"].as_decimal(decimal(128.0)).as_float();
+			noise.z_smoothness = node["random"]["z_smoothness"].as_decimal(decimal(128.0)).as_float();
 
-			//profile::manager pmain("loop");
-			float vec[2];
-			std::vector<std::vector<int> > heightmap;
-			heightmap.resize(size_x);
-			for(int x = 0; x != size_x; ++x) {
-				heightmap[x].resize(size_z);
-				vec[0] = float(worldspace_position().x+x)/x_smooth;
-				for(int z = 0; z != size_z; ++z) {
-					vec[1] = float(+worldspace_position().z+z)/z_smooth;
-					heightmap[x][z] = int(glm::simplex(glm::vec2(vec[0], vec[1])) * noise_height/2.0f) + 64;
-				}
-			}
-
-			for(int x = 0; x != size_x; ++x) {
-				for(int z = 0; z != size_z; ++z) {
-					if(heightmap[x][z] < int(worldspace_position().y)) {
-						continue;
-					}
-					int h = heightmap[x][z] - int(worldspace_position().y);
-					if(heightmap[x][z] >= int(worldspace_position().y) + size_y) {
-						h = size_y;
-					} 
-					for(int y = 0; y < h; ++y) {
-						tiles_[position(x,y,z)] = color.write();
-					}
-				}
-			}
-		} else {
-			ASSERT_LOG(node.has_key("voxels"), "'voxels' attribute must exist.");
+			dense_voxels voxels;
+			generate_terrain(noise, glm::ivec3(worldspace_position()), size_x, size_y, size_z, &voxels);
+			assign_voxels(voxels, std::vector<variant>(1, color.write()));
+		} else if(node.has_key("voxels")) {
 			ASSERT_LOG(node["voxels"].is_map(), "'voxels' must be a map.");
 
 			const variant& voxels = node["voxels"];
@@ -580,23 +770,16 @@ namespace voxel{
 				if(max_y < y) { max_y = y; }
 				if(min_z > z) { min_z = z; }
 				if(max_z < z) { max_z = z; }
+			}
 
-				tiles_[position(x,y,z)] = voxels[voxel_keys[n]];
-				/*for(int i = 0; i != scale_x(); ++i) {
-					for(int j = 0; j != scale_y(); ++j) {
-						for(int k = 0; k != scale_z(); ++k) {
-							tiles_[position(x+i,y+j,z+k)] = voxels[voxel_keys[n]];
-							if(min_x > x+i) { min_x = x+i; }
-							if(max_x < x+i) { max_x = x+i; }
-							if(min_y > y+j) { min_y = y+j; }
-							if(max_y < y+j) { max_y = y+j; }
-							if(min_z > z+k) { min_z = z+k; }
-							if(max_z < z+k) { max_z = z+k; }
-						}
-					}
-				}*/
+			reserve_voxels(min_x, min_y, min_z, max_x, max_y, max_z);
+			for(int n = 0; n != voxel_keys.num_elements(); ++n) {
+				set_voxel(voxel_keys[n][0].as_int(), voxel_keys[n][1].as_int(), voxel_keys[n][2].as_int(), voxels[voxel_keys[n]]);
 			}
 			set_size(max_x - min_x + 1, max_y - min_y + 1, max_z - min_z + 1);
+		} else {
+			// The voxels are given later, as for chunks of streamed worlds.
+			set_size(0, 0, 0);
 		}
 
 		build();
@@ -609,6 +792,9 @@ namespace voxel{
 		u_texture_ = shader->get_fixed_uniform("texture");
 		ASSERT_LOG(u_texture_ != -1, "chunk_colored: texture == -1");	
 		
+		// Palette index 0 is an empty voxel.
+		areas_.resize(1);
+
 		if(node.has_key("random")) {
 			// Load in some random data.
 			int size_x = node["random"]["width"].as_int(32);
@@ -623,6 +809,7 @@ namespace voxel{
 			boost::random::uniform_int_distribution<> dist(0,255);
 			graphics::color random_color(dist(rng), dist(rng), dist(rng), 255);
 
+			reserve_voxels(0, 0, 0, size_x-1, size_y-1, size_z-1);
 			std::vector<float> vec;
 			vec.resize(2);
 			for(int x = 0; x != size_x; ++x) {
@@ -633,9 +820,9 @@ namespace voxel{
 					h = std::max<int>(1, std::min<int>(size_y-1, h));
 					for(int y = 0; y != h; ++y) {
 						if(node["random"].has_key("type")) {
-								tiles_[position(x,y,z)] = node["random"]["type"].as_string();
+								set_voxel(x, y, z, node["random"]["type"]);
 						} else {
-								tiles_[position(x,y,z)] = get_textured_terrain_info().random()->first;
+								set_voxel(x, y, z, variant(get_textured_terrain_info().random()->first));
 						}
 					}
 				}
@@ -674,399 +861,79 @@ namespace voxel{
 				if(max_y < y) { max_y = y; }
 				if(min_z > z) { min_z = z; }
 				if(max_z < z) { max_z = z; }
-				tiles_[position(x,y,z)] = voxels[voxel_keys[n]].as_string();
+			}
+
+			reserve_voxels(min_x, min_y, min_z, max_x, max_y, max_z);
+			for(int n = 0; n != voxel_keys.num_elements(); ++n) {
+				set_voxel(voxel_keys[n][0].as_int(), voxel_keys[n][1].as_int(), voxel_keys[n][2].as_int(), variant(voxels[voxel_keys[n]].as_string()));
 			}
 			set_size(max_x - min_x + 1, max_y - min_y + 1, max_z - min_z + 1);
 		}
 
-		ASSERT_LOG(tiles_.empty() == false, "ISOMAP: No tiles found");
+		ASSERT_LOG(voxels().empty() == false, "ISOMAP: No tiles found");
 
 		build();
 	}
 	
-	void chunk_colored::handle_build()
+	chunk::mesh_builder chunk_colored::handle_prepare_build() const
 	{
-		//profile::manager pman("chunk_colored::handle_build");
-
-		carray_.clear();
-		carray_.resize(MAX_FACES);
-		cattrib_offsets_.clear();
-		cattrib_offsets_.resize(MAX_FACES);
-
-		for(auto& t : tiles_) {
-			int x = t.first.x;
-			int y = t.first.y;
-			int z = t.first.z;
-			GLfloat xf = GLfloat(x * scale_x());
-			GLfloat zf = GLfloat(z * scale_z());
-			GLfloat sx = GLfloat(scale_x());
-			GLfloat sy = GLfloat(scale_y());
-			GLfloat sz = GLfloat(scale_z());
-
-			for(int h = 0; h <= y; ++h) {
-				GLfloat yf = GLfloat(h * scale_y());
-				if(x > 0) {
-					if(is_solid(x-1, h, z) == false) {
-						add_face_left(xf,yf,zf,sx,t.second);
-					}
-				} else {
-					add_face_left(xf,yf,zf,sx,t.second);
-				}
-				if(x < size_x() - 1) {
-					if(is_solid(x+1, h, z) == false) {
-						add_face_right(xf,yf,zf,sx,t.second);
-					}
-				} else {
-					add_face_right(xf,yf,zf,sx,t.second);
-				}
-				if(y > 0) {
-					if(is_solid(x, h-1, z) == false) {
-						add_face_bottom(xf,yf,zf,sy,t.second);
-					}
-				} else {
-					add_face_bottom(xf,yf,zf,sy,t.second);
-				}
-				if(y < size_y() - 1) {
-					if(is_solid(x, h+1, z) == false) {
-						add_face_top(xf,yf,zf,sy,t.second);
-					}
-				} else {
-					add_face_top(xf,yf,zf,sy,t.second);
-				}
-				if(z > 0) {
-					if(is_solid(x, h, z-1) == false) {
-						add_face_back(xf,yf,zf,sz,t.second);
-					}
-				} else {
-					add_face_back(xf,yf,zf,sz,t.second);
-				}
-				if(z < size_z() - 1) {
-					if(is_solid(x, h, z+1) == false) {
-						add_face_front(xf,yf,zf,sz,t.second);
-					}
-				} else {
-					add_face_front(xf,yf,zf,sz,t.second);
-				}
-			}
-		}
-		
-		add_vertex_vbo_data();
-
-		size_t total_size = 0;
-		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
-			cattrib_offsets_[n] = total_size;
-			total_size += carray_[n].size() * sizeof(uint8_t);
-		}
-		glBindBuffer(GL_ARRAY_BUFFER, vbo()[1]);
-		glBufferData(GL_ARRAY_BUFFER, total_size, NULL, GL_STATIC_DRAW);
-		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
-			glBufferSubData(GL_ARRAY_BUFFER, cattrib_offsets_[n], carray_[n].size()*sizeof(uint8_t), &carray_[n][0]);
-		}
-		clear_vertex_data();
-		carray_.clear();
-
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-	}
-
-	void chunk_textured::handle_build()
-	{
-		//profile::manager pman("chunk_textured::handle_build");
-
-		tarray_.clear();
-		tarray_.resize(MAX_FACES);
-		tattrib_offsets_.clear();
-		tattrib_offsets_.resize(MAX_FACES);
-
-		for(auto& t : tiles_) {
-			int x = t.first.x;
-			int y = t.first.y;
-			int z = t.first.z;
-			GLfloat xf = GLfloat(x);
-			GLfloat yf = GLfloat(y);
-			GLfloat zf = GLfloat(z);
-
-			if(x > 0) {
-				if(is_solid(x-1, y, z) == false) {
-					add_face_left(xf,yf,zf,1,t.second);
-				}
-			} else {
-				add_face_left(xf,yf,zf,1,t.second);
-			}
-			if(x < size_x() - 1) {
-				if(is_solid(x+1, y, z) == false) {
-					add_face_right(xf,yf,zf,1,t.second);
-				}
-			} else {
-				add_face_right(xf,yf,zf,1,t.second);
-			}
-			if(y > 0) {
-				if(is_solid(x, y-1, z) == false) {
-					add_face_bottom(xf,yf,zf,1,t.second);
-				}
-			} else {
-				add_face_bottom(xf,yf,zf,1,t.second);
-			}
-			if(y < size_y() - 1) {
-				if(is_solid(x, y+1, z) == false) {
-					add_face_top(xf,yf,zf,1,t.second);
-				}
-			} else {
-				add_face_top(xf,yf,zf,1,t.second);
-			}
-			if(z > 0) {
-				if(is_solid(x, y, z-1) == false) {
-					add_face_back(xf,yf,zf,1,t.second);
-				}
-			} else {
-				add_face_back(xf,yf,zf,1,t.second);
-			}
-			if(z < size_z() - 1) {
-				if(is_solid(x, y, z+1) == false) {
-					add_face_front(xf,yf,zf,1,t.second);
-				}
-			} else {
-				add_face_front(xf,yf,zf,1,t.second);
-			}
-		}
-		
-		add_vertex_vbo_data();
-
-		size_t total_size = 0;
-		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
-			tattrib_offsets_[n] = total_size;
-			total_size += tarray_[n].size() * sizeof(GLfloat);
-		}
-		glBindBuffer(GL_ARRAY_BUFFER, vbo()[1]);
-		glBufferData(GL_ARRAY_BUFFER, total_size, NULL, GL_STATIC_DRAW);
-		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
-			glBufferSubData(GL_ARRAY_BUFFER, tattrib_offsets_[n], tarray_[n].size()*sizeof(GLfloat), &tarray_[n][0]);
-		}
-		clear_vertex_data();
-		tarray_.clear();
-
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		const glm::vec3 scale = glm::vec3(scale_x(), scale_y(), scale_z());
+		return boost::bind(build_colored_mesh, voxels(), opaque(), colors_, scale, _1);
 	}
 
-	void chunk_colored::add_carray_data(int face, const graphics::color& color, std::vector<uint8_t>& carray)
+	chunk::mesh_builder chunk_textured::handle_prepare_build() const
 	{
-		for(int n = 0; n != 6; ++n) {
-			carray.push_back(color.r());
-			carray.push_back(color.g());
-			carray.push_back(color.b());
-			carray.push_back(color.a());
-		}
+		return boost::bind(build_textured_mesh, voxels(), opaque(), areas_, _1);
 	}
 
-	void chunk_textured::add_tarray_data(int face, const rectf& area, std::vector<GLfloat>& tarray)
+	bool chunk_colored::handle_add_palette_entry(const variant& type)
 	{
-		switch(face) {
-		case FRONT_FACE:
-			tarray.push_back(area.x2f()); tarray.push_back(area.y2f()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.y2f()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.yf()); 
-
-			tarray.push_back(area.xf());  tarray.push_back(area.yf()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.yf()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.y2f()); 
-			break;
-		case RIGHT_FACE:
-			tarray.push_back(area.x2f()); tarray.push_back(area.yf()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.y2f()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.yf()); 
-		
-			tarray.push_back(area.xf());  tarray.push_back(area.yf()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.y2f()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.y2f()); 
-			break;
-		case TOP_FACE:
-			tarray.push_back(area.x2f()); tarray.push_back(area.y2f()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.yf()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.y2f()); 
-		
-			tarray.push_back(area.xf());  tarray.push_back(area.y2f()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.yf()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.yf()); 
-			break;
-		case BACK_FACE:
-			tarray.push_back(area.xf());  tarray.push_back(area.y2f()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.y2f()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.yf()); 
-		
-			tarray.push_back(area.x2f()); tarray.push_back(area.yf()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.yf()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.y2f()); 
-			break;
-		case LEFT_FACE:
-			tarray.push_back(area.x2f()); tarray.push_back(area.yf()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.yf()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.y2f()); 
-		
-			tarray.push_back(area.x2f()); tarray.push_back(area.y2f()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.yf()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.y2f()); 
-			break;
-		case BOTTOM_FACE:
-			tarray.push_back(area.x2f()); tarray.push_back(area.y2f()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.y2f()); 
-			tarray.push_back(area.x2f()); tarray.push_back(area.yf()); 
-		
-			tarray.push_back(area.x2f()); tarray.push_back(area.yf()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.y2f()); 
-			tarray.push_back(area.xf());  tarray.push_back(area.yf()); 
-			break;
-		default: ASSERT_LOG(false, "isomap::add_vertex_data unexpected facing value: " << face);
-		}
-	}
-
-	void chunk_colored::add_face_left(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const variant& col)
-	{
-		add_vertex_data(LEFT_FACE, x, y, z, s, get_vertex_data()[LEFT_FACE]);
-		if(col.is_string()) {
-			auto it = get_colored_terrain_info().find(col.as_string());
-			if(it != get_colored_terrain_info().end()) {
-				const graphics::color color = it->second.faces & LEFT ? it->second.color[4] : it->second.color[0];
-				add_carray_data(LEFT_FACE, color, carray_[LEFT_FACE]);
-				return;
-			}
-		}
-		add_carray_data(LEFT_FACE, graphics::color(col), carray_[LEFT_FACE]);
-	}
-
-	void chunk_colored::add_face_right(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const variant& col)
-	{
-		add_vertex_data(RIGHT_FACE, x, y, z, s, get_vertex_data()[RIGHT_FACE]);
-		if(col.is_string()) {
-			auto it = get_colored_terrain_info().find(col.as_string());
+		face_colors colors;
+		if(type.is_string()) {
+			auto it = get_colored_terrain_info().find(type.as_string());
 			if(it != get_colored_terrain_info().end()) {
-				const graphics::color color = it->second.faces & RIGHT ? it->second.color[1] : it->second.color[0];
-				add_carray_data(RIGHT_FACE, color, carray_[RIGHT_FACE]);
-				return;
-			}
-		}
-		add_carray_data(RIGHT_FACE, graphics::color(col), carray_[RIGHT_FACE]);
-	}
-
-	void chunk_colored::add_face_front(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const variant& col)
-	{
-		add_vertex_data(FRONT_FACE, x, y, z, s, get_vertex_data()[FRONT_FACE]);
-		if(col.is_string()) {
-			auto it = get_colored_terrain_info().find(col.as_string());
-			if(it != get_colored_terrain_info().end()) {
-				const graphics::color color = it->second.color[0];
-				add_carray_data(FRONT_FACE, color, carray_[FRONT_FACE]);
-				return;
+				for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
+					const graphics::color& color = n == FRONT_FACE || (it->second.faces & (1 << n)) ? it->second.color[n] : it->second.color[0];
+					colors.rgba[n][0] = color.r();
+					colors.rgba[n][1] = color.g();
+					colors.rgba[n][2] = color.b();
+					colors.rgba[n][3] = color.a();
+				}
+				colors_.push_back(colors);
+				return it->second.color[0].a() == 255;
 			}
 		}
-		add_carray_data(FRONT_FACE, graphics::color(col), carray_[FRONT_FACE]);
-	}
 
-	void chunk_colored::add_face_back(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const variant& col)
-	{
-		add_vertex_data(BACK_FACE, x, y, z, s, get_vertex_data()[BACK_FACE]);
-		if(col.is_string()) {
-			auto it = get_colored_terrain_info().find(col.as_string());
-			if(it != get_colored_terrain_info().end()) {
-				const graphics::color color = it->second.faces & BACK ? it->second.color[3] : it->second.color[0];
-				add_carray_data(BACK_FACE, color, carray_[BACK_FACE]);
-				return;
-			}
+		const graphics::color color(type);
+		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
+			colors.rgba[n][0] = color.r();
+			colors.rgba[n][1] = color.g();
+			colors.rgba[n][2] = color.b();
+			colors.rgba[n][3] = color.a();
 		}
-		add_carray_data(BACK_FACE, graphics::color(col), carray_[BACK_FACE]);
+		colors_.push_back(colors);
+		return color.a() == 255;
 	}
 
-	void chunk_colored::add_face_top(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const variant& col)
+	bool chunk_textured::handle_add_palette_entry(const variant& type)
 	{
-		add_vertex_data(TOP_FACE, x, y, z, s, get_vertex_data()[TOP_FACE]);
-		if(col.is_string()) {
-			auto it = get_colored_terrain_info().find(col.as_string());
-			if(it != get_colored_terrain_info().end()) {
-				const graphics::color color = it->second.faces & TOP ? it->second.color[2] : it->second.color[0];
-				add_carray_data(TOP_FACE, color, carray_[TOP_FACE]);
-				return;
-			}
-		}
-		add_carray_data(TOP_FACE, graphics::color(col), carray_[TOP_FACE]);
-	}
+		auto it = get_textured_terrain_info().find(type.as_string());
+		ASSERT_LOG(it != get_textured_terrain_info().end(), "chunk_textured: Unable to find tile type in list: " << type.as_string());
 
-	void chunk_colored::add_face_bottom(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const variant& col)
-	{
-		add_vertex_data(BOTTOM_FACE, x, y, z, s, get_vertex_data()[BOTTOM_FACE]);
-		if(col.is_string()) {
-			auto it = get_colored_terrain_info().find(col.as_string());
-			if(it != get_colored_terrain_info().end()) {
-				const graphics::color color = it->second.faces & BOTTOM ? it->second.color[5] : it->second.color[0];
-				add_carray_data(BOTTOM_FACE, color, carray_[BOTTOM_FACE]);
-				return;
-			}
+		face_areas areas;
+		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
+			const rectf& area = n == FRONT_FACE || (it->second.faces & (1 << n)) ? it->second.area[n] : it->second.area[0];
+			areas.area[n][0] = area.xf();
+			areas.area[n][1] = area.yf();
+			areas.area[n][2] = area.x2f();
+			areas.area[n][3] = area.y2f();
 		}
-		add_carray_data(BOTTOM_FACE, graphics::color(col), carray_[BOTTOM_FACE]);
-	}
-
-	void chunk_textured::add_face_left(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const std::string& bid)
-	{
-		add_vertex_data(LEFT_FACE, x, y, z, s, get_vertex_data()[LEFT_FACE]);
-
-		auto it = get_textured_terrain_info().find(bid);
-		ASSERT_LOG(it != get_textured_terrain_info().end(), "add_face_left: Unable to find tile type in list: " << bid);
-		const rectf area = it->second.faces & LEFT ? it->second.area[4] : it->second.area[0];
-		add_tarray_data(LEFT_FACE, area, tarray_[LEFT_FACE]);
-	}
-
-	void chunk_textured::add_face_right(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const std::string& bid)
-	{
-		add_vertex_data(RIGHT_FACE, x, y, z, s, get_vertex_data()[RIGHT_FACE]);
-
-		auto it = get_textured_terrain_info().find(bid);
-		ASSERT_LOG(it != get_textured_terrain_info().end(), "add_face_right: Unable to find tile type in list: " << bid);
-		const rectf area = it->second.faces & RIGHT ? it->second.area[1] : it->second.area[0];
-		add_tarray_data(RIGHT_FACE, area, tarray_[RIGHT_FACE]);
-	}
-
-	void chunk_textured::add_face_front(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const std::string& bid)
-	{
-		add_vertex_data(FRONT_FACE, x, y, z, s, get_vertex_data()[FRONT_FACE]);
-
-		auto it = get_textured_terrain_info().find(bid);
-		ASSERT_LOG(it != get_textured_terrain_info().end(), "add_face_front: Unable to find tile type in list: " << bid);
-		const rectf area = it->second.area[0];
-		add_tarray_data(FRONT_FACE, area, tarray_[FRONT_FACE]);
-	}
-
-	void chunk_textured::add_face_back(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const std::string& bid)
-	{
-		add_vertex_data(BACK_FACE, x, y, z, s, get_vertex_data()[BACK_FACE]);
-
-		auto it = get_textured_terrain_info().find(bid);
-		ASSERT_LOG(it != get_textured_terrain_info().end(), "add_face_back: Unable to find tile type in list: " << bid);
-		const rectf area = it->second.faces & BACK ? it->second.area[3] : it->second.area[0];
-		add_tarray_data(BACK_FACE, area, tarray_[BACK_FACE]);
-	}
-
-	void chunk_textured::add_face_top(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const std::string& bid)
-	{
-		add_vertex_data(TOP_FACE, x, y, z, s, get_vertex_data()[TOP_FACE]);
-
-		auto it = get_textured_terrain_info().find(bid);
-		ASSERT_LOG(it != get_textured_terrain_info().end(), "add_face_top: Unable to find tile type in list: " << bid);
-		const rectf area = it->second.faces & TOP ? it->second.area[2] : it->second.area[0];
-		add_tarray_data(TOP_FACE, area, tarray_[TOP_FACE]);
-	}
-
-	void chunk_textured::add_face_bottom(GLfloat x, GLfloat y, GLfloat z, GLfloat s, const std::string& bid)
-	{
-		add_vertex_data(BOTTOM_FACE, x, y, z, s, get_vertex_data()[BOTTOM_FACE]);
-
-		auto it = get_textured_terrain_info().find(bid);
-		ASSERT_LOG(it != get_textured_terrain_info().end(), "add_face_bottom: Unable to find tile type in list: " << bid);
-		const rectf area = it->second.faces & BOTTOM ? it->second.area[5] : it->second.area[0];
-		add_tarray_data(BOTTOM_FACE, area, tarray_[BOTTOM_FACE]);
+		areas_.push_back(areas);
+		return !it->second.transparent;
 	}
 
 	void chunk_colored::handle_draw(const graphics::lighting_ptr lighting, const camera_callable_ptr& camera) const
 	{
-		ASSERT_LOG(get_vertex_attribute_offsets().size() != 0, "get_vertex_attribute_offsets().size() == 0");
-		ASSERT_LOG(cattrib_offsets_.size() != 0, "cattrib_offsets_.size() == 0");
-
 		glm::mat4 model = /*glm::scale(glm::mat4(1.0f), glm::vec3(1.0f/float(scale_x()), 1.0f/float(scale_y()), 1.0f/float(scale_z())))
 			* */glm::translate(glm::mat4(1.0f), worldspace_position());
 		glm::mat4 mvp = camera->projection_mat() * camera->view_mat() * model;
@@ -1078,16 +945,15 @@ namespace voxel{
 
 		glEnableVertexAttribArray(position_uniform());
 		glEnableVertexAttribArray(a_color_);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo()[0]);
+		glVertexAttribPointer(position_uniform(), 3, GL_FLOAT, GL_FALSE, vertex_size(), reinterpret_cast<const GLvoid*>(offsetof(colored_vertex, position)));
+		glVertexAttribPointer(a_color_, 4, GL_UNSIGNED_BYTE, GL_TRUE, vertex_size(), reinterpret_cast<const GLvoid*>(offsetof(colored_vertex, color)));
 		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
-			if(debug_draw_faces & (1 << n)) {
+			if((debug_draw_faces & (1 << n)) && face_count(n) != 0) {
 				if(normal_uniform() != -1) {
 					glUniform3fv(normal_uniform(), 1, glm::value_ptr(normals()[n]));
 				}
-				glBindBuffer(GL_ARRAY_BUFFER, vbo()[0]);
-				glVertexAttribPointer(position_uniform(), 3, GL_FLOAT, GL_FALSE, 0, reinterpret_cast<const GLfloat*>(get_vertex_attribute_offsets()[n]));
-				glBindBuffer(GL_ARRAY_BUFFER, vbo()[1]);
-				glVertexAttribPointer(a_color_, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, reinterpret_cast<const GLfloat*>(cattrib_offsets_[n]));
-				glDrawArrays(GL_TRIANGLES, 0, get_num_vertices()[n]);
+				glDrawArrays(GL_TRIANGLES, face_begin(n), face_count(n));
 			}
 		}
 		glDisableVertexAttribArray(position_uniform());
@@ -1097,9 +963,6 @@ namespace voxel{
 
 	void chunk_textured::handle_draw(const graphics::lighting_ptr lighting, const camera_callable_ptr& camera) const
 	{
-		ASSERT_LOG(get_vertex_attribute_offsets().size() != 0, "get_vertex_attribute_offsets().size() == 0");
-		ASSERT_LOG(tattrib_offsets_.size() != 0, "tattrib_offsets_.size() == 0");
-
 		glActiveTexture(GL_TEXTURE0);
 		get_textured_terrain_info().get_tex().set_as_current_texture();
 		glUniform1i(u_texture_, 0);
@@ -1114,16 +977,15 @@ namespace voxel{
 
 		glEnableVertexAttribArray(position_uniform());
 		glEnableVertexAttribArray(a_texcoord_);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo()[0]);
+		glVertexAttribPointer(position_uniform(), 3, GL_FLOAT, GL_FALSE, vertex_size(), reinterpret_cast<const GLvoid*>(offsetof(textured_vertex, position)));
+		glVertexAttribPointer(a_texcoord_, 2, GL_FLOAT, GL_FALSE, vertex_size(), reinterpret_cast<const GLvoid*>(offsetof(textured_vertex, texcoord)));
 		for(int n = FRONT_FACE; n != MAX_FACES; ++n) {
-			if(debug_draw_faces & (1 << n)) {
+			if((debug_draw_faces & (1 << n)) && face_count(n) != 0) {
 				if(normal_uniform() != -1) {
 					glUniform3fv(normal_uniform(), 1, glm::value_ptr(normals()[n]));
 				}
-				glBindBuffer(GL_ARRAY_BUFFER, vbo()[0]);
-				glVertexAttribPointer(position_uniform(), 3, GL_FLOAT, GL_FALSE, 0, reinterpret_cast<const GLfloat*>(get_vertex_attribute_offsets()[n]));
-				glBindBuffer(GL_ARRAY_BUFFER, vbo()[1]);
-				glVertexAttribPointer(a_texcoord_, 2, GL_FLOAT, GL_FALSE, 0, reinterpret_cast<const GLfloat*>(tattrib_offsets_[n]));
-				glDrawArrays(GL_TRIANGLES, 0, get_num_vertices()[n]);
+				glDrawArrays(GL_TRIANGLES, face_begin(n), face_count(n));
 			}
 		}
 		glDisableVertexAttribArray(position_uniform());
@@ -1131,114 +993,14 @@ namespace voxel{
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
 
-	variant chunk_textured::get_tile_type(int x, int y, int z) const
-	{
-		auto it = tiles_.find(position(x, y, z));
-		if(it == tiles_.end()) {
-			return variant();
-		}
-		return variant(it->second);
-	}
-
-	variant chunk_colored::get_tile_type(int x, int y, int z) const
-	{
-		auto it = tiles_.find(position(x, y, z));
-		if(it == tiles_.end()) {
-			return variant();
-		}
-		return it->second;
-	}
-
-	void chunk_colored::handle_set_tile(int x, int y, int z, const variant& type)
-	{
-		tiles_[position(x,y,z)] = type;
-	}
-
-	void chunk_colored::handle_del_tile(int x, int y, int z)
-	{
-		auto it = tiles_.find(position(x,y,z));
-		if(it == tiles_.end()) {
-			std::cerr << "chunk_colored::handle_del_tile(): No tile at " << x << "," << y << "," << z << " to delete" << std::endl;
-		} else {
-			tiles_.erase(it);
-		}
-	}
-
-	void chunk_textured::handle_set_tile(int x, int y, int z, const variant& type)
-	{
-		tiles_[position(x,y,z)] = type.as_string();
-	}
-
-	void chunk_textured::handle_del_tile(int x, int y, int z)
-	{
-		auto it = tiles_.find(position(x,y,z));
-		if(it == tiles_.end()) {
-			std::cerr << "chunk_textured::handle_del_tile(): No tile at " << x << "," << y << "," << z << " to delete" << std::endl;
-		} else {
-			tiles_.erase(it);
-		}
-	}
-
-	bool chunk_textured::is_solid(int x, int y, int z) const
-	{
-		auto it = tiles_.find(position(x,y,z));
-		if(it != tiles_.end()) {
-			if(it->second.empty() == false) {
-				auto ti = get_textured_terrain_info().find(it->second);
-				ASSERT_LOG(ti != get_textured_terrain_info().end(), "is_solid: Terrain not found: " << it->second);
-				return !ti->second.transparent;
-			}
-		}
-		return false;
-	}
-
-	bool chunk_colored::is_solid(int x, int y, int z) const
-	{
-		auto it = tiles_.find(position(x,y,z));
-		if(it != tiles_.end()) {
-			if(it->second.is_string()) {
-				auto ti = get_colored_terrain_info().find(it->second.as_string());
-				if(ti != get_colored_terrain_info().end()) {
-					return ti->second.color[0].a() == 255;
-				}
-			}
-			return graphics::color(it->second).a() == 255;
-		}
-		return false;
-	}
-
 	variant chunk_colored::handle_write()
 	{
-		variant_builder res;
-		std::map<variant,variant> vox;
-		for(auto t : tiles_) {
-			std::vector<variant> v;
-			v.push_back(variant(t.first.x));
-			v.push_back(variant(t.first.y));
-			v.push_back(variant(t.first.z));
-			vox[variant(&v)] = t.second;
-		}
-		std::string s = variant(&vox).write_json();
-		std::vector<char> enc_and_comp(base64::b64encode(zip::compress(std::vector<char>(s.begin(), s.end()))));
-		res.add("voxels", std::string(enc_and_comp.begin(), enc_and_comp.end()));
-		return res.build();
+		return write_voxels(voxels(), palette());
 	}
 	
 	variant chunk_textured::handle_write()
 	{
-		variant_builder res;
-		std::map<variant,variant> vox;
-		for(auto t : tiles_) {
-			std::vector<variant> v;
-			v.push_back(variant(t.first.x));
-			v.push_back(variant(t.first.y));
-			v.push_back(variant(t.first.z));
-			vox[variant(&v)] = variant(t.second);
-		}
-		std::string s = variant(&vox).write_json();
-		std::vector<char> enc_and_comp(base64::b64encode(zip::compress(std::vector<char>(s.begin(), s.end()))));
-		res.add("voxels", std::string(enc_and_comp.begin(), enc_and_comp.end()));
-		return res.build();
+		return write_voxels(voxels(), palette());
 	}
 	
 	namespace chunk_factory 
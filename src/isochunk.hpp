@@ -5,8 +5,11 @@
 #error in order to build with Iso tiles you need to be building with shaders (USE_SHADERS)
 #endif
 
+#include <boost/function.hpp>
 #include <boost/intrusive_ptr.hpp>
 #include <boost/unordered_map.hpp>
+#include <algorithm>
+#include <map>
 #include <vector>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -20,6 +23,7 @@
 #include "raster.hpp"
 #include "shaders.hpp"
 #include "variant.hpp"
+#include "voxel_mesher.hpp"
 
 namespace voxel
 {
@@ -51,6 +55,38 @@ namespace voxel
 	class logical_world;
 	typedef boost::intrusive_ptr<logical_world> logical_world_ptr;
 
+	//the rolling hills colored chunks with 'random' settings, and streamed
+	//worlds, are made of.
+	struct terrain_noise
+	{
+		int height;
+		float x_smoothness, z_smoothness;
+	};
+
+	//fills voxels, in the chunk's own coordinates, with palette index 1
+	//where the terrain is solid in the chunk at worldspace_position. It
+	//only uses its arguments, so it can be run on worker threads.
+	void generate_terrain(const terrain_noise& noise, const glm::ivec3& worldspace_position, int size_x, int size_y, int size_z, dense_voxels* voxels);
+
+	//the vertices of a chunk, to be drawn as triangles. Each vertex is
+	//vertex_size bytes, and the vertices of each face come one after
+	//another, starting at face_begin[face].
+	struct chunk_mesh
+	{
+		chunk_mesh() : vertex_size(0) {
+			std::fill(face_begin, face_begin + MESH_NUM_FACES + 1, 0);
+		}
+
+		std::vector<uint8_t> vertices;
+		int vertex_size;
+		int face_begin[MESH_NUM_FACES + 1];
+	};
+
+	//The voxels of a chunk are kept as palette indices in a dense_voxels
+	//box, with the tile type each index stands for in the chunk's palette.
+	//Meshes are built by greedy_mesh() into one interleaved buffer. After
+	//the chunk is edited the mesh is rebuilt on a worker thread, from a
+	//copy of the voxels, and swapped in when it's done.
 	class chunk : public game_logic::formula_callable
 	{
 	public:
@@ -72,13 +108,20 @@ namespace voxel
 		void draw(const graphics::lighting_ptr lighting, const camera_callable_ptr& camera) const;
 		variant write();
 
-		virtual bool is_solid(int x, int y, int z) const = 0;
-		virtual variant get_tile_type(int x, int y, int z) const = 0;
+		bool is_solid(int x, int y, int z) const { return opaque_[voxels_.get(x, y, z)]; }
+		variant get_tile_type(int x, int y, int z) const { return palette_[voxels_.get(x, y, z)]; }
 		static variant get_tile_info(const std::string& type);
 
 		void set_tile(int x, int y, int z, const variant& type);
 		void del_tile(int x, int y, int z);
 
+		//replaces all the voxels, where palette gives the tile type of each
+		//index from 1 up, and rebuilds the mesh in the background.
+		void set_voxels(const dense_voxels& voxels, const std::vector<variant>& palette);
+
+		const dense_voxels& voxels() const { return voxels_; }
+		const std::vector<variant>& palette() const { return palette_; }
+
 		bool textured() const { return textured_; }
 		int size_x() const { return size_x_; }
 		int size_y() const { return size_y_; }
@@ -93,28 +136,39 @@ namespace voxel
 		static const std::vector<colored_tile_editor_info>& get_colored_editor_tiles();
 	protected:
 		enum {
-			FRONT_FACE,
-			RIGHT_FACE,
-			TOP_FACE,
-			BACK_FACE,
-			LEFT_FACE,
-			BOTTOM_FACE,
-			MAX_FACES,
+			FRONT_FACE = MESH_FRONT,
+			RIGHT_FACE = MESH_RIGHT,
+			TOP_FACE = MESH_TOP,
+			BACK_FACE = MESH_BACK,
+			LEFT_FACE = MESH_LEFT,
+			BOTTOM_FACE = MESH_BOTTOM,
+			MAX_FACES = MESH_NUM_FACES,
 		};
 
-		virtual void handle_build() = 0;
+		typedef boost::function<void(chunk_mesh*)> mesh_builder;
+
+		//returns a function which builds the chunk's mesh. It must only use
+		//copies of what it needs, since it may be run on another thread
+		//while the chunk is edited.
+		virtual mesh_builder handle_prepare_build() const = 0;
 		virtual void handle_draw(const graphics::lighting_ptr lighting, const camera_callable_ptr& camera) const = 0;
-		virtual void handle_set_tile(int x, int y, int z, const variant& type) = 0;
-		virtual void handle_del_tile(int x, int y, int z) = 0;
 		virtual variant handle_write() = 0;
 
-		void add_vertex_data(int face, GLfloat x, GLfloat y, GLfloat z, GLfloat size, std::vector<GLfloat>& varray);
-		std::vector<std::vector<GLfloat> >& get_vertex_data() { return varray_; }
-		void add_vertex_vbo_data();
-		void clear_vertex_data() { varray_.clear(); }
+		//called the first time a tile type is put in the chunk, so the
+		//chunk can work out how to draw it. Returns whether tiles of the
+		//type hide the faces of the tiles next to them.
+		virtual bool handle_add_palette_entry(const variant& type) = 0;
+
+		//set the voxels without rebuilding the mesh.
+		void set_voxel(int x, int y, int z, const variant& type);
+		void assign_voxels(const dense_voxels& voxels, const std::vector<variant>& palette);
+		void reserve_voxels(int min_x, int min_y, int min_z, int max_x, int max_y, int max_z);
+		const std::vector<bool>& opaque() const { return opaque_; }
+
 		const graphics::vbo_array& vbo() const { return vbos_; }
-		const std::vector<size_t>& get_vertex_attribute_offsets() const { return vattrib_offsets_; }
-		const std::vector<size_t>& get_num_vertices() const { return num_vertices_; }
+		int vertex_size() const { return mesh_vertex_size_; }
+		int face_begin(int face) const { return mesh_face_begin_[face]; }
+		int face_count(int face) const { return mesh_face_begin_[face+1] - mesh_face_begin_[face]; }
 		const std::vector<glm::vec3>& normals() const { return normals_; }
 
 		GLuint mvp_uniform() const { return u_mvp_matrix_; }
@@ -125,16 +179,30 @@ namespace voxel
 	private:
 		DECLARE_CALLABLE(chunk);
 
+		unsigned palette_index(const variant& type);
+		void upload_mesh(const chunk_mesh& mesh);
+		void build_in_background();
+		void finish_background_build(const chunk_mesh& mesh);
+
 		// Is this a coloured or textured chunk
 		bool textured_;
-		// VBO's to draw the chunk.
+		// VBO to draw the chunk.
 		graphics::vbo_array vbos_;
-		// Vertex array data for the chunk
-		std::vector<std::vector<GLfloat> > varray_;
-		// Vertex attribute offsets
-		std::vector<size_t> vattrib_offsets_;
-		// Number of vertices to be drawn.
-		std::vector<size_t> num_vertices_;
+		// Layout of the vertices in the VBO.
+		int mesh_vertex_size_;
+		int mesh_face_begin_[MESH_NUM_FACES + 1];
+
+		// Set while a mesh is being built on a worker thread, and if the
+		// chunk was edited again since it started.
+		bool building_;
+		bool build_pending_;
+
+		// The voxels, as indices into the palette of tile types. Index 0
+		// is empty.
+		dense_voxels voxels_;
+		std::vector<variant> palette_;
+		std::map<variant, unsigned> palette_ids_;
+		std::vector<bool> opaque_;
 
 		int size_x_;
 		int size_y_;
@@ -159,27 +227,19 @@ namespace voxel
 		chunk_colored();
 		explicit chunk_colored(gles2::program_ptr shader, logical_world_ptr logic, const variant& node);
 		virtual ~chunk_colored();
-		bool is_solid(int x, int y, int z) const;
-		variant get_tile_type(int x, int y, int z) const;
+
+		//the colour of each face of a tile type, as RGBA.
+		struct face_colors
+		{
+			uint8_t rgba[MESH_NUM_FACES][4];
+		};
 	protected:
-		void handle_build();
+		mesh_builder handle_prepare_build() const;
 		void handle_draw(const graphics::lighting_ptr lighting, const camera_callable_ptr& camera) const;
 		variant handle_write();
-		void handle_set_tile(int x, int y, int z, const variant& type);
-		void handle_del_tile(int x, int y, int z);
+		bool handle_add_palette_entry(const variant& type);
 	private:
-		void add_face_left(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const variant& col);
-		void add_face_right(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const variant& col);
-		void add_face_front(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const variant& col);
-		void add_face_back(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const variant& col);
-		void add_face_top(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const variant& col);
-		void add_face_bottom(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const variant& col);
-
-		void add_carray_data(int face, const graphics::color& color, std::vector<uint8_t>& carray);
-
-		std::vector<std::vector<uint8_t> > carray_;
-		std::vector<size_t> cattrib_offsets_;
-		boost::unordered_map<position, variant> tiles_;
+		std::vector<face_colors> colors_;
 
 		GLuint a_color_;
 	};
@@ -190,27 +250,20 @@ namespace voxel
 		chunk_textured();
 		explicit chunk_textured(gles2::program_ptr shader, logical_world_ptr logic, const variant& node);
 		virtual ~chunk_textured();
-		bool is_solid(int x, int y, int z) const;
-		variant get_tile_type(int x, int y, int z) const;
+
+		//the area of the texture each face of a tile type uses, as x1, y1,
+		//x2, y2.
+		struct face_areas
+		{
+			GLfloat area[MESH_NUM_FACES][4];
+		};
 	protected:
-		void handle_build();
+		mesh_builder handle_prepare_build() const;
 		void handle_draw(const graphics::lighting_ptr lighting, const camera_callable_ptr& camera) const;
 		variant handle_write();
-		void handle_set_tile(int x, int y, int z, const variant& type);
-		void handle_del_tile(int x, int y, int z);
+		bool handle_add_palette_entry(const variant& type);
 	private:
-		void add_face_left(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const std::string& bid);
-		void add_face_right(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const std::string& bid);
-		void add_face_front(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const std::string& bid);
-		void add_face_back(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const std::string& bid);
-		void add_face_top(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const std::string& bid);
-		void add_face_bottom(GLfloat x, GLfloat y, GLfloat z, GLfloat size, const std::string& bid);
-
-		void add_tarray_data(int face, const rectf& area, std::vector<GLfloat>& tarray);
-
-		std::vector<std::vector<GLfloat> > tarray_;
-		std::vector<size_t> tattrib_offsets_;
-		boost::unordered_map<position, std::string> tiles_;
+		std::vector<face_areas> areas_;
 
 		GLuint u_texture_;
 		GLuint a_texcoord_;
@@ -7,23 +7,171 @@
 #define bmround	round
 #endif
 
+#include <boost/bind.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <sstream>
 #include <vector>
 #include "asserts.hpp"
+#include "background_task_pool.hpp"
+#include "base64.hpp"
+#include "filesystem.hpp"
+#include "foreach.hpp"
+#include "frame_timings.hpp"
 #include "isoworld.hpp"
+#include "json_parser.hpp"
 #include "level.hpp"
+#include "preferences.hpp"
 #include "profile_timer.hpp"
 #include "user_voxel_object.hpp"
 #include "variant_utils.hpp"
 #include "voxel_object.hpp"
 #include "wml_formula_callable.hpp"
 
+PREF_INT(isoworld_max_chunks, 1024, "Most chunks an infinite voxel world keeps before dropping the ones out of view longest");
+PREF_INT(isoworld_max_loads, 4, "Most chunks of an infinite voxel world loaded or generated at once on worker threads");
+PREF_INT(isoworld_chunks_per_frame, 4, "Most chunks of an infinite voxel world added to it each frame");
+
 namespace voxel
 {
 	const int chunk_size = 32;
-	const int initial_chunks = 16;
+
+	// How many chunks high infinite worlds are.
+	const int infinite_layers = 4;
 
 	const int default_view_distance = 5;
 
+	// How high the noise the terrain of infinite worlds is made from goes.
+	const int default_noise_height = 128;
+
+	struct chunk_stream
+	{
+		chunk_stream() : cycle(0), loads(0) {}
+
+		// Where region files are kept, or empty if they can't be. They only
+		// hold edited chunks dropped from memory while this world exists,
+		// and are deleted with it. Edits are saved with the level.
+		std::string dir;
+		terrain_noise noise;
+		// JSON of the tile type generated terrain is made of.
+		std::string type;
+
+		int cycle;
+
+		// Chunks being loaded or generated, and ones which are done and
+		// waiting to be added to the world.
+		int loads;
+		boost::unordered_set<position> loading;
+		std::deque<stored_chunk_ptr> loaded;
+
+		// The cycle each chunk in the world was last in view distance of the
+		// camera, and which have been edited since they were last saved.
+		boost::unordered_map<position, int> last_used;
+		boost::unordered_set<position> dirty;
+
+		// Every chunk edited since the world was made, including those
+		// given by the level, which are written when the level is.
+		boost::unordered_set<position> edited;
+
+		// Edited chunks which were dropped from the world and aren't written
+		// yet, the chunks waiting to be written to each region, and regions
+		// being written.
+		boost::unordered_map<position, stored_chunk_ptr> unsaved;
+		boost::unordered_map<position, std::vector<stored_chunk_ptr> > waiting_saves;
+		boost::unordered_set<position> writing_regions;
+	};
+
+	namespace
+	{
+		int chunk_origin(int n)
+		{
+			return (n >= 0 ? n/chunk_size : -((-n + chunk_size - 1)/chunk_size)) * chunk_size;
+		}
+
+		position region_of(const position& origin)
+		{
+			int rx, ry, rz;
+			region_file::get_region(origin.x/chunk_size, origin.y/chunk_size, origin.z/chunk_size, &rx, &ry, &rz);
+			return position(rx, ry, rz);
+		}
+
+		// Each world gets a directory of its own, so no world ever sees
+		// another's chunks.
+		std::string make_region_dir()
+		{
+			static int nworlds = 0;
+			const std::string parent = sys::get_dir(std::string(preferences::user_data_path()) + "isoworld-regions");
+			if(parent.empty()) {
+				return "";
+			}
+
+			std::ostringstream s;
+			s << parent << "/" << SDL_GetTicks() << "-" << rand() << "-" << ++nworlds;
+			return sys::get_dir(s.str());
+		}
+
+		bool nearer(const std::pair<int, position>& a, const std::pair<int, position>& b)
+		{
+			return a.first < b.first;
+		}
+
+		stored_chunk_ptr store_chunk(const position& origin, const chunk& c)
+		{
+			stored_chunk_ptr res(new stored_chunk);
+			res->x = origin.x/chunk_size;
+			res->y = origin.y/chunk_size;
+			res->z = origin.z/chunk_size;
+			res->voxels = c.voxels();
+			for(size_t n = 1; n < c.palette().size(); ++n) {
+				res->palette.push_back(c.palette()[n].write_json());
+			}
+			return res;
+		}
+
+		// Run on a worker thread.
+		void load_chunk(const std::string& dir, const terrain_noise& noise, const std::string& type, stored_chunk_ptr c)
+		{
+			if(!dir.empty()) {
+				int rx, ry, rz;
+				region_file::get_region(c->x, c->y, c->z, &rx, &ry, &rz);
+				if(region_file::read_chunk(region_file::get_path(dir, rx, ry, rz), c->x, c->y, c->z, chunk_size, c.get())) {
+					return;
+				}
+			}
+
+			generate_terrain(noise, glm::ivec3(c->x, c->y, c->z) * chunk_size, chunk_size, chunk_size, chunk_size, &c->voxels);
+			c->palette.assign(1, type);
+		}
+
+		void chunk_loaded(boost::weak_ptr<chunk_stream> stream, stored_chunk_ptr c)
+		{
+			boost::shared_ptr<chunk_stream> s = stream.lock();
+			if(s) {
+				--s->loads;
+				s->loaded.push_back(c);
+			}
+		}
+
+		void region_saved(boost::weak_ptr<chunk_stream> stream, position region, std::vector<stored_chunk_ptr> chunks)
+		{
+			boost::shared_ptr<chunk_stream> s = stream.lock();
+			if(!s) {
+				return;
+			}
+
+			s->writing_regions.erase(region);
+			foreach(const stored_chunk_ptr& c, chunks) {
+				auto it = s->unsaved.find(position(c->x*chunk_size, c->y*chunk_size, c->z*chunk_size));
+				if(it != s->unsaved.end() && it->second == c) {
+					s->unsaved.erase(it);
+				}
+			}
+		}
+	}
+
 	logical_world::logical_world(const variant& node)
 		:size_x_(0), size_y_(0), size_z_(0), 
 		scale_x_(node["scale_x"].as_int(1)), scale_y_(node["scale_y"].as_int(1)), scale_z_(node["scale_z"].as_int(1)),
@@ -53,7 +201,9 @@ namespace voxel
 				if(min_z > gpz) { min_z = gpz; }
 				if(max_z < gpz) { max_z = gpz; }
 
-				heightmap_[std::make_pair(gpx,gpz)] = gpy;
+				if(gpy > heights_.get(gpx, gpz)) {
+					heights_.set(gpx, gpz, gpy);
+				}
 			}
 		}
 		size_x_ = max_x - min_x + 1;
@@ -90,7 +240,10 @@ namespace voxel
 
 	world::world(const variant& node)
 		: view_distance_(node["view_distance"].as_int(default_view_distance)), 
-		seed_(node["seed"].as_int(0))
+		seed_(node["seed"].as_int(0)), 
+		x_smoothness_(node["x_smoothness"].as_int(rand() % 480 + 32)),	// 32 is very spiky, 512 is very flat
+		z_smoothness_(node["z_smoothness"].as_int(rand() % 480 + 32)),
+		object_index_valid_(false)
 	{
 		ASSERT_LOG(node.has_key("shader"), "Must have 'shader' attribute");
 		ASSERT_LOG(node["shader"].is_string(), "'shader' attribute must be a string");
@@ -114,16 +267,36 @@ namespace voxel
 			logic_.reset(new logical_world(node));
 			build_fixed(node["chunks"]);
 		} else {
-			build_infinite();
+			build_infinite(node);
 		}
 	}
 
 	world::~world()
 	{
+		if(stream_ && !stream_->dir.empty()) {
+			// Nothing is kept from the region files, but chunks still being
+			// written mustn't put them back after they're removed.
+			while(!stream_->writing_regions.empty()) {
+				SDL_Delay(1);
+				background_task_pool::pump();
+			}
+			sys::rmdir_recursive(stream_->dir);
+		}
 	}
 
 	void world::set_tile(int x, int y, int z, const variant& type)
 	{
+		if(stream_) {
+			const position origin(chunk_origin(x), chunk_origin(y), chunk_origin(z));
+			auto it = chunks_.find(origin);
+			if(it != chunks_.end()) {
+				it->second->set_tile(x-origin.x, y-origin.y, z-origin.z, type);
+				stream_->dirty.insert(origin);
+				stream_->edited.insert(origin);
+			}
+			return;
+		}
+
 		int fx = int(floor(x));
 		int fy = int(floor(y));
 		int fz = int(floor(z));
@@ -135,6 +308,17 @@ namespace voxel
 	
 	void world::del_tile(int x, int y, int z)
 	{
+		if(stream_) {
+			const position origin(chunk_origin(x), chunk_origin(y), chunk_origin(z));
+			auto it = chunks_.find(origin);
+			if(it != chunks_.end()) {
+				it->second->del_tile(x-origin.x, y-origin.y, z-origin.z);
+				stream_->dirty.insert(origin);
+				stream_->edited.insert(origin);
+			}
+			return;
+		}
+
 		int fx = int(floor(x));
 		int fy = int(floor(y));
 		int fz = int(floor(z));
@@ -146,6 +330,12 @@ namespace voxel
 
 	variant world::get_tile_type(int x, int y, int z) const
 	{
+		if(stream_) {
+			const position origin(chunk_origin(x), chunk_origin(y), chunk_origin(z));
+			auto it = chunks_.find(origin);
+			return it != chunks_.end() ? it->second->get_tile_type(x-origin.x, y-origin.y, z-origin.z) : variant();
+		}
+
 		int fx = int(floor(x));
 		int fy = int(floor(y));
 		int fz = int(floor(z));
@@ -159,6 +349,7 @@ namespace voxel
 	void world::add_object(user_voxel_object_ptr obj)
 	{
 		objects_.insert(obj);
+		object_index_valid_ = false;
 	}
 
 	void world::remove_object(user_voxel_object_ptr obj)
@@ -166,15 +357,75 @@ namespace voxel
 		auto it = objects_.find(obj);
 		ASSERT_LOG(it != objects_.end(), "Unable to remove object '" << obj->type() << "' from level");
 		objects_.erase(it);
+		object_index_valid_ = false;
 	}
 
-	void world::get_objects_at_point(const glm::vec3& pt, std::vector<user_voxel_object_ptr>& obj_list)
+	void world::update_object_index() const
 	{
+		if(object_index_valid_) {
+			return;
+		}
+
+		object_index_.clear();
+		indexed_objects_.clear();
 		for(auto obj : objects_) {
-			if(obj->pt_in_object(pt)) {
-				obj_list.push_back(obj);
+			glm::vec3 b1, b2;
+			if(obj->get_world_bounds(&b1, &b2)) {
+				object_index_.add(indexed_objects_.size(), b1, b2);
+				indexed_objects_.push_back(obj);
 			}
 		}
+		object_index_valid_ = true;
+	}
+
+	void world::get_objects_at_point(const glm::vec3& pt, std::vector<user_voxel_object_ptr>& obj_list) const
+	{
+		update_object_index();
+		std::vector<int> ids;
+		object_index_.find_at_point(pt, &ids);
+		foreach(int id, ids) {
+			obj_list.push_back(indexed_objects_[id]);
+		}
+	}
+
+	void world::get_objects_on_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance, std::vector<user_voxel_object_ptr>& obj_list) const
+	{
+		update_object_index();
+		std::vector<std::pair<float, int> > hits;
+		object_index_.find_on_ray(origin, direction, max_distance, &hits);
+		for(auto hit : hits) {
+			obj_list.push_back(indexed_objects_[hit.second]);
+		}
+	}
+
+	bool world::is_solid_voxel(int x, int y, int z) const
+	{
+		if(stream_) {
+			const position origin(chunk_origin(x), chunk_origin(y), chunk_origin(z));
+			auto it = chunks_.find(origin);
+			return it != chunks_.end() && it->second->voxels().get(x-origin.x, y-origin.y, z-origin.z) != 0;
+		}
+
+		// Fixed worlds have only a few chunks, placed anywhere.
+		for(auto chnk : chunks_) {
+			const glm::ivec3 origin(chnk.first.x / int(logic_->scale_x()), chnk.first.y / int(logic_->scale_y()), chnk.first.z / int(logic_->scale_z()));
+			if(chnk.second->voxels().get(x-origin.x, y-origin.y, z-origin.z) != 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool world::cast_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance, ray_hit* hit) const
+	{
+		// Scaling the ray into voxels leaves how far along it things are
+		// the same.
+		glm::vec3 scale(1.0f);
+		if(logic_) {
+			scale = glm::vec3(float(logic_->scale_x()), float(logic_->scale_y()), float(logic_->scale_z()));
+		}
+
+		return voxel::cast_ray(origin/scale, direction/scale, max_distance, [this](int x, int y, int z) { return is_solid_voxel(x, y, z); }, hit);
 	}
 
 	void world::build_fixed(const variant& node)
@@ -188,49 +439,235 @@ namespace voxel
 		}
 	}
 
-	void world::build_infinite()
-	{
-		profile::manager pman("Built voxel::world in");
-
-		int x_smoothness = rand() % 480 + 32;
-		int z_smoothness = rand() % 480 + 32;
-
-		// Generates initial chunks
-		for(int x = 0; x != initial_chunks; ++x) {
-			for(int y = 0; y != 4; y++) {
-				for(int z = 0; z != initial_chunks; ++z) {
-					std::cerr << "Generating chunk: " << x << "," << y << "," << z << std::endl;
-					std::map<variant,variant> m;
-					variant_builder rnd;
-
-					glm::ivec3 worldspace_pos(x * chunk_size, y * chunk_size, z * chunk_size);
-				
-					rnd.add("width", chunk_size);
-					rnd.add("height", chunk_size);
-					rnd.add("depth", chunk_size);
-					//rnd.add("noise_height", rand() % chunk_size*2);
-					rnd.add("noise_height", 128);
-					rnd.add("type", graphics::color("medium_sea_green").write());
-					rnd.add("seed", seed_);
-					rnd.add("x_smoothness", x_smoothness);		// 32 is very spiky, 512 is very flat
-					rnd.add("z_smoothness", z_smoothness);
-
-					m[variant("type")] = variant("colored");
-					m[variant("shader")] = variant(shader_->name());
-					std::vector<variant> v;
-					v.push_back(variant(worldspace_pos.x));
-					v.push_back(variant(worldspace_pos.y));
-					v.push_back(variant(worldspace_pos.z));
-					m[variant("worldspace_position")] = variant(&v);
-					m[variant("random")] = rnd.build();
-
-					chunk_ptr cp = voxel::chunk_factory::create(shader_, logical_world_ptr(), variant(&m));
-					chunks_[position(worldspace_pos.x,worldspace_pos.y,worldspace_pos.z)] = cp;
-					active_chunks_.push_back(cp);
+	void world::build_infinite(const variant& node)
+	{
+		stream_.reset(new chunk_stream);
+		chunk_stream& s = *stream_;
+
+		// If there's nowhere to keep region files edited chunks are never
+		// dropped.
+		s.dir = make_region_dir();
+		if(s.dir.empty()) {
+			std::cerr << "voxel::world: Unable to use region directory, edited chunks will be kept in memory" << std::endl;
+		}
+
+		// Edited chunks saved with the level go in before any are loaded
+		// or generated.
+		const variant edits = node["edited_chunks"];
+		for(int n = 0; edits.is_list() && n != edits.num_elements(); ++n) {
+			const variant& edit = edits[n];
+			stored_chunk_ptr c(new stored_chunk);
+			c->x = edit["position"][0].as_int();
+			c->y = edit["position"][1].as_int();
+			c->z = edit["position"][2].as_int();
+			if(!region_file::decode_chunk(base64::b64decode(edit["data"].as_string()), chunk_size, c.get())) {
+				std::cerr << "voxel::world: Ignoring corrupt edited chunk at " << c->x << "," << c->y << "," << c->z << std::endl;
+				continue;
+			}
+
+			const position pos(c->x*chunk_size, c->y*chunk_size, c->z*chunk_size);
+			s.unsaved[pos] = c;
+			s.edited.insert(pos);
+		}
+
+		s.noise.height = node["noise_height"].as_int(default_noise_height);
+		s.noise.x_smoothness = float(x_smoothness_);
+		s.noise.z_smoothness = float(z_smoothness_);
+		s.type = graphics::color("medium_sea_green").write().write_json();
+	}
+
+	void world::stream_chunks()
+	{
+		chunk_stream& s = *stream_;
+		++s.cycle;
+
+		// Chunks the workers are done with are added a few at a time, so
+		// adding them never stalls a frame.
+		int added = 0;
+		while(!s.loaded.empty() && added < g_isoworld_chunks_per_frame) {
+			const stored_chunk_ptr c = s.loaded.front();
+			s.loaded.pop_front();
+			s.loading.erase(position(c->x*chunk_size, c->y*chunk_size, c->z*chunk_size));
+			add_stored_chunk(*c, false);
+			++added;
+		}
+
+		const glm::vec3& camera = level::current().camera()->position();
+		const int cx = chunk_origin(int(floor(camera.x)))/chunk_size;
+		const int cy = chunk_origin(int(floor(camera.y)))/chunk_size;
+		const int cz = chunk_origin(int(floor(camera.z)))/chunk_size;
+
+		std::vector<std::pair<int, position> > wanted;
+		for(int x = cx - view_distance_; x <= cx + view_distance_; ++x) {
+			for(int z = cz - view_distance_; z <= cz + view_distance_; ++z) {
+				for(int y = 0; y != infinite_layers; ++y) {
+					const int dist = (x-cx)*(x-cx) + (y-cy)*(y-cy) + (z-cz)*(z-cz);
+					wanted.push_back(std::make_pair(dist, position(x*chunk_size, y*chunk_size, z*chunk_size)));
+				}
+			}
+		}
+		std::stable_sort(wanted.begin(), wanted.end(), nearer);
+
+		typedef std::pair<int, position> wanted_chunk;
+		foreach(const wanted_chunk& w, wanted) {
+			const position& pos = w.second;
+			if(chunks_.count(pos)) {
+				s.last_used[pos] = s.cycle;
+				continue;
+			}
+
+			if(s.loading.count(pos)) {
+				continue;
+			}
+
+			auto unsaved = s.unsaved.find(pos);
+			if(unsaved != s.unsaved.end()) {
+				if(added < g_isoworld_chunks_per_frame) {
+					add_stored_chunk(*unsaved->second, true);
+					s.unsaved.erase(unsaved);
+					++added;
+				}
+				continue;
+			}
+
+			if(s.loads >= g_isoworld_max_loads) {
+				continue;
+			}
+
+			stored_chunk_ptr c(new stored_chunk);
+			c->x = pos.x/chunk_size;
+			c->y = pos.y/chunk_size;
+			c->z = pos.z/chunk_size;
+			s.loading.insert(pos);
+			++s.loads;
+			background_task_pool::submit(boost::bind(load_chunk, s.dir, s.noise, s.type, c),
+				boost::bind(chunk_loaded, boost::weak_ptr<chunk_stream>(stream_), c));
+		}
+
+		evict_chunks();
+		submit_saves();
+
+		frame_timings::add_counter("isoworld_chunks", chunks_.size());
+		frame_timings::add_counter("isoworld_chunks_loading", s.loads);
+	}
+
+	void world::add_stored_chunk(const stored_chunk& stored, bool dirty)
+	{
+		const position pos(stored.x*chunk_size, stored.y*chunk_size, stored.z*chunk_size);
+
+		std::map<variant,variant> m;
+		m[variant("type")] = variant("colored");
+		std::vector<variant> v;
+		v.push_back(variant(pos.x));
+		v.push_back(variant(pos.y));
+		v.push_back(variant(pos.z));
+		m[variant("worldspace_position")] = variant(&v);
+
+		chunk_ptr cp = voxel::chunk_factory::create(shader_, logic_, variant(&m));
+		cp->set_size(chunk_size, chunk_size, chunk_size);
+
+		std::vector<variant> palette;
+		foreach(const std::string& type, stored.palette) {
+			palette.push_back(json::parse(type, json::JSON_NO_PREPROCESSOR));
+		}
+		cp->set_voxels(stored.voxels, palette);
+
+		chunks_[pos] = cp;
+		stream_->last_used[pos] = stream_->cycle;
+		if(dirty) {
+			stream_->dirty.insert(pos);
+		}
+	}
+
+	void world::evict_chunks()
+	{
+		chunk_stream& s = *stream_;
+		if(chunks_.size() <= size_t(g_isoworld_max_chunks)) {
+			return;
+		}
+
+		// Chunks in view distance are never dropped, and edited ones only if
+		// they can be saved.
+		std::vector<std::pair<int, position> > unused;
+		typedef std::pair<const position, chunk_ptr> chunk_pair;
+		foreach(const chunk_pair& c, chunks_) {
+			const int last_used = s.last_used[c.first];
+			if(last_used != s.cycle && (!s.dir.empty() || !s.dirty.count(c.first))) {
+				unused.push_back(std::make_pair(last_used, c.first));
+			}
+		}
+		std::stable_sort(unused.begin(), unused.end(), nearer);
+
+		const size_t nevict = std::min(unused.size(), chunks_.size() - size_t(g_isoworld_max_chunks));
+		for(size_t n = 0; n != nevict; ++n) {
+			const position& pos = unused[n].second;
+			if(s.dirty.erase(pos)) {
+				const stored_chunk_ptr stored = store_chunk(pos, *chunks_[pos]);
+				s.unsaved[pos] = stored;
+				s.waiting_saves[region_of(pos)].push_back(stored);
+			}
+			chunks_.erase(pos);
+			s.last_used.erase(pos);
+		}
+	}
+
+	void world::submit_saves()
+	{
+		chunk_stream& s = *stream_;
+		std::vector<position> started;
+		typedef std::pair<const position, std::vector<stored_chunk_ptr> > save_pair;
+		foreach(const save_pair& p, s.waiting_saves) {
+			// A region is only written by one worker at a time, so no
+			// chunks are lost.
+			if(s.writing_regions.count(p.first)) {
+				continue;
+			}
+
+			s.writing_regions.insert(p.first);
+			background_task_pool::submit(boost::bind(region_file::write_chunks, region_file::get_path(s.dir, p.first.x, p.first.y, p.first.z), p.second),
+				boost::bind(region_saved, boost::weak_ptr<chunk_stream>(stream_), p.first, p.second));
+			started.push_back(p.first);
+		}
+
+		foreach(const position& region, started) {
+			s.waiting_saves.erase(region);
+		}
+	}
+
+	variant world::write_edited_chunks() const
+	{
+		const chunk_stream& s = *stream_;
+		std::vector<variant> res;
+		foreach(const position& pos, s.edited) {
+			// An edited chunk is in memory, waiting to be written to its
+			// region file, or already written.
+			stored_chunk_ptr c;
+			auto loaded = chunks_.find(pos);
+			auto unsaved = s.unsaved.find(pos);
+			if(loaded != chunks_.end()) {
+				c = store_chunk(pos, *loaded->second);
+			} else if(unsaved != s.unsaved.end()) {
+				c = unsaved->second;
+			} else {
+				c.reset(new stored_chunk);
+				c->x = pos.x/chunk_size;
+				c->y = pos.y/chunk_size;
+				c->z = pos.z/chunk_size;
+				const position region = region_of(pos);
+				if(!region_file::read_chunk(region_file::get_path(s.dir, region.x, region.y, region.z), c->x, c->y, c->z, chunk_size, c.get())) {
+					std::cerr << "voxel::world: Lost edited chunk at " << c->x << "," << c->y << "," << c->z << std::endl;
+					continue;
 				}
 			}
+
+			variant_builder edit;
+			edit.add("position", c->x);
+			edit.add("position", c->y);
+			edit.add("position", c->z);
+			edit.add("data", base64::b64encode(region_file::encode_chunk(*c)));
+			res.push_back(edit.build());
 		}
-		//get_active_chunks();
+		return variant(&res);
 	}
 
 	void world::draw(const camera_callable_ptr& camera) const
@@ -285,6 +722,20 @@ namespace voxel
 			res.add("seed", seed_);
 		}
 
+		if(stream_) {
+			// Infinite worlds are generated again from their settings, so
+			// only the chunks which were edited are written.
+			res.add("x_smoothness", x_smoothness_);
+			res.add("z_smoothness", z_smoothness_);
+			if(stream_->noise.height != default_noise_height) {
+				res.add("noise_height", stream_->noise.height);
+			}
+			if(!stream_->edited.empty()) {
+				res.add("edited_chunks", write_edited_chunks());
+			}
+			return res.build();
+		}
+
 		for(auto chnk : chunks_) {
 			variant_builder wsp;
 			wsp.add("worldspace_position", chnk.first.x);
@@ -305,10 +756,14 @@ namespace voxel
 
 	void world::process()
 	{
+		if(stream_) {
+			stream_chunks();
+		}
 		get_active_chunks();
 		for(auto obj : objects_) {
 			obj->process(level::current());
 		}
+		object_index_valid_ = false;
 	}
 
 	void world::get_active_chunks()
@@ -340,6 +795,15 @@ namespace voxel
 			v.push_back(variant(x)); v.push_back(variant(y)); v.push_back(variant(z));
 			return variant(&v);
 		}
+
+		variant ray_hit_to_variant(const ray_hit& hit)
+		{
+			variant_builder res;
+			res.add("voxel", ivec3_to_variant(hit.voxel));
+			res.add("normal", ivec3_to_variant(hit.normal));
+			res.add("distance", decimal(hit.distance));
+			return res.build();
+		}
 	}
 
 	bool logical_world::is_xedge(int x) const
@@ -366,85 +830,57 @@ namespace voxel
 		return true;
 	}
 
-	bool logical_world::is_solid(int x, int y, int z) const
+	bool logical_world::cast_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance, ray_hit* hit) const
 	{
-		auto it = heightmap_.find(std::make_pair(x,z));
-		if(it == heightmap_.end()) {
-			return false;
-		}
-		if(y <= it->second) {
-			return true;
-		} else {
-			return false;
-		}
+		const heightfield& heights = heights_;
+		return voxel::cast_ray(origin, direction, max_distance, [&heights](int x, int y, int z) { return heights.is_solid(x, y, z); }, hit);
+	}
+
+	bool logical_world::line_of_sight(const glm::ivec3& from, const glm::ivec3& to) const
+	{
+		// From the middle of one voxel to the middle of the other, ignoring
+		// the two voxels themselves.
+		const heightfield& heights = heights_;
+		ray_hit hit;
+		return !voxel::cast_ray(glm::vec3(from) + 0.5f, glm::vec3(to - from), 1.0f, [&](int x, int y, int z) {
+			const glm::ivec3 v(x, y, z);
+			return v != from && v != to && heights.is_solid(x, y, z);
+		}, &hit);
 	}
 
 	pathfinding::directed_graph_ptr logical_world::create_directed_graph(bool allow_diagonals) const
 	{
 		profile::manager pman("logical_world::create_directed_graph");
 
+		// Each column with anything in it has a vertex on top of it, and
+		// neighbouring columns are found straight from the heightfield.
 		std::vector<variant> vertex_list;
-		std::map<std::pair<int,int>, int> vlist;
-
-		for(auto p : heightmap_) {
-			int x = p.first.first;
-			int y = p.second;
-			int z = p.first.second;
-
-			if(y < size_y() - 1) {
-				if(is_solid(x, y+1, z) == false) {
-					vertex_list.push_back(variant_list_from_position(x,y+1,z));
-					vlist[std::make_pair(x,z)] = y+1;
+		std::vector<glm::ivec3> vertices;
+		for(int z = heights_.min_z(); z != heights_.min_z() + heights_.size_z(); ++z) {
+			for(int x = heights_.min_x(); x != heights_.min_x() + heights_.size_x(); ++x) {
+				const int h = heights_.get(x, z);
+				if(h != heightfield::NoHeight) {
+					vertex_list.push_back(variant_list_from_position(x,h+1,z));
+					vertices.push_back(glm::ivec3(x,h+1,z));
 				}
-			} else {
-				vertex_list.push_back(variant_list_from_position(x,y+1,z));
-				vlist[std::make_pair(x,z)] = y+1;
 			}
 		}
-	
+
+		static const int Neighbours[8][2] = { {1,0}, {-1,0}, {0,1}, {0,-1}, {1,1}, {1,-1}, {-1,1}, {-1,-1} };
 		pathfinding::graph_edge_list edges;
-		for(auto p : vertex_list) {
-			const int x = p[0].as_int();
-			const int y = p[1].as_int();
-			const int z = p[2].as_int();
+		for(int n = 0; n != vertices.size(); ++n) {
+			const glm::ivec3& v = vertices[n];
 
 			std::vector<variant> current_edges;
-			
-			auto it = vlist.find(std::make_pair(x+1,z));
-			if(it != vlist.end() && !is_xedge(x+1) && !is_solid(x+1,it->second,z)) {
-				current_edges.push_back(variant_list_from_position(x+1,it->second,z));
-			}
-			it = vlist.find(std::make_pair(x-1,z));
-			if(it != vlist.end() && !is_xedge(x-1) && !is_solid(x-1,it->second,z)) {
-				current_edges.push_back(variant_list_from_position(x-1,it->second,z));
-			}
-			it = vlist.find(std::make_pair(x,z+1));
-			if(it != vlist.end() && !is_zedge(z+1) && !is_solid(x,it->second,z+1)) {
-				current_edges.push_back(variant_list_from_position(x,it->second,z+1));
-			}
-			it = vlist.find(std::make_pair(x,z-1));
-			if(it != vlist.end() && !is_zedge(z-1) && !is_solid(x,it->second,z-1)) {
-				current_edges.push_back(variant_list_from_position(x,it->second,z-1));
-			}
-			if(allow_diagonals) {
-				it = vlist.find(std::make_pair(x+1,z+1));
-				if(it != vlist.end() && !is_xedge(x+1) && !is_zedge(z+1) && !is_solid(x+1,it->second,z+1)) {
-					current_edges.push_back(variant_list_from_position(x+1,it->second,z+1));
-				}
-				it = vlist.find(std::make_pair(x+1,z-1));
-				if(it != vlist.end() && !is_xedge(x+1) && !is_zedge(z-1) && !is_solid(x+1,it->second,z-1)) {
-					current_edges.push_back(variant_list_from_position(x+1,it->second,z-1));
-				}
-				it = vlist.find(std::make_pair(x-1,z+1));
-				if(it != vlist.end() && !is_xedge(x-1) && !is_zedge(z+1) && !is_solid(x-1,it->second,z+1)) {
-					current_edges.push_back(variant_list_from_position(x-1,it->second,z+1));
-				}
-				it = vlist.find(std::make_pair(x-1,z-1));
-				if(it != vlist.end() && !is_xedge(x-1) && !is_zedge(z-1) && !is_solid(x-1,it->second,z-1)) {
-					current_edges.push_back(variant_list_from_position(x-1,it->second,z-1));
+			for(int i = 0; i != (allow_diagonals ? 8 : 4); ++i) {
+				const int nx = v.x + Neighbours[i][0];
+				const int nz = v.z + Neighbours[i][1];
+				const int h = heights_.get(nx, nz);
+				if(h != heightfield::NoHeight && !is_xedge(nx) && !is_zedge(nz)) {
+					current_edges.push_back(variant_list_from_position(nx,h+1,nz));
 				}
 			}
-			edges[variant_list_from_position(x, y, z)] = current_edges;
+			edges[vertex_list[n]] = current_edges;
 		}
 		return pathfinding::directed_graph_ptr(new pathfinding::directed_graph(&vertex_list, &edges));
 	}
@@ -481,11 +917,23 @@ namespace voxel
 	BEGIN_DEFINE_FN(get_height_at_point, "(int,int) -> int|null")
 		int xx = FN_ARG(0).as_int();
 		int yy = FN_ARG(1).as_int();
-		auto it = obj.heightmap_.find(std::make_pair(xx,yy));
-		if(it == obj.heightmap_.end()) {
+		const int h = obj.heights_.get(xx, yy);
+		if(h == heightfield::NoHeight) {
+			return variant();
+		}
+		return variant(h);
+	END_DEFINE_FN
+
+	BEGIN_DEFINE_FN(cast_ray, "([decimal,decimal,decimal], [decimal,decimal,decimal], decimal=64) -> {voxel: [int,int,int], normal: [int,int,int], distance: decimal}|null")
+		ray_hit hit;
+		if(!obj.cast_ray(variant_to_vec3(FN_ARG(0)), variant_to_vec3(FN_ARG(1)), NUM_FN_ARGS > 2 ? FN_ARG(2).as_decimal().as_float() : 64.0f, &hit)) {
 			return variant();
 		}
-		return variant(it->second);
+		return ray_hit_to_variant(hit);
+	END_DEFINE_FN
+
+	BEGIN_DEFINE_FN(line_of_sight, "([int,int,int], [int,int,int]) -> bool")
+		return variant::from_bool(obj.line_of_sight(variant_to_ivec3(FN_ARG(0)), variant_to_ivec3(FN_ARG(1))));
 	END_DEFINE_FN
 
 	BEGIN_DEFINE_FN(create_world, "() -> commands")
@@ -539,6 +987,7 @@ namespace voxel
 		return variant(&v);	
 	DEFINE_SET_FIELD_TYPE("[builtin voxel_object|map]")
 		obj.objects_.clear();
+		obj.object_index_valid_ = false;
 		for(int n = 0; n != value.num_elements(); ++n) {
 			if(value[n].is_callable()) {
 				user_voxel_object_ptr o = value.try_convert<user_voxel_object>();
@@ -551,6 +1000,34 @@ namespace voxel
 	DEFINE_FIELD(logical, "builtin logical_world")
 		return variant(obj.logic_.get());
 
+	BEGIN_DEFINE_FN(cast_ray, "([decimal,decimal,decimal], [decimal,decimal,decimal], decimal=64) -> {voxel: [int,int,int], normal: [int,int,int], distance: decimal}|null")
+		ray_hit hit;
+		if(!obj.cast_ray(variant_to_vec3(FN_ARG(0)), variant_to_vec3(FN_ARG(1)), NUM_FN_ARGS > 2 ? FN_ARG(2).as_decimal().as_float() : 64.0f, &hit)) {
+			return variant();
+		}
+		return ray_hit_to_variant(hit);
+	END_DEFINE_FN
+
+	BEGIN_DEFINE_FN(objects_at_point, "([decimal,decimal,decimal]) -> [builtin voxel_object]")
+		std::vector<user_voxel_object_ptr> objs;
+		obj.get_objects_at_point(variant_to_vec3(FN_ARG(0)), objs);
+		std::vector<variant> v;
+		for(auto o : objs) {
+			v.push_back(variant(o.get()));
+		}
+		return variant(&v);
+	END_DEFINE_FN
+
+	BEGIN_DEFINE_FN(objects_on_ray, "([decimal,decimal,decimal], [decimal,decimal,decimal], decimal=64) -> [builtin voxel_object]")
+		std::vector<user_voxel_object_ptr> objs;
+		obj.get_objects_on_ray(variant_to_vec3(FN_ARG(0)), variant_to_vec3(FN_ARG(1)), NUM_FN_ARGS > 2 ? FN_ARG(2).as_decimal().as_float() : 64.0f, objs);
+		std::vector<variant> v;
+		for(auto o : objs) {
+			v.push_back(variant(o.get()));
+		}
+		return variant(&v);
+	END_DEFINE_FN
+
 	DEFINE_FIELD(draw_primitive, "[builtin draw_primitive]")
 		std::vector<variant> v;
 		for(auto prim : obj.draw_primitives_) {
@@ -6,6 +6,7 @@
 #endif
 
 #include <boost/intrusive_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 #include <vector>
@@ -24,6 +25,8 @@
 #include "shaders.hpp"
 #include "skybox.hpp"
 #include "variant.hpp"
+#include "voxel_query.hpp"
+#include "voxel_region.hpp"
 #include "wml_formula_callable.hpp"
 
 namespace voxel
@@ -39,7 +42,11 @@ namespace voxel
 
 		pathfinding::directed_graph_ptr create_directed_graph(bool allow_diagonals=false) const;
 
-		bool is_solid(int x, int y, int z) const;
+		bool is_solid(int x, int y, int z) const { return heights_.is_solid(x, y, z); }
+
+		// Ray casts and sight lines, in logical coordinates.
+		bool cast_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance, ray_hit* hit) const;
+		bool line_of_sight(const glm::ivec3& from, const glm::ivec3& to) const;
 
 		bool is_xedge(int x) const;
 		bool is_yedge(int y) const;
@@ -59,7 +66,8 @@ namespace voxel
 
 		variant serialize_to_wml() const;
 
-		boost::unordered_map<std::pair<int,int>, int> heightmap_;
+		// The height of the top voxel of each column.
+		heightfield heights_;
 		// Only valid for fixed size worlds
 		int size_x_;
 		int size_y_;
@@ -78,6 +86,15 @@ namespace voxel
 
 	typedef boost::intrusive_ptr<logical_world> logical_world_ptr;
 
+	struct chunk_stream;
+
+	//A world is either fixed, with all its chunks given, or infinite. The
+	//chunks of an infinite world are streamed in around the camera: they're
+	//read from region files, or generated if they've never been stored, on
+	//worker threads, nearest first. Chunks far from the camera are dropped
+	//when there are too many, least recently used first, with edited ones
+	//written to region files of the world's own, which are deleted with it.
+	//Edited chunks are saved with the level when the world is written.
 	class world : public game_logic::formula_callable
 	{
 	public:
@@ -90,7 +107,7 @@ namespace voxel
 		void del_tile(int x, int y, int z);
 		variant get_tile_type(int x, int y, int z) const;
 
-		void build_infinite();
+		void build_infinite(const variant& node);
 		void build_fixed(const variant& node);
 		void draw(const camera_callable_ptr& camera) const;
 		variant write();
@@ -99,7 +116,17 @@ namespace voxel
 		void add_object(user_voxel_object_ptr obj);
 		void remove_object(user_voxel_object_ptr obj);
 
-		void get_objects_at_point(const glm::vec3& pt, std::vector<user_voxel_object_ptr>& obj);
+		// Object queries see objects where they were when they were last
+		// processed, added or removed.
+		void get_objects_at_point(const glm::vec3& pt, std::vector<user_voxel_object_ptr>& obj) const;
+		// The objects the ray enters, nearest first.
+		void get_objects_on_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance, std::vector<user_voxel_object_ptr>& obj) const;
+
+		// Whether there's a voxel at x, y, z, in logical coordinates.
+		bool is_solid_voxel(int x, int y, int z) const;
+		// Takes a ray in world space and finds the voxel it hits, in
+		// logical coordinates.
+		bool cast_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance, ray_hit* hit) const;
 		std::set<user_voxel_object_ptr>& get_objects() { return objects_; }
 	protected:
 	private:
@@ -114,17 +141,37 @@ namespace voxel
 
 		uint32_t seed_;
 
+		// Settings for the terrain of infinite worlds.
+		int x_smoothness_;
+		int z_smoothness_;
+
 		std::vector<chunk_ptr> active_chunks_;
 		boost::unordered_map<position, chunk_ptr> chunks_;
 
 		std::set<user_voxel_object_ptr> objects_;
 
+		// Index of where the objects are, rebuilt when it's next used after
+		// they're processed or objects are added or removed.
+		void update_object_index() const;
+		mutable bool object_index_valid_;
+		mutable aabb_grid object_index_;
+		mutable std::vector<user_voxel_object_ptr> indexed_objects_;
+
 		std::vector<graphics::draw_primitive_ptr> draw_primitives_;
 
 		logical_world_ptr logic_;
+
+		// Only set for infinite worlds.
+		boost::shared_ptr<chunk_stream> stream_;
 		
 		void get_active_chunks();
 
+		void stream_chunks();
+		void add_stored_chunk(const stored_chunk& stored, bool dirty);
+		void evict_chunks();
+		void submit_saves();
+		variant write_edited_chunks() const;
+
 		world();
 		world(const world&);
 	};
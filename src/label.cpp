@@ -166,11 +166,11 @@ void label::reformat_text()
 
 void label::recalculate_texture()
 {
-	texture_ = font::render_text(current_text(), color_, size_, font_);
-	inner_set_dim(texture_.width(),texture_.height());
+	text_layout_ = font::text_layout(current_text(), color_, size_, font_);
+	inner_set_dim(text_layout_.width(), text_layout_.height());
 
 	if(border_color_.get()) {
-		border_texture_ = font::render_text(current_text(), *border_color_, size_, font_);
+		border_text_layout_ = font::text_layout(current_text(), *border_color_, size_, font_);
 	}
 }
 
@@ -181,17 +181,17 @@ void label::handle_draw() const
 		graphics::draw_rect(rect, highlight_color_, highlight_color_.a);
 	}
 
-	if(border_texture_.valid()) {
-		graphics::blit_texture(border_texture_, x() - border_size_, y());
-		graphics::blit_texture(border_texture_, x() + border_size_, y());
-		graphics::blit_texture(border_texture_, x(), y() - border_size_);
-		graphics::blit_texture(border_texture_, x(), y() + border_size_);
+	if(!border_text_layout_.empty()) {
+		border_text_layout_.draw(x() - border_size_, y());
+		border_text_layout_.draw(x() + border_size_, y());
+		border_text_layout_.draw(x(), y() - border_size_);
+		border_text_layout_.draw(x(), y() + border_size_);
 	}
-	graphics::blit_texture(texture_, x(), y());
+	text_layout_.draw(x(), y());
 }
 
-void label::set_texture(graphics::texture t) {
-	texture_ = t;
+void label::set_text_layout(const font::text_layout& t) {
+	text_layout_ = t;
 }
 
 bool label::in_label(int xloc, int yloc) const
@@ -371,9 +371,9 @@ void dialog_label::recalculate_texture()
 	std::string txt = current_text().substr(0, prog);
 
 	if(prog > 0) {
-		set_texture(font::render_text(txt, color(), size(), font()));
+		set_text_layout(font::text_layout(txt, color(), size(), font()));
 	} else {
-		set_texture(graphics::texture());
+		set_text_layout(font::text_layout());
 	}
 }
 
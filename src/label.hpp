@@ -23,6 +23,7 @@
 #include <boost/shared_ptr.hpp>
 
 #include "color_chart.hpp"
+#include "font.hpp"
 #include "formula_callable_definition.hpp"
 #include "graphics.hpp"
 #include "texture.hpp"
@@ -71,7 +72,7 @@ protected:
 	std::string& current_text();
 	const std::string& current_text() const;
 	virtual void recalculate_texture();
-	void set_texture(graphics::texture t);
+	void set_text_layout(const font::text_layout& t);
 
 	virtual bool handle_event(const SDL_Event& event, bool claimed);
 	virtual variant handle_write();
@@ -86,7 +87,7 @@ private:
 	void reformat_text();
 
 	std::string text_, formatted_;
-	graphics::texture texture_, border_texture_;
+	font::text_layout text_layout_, border_text_layout_;
 	int border_size_;
 	SDL_Color color_;
 	SDL_Color highlight_color_;
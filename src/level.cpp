@@ -29,12 +29,15 @@
 #include "editor.hpp"
 #include "entity.hpp"
 #include "filesystem.hpp"
+#include "flow_field.hpp"
 #include "foreach.hpp"
 #include "formatter.hpp"
 #include "formula_profiler.hpp"
+#include "frame_timings.hpp"
 #include "gui_formula_functions.hpp"
 #include "hex_map.hpp"
 #include "hex_object.hpp"
+#include "image_loader.hpp"
 #include "iphone_controls.hpp"
 #include "json_parser.hpp"
 #include "level.hpp"
@@ -45,6 +48,8 @@
 #include "module.hpp"
 #include "multiplayer.hpp"
 #include "object_events.hpp"
+#include "particle_system.hpp"
+#include "path_service.hpp"
 #include "player_info.hpp"
 #include "playable_custom_object.hpp"
 #include "preferences.hpp"
@@ -52,6 +57,7 @@
 #include "random.hpp"
 #include "raster.hpp"
 #include "sound.hpp"
+#include "sprite_batch.hpp"
 #include "stats.hpp"
 #include "string_utils.hpp"
 #include "surface_palette.hpp"
@@ -213,6 +219,7 @@ level::level(const std::string& level_cfg, variant node)
 	  segment_width_(0), segment_height_(0),
 #if defined(USE_ISOMAP)
 	  mouselook_enabled_(false), mouselook_inverted_(false),
+	  world_char_index_(1.0f), world_char_index_valid_(false), world_char_index_moves_(0), world_char_index_truez_(0),
 #endif
 	  allow_touch_controls_(true)
 {
@@ -220,6 +227,8 @@ level::level(const std::string& level_cfg, variant node)
 	get_all_levels_set().insert(this);
 #endif
 
+	solid_changed();
+
 	std::cerr << "in level constructor...\n";
 	const int start_time = SDL_GetTicks();
 
@@ -609,6 +618,7 @@ void level::read_compiled_tiles(variant node, std::vector<level_tile>::iterator&
 void level::load_character(variant c)
 {
 	chars_.push_back(entity::build(c));
+	chars_changed();
 	layers_.insert(chars_.back()->zorder());
 	if(!chars_.back()->is_human()) {
 		chars_.back()->set_id(chars_.size());
@@ -663,6 +673,7 @@ void level::finish_loading()
 				sub_level->tiles_.erase(std::remove_if(sub_level->tiles_.begin(), sub_level->tiles_.end(), boost::bind(level_tile_not_in_rect, bounds, _1)), sub_level->tiles_.end());
 				sub_level->solid_.clear();
 				sub_level->standable_.clear();
+				sub_level->solid_changed();
 				foreach(const level_tile& t, sub_level->tiles_) {
 					sub_level->add_tile_solid(t);
 				}
@@ -687,6 +698,7 @@ void level::finish_loading()
 
 		solid_.clear();
 		standable_.clear();
+		solid_changed();
 		tiles_.clear();
 		prepare_tiles_for_drawing();
 
@@ -811,6 +823,7 @@ void level::finish_loading()
 		}
 
 		chars_.erase(std::remove(chars_.begin(), chars_.end(), entity_ptr()), chars_.end());
+		chars_changed();
 	}
 
 #if defined(USE_BOX2D)
@@ -1092,6 +1105,7 @@ void level::complete_tiles_refresh()
 	std::cerr << "adding solids..." << (SDL_GetTicks() - start) << "\n";
 	solid_.clear();
 	standable_.clear();
+	solid_changed();
 
 	foreach(level_tile& t, tiles_) {
 		add_tile_solid(t);
@@ -1165,6 +1179,8 @@ void level::rebuild_tiles_rect(const rect& r)
 		}
 	}
 
+	solid_changed(r);
+
 	tiles_.erase(std::remove_if(tiles_.begin(), tiles_.end(), TileInRect(r)), tiles_.end());
 
 	std::vector<level_tile> tiles;
@@ -1977,10 +1993,30 @@ void level::draw_status() const
 	}
 }
 
+PREF_BOOL(batch_entity_drawing, true, "Draw simple objects with the same zorder together, grouped by texture");
+
 namespace {
-void draw_entity(const entity& obj, int x, int y, bool editor) {
+graphics::sprite_batch& entity_batch()
+{
+	static graphics::sprite_batch batch;
+	return batch;
+}
+
+//draws an entity. If a batch is given the entity is added to it if it
+//can be, otherwise the batch is flushed so the entity is drawn after
+//everything before it.
+void draw_entity(const entity& obj, int x, int y, bool editor, graphics::sprite_batch* batch=NULL) {
 	const std::pair<int,int>* scroll_speed = obj.parallax_scale_millis();
 
+	if(batch) {
+		if(!scroll_speed && !editor && obj.draw_batched(*batch, x, y)) {
+			return;
+		}
+
+		batch->flush();
+		graphics::sprite_batch::add_unbatched();
+	}
+
 	if(scroll_speed) {
 		glPushMatrix();
 		const int scrollx = scroll_speed->first;
@@ -2073,6 +2109,12 @@ void level::draw(int x, int y, int w, int h) const
 
 	std::sort(active_chars_.begin(), active_chars_.end(), zorder_compare);
 
+	graphics::sprite_batch* batch = g_batch_entity_drawing && !editor_ ? &entity_batch() : NULL;
+	if(!editor_) {
+		particle_system_manager::begin_batching();
+	}
+	int batch_zorder = INT_MIN;
+
 	const std::vector<entity_ptr>* chars_ptr = &active_chars_;
 	std::vector<entity_ptr> editor_chars_buf;
 
@@ -2144,10 +2186,25 @@ void level::draw(int x, int y, int w, int h) const
 		}
 
 		while(entity_itor != chars.end() && (*entity_itor)->zorder() <= *layer) {
-			draw_entity(**entity_itor, x, y, editor_);
+			//objects are only batched with others of the same zorder, and
+			//particles are drawn over the objects with their zorder.
+			if((*entity_itor)->zorder() != batch_zorder) {
+				if(batch) {
+					batch->flush();
+				}
+				particle_system_manager::flush();
+				batch_zorder = (*entity_itor)->zorder();
+			}
+
+			draw_entity(**entity_itor, x, y, editor_, batch);
 			++entity_itor;
 		}
 
+		if(batch) {
+			batch->flush();
+		}
+		particle_system_manager::flush();
+
 		draw_layer(*layer, x, y, w, h);
 	}
 
@@ -2158,6 +2215,14 @@ void level::draw(int x, int y, int w, int h) const
 
 	int last_zorder = -1000000;
 	while(entity_itor != chars.end()) {
+		if((*entity_itor)->zorder() != batch_zorder) {
+			if(batch) {
+				batch->flush();
+			}
+			particle_system_manager::flush();
+			batch_zorder = (*entity_itor)->zorder();
+		}
+
 #ifdef USE_SHADERS
 		if((*entity_itor)->zorder() != last_zorder) {
 			last_zorder = (*entity_itor)->zorder();
@@ -2168,10 +2233,15 @@ void level::draw(int x, int y, int w, int h) const
 		}
 #endif
 
-		draw_entity(**entity_itor, x, y, editor_);
+		draw_entity(**entity_itor, x, y, editor_, batch);
 		++entity_itor;
 	}
 
+	if(batch) {
+		batch->flush();
+	}
+	particle_system_manager::end_batching();
+
 #ifdef USE_SHADERS
 	gles2::set_alpha_test(false);
 	frame_buffer_enter_zorder(1000000);
@@ -2536,6 +2606,18 @@ void level::draw_background(int x, int y, int rotation) const
 void level::process()
 {
 	formula_profiler::instrument instrumentation("LEVEL_PROCESS");
+	const frame_timings::scope timing("process");
+
+#if !defined(__native_client__)
+	if(controls::prediction_window_full()) {
+		//we're as far ahead of the other players' confirmed input as we
+		//can roll back. Keep sending our input so they can catch up, but
+		//don't advance until they do.
+		multiplayer::send_and_receive();
+		return;
+	}
+#endif
+
 	if(!gui_algorithm_.empty()) {
 		foreach(gui_algorithm_ptr g, gui_algorithm_) {
 			g->process(*this);
@@ -2548,6 +2630,7 @@ void level::process()
 		const int index = cycle_/LevelPreloadFrequency;
 		if(index < preloads_.size()) {
 			preload_level(preloads_[index]);
+			graphics::image_loader::prefetch_level(preloads_[index]);
 		}
 	}
 
@@ -2632,13 +2715,21 @@ void level::set_active_chars()
 		}
 	}
 
+	const size_t nchars = chars_.size();
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), entity_ptr()), chars_.end());
+	if(chars_.size() != nchars) {
+		chars_changed();
+	}
 
 	std::sort(active_chars_.begin(), active_chars_.end());
 	active_chars_.erase(std::unique(active_chars_.begin(), active_chars_.end()), active_chars_.end());
 	std::sort(active_chars_.begin(), active_chars_.end(), zorder_compare);
 }
 
+namespace {
+level::phase_timings* g_phase_timings = NULL;
+}
+
 void level::do_processing()
 {
 	if(cycle_ == 0) {
@@ -2658,8 +2749,28 @@ void level::do_processing()
 	}
 
 	const int ticks = SDL_GetTicks();
-	set_active_chars();
-	detect_user_collisions(*this);
+	Uint64 phase_start = g_phase_timings ? SDL_GetPerformanceCounter() : 0;
+	{
+		const frame_timings::scope timing("set_active_chars");
+		set_active_chars();
+	}
+
+	frame_timings::add_counter("active_objects", active_chars_.size());
+
+	if(g_phase_timings) {
+		const Uint64 now = SDL_GetPerformanceCounter();
+		g_phase_timings->activation += now - phase_start;
+		phase_start = now;
+	}
+
+	{
+		const frame_timings::scope timing("detect_user_collisions");
+		detect_user_collisions(*this);
+	}
+
+	if(g_phase_timings) {
+		g_phase_timings->collisions += SDL_GetPerformanceCounter() - phase_start;
+	}
 
 	
 /*
@@ -2687,33 +2798,65 @@ void level::do_processing()
 		active_chars = chars_immune_from_time_freeze_;
 	}
 
-	while(!active_chars.empty()) {
-		new_chars_.clear();
-		foreach(const entity_ptr& c, active_chars) {
-			if(!c->destroyed() && (chars_by_label_.count(c->label()) || c->is_human())) {
-				c->process(*this);
-			}
-	
-			if(c->destroyed() && !c->is_human()) {
-				if(player_ && !c->respawn() && c->get_id() != -1) {
-					player_->is_human()->object_destroyed(id(), c->get_id());
+	{
+		const frame_timings::scope objects_timing("objects");
+		while(!active_chars.empty()) {
+			new_chars_.clear();
+			foreach(const entity_ptr& c, active_chars) {
+				if(!c->destroyed() && (chars_by_label_.count(c->label()) || c->is_human())) {
+					if(g_phase_timings) {
+						const Uint64 start = SDL_GetPerformanceCounter();
+						c->process(*this);
+						g_phase_timings->object_types[c->debug_description()] += SDL_GetPerformanceCounter() - start;
+					} else {
+						c->process(*this);
+					}
 				}
 	
-				erase_char(c);
+				if(c->destroyed() && !c->is_human()) {
+					if(player_ && !c->respawn() && c->get_id() != -1) {
+						player_->is_human()->object_destroyed(id(), c->get_id());
+					}
+	
+					erase_char(c);
+				}
 			}
+
+			active_chars = new_chars_;
+			active_chars_.insert(active_chars_.end(), new_chars_.begin(), new_chars_.end());
 		}
+	}
 
-		active_chars = new_chars_;
-		active_chars_.insert(active_chars_.end(), new_chars_.begin(), new_chars_.end());
+	{
+		const frame_timings::scope timing("particles");
+		particle_system_manager::process();
+	}
+
+	{
+		const frame_timings::scope timing("paths");
+		pathfinding::path_service::process(*this);
+		pathfinding::flow_fields::process(*this);
 	}
 
 	if(water_) {
-		water_->process(*this);
+		const frame_timings::scope timing("water");
+		if(g_phase_timings) {
+			const Uint64 start = SDL_GetPerformanceCounter();
+			water_->process(*this);
+			g_phase_timings->water += SDL_GetPerformanceCounter() - start;
+		} else {
+			water_->process(*this);
+		}
 	}
 
 	solid_chars_.clear();
 }
 
+void level::set_phase_timings(level::phase_timings* timings)
+{
+	g_phase_timings = timings;
+}
+
 void level::erase_char(entity_ptr c)
 {
 
@@ -2721,6 +2864,7 @@ void level::erase_char(entity_ptr c)
 		chars_by_label_.erase(c->label());
 	}
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), c), chars_.end());
+	chars_changed();
 	if(c->group() >= 0) {
 		assert(c->group() < groups_.size());
 		entity_group& group = groups_[c->group()];
@@ -3376,6 +3520,7 @@ void level::remove_character(entity_ptr e)
 		chars_by_label_.erase(e->label());
 	}
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), e), chars_.end());
+	chars_changed();
 	solid_chars_.erase(std::remove(solid_chars_.begin(), solid_chars_.end(), e), solid_chars_.end());
 	active_chars_.erase(std::remove(active_chars_.begin(), active_chars_.end(), e), active_chars_.end());
 }
@@ -3468,6 +3613,8 @@ void level::add_solid_rect(int x1, int y1, int x2, int y2, int friction, int tra
 		return;
 	}
 
+	solid_changed(rect::from_coordinates(x1, y1, x2 - 1, y2 - 1));
+
 	for(int y = y1; y < y2; y += TileSize) {
 		for(int x = x1; x < x2; x += TileSize) {
 			tile_pos pos(x/TileSize, y/TileSize);
@@ -3499,8 +3646,61 @@ void level::add_standable(int x, int y, int friction, int traction, int damage,
 	set_solid(standable_, x, y, friction, traction, damage, info);
 }
 
+namespace {
+int g_solid_state_counter;
+}
+
+void level::solid_changed()
+{
+	solid_state_id_ = ++g_solid_state_counter;
+	solid_changes_.clear();
+	solid_changes_begin_ = solid_state_id_;
+}
+
+void level::solid_changed(const rect& area)
+{
+	solid_state_id_ = ++g_solid_state_counter;
+
+	//changes are usually made a pixel at a time, so grow the last change
+	//if this one is next to it.
+	if(!solid_changes_.empty()) {
+		solid_change& last = solid_changes_.back();
+		if(rects_intersect(rect(last.area.x() - 1, last.area.y() - 1, last.area.w() + 2, last.area.h() + 2), area)) {
+			last.area = rect_union(last.area, area);
+			last.state_id = solid_state_id_;
+			return;
+		}
+	}
+
+	solid_change change = { solid_state_id_, area };
+	solid_changes_.push_back(change);
+	if(solid_changes_.size() > 64) {
+		solid_changes_begin_ = solid_changes_.front().state_id;
+		solid_changes_.pop_front();
+	}
+}
+
+bool level::get_solid_changes(int since_state_id, std::vector<rect>* areas) const
+{
+	if(since_state_id < solid_changes_begin_) {
+		return false;
+	}
+
+	foreach(const solid_change& change, solid_changes_) {
+		if(change.state_id > since_state_id) {
+			areas->push_back(change.area);
+		}
+	}
+
+	return true;
+}
+
 void level::set_solid(level_solid_map& map, int x, int y, int friction, int traction, int damage, const std::string& info_str, bool solid)
 {
+	if(&map == &solid_) {
+		solid_changed(rect(x, y, 1, 1));
+	}
+
 	tile_pos pos(x/TileSize, y/TileSize);
 	x = x%TileSize;
 	y = y%TileSize;
@@ -3547,6 +3747,7 @@ void level::add_multi_player(entity_ptr p)
 	ASSERT_LOG(!g_player_type || g_player_type->match(variant(p.get())), "Player object being added to level does not match required player type. " << p->debug_description() << " is not a " << g_player_type->to_string());
 	players_.push_back(p);
 	chars_.push_back(p);
+	chars_changed();
 	if(p->label().empty() == false) {
 		chars_by_label_[p->label()] = p;
 	}
@@ -3593,6 +3794,7 @@ void level::add_player(entity_ptr p)
 	}
 
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), entity_ptr()), chars_.end());
+	chars_changed();
 }
 
 void level::add_character(entity_ptr p)
@@ -3620,6 +3822,7 @@ void level::add_character(entity_ptr p)
 		add_player(p);
 	} else {
 		chars_.push_back(p);
+		chars_changed();
 	}
 
 	p->add_to_level();
@@ -4263,6 +4466,7 @@ void level::backup()
 	}
 
 	snapshot->last_touched_player = last_touched_player_;
+	snapshot->path_requests = pathfinding::path_service::save();
 
 	backups_.push_back(snapshot);
 	if(backups_.size() > 250) {
@@ -4321,6 +4525,7 @@ void level::restore_from_backup(backup_snapshot& snapshot)
 	rng::set_seed(snapshot.rng_seed);
 	cycle_ = snapshot.cycle;
 	chars_ = snapshot.chars;
+	chars_changed();
 	players_ = snapshot.players;
 	player_ = snapshot.player;
 	groups_ = snapshot.groups;
@@ -4336,6 +4541,8 @@ void level::restore_from_backup(backup_snapshot& snapshot)
 		}
 	}
 
+	pathfinding::path_service::restore(*this, snapshot.path_requests);
+
 	for(const entity_ptr& ch : snapshot.chars) {
 		ch->handle_event(OBJECT_EVENT_LOAD);
 	}
@@ -4575,6 +4782,7 @@ void level::build_solid_data_from_sub_levels()
 	standable_ = standable_base_;
 	solid_.clear();
 	standable_.clear();
+	solid_changed();
 
 	for(std::map<std::string, sub_level_data>::const_iterator i = sub_levels_.begin(); i != sub_levels_.end(); ++i) {
 		if(!i->second.active) {
@@ -4698,18 +4906,64 @@ const float* level::view() const
 	return camera_->view();
 }
 
+namespace {
+const float WorldPointTolerance = 0.25f;
+}
+
+void level::update_world_char_index()
+{
+	if(world_char_index_valid_ && world_char_index_truez_ == entity::truez_changes()) {
+		if(world_char_index_moves_ == entity::world_position_changes()) {
+			return;
+		}
+
+		// the same characters are in the index, so just move those which
+		// have moved.
+		for(int n = 0; n != world_index_chars_.size(); ++n) {
+			const entity& c = *world_index_chars_[n];
+			const glm::vec3 pos(c.tx(), c.ty(), c.tz());
+			if(pos != world_index_positions_[n]) {
+				world_char_index_.move(n, pos - WorldPointTolerance, pos + WorldPointTolerance);
+				world_index_positions_[n] = pos;
+			}
+		}
+
+		world_char_index_moves_ = entity::world_position_changes();
+		return;
+	}
+
+	world_char_index_.clear();
+	world_index_chars_.clear();
+	world_index_positions_.clear();
+	foreach(const entity_ptr& c, chars_) {
+		if(c->truez()) {
+			const glm::vec3 pos(c->tx(), c->ty(), c->tz());
+			world_char_index_.add(world_index_chars_.size(), pos - WorldPointTolerance, pos + WorldPointTolerance);
+			world_index_chars_.push_back(c);
+			world_index_positions_.push_back(pos);
+		}
+	}
+	world_char_index_valid_ = true;
+	world_char_index_moves_ = entity::world_position_changes();
+	world_char_index_truez_ = entity::truez_changes();
+}
+
 std::vector<entity_ptr> level::get_characters_at_world_point(const glm::vec3& pt)
 {
-	const double tolerance = 0.25;
+	update_world_char_index();
+	std::vector<int> ids;
+	world_char_index_.find_at_point(pt, &ids);
+
 	std::vector<entity_ptr> result;
-	foreach(entity_ptr c, chars_) {
+	foreach(int id, ids) {
+		const entity_ptr& c = world_index_chars_[id];
 		if(object_classification_hidden(*c) || c->truez() == false) {
 			continue;
 		}
 
-		if(abs(pt.x - c->tx()) < tolerance 
-			&& abs(pt.y - c->ty()) < tolerance 
-			&& abs(pt.z - c->tz()) < tolerance) {
+		if(abs(pt.x - c->tx()) < WorldPointTolerance 
+			&& abs(pt.y - c->ty()) < WorldPointTolerance 
+			&& abs(pt.z - c->tz()) < WorldPointTolerance) {
 			result.push_back(c);
 		}
 	}
@@ -48,6 +48,7 @@
 #include "level_object.hpp"
 #include "level_solid_map.hpp"
 #include "movement_script.hpp"
+#include "path_service.hpp"
 #include "raster.hpp"
 #include "speech_dialog.hpp"
 #include "tile_map.hpp"
@@ -115,6 +116,20 @@ public:
 	void draw_background(int x, int y, int rotation) const;
 	void process();
 	void set_active_chars();
+
+	//time spent in each phase of processing, in performance counter ticks,
+	//added to whatever phase_timings object has been set, if any.
+	struct phase_timings {
+		phase_timings() : activation(0), collisions(0), water(0)
+		{}
+
+		Uint64 activation, collisions, water;
+
+		//time spent processing objects, by object type.
+		std::map<std::string, Uint64> object_types;
+	};
+
+	static void set_phase_timings(phase_timings* timings);
 	void process_draw();
 	bool standable(const rect& r, const surface_info** info=NULL) const;
 	bool standable(int x, int y, const surface_info** info=NULL) const;
@@ -125,6 +140,16 @@ public:
 	bool solid(int xbegin, int ybegin, int w, int h, const surface_info** info=NULL) const;
 	bool may_be_solid_in_rect(const rect& r) const;
 	void set_solid_area(const rect& r, bool solid);
+
+	//changes whenever the solid map does, and is never the same for two
+	//levels, so things built from the solid map can tell they're stale.
+	int solid_state_id() const { return solid_state_id_; }
+	const level_solid_map& solid_map() const { return solid_; }
+
+	//adds the areas whose solidity has changed since the solid map had the
+	//given state id to areas. Returns false if they aren't all known, in
+	//which case anything might have changed.
+	bool get_solid_changes(int since_state_id, std::vector<rect>* areas) const;
 	entity_ptr board(int x, int y) const;
 	const rect& boundaries() const { return boundaries_; }
 	void set_boundaries(const rect& bounds) { boundaries_ = bounds; }
@@ -463,6 +488,21 @@ private:
 	level_solid_map solid_base_;
 	level_solid_map standable_base_;
 
+	int solid_state_id_;
+
+	//recent changes to the solid map, with those next to each other merged,
+	//and the state id from which all changes are recorded.
+	struct solid_change {
+		int state_id;
+		rect area;
+	};
+	std::deque<solid_change> solid_changes_;
+	int solid_changes_begin_;
+
+	//records that the whole solid map, or just the area given, changed.
+	void solid_changed();
+	void solid_changed(const rect& area);
+
 	bool is_solid(const level_solid_map& map, int x, int y, const surface_info** surf_info) const;
 	bool is_solid(const level_solid_map& map, const entity& e, const std::vector<point>& points, const surface_info** surf_info) const;
 
@@ -638,6 +678,7 @@ private:
 		std::vector<entity_ptr> players;
 		std::vector<entity_group> groups;
 		entity_ptr player, last_touched_player;
+		pathfinding::path_service::saved_requests_ptr path_requests;
 	};
 
 	void restore_from_backup(backup_snapshot& snapshot);
@@ -693,8 +734,26 @@ private:
 	camera_callable_ptr camera_;
 	bool mouselook_enabled_;
 	bool mouselook_inverted_;
+
+	// Where the characters with a 3d position are, so mouse events don't
+	// have to check them all. Rebuilt after characters are added or
+	// removed or gain or lose a 3d position. Characters which have moved
+	// are updated in place.
+	void update_world_char_index();
+	voxel::aabb_grid world_char_index_;
+	std::vector<entity_ptr> world_index_chars_;
+	std::vector<glm::vec3> world_index_positions_;
+	bool world_char_index_valid_;
+	unsigned world_char_index_moves_, world_char_index_truez_;
 #endif
 
+	// Called whenever chars_ changes.
+	void chars_changed() {
+#if defined(USE_ISOMAP)
+		world_char_index_valid_ = false;
+#endif
+	}
+
 	// Hack to disable the touchscreen controls for the current level -- replace for 1.4
 	bool allow_touch_controls_;
 
@@ -41,8 +41,11 @@
 #include "formatter.hpp"
 #include "formula_profiler.hpp"
 #include "formula_callable.hpp"
+#include "frame_scheduler.hpp"
+#include "frame_timings.hpp"
 #include "gles2.hpp"
 #include "http_client.hpp"
+#include "image_loader.hpp"
 #if defined(TARGET_OS_HARMATTAN) || defined(TARGET_BLACKBERRY) || defined(__ANDROID__) || TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR
 #include "iphone_controls.hpp"
 #endif
@@ -57,12 +60,14 @@
 #include "load_level.hpp"
 #include "message_dialog.hpp"
 #include "object_events.hpp"
+#include "particle_system.hpp"
 #include "pause_game_dialog.hpp"
 #include "player_info.hpp"
 #include "preferences.hpp"
 #include "raster.hpp"
 #include "settings_dialog.hpp"
 #include "sound.hpp"
+#include "sprite_batch.hpp"
 #include "stats.hpp"
 #include "surface_cache.hpp"
 #include "tbs_internal_server.hpp"
@@ -73,8 +78,13 @@
 #include "globals.h"
 #include "texture.hpp"
 
+// Defined in video_selections.cpp
+extern int g_vsync;
+
 namespace {
 PREF_BOOL(reload_modified_objects, false, "Reload object definitions when their file is modified on disk");
+PREF_BOOL(interpolate_frames, false, "When vsync is on, draw frames between game cycles with objects and the camera moved smoothly between cycles");
+PREF_STRING(record_replay, "", "File to write the controls used to play the last level to on exit, for use with the replay_benchmark utility");
 
 level_runner* current_level_runner = NULL;
 
@@ -730,8 +740,8 @@ level_runner::level_runner(boost::intrusive_ptr<level>& lvl, std::string& level_
 	die_at = -1;
 	paused = false;
 	done = false;
-	start_time_ = SDL_GetTicks();
-	pause_time_ = -global_pause_time;
+	scheduler_pause_time_ = global_pause_time;
+	interpolation_camera_valid_ = false;
 	mouse_clicking_ = false;
 }
 
@@ -803,20 +813,17 @@ bool level_runner::play_level()
 			&& (!console_ || !console_->has_keyboard_focus())
 #endif
 		) {
-				if(!reversing) {
-					pause_time_ -= SDL_GetTicks();
-				}
 				reverse_cycle();
 				reversing = true;
 		} else {
 			if(reversing) {
 				controls::read_until(lvl_->cycle());
-				pause_time_ += SDL_GetTicks();
+				scheduler_.reset();
 			}
 			reversing = false;
 			bool res = play_cycle();
 			if(!res) {
-				return quit_;
+				break;
 			}
 
 			if(preferences::record_history()) {
@@ -825,6 +832,13 @@ bool level_runner::play_level()
 		}
 	}
 
+	if(!g_record_replay.empty()) {
+		variant_builder replay;
+		replay.add("level", lvl_->id());
+		replay.add("controls", controls::serialize_local_controls());
+		sys::write_file(g_record_replay, replay.build().write_json());
+	}
+
 	return quit_;
 }
 
@@ -847,7 +861,17 @@ bool level_runner::play_cycle()
 		controls::mark_valid();
 	}
 
-	background_task_pool::pump();
+	frame_timings::end_frame();
+
+	{
+		const frame_timings::scope timing("background_task_pool::pump");
+		background_task_pool::pump();
+	}
+
+	graphics::image_loader::begin_frame();
+	graphics::sprite_batch::begin_frame();
+	particle_system_manager::begin_frame();
+	graphics::image_loader::stage_pending();
 
 	performance_data current_perf(current_fps_,50,0,0,0,0,0,custom_object::events_handled_per_second,"");
 
@@ -863,6 +887,9 @@ bool level_runner::play_cycle()
 	box2d::world_ptr world = box2d::world::our_world_ptr();
 	if(world && !paused) {
 		world->step(1.0f/50.0f);
+	} else if(world) {
+		// Otherwise changes made while paused would wait for the next step.
+		world->finish_step();
 	}
 #endif
 
@@ -943,17 +970,21 @@ bool level_runner::play_cycle()
 
 	const bool is_multiplayer = controls::num_players() > 1;
 
-	int desired_end_time = start_time_ + pause_time_ + global_pause_time + cycle*preferences::frame_time_millis() + preferences::frame_time_millis();
-
-	if(!is_multiplayer) {
-		const int ticks = SDL_GetTicks();
-		if(desired_end_time < ticks || alt_frame_time_scoper.active()) {
-			const int new_desired_end_time = ticks + preferences::frame_time_millis();
-			pause_time_ += new_desired_end_time - desired_end_time;
-			desired_end_time = new_desired_end_time;
-		}
+	//time spent in a pause_scope, or running as fast as we can, shouldn't
+	//be caught up on.
+	if(scheduler_pause_time_ != global_pause_time || alt_frame_time_scoper.active() || is_skipping_game()) {
+		scheduler_pause_time_ = global_pause_time;
+		scheduler_.reset();
 	}
 
+	//in multiplayer we have to keep pace with the other players, so we
+	//never drop cycles.
+	scheduler_.begin_cycle(!is_multiplayer);
+
+	//interpolation blends from where things were when the level was last
+	//processed, so it's only done on cycles the level is processed.
+	bool interpolating = g_interpolate_frames && g_vsync != 0 && !is_skipping_game() && !paused && !editor_ && pause_stack == 0 && !message_dialog::get();
+
 	//record player movement every minute on average.
 #if !TARGET_OS_HARMATTAN && !TARGET_OS_IPHONE
 	if(rand()%3000 == 0 && lvl_->player()) {
@@ -1509,12 +1540,17 @@ bool level_runner::play_cycle()
 	}
 
 	if(message_dialog::get()) {
+		//a dialog may have opened since the cycle started.
+		interpolating = false;
 		message_dialog::get()->process();
-		pause_time_ += preferences::frame_time_millis();
 	} else {
 		if (!paused && pause_stack == 0) {
 			const int start_process = SDL_GetTicks();
 
+			if(interpolating) {
+				record_interpolation_start();
+			}
+
 			try {
 				debug_console::process_graph();
 				lvl_->process();
@@ -1526,7 +1562,7 @@ bool level_runner::play_cycle()
 			next_process_ += process_time;
 			current_perf.process = process_time;
 		} else {
-			pause_time_ += preferences::frame_time_millis();
+			interpolating = false;
 		}
 	}
 
@@ -1540,7 +1576,7 @@ bool level_runner::play_cycle()
 	const int MaxSkips = 3;
 
 	const int start_draw = SDL_GetTicks();
-	if(start_draw < desired_end_time || nskip_draw_ >= MaxSkips) {
+	if(!scheduler_.behind() || nskip_draw_ >= MaxSkips) {
 		bool should_draw = true;
 		
 		if(editor_ && paused) {
@@ -1613,7 +1649,11 @@ bool level_runner::play_cycle()
 						lvl_->add_draw_character(e);
 					}
 				}
-				render_scene(*lvl_, last_draw_position());
+				if(interpolating) {
+					render_interpolated_scene();
+				} else {
+					render_scene(*lvl_, last_draw_position());
+				}
 #ifndef NO_EDITOR
 				int index = 0;
 				if(!history_trails_.empty()) {
@@ -1644,6 +1684,7 @@ bool level_runner::play_cycle()
 	box2d::world_ptr world = box2d::world::our_world_ptr();
 	if(world) {
 		if(world->draw_debug_data()) {
+			world->finish_step();
 			world->current_ptr()->DrawDebugData();
 		}
 	}
@@ -1667,7 +1708,9 @@ bool level_runner::play_cycle()
 
 		const int start_flip = SDL_GetTicks();
 		if(!is_skipping_game()) {
+			const frame_timings::scope timing("flip");
 			get_main_window()->swap();
+			scheduler_.frame_presented();
 		}
 
 		const int flip_time = SDL_GetTicks() - start_flip;
@@ -1709,22 +1752,36 @@ bool level_runner::play_cycle()
 
 	formula_profiler::pump();
 
-	const int raw_wait_time = desired_end_time - SDL_GetTicks();
-	const int wait_time = std::max<int>(1, desired_end_time - SDL_GetTicks());
+	//with vsync on swapping waits for the display to refresh, so the time
+	//until the next cycle can be filled with frames drawn between cycles,
+	//as long as there's time for another one.
+	if(interpolating) {
+		while(scheduler_.ms_until_next_cycle() > scheduler_.last_frame_ms()) {
+			render_interpolated_scene();
+#ifndef NO_EDITOR
+			if(console_) {
+				console_->draw();
+			}
+#endif
+			if(preferences::show_fps()) {
+				draw_fps(*lvl_, performance_data(current_fps_, current_cycles_, current_delay_, current_draw_, current_process_, current_flip_, cycle, current_events_, profiling_summary_));
+			}
+
+			get_main_window()->swap();
+			scheduler_.frame_presented();
+			++next_fps_;
+		}
+	}
+
+	int wait_time = 0;
+	if(!is_skipping_game()) {
+		wait_time = scheduler_.wait_for_next_cycle();
+	}
+
 	next_delay_ += wait_time;
 	current_perf.delay = wait_time;
-	if (wait_time != 1 && !is_skipping_game()) {
-		SDL_Delay(wait_time);
-	}
 
 	performance_data::set_current(current_perf);
-	
-	if(is_skipping_game()) {
-		const int adjust_time = desired_end_time - SDL_GetTicks();
-		if(adjust_time > 0) {
-			pause_time_ -= adjust_time;
-		}
-	}
 
 	if (!paused && pause_stack == 0) ++cycle;
 
@@ -1740,6 +1797,60 @@ bool level_runner::play_cycle()
 	return !quit_;
 }
 
+namespace {
+//objects which moved further than this in a cycle, in centi-pixels, were
+//teleported rather than moving, so don't slide them there.
+const int MaxInterpolationDistance = 10000;
+}
+
+void level_runner::record_interpolation_start()
+{
+	interpolation_start_.clear();
+	foreach(const entity_ptr& e, lvl_->get_active_chars()) {
+		interpolation_start_.push_back(std::pair<entity_ptr, point>(e, point(e->centi_x(), e->centi_y())));
+	}
+
+	interpolation_camera_valid_ = last_draw_position().init;
+	interpolation_camera_start_ = point(last_draw_position().x, last_draw_position().y);
+}
+
+void level_runner::render_interpolated_scene()
+{
+	const float fraction = scheduler_.cycle_fraction();
+
+	//move everything part of the way back to where it was at the start of
+	//the cycle, draw, then put it back.
+	std::vector<point> positions;
+	positions.reserve(interpolation_start_.size());
+	for(std::vector<std::pair<entity_ptr, point> >::const_iterator i = interpolation_start_.begin(); i != interpolation_start_.end(); ++i) {
+		entity& e = *i->first;
+		positions.push_back(point(e.centi_x(), e.centi_y()));
+
+		const int dx = e.centi_x() - i->second.x;
+		const int dy = e.centi_y() - i->second.y;
+		if((dx || dy) && abs(dx) < MaxInterpolationDistance && abs(dy) < MaxInterpolationDistance) {
+			e.set_centi_x(i->second.x + static_cast<int>(dx*fraction));
+			e.set_centi_y(i->second.y + static_cast<int>(dy*fraction));
+		}
+	}
+
+	screen_position pos = last_draw_position();
+	if(interpolation_camera_valid_ && pos.init) {
+		pos.x = interpolation_camera_start_.x + static_cast<int>((pos.x - interpolation_camera_start_.x)*fraction);
+		pos.y = interpolation_camera_start_.y + static_cast<int>((pos.y - interpolation_camera_start_.y)*fraction);
+	}
+
+	render_scene(*lvl_, pos);
+
+	for(int n = 0; n != positions.size(); ++n) {
+		entity& e = *interpolation_start_[n].first;
+		if(e.centi_x() != positions[n].x || e.centi_y() != positions[n].y) {
+			e.set_centi_x(positions[n].x);
+			e.set_centi_y(positions[n].y);
+		}
+	}
+}
+
 void level_runner::toggle_pause()
 {
 	paused = !paused;
@@ -24,6 +24,7 @@
 
 #include "button.hpp"
 #include "debug_console.hpp"
+#include "frame_scheduler.hpp"
 #include "geometry.hpp"
 #include "level.hpp"
 #include "pause_game_dialog.hpp"
@@ -91,8 +92,19 @@ private:
 	int die_at;
 	bool paused;
 	bool done;
-	int start_time_;
-	int pause_time_;
+
+	frame_scheduler scheduler_;
+
+	//global_pause_time when the scheduler was last reset.
+	int scheduler_pause_time_;
+
+	//where objects and the camera were at the start of the cycle, for
+	//drawing frames between cycles.
+	std::vector<std::pair<entity_ptr, point> > interpolation_start_;
+	point interpolation_camera_start_;
+	bool interpolation_camera_valid_;
+	void record_interpolation_start();
+	void render_interpolated_scene();
 
 	point last_stats_point_;
 	std::string last_stats_point_level_;
@@ -23,6 +23,7 @@
 #include "concurrent_cache.hpp"
 #include "filesystem.hpp"
 #include "foreach.hpp"
+#include "image_loader.hpp"
 #include "json_parser.hpp"
 #include "level.hpp"
 #include "load_level.hpp"
@@ -31,7 +32,9 @@
 #include "preferences.hpp"
 #include "preprocessor.hpp"
 #include "string_utils.hpp"
+#include "surface_formula.hpp"
 #include "texture.hpp"
+#include "texture_atlas.hpp"
 #include "thread.hpp"
 #include "variant.hpp"
 
@@ -211,6 +214,7 @@ void preload_level(const std::string& lvl)
 boost::intrusive_ptr<level> load_level(const std::string& lvl)
 {
 	std::cerr << "START LOAD LEVEL\n";
+	const int start_time = SDL_GetTicks();
 	level_map::iterator itor;
 	{
 		threading::lock lck(levels_loading_mutex());
@@ -218,6 +222,10 @@ boost::intrusive_ptr<level> load_level(const std::string& lvl)
 		if(itor == levels_loading.end()) {
 			boost::intrusive_ptr<level> res(new level(lvl));
 			res->finish_loading();
+			graphics::texture_atlas::flush_pending();
+			graphics::image_loader::level_loaded(lvl, SDL_GetTicks() - start_time);
+			save_surface_formula_results();
+	save_surface_formula_results();
 			fprintf(stderr, "LOADED LEVEL: %p\n", res);
 			return res;
 		}
@@ -231,6 +239,9 @@ boost::intrusive_ptr<level> load_level(const std::string& lvl)
 		res.reset(new level(lvl));
 	}
 	res->finish_loading();
+	graphics::texture_atlas::flush_pending();
+	graphics::image_loader::level_loaded(lvl, SDL_GetTicks() - start_time);
+	save_surface_formula_results();
 	levels_loading.erase(itor);
 	std::cerr << "FINISH LOAD LEVEL\n";
 	return res;
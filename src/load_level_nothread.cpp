@@ -18,6 +18,7 @@
 #include "concurrent_cache.hpp"
 #include "filesystem.hpp"
 #include "foreach.hpp"
+#include "image_loader.hpp"
 #include "json_parser.hpp"
 #include "level.hpp"
 #include "load_level.hpp"
@@ -25,6 +26,8 @@
 #include "preferences.hpp"
 #include "preprocessor.hpp"
 #include "string_utils.hpp"
+#include "surface_formula.hpp"
+#include "texture_atlas.hpp"
 #include "variant.hpp"
 
 namespace {
@@ -95,8 +98,12 @@ void preload_level(const std::string& lvl)
 
 boost::intrusive_ptr<level> load_level(const std::string& lvl)
 {
+	const int start_time = SDL_GetTicks();
 	boost::intrusive_ptr<level> res(new level(lvl));
 	res->finish_loading();
+	graphics::texture_atlas::flush_pending();
+	graphics::image_loader::level_loaded(lvl, SDL_GetTicks() - start_time);
+	save_surface_formula_results();
 	return res;
 }
 
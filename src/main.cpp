@@ -52,10 +52,12 @@
 #include "formula_callable_definition.hpp"
 #include "formula_object.hpp"
 #include "formula_profiler.hpp"
+#include "frame_timings.hpp"
 #include "framed_gui_element.hpp"
 #include "graphical_font.hpp"
 #include "gui_section.hpp"
 #include "i18n.hpp"
+#include "image_loader.hpp"
 #include "input.hpp"
 #include "ipc.hpp"
 #include "iphone_device_info.h"
@@ -70,6 +72,7 @@
 #include "message_dialog.hpp"
 #include "module.hpp"
 #include "multiplayer.hpp"
+#include "path_service.hpp"
 #include "player_info.hpp"
 #include "preferences.hpp"
 #include "preprocessor.hpp"
@@ -78,6 +81,7 @@
 #include "stats.hpp"
 #include "string_utils.hpp"
 #include "surface_cache.hpp"
+#include "surface_formula.hpp"
 #include "tbs_internal_server.hpp"
 #include "texture.hpp"
 #include "texture_frame_buffer.hpp"
@@ -918,6 +922,9 @@ extern "C" int main(int argcount, char* argvec[])
 #endif 
 	
 	graphics::texture::manager texture_manager;
+	graphics::image_loader::manager image_loader_manager;
+	const pathfinding::path_service::manager path_service_manager;
+	const frame_timings::manager frame_timings_manager;
 
 #ifndef NO_EDITOR
 	editor::manager editor_manager;
@@ -1057,6 +1064,7 @@ extern "C" int main(int argcount, char* argvec[])
 #endif
 
 	preferences::save_preferences();
+	save_surface_formula_results();
 
 #if !defined(_MSC_VER) && defined(UTILITY_IN_PROC)
 	if(create_utility_in_new_process) {
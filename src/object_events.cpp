@@ -76,6 +76,8 @@ std::vector<std::string> create_object_event_names()
 	res.push_back("drag");
 	res.push_back("drag_start");
 	res.push_back("drag_end");
+	res.push_back("path_found");
+	res.push_back("path_not_found");
 
 	ASSERT_EQ(res.size(), NUM_OBJECT_BUILTIN_EVENT_IDS);
 	return res;
@@ -151,6 +153,7 @@ variant_type_ptr get_object_event_arg_type(int id)
 		EVENT_ARG(COLLIDE_SIDE, "{area: string|null, collide_with: custom_obj|null, collide_with_area: string|null}")
 		EVENT_ARG(CHANGE_ANIMATION_FAILURE, "{previous_animation: string}")
 		EVENT_ARG(COSMIC_SHIFT, "{xshift: int, yshift: int}")
+		EVENT_ARG(PATH_FOUND, "{path: [[int,int]]}")
 		default: {
 			const std::string& str = get_object_event_str(id);
 			if(strstr(str.c_str(), "collide_object")) {
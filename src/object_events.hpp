@@ -71,6 +71,8 @@ enum OBJECT_EVENT_ID {
 	OBJECT_EVENT_MOUSE_DRAG,
 	OBJECT_EVENT_MOUSE_DRAG_START,
 	OBJECT_EVENT_MOUSE_DRAG_END,
+	OBJECT_EVENT_PATH_FOUND,
+	OBJECT_EVENT_PATH_NOT_FOUND,
 	NUM_OBJECT_BUILTIN_EVENT_IDS,
 };
 
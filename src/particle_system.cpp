@@ -17,6 +17,7 @@
 #include <iostream>
 #include <deque>
 #include <boost/cstdint.hpp>
+#include <climits>
 #include <math.h>
 #include <algorithm>
 
@@ -121,6 +122,8 @@ public:
 		texture_.set_as_current_texture();
 	}
 
+	const graphics::texture& texture() const { return texture_; }
+
 	int width() const { return width_; }
 	int height() const { return height_; }
 private:
@@ -159,6 +162,7 @@ struct simple_particle_system_info {
 		delta_g_(node["delta_g"].as_int(0)),
 		delta_b_(node["delta_b"].as_int(0)),
 		delta_a_(node["delta_a"].as_int(0)),
+		min_spawn_percent_(node["min_spawn_percent"].as_int(0)),
 		random_schedule_(false)
 
 	{
@@ -186,11 +190,246 @@ struct simple_particle_system_info {
 
 	int delta_r_, delta_g_, delta_b_, delta_a_;
 
+	//the lowest the spawn rate is cut to when there are too many particles.
+	int min_spawn_percent_;
+
 	std::vector<int> velocity_x_schedule_, velocity_y_schedule_;
 
 	bool random_schedule_;
 };
 
+PREF_INT(particle_budget, 30000, "The number of simple and point particles allowed in a level before particle systems spawn fewer of them");
+PREF_BOOL(batch_particle_drawing, true, "Draw the particles of simple and point particle systems grouped by texture");
+
+//buffers particles are kept in, handed back when a system is destroyed so
+//the next one made doesn't have to allocate its own.
+template<typename T>
+std::vector<std::vector<T> >& particle_buffer_pool()
+{
+	static std::vector<std::vector<T> > pool;
+	return pool;
+}
+
+template<typename T>
+void take_particle_buffer(std::vector<T>& buf)
+{
+	std::vector<std::vector<T> >& pool = particle_buffer_pool<T>();
+	if(!pool.empty()) {
+		buf.swap(pool.back());
+		pool.pop_back();
+	}
+}
+
+template<typename T>
+void return_particle_buffer(std::vector<T>& buf)
+{
+	std::vector<std::vector<T> >& pool = particle_buffer_pool<T>();
+	if(pool.size() < 64 && buf.capacity() > 0) {
+		buf.clear();
+		pool.push_back(std::vector<T>());
+		pool.back().swap(buf);
+	}
+}
+
+//a particle system whose particles are moved by particle_system_manager.
+//Each cycle its owner processes it, which removes expired particles and
+//spawns new ones, and the particles that were already there are moved
+//once all objects have been processed.
+class batched_particle_system : public particle_system
+{
+public:
+	batched_particle_system() : queued_(false)
+	{}
+
+	//moves the particles if they're waiting to be moved.
+	void move_queued() {
+		if(queued_) {
+			queued_ = false;
+			move_particles();
+		}
+	}
+
+	virtual int num_particles() const = 0;
+
+protected:
+	//queues the particles there are now to be moved by the manager.
+	void queue_move();
+
+	virtual void move_particles() = 0;
+
+	//the area the particles cover, in level co-ordinates.
+	rect bounds() const {
+		if(min_x_ > max_x_) {
+			return rect();
+		}
+		return rect::from_coordinates(min_x_, min_y_, max_x_, max_y_);
+	}
+
+	void reset_bounds() {
+		min_x_ = min_y_ = INT_MAX;
+		max_x_ = max_y_ = INT_MIN;
+	}
+
+	void extend_bounds(int x, int y, int margin) {
+		min_x_ = std::min(min_x_, x - margin);
+		min_y_ = std::min(min_y_, y - margin);
+		max_x_ = std::max(max_x_, x + margin);
+		max_y_ = std::max(max_y_, y + margin);
+	}
+
+	//true if the particles are on the screen, counting those that aren't.
+	bool on_screen(const rect& area) const;
+
+private:
+	bool queued_;
+	int min_x_, min_y_, max_x_, max_y_;
+};
+
+std::vector<boost::intrusive_ptr<batched_particle_system> > systems_to_move;
+
+particle_system_manager::stats current_stats, last_stats;
+int spawn_scale_millis = 1000;
+bool batching_particles = false;
+
+//how much a system should cut its spawn rate by, out of 1000. Types of
+//system can set a lowest rate they'll be cut to.
+int spawn_scale(int min_spawn_percent)
+{
+	return std::max(spawn_scale_millis, min_spawn_percent*10);
+}
+
+void batched_particle_system::queue_move()
+{
+	queued_ = true;
+	systems_to_move.push_back(this);
+}
+
+bool batched_particle_system::on_screen(const rect& area) const
+{
+	if(rects_intersect(bounds(), area)) {
+		return true;
+	}
+
+	++current_stats.culled;
+	return false;
+}
+
+//particles queued to be drawn as a triangle strip with a texture. Each
+//particle begins and ends with a repeated vertex, so those of any number
+//of systems can be drawn in one strip.
+struct textured_particle_batch {
+	graphics::texture tex;
+	bool colored;
+	std::vector<GLfloat> varray, tcarray;
+	std::vector<GLbyte> carray;
+};
+
+//particles queued to be drawn as points of one size.
+struct point_particle_batch {
+	int dot_size;
+	bool dot_rounded;
+	std::vector<GLshort> vertex;
+	std::vector<unsigned int> colors;
+};
+
+std::vector<textured_particle_batch> textured_batches;
+std::vector<point_particle_batch> point_batches;
+
+textured_particle_batch& get_textured_batch(const graphics::texture& tex, bool colored)
+{
+	foreach(textured_particle_batch& b, textured_batches) {
+		if(b.tex == tex && b.colored == colored) {
+			return b;
+		}
+	}
+
+	textured_batches.push_back(textured_particle_batch());
+	textured_batches.back().tex = tex;
+	textured_batches.back().colored = colored;
+	return textured_batches.back();
+}
+
+point_particle_batch& get_point_batch(int dot_size, bool dot_rounded)
+{
+	foreach(point_particle_batch& b, point_batches) {
+		if(b.dot_size == dot_size && b.dot_rounded == dot_rounded) {
+			return b;
+		}
+	}
+
+	point_batches.push_back(point_particle_batch());
+	point_batches.back().dot_size = dot_size;
+	point_batches.back().dot_rounded = dot_rounded;
+	return point_batches.back();
+}
+
+//draws a strip of textured particles, with the texture already set.
+void draw_particle_strip(const std::vector<GLfloat>& varray, const std::vector<GLfloat>& tcarray, const std::vector<GLbyte>& carray, bool colored)
+{
+#if defined(USE_SHADERS)
+	if(colored) {
+		gles2::manager gles2_manager(gles2::get_texcol_shader());
+		gles2::active_shader()->shader()->color_array(4, GL_UNSIGNED_BYTE, GL_TRUE, 0, &carray.front());
+		gles2::active_shader()->shader()->vertex_array(2, GL_FLOAT, GL_FALSE, 0, &varray.front());
+		gles2::active_shader()->shader()->texture_array(2, GL_FLOAT, GL_FALSE, 0, &tcarray.front());
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, varray.size()/2);
+	} else {
+		gles2::active_shader()->prepare_draw();
+		gles2::active_shader()->shader()->vertex_array(2, GL_FLOAT, GL_FALSE, 0, &varray.front());
+		gles2::active_shader()->shader()->texture_array(2, GL_FLOAT, GL_FALSE, 0, &tcarray.front());
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, varray.size()/2);
+	}
+#else
+	if(colored){
+		glEnableClientState(GL_COLOR_ARRAY);
+		glColorPointer(4, GL_UNSIGNED_BYTE, 0, &carray.front());
+	}
+	
+	glVertexPointer(2, GL_FLOAT, 0, &varray.front());
+	glTexCoordPointer(2, GL_FLOAT, 0, &tcarray.front());
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, varray.size()/2);
+
+	if(colored){
+		glDisableClientState(GL_COLOR_ARRAY);
+	}
+#endif
+	glColor4f(1.0, 1.0, 1.0, 1.0);
+}
+
+void draw_particle_points(const std::vector<GLshort>& vertex, const std::vector<unsigned int>& colors, int dot_size, bool dot_rounded)
+{
+	glColor4f(1.0, 1.0, 1.0, 1.0);
+
+#if defined(USE_SHADERS)
+	// Not dealing with GL_POINT_SMOOTH right now -- this would probably be better as a frgament shader.
+	glPointSize(dot_size);
+	gles2::manager gles2_manager(gles2::get_simple_col_shader());
+	gles2::active_shader()->shader()->vertex_array(2, GL_SHORT, GL_FALSE, 0, &vertex[0]);
+	gles2::active_shader()->shader()->color_array(4, GL_UNSIGNED_BYTE, GL_TRUE, 0, &colors[0]);
+	glDrawArrays(GL_POINTS, 0, colors.size());
+#else
+	glDisable(GL_TEXTURE_2D);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	if(dot_rounded){
+		glEnable( GL_POINT_SMOOTH );
+	}
+	glPointSize(dot_size);
+
+	glVertexPointer(2, GL_SHORT, 0, &vertex[0]);
+	glColorPointer(4, GL_UNSIGNED_BYTE, 0, &colors[0]);
+	glDrawArrays(GL_POINTS, 0, colors.size());
+
+	glDisableClientState(GL_COLOR_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnable(GL_TEXTURE_2D);
+	if(dot_rounded){
+		glDisable( GL_POINT_SMOOTH );
+	}
+#endif
+	glColor4f(1.0, 1.0, 1.0, 1.0);
+}
+
 class simple_particle_system_factory : public particle_system_factory {
 public:
 	explicit simple_particle_system_factory(variant node);
@@ -211,19 +450,26 @@ simple_particle_system_factory::simple_particle_system_factory(variant node)
 	}
 }
 
-class simple_particle_system : public particle_system
+class simple_particle_system : public batched_particle_system
 {
 public:
 	simple_particle_system(const entity& e, const simple_particle_system_factory& factory);
-	~simple_particle_system() {}
+	~simple_particle_system();
 
-	bool is_destroyed() const { return info_.system_time_to_live_ == 0 || info_.spawn_rate_ < 0 && particles_.empty(); }
+	bool is_destroyed() const { return info_.system_time_to_live_ == 0 || info_.spawn_rate_ < 0 && num_particles() == 0; }
 	bool should_save() const { return info_.spawn_rate_ >= 0; }
 	void process(const entity& e);
 	void draw(const rect& area, const entity& e) const;
+	bool draw_batched(const rect& area, const entity& e) const;
+	int num_particles() const { return particles_.size() - first_; }
 
 private:
 	void prepump(const entity& e);
+	void remove_expired();
+	void move_particles();
+	void move_particles(int count);
+	void spawn(const entity& e);
+	void add_vertices(const entity& e, std::vector<GLfloat>& varray, std::vector<GLfloat>& tcarray, std::vector<GLbyte>* carray) const;
 
 	variant get_value(const std::string& key) const {
 		if(key == "spawn_rate") {
@@ -353,15 +599,36 @@ private:
 		int created_at;
 	};
 
-	std::deque<particle> particles_;
+	//particles, oldest first, from first_ on. Expired particles are only
+	//removed from the front of the buffer once they make up half of it.
+	std::vector<particle> particles_;
+	int first_;
 	std::deque<generation> generations_;
 
 	int spawn_buildup_;
+
+	//particles to be moved by the manager, and the way the owner was
+	//facing when it was last processed.
+	int nmove_;
+	bool face_right_;
+
+	//how far particles can be drawn from their position.
+	int margin_;
 };
 
 simple_particle_system::simple_particle_system(const entity& e, const simple_particle_system_factory& factory)
-  : factory_(factory), info_(factory.info_), cycle_(0), spawn_buildup_(0)
+  : factory_(factory), info_(factory.info_), cycle_(0), first_(0), spawn_buildup_(0), nmove_(0), face_right_(e.face_right()), margin_(0)
 {
+	take_particle_buffer(particles_);
+	foreach(const particle_animation& anim, factory_.frames_) {
+		margin_ = std::max(margin_, std::max(anim.width(), anim.height()));
+	}
+	reset_bounds();
+}
+
+simple_particle_system::~simple_particle_system()
+{
+	return_particle_buffer(particles_);
 }
 
 void simple_particle_system::prepump(const entity& e)
@@ -372,64 +639,85 @@ void simple_particle_system::prepump(const entity& e)
 	//for the short period of time (often as low as 4 seconds) needed to eliminate that implementation artifact
 	for( int i = 0; i < info_.pre_pump_cycles_; ++i)
 	{
-		process(e);
+		--info_.system_time_to_live_;
+		++cycle_;
+		remove_expired();
+		move_particles(num_particles());
+		spawn(e);
 	}
 	
 }
 
 void simple_particle_system::process(const entity& e)
 {
+	//in case the manager didn't get to last cycle's particles.
+	move_queued();
+
 	--info_.system_time_to_live_;
 	++cycle_;
+	face_right_ = e.face_right();
 
 	if(cycle_ == 1) {
 		prepump(e);
 	}
 
+	remove_expired();
+
+	nmove_ = num_particles();
+	queue_move();
+
+	spawn(e);
+}
+
+void simple_particle_system::remove_expired()
+{
 	while(!generations_.empty() && cycle_ - generations_.front().created_at == info_.time_to_live_) {
-		particles_.erase(particles_.begin(), particles_.begin() + generations_.front().members);
+		first_ += generations_.front().members;
 		generations_.pop_front();
 	}
 
-	std::deque<particle>::iterator p = particles_.begin();
-	foreach(generation& gen, generations_) {
-		for(int n = 0; n != gen.members; ++n) {
-			p->pos[0] += p->velocity[0];
-			p->pos[1] += p->velocity[1];
-			if(e.face_right()) {
-				p->velocity[0] += info_.accel_x_/1000.0;
-			} else {
-				p->velocity[0] -= info_.accel_x_/1000.0;
-			}
-			p->velocity[1] += info_.accel_y_/1000.0;
-			++p;
-		}
+	if(first_ > 0 && first_*2 >= particles_.size()) {
+		particles_.erase(particles_.begin(), particles_.begin() + first_);
+		first_ = 0;
 	}
+}
 
-	if(info_.velocity_x_schedule_.empty() == false) {
-		std::deque<particle>::iterator p = particles_.begin();
-		foreach(generation& gen, generations_) {
-
-			for(int n = 0; n != gen.members; ++n) {
-				const int ncycle = p->random + cycle_ - gen.created_at - 1;
-				p->velocity[0] += info_.velocity_x_schedule_[ncycle%info_.velocity_x_schedule_.size()];
-				if(cycle_ - gen.created_at > 1) {
-					p->velocity[0] -= info_.velocity_x_schedule_[(ncycle-1)%info_.velocity_x_schedule_.size()];
-				}
+void simple_particle_system::move_particles()
+{
+	move_particles(nmove_);
+}
 
-				++p;
-			}
-		}
+void simple_particle_system::move_particles(int count)
+{
+	particle* const begin = particles_.empty() ? NULL : &particles_[first_];
+	particle* const end = begin + count;
+
+	const GLfloat accel_x = (face_right_ ? info_.accel_x_ : -info_.accel_x_)/1000.0;
+	const GLfloat accel_y = info_.accel_y_/1000.0;
+	for(particle* p = begin; p != end; ++p) {
+		p->pos[0] += p->velocity[0];
+		p->pos[1] += p->velocity[1];
+		p->velocity[0] += accel_x;
+		p->velocity[1] += accel_y;
 	}
 
-	if(info_.velocity_y_schedule_.empty() == false) {
-		std::deque<particle>::iterator p = particles_.begin();
-		foreach(generation& gen, generations_) {
-			for(int n = 0; n != gen.members; ++n) {
+	if(info_.velocity_x_schedule_.empty() == false || info_.velocity_y_schedule_.empty() == false) {
+		particle* p = begin;
+		foreach(const generation& gen, generations_) {
+			for(int n = 0; n != gen.members && p != end; ++n) {
 				const int ncycle = p->random + cycle_ - gen.created_at - 1;
-				p->velocity[1] += info_.velocity_y_schedule_[ncycle%info_.velocity_y_schedule_.size()];
-				if(cycle_ - gen.created_at > 1) {
-					p->velocity[1] -= info_.velocity_y_schedule_[(ncycle-1)%info_.velocity_y_schedule_.size()];
+				if(info_.velocity_x_schedule_.empty() == false) {
+					p->velocity[0] += info_.velocity_x_schedule_[ncycle%info_.velocity_x_schedule_.size()];
+					if(cycle_ - gen.created_at > 1) {
+						p->velocity[0] -= info_.velocity_x_schedule_[(ncycle-1)%info_.velocity_x_schedule_.size()];
+					}
+				}
+
+				if(info_.velocity_y_schedule_.empty() == false) {
+					p->velocity[1] += info_.velocity_y_schedule_[ncycle%info_.velocity_y_schedule_.size()];
+					if(cycle_ - gen.created_at > 1) {
+						p->velocity[1] -= info_.velocity_y_schedule_[(ncycle-1)%info_.velocity_y_schedule_.size()];
+					}
 				}
 
 				++p;
@@ -437,12 +725,22 @@ void simple_particle_system::process(const entity& e)
 		}
 	}
 
+	reset_bounds();
+	for(int n = first_; n != particles_.size(); ++n) {
+		extend_bounds(int(particles_[n].pos[0]), int(particles_[n].pos[1]), margin_);
+	}
+}
+
+void simple_particle_system::spawn(const entity& e)
+{
 	int nspawn = info_.spawn_rate_;
 	if(info_.spawn_rate_random_ > 0) {
 		nspawn += rand()%info_.spawn_rate_random_;
 	}
 
 	if(nspawn > 0) {
+		//fewer particles are spawned when there are too many in the level.
+		nspawn = (nspawn*spawn_scale(info_.min_spawn_percent_))/1000;
 		nspawn += spawn_buildup_;
 	}
 
@@ -515,42 +813,29 @@ void simple_particle_system::process(const entity& e)
 		}
 
 		particles_.push_back(p);
+		extend_bounds(int(p.pos[0]), int(p.pos[1]), margin_);
 	}
 }
 
-void simple_particle_system::draw(const rect& area, const entity& e) const
+void simple_particle_system::add_vertices(const entity& e, std::vector<GLfloat>& varray, std::vector<GLfloat>& tcarray, std::vector<GLbyte>* carray) const
 {
-	if(particles_.empty()) {
-		return;
-	}
-
-	std::deque<particle>::const_iterator p = particles_.begin();
-
-	//all particles must have the same texture, so just set it once.
-	p->anim->set_texture();
-	std::vector<GLfloat>& varray = graphics::global_vertex_array();
-	std::vector<GLfloat>& tcarray = graphics::global_texcoords_array();
-	std::vector<GLbyte>& carray = graphics::global_vertex_color_array();
+	std::vector<particle>::const_iterator p = particles_.begin() + first_;
 
 	const int facing = e.face_right() ? 1 : -1;
-			
 
-	carray.clear();
-	varray.clear();
-	tcarray.clear();
 	foreach(const generation& gen, generations_) {
 		for(int n = 0; n != gen.members; ++n) {
 			const particle_animation* anim = p->anim;
 			const particle_animation::frame_area& f = anim->get_frame(cycle_ - gen.created_at);
 
-			if(info_.delta_a_){
+			if(carray){
 				//Spare the bandwidth if we're opaque
 				const int alpha_level = std::max(256 - info_.delta_a_*(cycle_ - gen.created_at), 0);
 				const int red = 255;
 				const int green = 255;
 				const int blue = 255;
 				for( int i = 0; i < 6; ++i){
-					carray.push_back(red); carray.push_back(green); carray.push_back(blue); carray.push_back(alpha_level);
+					carray->push_back(red); carray->push_back(green); carray->push_back(blue); carray->push_back(alpha_level);
 				}
 
 			}
@@ -587,35 +872,40 @@ void simple_particle_system::draw(const rect& area, const entity& e) const
 			++p;
 		}
 	}
-	
-#if defined(USE_SHADERS)
-	if(info_.delta_a_) {
-		gles2::manager gles2_manager(gles2::get_texcol_shader());
-		gles2::active_shader()->shader()->color_array(4, GL_UNSIGNED_BYTE, GL_TRUE, 0, &carray.front());
-		gles2::active_shader()->shader()->vertex_array(2, GL_FLOAT, GL_FALSE, 0, &varray.front());
-		gles2::active_shader()->shader()->texture_array(2, GL_FLOAT, GL_FALSE, 0, &tcarray.front());
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, varray.size()/2);
-	} else {
-		gles2::active_shader()->prepare_draw();
-		gles2::active_shader()->shader()->vertex_array(2, GL_FLOAT, GL_FALSE, 0, &varray.front());
-		gles2::active_shader()->shader()->texture_array(2, GL_FLOAT, GL_FALSE, 0, &tcarray.front());
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, varray.size()/2);
+}
+
+void simple_particle_system::draw(const rect& area, const entity& e) const
+{
+	if(num_particles() == 0 || !on_screen(area)) {
+		return;
 	}
-#else
-	if(info_.delta_a_){
-		glEnableClientState(GL_COLOR_ARRAY);
-		glColorPointer(4, GL_UNSIGNED_BYTE, 0, &carray.front());
+
+	//all particles must have the same texture, so just set it once.
+	particles_[first_].anim->set_texture();
+	std::vector<GLfloat>& varray = graphics::global_vertex_array();
+	std::vector<GLfloat>& tcarray = graphics::global_texcoords_array();
+	std::vector<GLbyte>& carray = graphics::global_vertex_color_array();
+
+	carray.clear();
+	varray.clear();
+	tcarray.clear();
+	add_vertices(e, varray, tcarray, info_.delta_a_ ? &carray : NULL);
+	draw_particle_strip(varray, tcarray, carray, info_.delta_a_ != 0);
+}
+
+bool simple_particle_system::draw_batched(const rect& area, const entity& e) const
+{
+	if(!batching_particles) {
+		return false;
 	}
-	
-	glVertexPointer(2, GL_FLOAT, 0, &varray.front());
-	glTexCoordPointer(2, GL_FLOAT, 0, &tcarray.front());
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, varray.size()/2);
 
-	if(info_.delta_a_){
-		glDisableClientState(GL_COLOR_ARRAY);
+	if(num_particles() == 0 || !on_screen(area)) {
+		return true;
 	}
-#endif
-	glColor4f(1.0, 1.0, 1.0, 1.0);
+
+	textured_particle_batch& batch = get_textured_batch(particles_[first_].anim->texture(), info_.delta_a_ != 0);
+	add_vertices(e, batch.varray, batch.tcarray, info_.delta_a_ ? &batch.carray : NULL);
+	return true;
 }
 
 particle_system_ptr simple_particle_system_factory::create(const entity& e) const
@@ -640,7 +930,8 @@ struct point_particle_info
 		dot_size(node["dot_size"].as_int(1)*(preferences::double_scale() ? 2 : 1)),
 		dot_rounded(node["dot_rounded"].as_bool(false)),
 	    time_to_live(node["time_to_live"].as_int()),
-	    time_to_live_max(node["time_to_live_rand"].as_int() + time_to_live) {
+	    time_to_live_max(node["time_to_live_rand"].as_int() + time_to_live),
+	    min_spawn_percent(node["min_spawn_percent"].as_int(0)) {
 
 		if(node.has_key("colors")) {
 			const std::vector<variant> colors_vec = node["colors"].as_list();
@@ -704,35 +995,38 @@ struct point_particle_info
 
 	std::vector<unsigned int> colors;
 	int ttl_divisor;
+
+	//the lowest the generation rate is cut to when there are too many
+	//particles.
+	int min_spawn_percent;
 };
 
-class point_particle_system : public particle_system
+class point_particle_system : public batched_particle_system
 {
 public:
-	point_particle_system(const entity& obj, const point_particle_info& info) : obj_(obj), info_(info), particle_generation_(0), generation_rate_millis_(info.generation_rate_millis), pos_x_(info.pos_x), pos_x_rand_(info.pos_x_rand), pos_y_(info.pos_y), pos_y_rand_(info.pos_y_rand) {
+	point_particle_system(const entity& obj, const point_particle_info& info) : obj_(obj), info_(info), particle_generation_(0), generation_rate_millis_(info.generation_rate_millis), pos_x_(info.pos_x), pos_x_rand_(info.pos_x_rand), pos_y_(info.pos_y), pos_y_rand_(info.pos_y_rand), nmove_(0), face_right_(obj.face_right()) {
+		take_particle_buffer(particles_);
+		reset_bounds();
+	}
+
+	~point_particle_system() {
+		return_particle_buffer(particles_);
 	}
 
+	int num_particles() const { return particles_.size(); }
+
 	void process(const entity& e) {
-		particle_generation_ += generation_rate_millis_;
+		//in case the manager didn't get to last cycle's particles.
+		move_queued();
+
+		//fewer particles are generated when there are too many in the level.
+		particle_generation_ += (generation_rate_millis_*spawn_scale(info_.min_spawn_percent))/1000;
+		face_right_ = e.face_right();
 
 		particles_.erase(std::remove_if(particles_.begin(), particles_.end(), particle_destroyed), particles_.end());
 
-		for(std::vector<particle>::iterator p = particles_.begin();
-		    p != particles_.end(); ++p) {
-			p->pos_x += p->velocity_x;
-			p->pos_y += p->velocity_y;
-			if(e.face_right()) {
-				p->velocity_x += info_.accel_x/1000.0;
-			} else {
-				p->velocity_x -= info_.accel_x/1000.0;
-			}
-			p->velocity_y += info_.accel_y/1000.0;
-			p->rgba[0] = std::min(std::max(0, p->rgba[0] + info_.rgba_delta[0]), 255);
-			p->rgba[1] = std::min(std::max(0, p->rgba[1] + info_.rgba_delta[1]), 255);
-			p->rgba[2] = std::min(std::max(0, p->rgba[2] + info_.rgba_delta[2]), 255);
-			p->rgba[3] = std::min(std::max(0, p->rgba[3] + info_.rgba_delta[3]), 255);
-			p->ttl--;
-		}
+		nmove_ = particles_.size();
+		queue_move();
 
 		while(particle_generation_ >= 1000) {
 			//std::cerr << "PARTICLE X ORIGIN: " << pos_x_;
@@ -786,22 +1080,69 @@ public:
 				p.rgba[3] = std::min(std::max(0, p.rgba[3] + rand()%info_.rgba_rand[3]), 255);
 			}
 
+			extend_bounds(p.pos_x/1024, p.pos_y/1024, info_.dot_size);
+
 			particle_generation_ -= 1000;
 		}
 	}
 
 	void draw(const rect& area, const entity& e) const {
-		if(particles_.empty()) {
+		if(particles_.empty() || !on_screen(area)) {
 			return;
 		}
 
 		static std::vector<GLshort> vertex;
 		static std::vector<unsigned int> colors;
-		vertex.resize(particles_.size()*2);
-		colors.resize(particles_.size());
+		vertex.clear();
+		colors.clear();
+		add_vertices(vertex, colors);
+		draw_particle_points(vertex, colors, info_.dot_size, info_.dot_rounded);
+	}
+
+	bool draw_batched(const rect& area, const entity& e) const {
+		if(!batching_particles) {
+			return false;
+		}
 
-		unsigned int* c = &colors[0];
-		GLshort* v = &vertex[0];
+		if(particles_.empty() || !on_screen(area)) {
+			return true;
+		}
+
+		point_particle_batch& batch = get_point_batch(info_.dot_size, info_.dot_rounded);
+		add_vertices(batch.vertex, batch.colors);
+		return true;
+	}
+private:
+	void move_particles() {
+		const double accel_x = (face_right_ ? info_.accel_x : -info_.accel_x)/1000.0;
+		const double accel_y = info_.accel_y/1000.0;
+
+		reset_bounds();
+		for(std::vector<particle>::iterator p = particles_.begin();
+		    p != particles_.begin() + nmove_; ++p) {
+			p->pos_x += p->velocity_x;
+			p->pos_y += p->velocity_y;
+			p->velocity_x += accel_x;
+			p->velocity_y += accel_y;
+			p->rgba[0] = std::min(std::max(0, p->rgba[0] + info_.rgba_delta[0]), 255);
+			p->rgba[1] = std::min(std::max(0, p->rgba[1] + info_.rgba_delta[1]), 255);
+			p->rgba[2] = std::min(std::max(0, p->rgba[2] + info_.rgba_delta[2]), 255);
+			p->rgba[3] = std::min(std::max(0, p->rgba[3] + info_.rgba_delta[3]), 255);
+			p->ttl--;
+		}
+
+		foreach(const particle& p, particles_) {
+			extend_bounds(p.pos_x/1024, p.pos_y/1024, info_.dot_size);
+		}
+	}
+
+	void add_vertices(std::vector<GLshort>& vertex, std::vector<unsigned int>& colors) const {
+		const size_t begin = colors.size();
+		vertex.resize(vertex.size() + particles_.size()*2);
+		colors.resize(colors.size() + particles_.size());
+
+		unsigned int* c = &colors[begin];
+		GLshort* v = &vertex[begin*2];
 		for(std::vector<particle>::const_iterator p = particles_.begin();
 		    p != particles_.end(); ++p) {
 			*v++ = p->pos_x/1024;
@@ -812,39 +1153,8 @@ public:
 				*c++ = p->color;
 			}
 		}
-
-		glColor4f(1.0, 1.0, 1.0, 1.0);
-
-#if defined(USE_SHADERS)
-		// Not dealing with GL_POINT_SMOOTH right now -- this would probably be better as a frgament shader.
-		glPointSize(info_.dot_size);
-		gles2::manager gles2_manager(gles2::get_simple_col_shader());
-		gles2::active_shader()->shader()->vertex_array(2, GL_SHORT, GL_FALSE, 0, &vertex[0]);
-		gles2::active_shader()->shader()->color_array(4, GL_UNSIGNED_BYTE, GL_TRUE, 0, &colors[0]);
-		glDrawArrays(GL_POINTS, 0, particles_.size());
-#else
-		glDisable(GL_TEXTURE_2D);
-		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
-		glEnableClientState(GL_COLOR_ARRAY);
-		if(info_.dot_rounded){
-			glEnable( GL_POINT_SMOOTH );
-		}
-		glPointSize(info_.dot_size);
-
-		glVertexPointer(2, GL_SHORT, 0, &vertex[0]);
-		glColorPointer(4, GL_UNSIGNED_BYTE, 0, &colors[0]);
-		glDrawArrays(GL_POINTS, 0, particles_.size());
-
-		glDisableClientState(GL_COLOR_ARRAY);
-		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-		glEnable(GL_TEXTURE_2D);
-		if(info_.dot_rounded){
-			glDisable( GL_POINT_SMOOTH );
-		}
-#endif
-		glColor4f(1.0, 1.0, 1.0, 1.0);
 	}
-private:
+
 	const entity& obj_;
 	const point_particle_info& info_;
 
@@ -862,6 +1172,11 @@ private:
 	int pos_x_, pos_x_rand_, pos_y_, pos_y_rand_;
 	std::vector<particle> particles_;
 
+	//particles to be moved by the manager, and the way the owner was
+	//facing when it was last processed.
+	int nmove_;
+	bool face_right_;
+
 	variant get_value(const std::string& key) const {
 		return variant();
 	}
@@ -921,3 +1236,91 @@ particle_system_factory::~particle_system_factory()
 particle_system::~particle_system()
 {
 }
+
+namespace particle_system_manager
+{
+
+void process()
+{
+	current_stats.systems = systems_to_move.size();
+	current_stats.particles = 0;
+
+	foreach(const boost::intrusive_ptr<batched_particle_system>& system, systems_to_move) {
+		system->move_queued();
+		current_stats.particles += system->num_particles();
+	}
+
+	systems_to_move.clear();
+
+	//when there are too many particles spawn rates are cut in proportion,
+	//then let recover a little each cycle once there are few enough.
+	if(g_particle_budget > 0 && current_stats.particles > g_particle_budget) {
+		spawn_scale_millis = (spawn_scale_millis*g_particle_budget)/current_stats.particles;
+	} else if(spawn_scale_millis < 1000) {
+		spawn_scale_millis = std::min(1000, spawn_scale_millis + 10);
+	}
+
+	current_stats.spawn_scale_millis = spawn_scale_millis;
+	last_stats.systems = current_stats.systems;
+	last_stats.particles = current_stats.particles;
+	last_stats.spawn_scale_millis = current_stats.spawn_scale_millis;
+}
+
+void begin_frame()
+{
+	last_stats.culled = current_stats.culled;
+	last_stats.draw_calls = current_stats.draw_calls;
+	current_stats.culled = current_stats.draw_calls = 0;
+}
+
+void begin_batching()
+{
+	batching_particles = g_batch_particle_drawing;
+}
+
+void end_batching()
+{
+	flush();
+	batching_particles = false;
+}
+
+bool batching()
+{
+	return batching_particles;
+}
+
+void flush()
+{
+	foreach(textured_particle_batch& batch, textured_batches) {
+		if(batch.varray.empty()) {
+			continue;
+		}
+
+		batch.tex.set_as_current_texture();
+		draw_particle_strip(batch.varray, batch.tcarray, batch.carray, batch.colored);
+		++current_stats.draw_calls;
+
+		batch.varray.clear();
+		batch.tcarray.clear();
+		batch.carray.clear();
+	}
+
+	foreach(point_particle_batch& batch, point_batches) {
+		if(batch.colors.empty()) {
+			continue;
+		}
+
+		draw_particle_points(batch.vertex, batch.colors, batch.dot_size, batch.dot_rounded);
+		++current_stats.draw_calls;
+
+		batch.vertex.clear();
+		batch.colors.clear();
+	}
+}
+
+const stats& get_stats()
+{
+	return last_stats;
+}
+
+}
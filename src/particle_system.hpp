@@ -50,10 +50,59 @@ public:
 	virtual void process(const entity& e) = 0;
 	virtual void draw(const rect& area, const entity& e) const = 0;
 
+	//queues the particles to be drawn along with those of other systems
+	//that use the same texture, if particle_system_manager is batching.
+	//Returns false if they weren't queued, and draw() should be used.
+	virtual bool draw_batched(const rect& area, const entity& e) const { return false; }
+
 	void set_type(const std::string& type) { type_ = type; }
 	const std::string& type() const { return type_; }
 private:
 	std::string type_;
 };
 
+//Simple and point particle systems are moved together once every object
+//has been processed, rather than each one by the object that owns it. The
+//number of particles they have is kept within a budget by cutting how fast
+//they spawn new ones, and while a level is being drawn their particles are
+//queued up and drawn grouped by texture.
+namespace particle_system_manager
+{
+
+//moves the particles of all the systems processed this cycle. Called once
+//a cycle, after objects have been processed.
+void process();
+
+//marks the start of a new frame, for the draw stats. Called once a frame
+//from the main loop, since a level may be drawn more than once a frame.
+void begin_frame();
+
+//while batching, draw_batched() queues particles up. flush() draws all
+//that are queued, and must be called before anything which should be drawn
+//over them. end_batching() flushes.
+void begin_batching();
+void end_batching();
+bool batching();
+void flush();
+
+struct stats {
+	stats() : systems(0), particles(0), culled(0), draw_calls(0), spawn_scale_millis(1000)
+	{}
+
+	//systems moved in the last cycle and the particles they had.
+	int systems, particles;
+
+	//systems not drawn in the last frame since they were off the screen,
+	//and the draw calls used for the particles that were queued.
+	int culled, draw_calls;
+
+	//how much spawn rates are cut by to keep within the budget, out of
+	//1000.
+	int spawn_scale_millis;
+};
+
+const stats& get_stats();
+
+}
+
 #endif
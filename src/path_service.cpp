@@ -0,0 +1,541 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "background_task_pool.hpp"
+#include "entity.hpp"
+#include "foreach.hpp"
+#include "formula_callable.hpp"
+#include "frame_timings.hpp"
+#include "grid_pathfinder.hpp"
+#include "level.hpp"
+#include "object_events.hpp"
+#include "path_service.hpp"
+#include "pathfinding.hpp"
+#include "preferences.hpp"
+#include "thread.hpp"
+
+PREF_INT(path_search_budget, 20000, "Most cells the path service searches each cycle");
+PREF_INT(path_request_timeout, 300, "Cycles after which the path service forgets the search of an object which stops asking for paths");
+
+namespace pathfinding {
+namespace path_service {
+
+namespace {
+
+//no object's search is given less than this many cells a cycle, so with
+//a lot of searches to run only some are run each cycle.
+const int MinSearchBudget = 500;
+
+//how many versions of changed cells a snapshot remembers. Searches older
+//than that are started again.
+const int MaxSnapshotChanges = 16;
+
+//a copy of the level's solidity for one size of tile, which searches run
+//against. It's only changed while no searches are running.
+struct snapshot
+{
+	snapshot(const level& lvl, const point& origin, int width, int height, int cell_width, int cell_height)
+	  : grid(lvl, origin, width, height, cell_width, cell_height),
+	    solid_state_id(lvl.solid_state_id()), version(0)
+	{}
+
+	grid_map grid;
+	int solid_state_id;
+
+	//goes up each time cells change, with the cells which changed in the
+	//most recent versions.
+	int version;
+	std::deque<std::pair<int, std::vector<int> > > changes;
+};
+
+typedef boost::shared_ptr<snapshot> snapshot_ptr;
+
+struct agent
+{
+	agent() : src(-1), dst(-1), requested(false), last_request_cycle(0),
+	          last_served_cycle(-1), version(0), searching(false),
+	          result(incremental_grid_search::NOT_FOUND), budget(0), expanded(0)
+	{}
+
+	entity_ptr obj;
+	snapshot_ptr snap;
+
+	//the last thing asked for, and whether it's still to be searched for.
+	point src_pt, dst_pt;
+	int src, dst;
+	bool requested;
+	int last_request_cycle;
+
+	//the last cycle the search was given cells to search.
+	int last_served_cycle;
+
+	//what's being searched for, the search and the snapshot version it's
+	//up to date with. searching is set if the search ran out of cells to
+	//search last cycle.
+	point search_src_pt, search_dst_pt;
+	boost::shared_ptr<incremental_grid_search> search;
+	int version;
+	bool searching;
+
+	//set before a search is run: cells which have changed since it last
+	//ran, and how many cells it may search.
+	std::vector<int> changed;
+
+	//filled in by the search.
+	incremental_grid_search::RESULT result;
+	int budget, expanded;
+	std::vector<int> path;
+};
+
+typedef boost::shared_ptr<agent> agent_ptr;
+
+const level* current_level = NULL;
+std::map<std::vector<int>, snapshot_ptr> snapshots;
+
+//agents by the label of their object, which is the same for everyone
+//playing the level and across backups, so searches are run and results
+//delivered in the same order.
+std::map<std::string, agent_ptr> agents;
+
+//objects whose requests couldn't be searched for, to be told so next
+//cycle, in the order they asked.
+std::vector<std::string> failed_requests;
+
+//the searches being run.
+std::vector<agent_ptr> batch;
+
+//the thread searches are run on, which is kept while there is a manager
+//and waits for a batch to be started each cycle.
+boost::scoped_ptr<threading::thread> batch_thread;
+threading::mutex batch_mutex;
+threading::condition batch_cond;
+bool batch_running = false;
+bool quit_batch_thread = false;
+
+void search_agents(int begin, int end)
+{
+	for(int n = begin; n != end; ++n) {
+		agent& a = *batch[n];
+		a.expanded = 0;
+		a.path.clear();
+
+		if(a.snap->grid.blocked(a.search->source()) || a.snap->grid.blocked(a.search->destination())) {
+			a.result = incremental_grid_search::NOT_FOUND;
+			continue;
+		}
+
+		if(!a.changed.empty()) {
+			a.search->cells_changed(a.changed);
+			a.changed.clear();
+		}
+
+		a.result = a.search->compute(a.budget, &a.expanded);
+		if(a.result == incremental_grid_search::FOUND && !a.search->get_path(&a.path)) {
+			a.result = incremental_grid_search::NOT_FOUND;
+		}
+	}
+}
+
+void run_batch()
+{
+	const frame_timings::scope timing("path_service");
+	background_task_pool::parallel_for(batch.size(), search_agents);
+}
+
+void batch_thread_main()
+{
+	for(;;) {
+		{
+			threading::lock lck(batch_mutex);
+			while(!batch_running && !quit_batch_thread) {
+				batch_cond.wait(batch_mutex);
+			}
+
+			if(quit_batch_thread) {
+				return;
+			}
+		}
+
+		run_batch();
+
+		threading::lock lck(batch_mutex);
+		batch_running = false;
+		batch_cond.notify_all();
+	}
+}
+
+void finish_batch()
+{
+	threading::lock lck(batch_mutex);
+	while(batch_running) {
+		batch_cond.wait(batch_mutex);
+	}
+}
+
+void deliver_failures(level& lvl)
+{
+	foreach(const std::string& label, failed_requests) {
+		entity_ptr obj = lvl.get_entity_by_label(label);
+		if(obj) {
+			obj->handle_event(OBJECT_EVENT_PATH_NOT_FOUND);
+		}
+	}
+
+	failed_requests.clear();
+}
+
+void deliver_results(level& lvl)
+{
+	foreach(const agent_ptr& a, batch) {
+		frame_timings::add_counter("path_cells_searched", a->expanded);
+
+		a->searching = a->result == incremental_grid_search::INCOMPLETE;
+		if(a->searching) {
+			continue;
+		}
+
+		//the object may have asked for somewhere else or cancelled while
+		//this was being searched for, or be gone from the level.
+		std::map<std::string, agent_ptr>::const_iterator i = agents.find(a->obj->label());
+		if(i == agents.end() || i->second != a || (a->requested && a->dst_pt != a->search_dst_pt) || lvl.get_entity_by_label(a->obj->label()) != a->obj) {
+			continue;
+		}
+
+		game_logic::map_formula_callable_ptr callable(new game_logic::map_formula_callable);
+		if(a->result == incremental_grid_search::FOUND) {
+			std::vector<variant> path;
+			path.push_back(point_as_variant_list(a->search_src_pt));
+			for(int n = 1; n < int(a->path.size()) - 1; ++n) {
+				path.push_back(point_as_variant_list(a->snap->grid.cell_pos(a->path[n])));
+			}
+			path.push_back(point_as_variant_list(a->search_dst_pt));
+
+			callable->add("path", variant(&path));
+			a->obj->handle_event(OBJECT_EVENT_PATH_FOUND, callable.get());
+		} else {
+			a->obj->handle_event(OBJECT_EVENT_PATH_NOT_FOUND, callable.get());
+		}
+	}
+
+	batch.clear();
+}
+
+//brings the snapshots up to date with the level, noting which cells
+//changed so searches can be repaired.
+void update_snapshots(const level& lvl)
+{
+	typedef std::pair<const std::vector<int>, snapshot_ptr> snapshot_pair;
+	foreach(snapshot_pair& p, snapshots) {
+		snapshot& snap = *p.second;
+		std::vector<int> changed;
+		update_grid(lvl, &snap.grid, &snap.solid_state_id, &changed);
+		if(!changed.empty()) {
+			++snap.version;
+			snap.changes.push_back(std::pair<int, std::vector<int> >(snap.version, changed));
+			if(snap.changes.size() > MaxSnapshotChanges) {
+				snap.changes.pop_front();
+			}
+		}
+	}
+}
+
+bool agent_less_recently_served(const agent_ptr& a, const agent_ptr& b)
+{
+	if(a->last_served_cycle != b->last_served_cycle) {
+		return a->last_served_cycle < b->last_served_cycle;
+	}
+
+	return a->obj->label() < b->obj->label();
+}
+
+//gives an agent's search the cells which have changed since it last ran,
+//returning false if it's too far behind and has to be started again.
+bool catch_up(agent& a)
+{
+	if(a.version + MaxSnapshotChanges < a.snap->version) {
+		return false;
+	}
+
+	typedef std::pair<int, std::vector<int> > change;
+	foreach(const change& c, a.snap->changes) {
+		if(c.first > a.version) {
+			a.changed.insert(a.changed.end(), c.second.begin(), c.second.end());
+		}
+	}
+
+	a.version = a.snap->version;
+	return true;
+}
+
+void start_search(agent& a, int src, int dst)
+{
+	a.search.reset(new incremental_grid_search(a.snap->grid, src, dst));
+	a.version = a.snap->version;
+	a.changed.clear();
+}
+
+void start_batch(level& lvl)
+{
+	std::vector<agent_ptr> waiting;
+	std::vector<std::string> expired;
+
+	typedef std::pair<const std::string, agent_ptr> agent_pair;
+	foreach(agent_pair& p, agents) {
+		agent& a = *p.second;
+		if(a.requested || a.searching) {
+			waiting.push_back(p.second);
+		} else if(a.obj->refcount() == 1 || lvl.cycle() - a.last_request_cycle > g_path_request_timeout) {
+			expired.push_back(p.first);
+		}
+	}
+
+	foreach(const std::string& label, expired) {
+		agents.erase(label);
+	}
+
+	if(waiting.empty()) {
+		return;
+	}
+
+	//if not everything can be searched this cycle, the objects whose
+	//searches were run longest ago go first.
+	const int budget = std::max(g_path_search_budget, MinSearchBudget);
+	const int nsearches = std::min<int>(waiting.size(), budget/MinSearchBudget);
+	if(nsearches < waiting.size()) {
+		std::sort(waiting.begin(), waiting.end(), agent_less_recently_served);
+		waiting.resize(nsearches);
+	}
+
+	foreach(const agent_ptr& a, waiting) {
+		if(a->requested) {
+			if(a->search && a->search->destination() == a->dst && catch_up(*a)) {
+				a->search->set_source(a->src);
+			} else {
+				start_search(*a, a->src, a->dst);
+			}
+
+			a->search_src_pt = a->src_pt;
+			a->search_dst_pt = a->dst_pt;
+			a->requested = false;
+		} else if(!catch_up(*a)) {
+			start_search(*a, a->search->source(), a->search->destination());
+		}
+
+		a->budget = budget/nsearches;
+		a->last_served_cycle = lvl.cycle();
+		batch.push_back(a);
+	}
+
+	if(!batch_thread) {
+		run_batch();
+		return;
+	}
+
+	threading::lock lck(batch_mutex);
+	batch_running = true;
+	batch_cond.notify_all();
+}
+
+struct saved_request
+{
+	std::string label;
+	snapshot_ptr snap;
+	point src_pt, dst_pt;
+	int last_request_cycle, last_served_cycle;
+};
+
+}
+
+struct saved_requests
+{
+	std::vector<saved_request> requests;
+	std::vector<std::string> failed;
+};
+
+manager::manager()
+{
+	quit_batch_thread = false;
+	batch_thread.reset(new threading::thread("path_service", batch_thread_main));
+}
+
+manager::~manager()
+{
+	finish_batch();
+	{
+		threading::lock lck(batch_mutex);
+		quit_batch_thread = true;
+		batch_cond.notify_all();
+	}
+
+	batch_thread.reset();
+}
+
+void request(level& lvl, entity_ptr obj, const point& src_pt, const point& dst_pt, int tile_size_x, int tile_size_y)
+{
+	failed_requests.erase(std::remove(failed_requests.begin(), failed_requests.end(), obj->label()), failed_requests.end());
+
+	point origin;
+	int width, height;
+	if(!get_midpoint_grid_layout(lvl.boundaries(), tile_size_x, tile_size_y, &origin, &width, &height)) {
+		agents.erase(obj->label());
+		failed_requests.push_back(obj->label());
+		return;
+	}
+
+	std::vector<int> key;
+	key.push_back(origin.x);
+	key.push_back(origin.y);
+	key.push_back(width);
+	key.push_back(height);
+	key.push_back(tile_size_x);
+	key.push_back(tile_size_y);
+
+	snapshot_ptr& snap = snapshots[key];
+	if(!snap) {
+		snap.reset(new snapshot(lvl, origin, width, height, tile_size_x, tile_size_y));
+	}
+
+	//a search on another size of tile can't be carried on, so the object
+	//gets a new agent. If the old one's search is being run it's left to
+	//finish, and its result is ignored.
+	agent_ptr& a = agents[obj->label()];
+	if(!a || a->snap != snap) {
+		agent_ptr fresh(new agent);
+		if(a) {
+			fresh->last_served_cycle = a->last_served_cycle;
+		}
+
+		a = fresh;
+		a->snap = snap;
+	}
+
+	a->obj = obj;
+
+	a->src_pt = src_pt;
+	a->dst_pt = dst_pt;
+	a->src = snap->grid.cell_at(src_pt);
+	a->dst = snap->grid.cell_at(dst_pt);
+	a->requested = true;
+	a->last_request_cycle = lvl.cycle();
+}
+
+void cancel(const entity& obj)
+{
+	agents.erase(obj.label());
+	failed_requests.erase(std::remove(failed_requests.begin(), failed_requests.end(), obj.label()), failed_requests.end());
+}
+
+void process(level& lvl)
+{
+	if(current_level != &lvl) {
+		clear();
+		current_level = &lvl;
+	}
+
+	finish_batch();
+	deliver_results(lvl);
+	deliver_failures(lvl);
+
+	update_snapshots(lvl);
+	start_batch(lvl);
+}
+
+saved_requests_ptr save()
+{
+	boost::shared_ptr<saved_requests> result(new saved_requests);
+	typedef std::pair<const std::string, agent_ptr> agent_pair;
+	foreach(const agent_pair& p, agents) {
+		const agent& a = *p.second;
+		if(a.requested || a.searching) {
+			saved_request r;
+			r.label = p.first;
+			r.snap = a.snap;
+			r.src_pt = a.src_pt;
+			r.dst_pt = a.dst_pt;
+			r.last_request_cycle = a.last_request_cycle;
+			r.last_served_cycle = a.last_served_cycle;
+			result->requests.push_back(r);
+		}
+	}
+
+	result->failed = failed_requests;
+
+	if(result->requests.empty() && result->failed.empty()) {
+		return saved_requests_ptr();
+	}
+
+	return result;
+}
+
+void restore(level& lvl, const saved_requests_ptr& saved)
+{
+	//another level's requests are forgotten once it's processed.
+	if(current_level != &lvl) {
+		return;
+	}
+
+	finish_batch();
+	batch.clear();
+	agents.clear();
+	failed_requests.clear();
+	if(!saved) {
+		return;
+	}
+
+	failed_requests = saved->failed;
+
+	foreach(const saved_request& r, saved->requests) {
+		entity_ptr obj = lvl.get_entity_by_label(r.label);
+		if(!obj) {
+			continue;
+		}
+
+		agent_ptr a(new agent);
+		a->obj = obj;
+		a->snap = r.snap;
+		a->src_pt = r.src_pt;
+		a->dst_pt = r.dst_pt;
+		a->src = r.snap->grid.cell_at(r.src_pt);
+		a->dst = r.snap->grid.cell_at(r.dst_pt);
+		a->requested = true;
+		a->last_request_cycle = r.last_request_cycle;
+		a->last_served_cycle = r.last_served_cycle;
+		agents[r.label] = a;
+	}
+}
+
+void clear()
+{
+	finish_batch();
+	batch.clear();
+	agents.clear();
+	failed_requests.clear();
+	snapshots.clear();
+	current_level = NULL;
+}
+
+}
+}
@@ -0,0 +1,76 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PATH_SERVICE_HPP_INCLUDED
+#define PATH_SERVICE_HPP_INCLUDED
+
+#include <boost/shared_ptr.hpp>
+
+#include "entity_fwd.hpp"
+#include "geometry.hpp"
+
+class level;
+
+//Finds paths for objects on worker threads, so that many objects asking
+//for paths in the same cycle don't hold up a frame. The searches started
+//in a cycle run against a copy of the level's solidity taken then, while
+//the game carries on, and only search so many cells in total before
+//stopping to carry on next cycle. Results are sent to the object which
+//asked as a path_found event, with a path like plot_path gives, or a
+//path_not_found event. They always arrive the cycle after the search
+//finishes, or for a request which can't be searched at all the cycle after
+//it's made, so replays stay in step.
+//
+//While an object keeps asking for paths to the same place its search is
+//kept, and repaired as the object moves and the level's solidity changes
+//rather than done again.
+namespace pathfinding {
+namespace path_service {
+
+//keeps the thread searches are run on. Without one they're run when
+//they're started.
+struct manager {
+	manager();
+	~manager();
+};
+
+//asks for a path for obj from src to dst, through tiles of the given size,
+//in place of anything obj asked for before.
+void request(level& lvl, entity_ptr obj, const point& src, const point& dst, int tile_size_x, int tile_size_y);
+
+//forgets what obj asked for.
+void cancel(const entity& obj);
+
+//called by the level once a cycle, to deliver the results of the last
+//cycle's searches and start the next ones.
+void process(level& lvl);
+
+//waits for searches being run to finish, and forgets everything.
+void clear();
+
+//what objects have asked for and not yet been given, kept with each level
+//backup. Restoring it forgets the searches being run, and starts again
+//those of the objects as they are in the restored level.
+struct saved_requests;
+typedef boost::shared_ptr<const saved_requests> saved_requests_ptr;
+
+saved_requests_ptr save();
+void restore(level& lvl, const saved_requests_ptr& saved);
+
+}
+}
+
+#endif
@@ -14,9 +14,10 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
-#include <queue>
+#include <algorithm>
 
 #include "math.h"
+#include "grid_pathfinder.hpp"
 #include "level.hpp"
 #include "pathfinding.hpp"
 #include "tile_map.hpp"
@@ -130,14 +131,34 @@ variant weighted_directed_graph::get_value(const std::string& key) const {
 	return variant();
 }*/
 
+dense_graph::dense_graph(weighted_directed_graph& wg)
+	: vertices(wg.get_vertices())
+{
+	for(int n = 0; n != vertices.size(); ++n) {
+		ids[vertices[n]] = n;
+	}
+
+	edge_begin.reserve(vertices.size() + 1);
+	foreach(const variant& v, vertices) {
+		edge_begin.push_back(edge_to.size());
+		foreach(const variant& e, wg.get_edges_from_node(v)) {
+			const int to = id(e);
+			const decimal* weight = wg.find_weight(v, e);
+			if(to != -1 && weight != NULL) {
+				edge_to.push_back(to);
+				edge_weight.push_back(*weight);
+			}
+		}
+	}
+	edge_begin.push_back(edge_to.size());
+}
+
 variant a_star_search(weighted_directed_graph_ptr wg, 
 	const variant src_node, 
 	const variant dst_node, 
 	game_logic::expression_ptr heuristic, 
 	game_logic::map_formula_callable_ptr callable)
 {
-	typedef graph_node<variant, decimal>::graph_node_ptr gnp;
-	std::priority_queue<gnp, std::vector<gnp> > open_list;
 	std::vector<variant> path;
 	variant& a = callable->add_direct_access("a");
 	variant& b = callable->add_direct_access("b");
@@ -147,69 +168,71 @@ variant a_star_search(weighted_directed_graph_ptr wg,
 		return variant(&path);
 	}
 
-	bool searching = true;
-	try {
-		a = src_node;
-		gnp current = wg->get_graph_node(src_node);
-		current->set_cost(decimal::from_int(0), heuristic->evaluate(*callable).as_decimal());
-		current->set_on_open_list(true);
-		open_list.push(current);
-
-		while(searching) {
-			if(open_list.empty()) {
-				// open list is empty node not found.
-				PathfindingException<variant> path_error = {
-					"Open list was empty -- no path found. ", 
-					src_node, 
-					dst_node
-				};
-				throw path_error;
+	const dense_graph& g = wg->get_dense_graph();
+	const int src = g.id(src_node);
+	const int dst = g.id(dst_node);
+	if(src == -1 || dst == -1) {
+		std::cerr << "weighted_directed_graph: No node found having a value of " << (src == -1 ? src_node : dst_node).to_debug_string() << std::endl;
+		return variant(&path);
+	}
+
+	const int nvertices = g.vertices.size();
+	std::vector<decimal> g_cost(nvertices), h_cost(nvertices);
+	std::vector<int> parent(nvertices, -1);
+	std::vector<bool> seen(nvertices);
+	indexed_heap<decimal> open_list;
+	open_list.resize(nvertices);
+
+	a = src_node;
+	g_cost[src] = decimal::from_int(0);
+	h_cost[src] = heuristic->evaluate(*callable).as_decimal();
+	seen[src] = true;
+	open_list.push(src, h_cost[src]);
+
+	while(!open_list.empty()) {
+		const int current = open_list.pop();
+		if(current == dst) {
+			for(int n = dst; n != -1; n = parent[n]) {
+				path.push_back(g.vertices[n]);
 			}
-			current = open_list.top(); open_list.pop();
-			current->set_on_open_list(false);
-
-			if(current->get_node_value() == dst_node) {
-				// Found the path to our node.
-				searching = false;
-				graph_node<variant, decimal>::graph_node_ptr p = current->get_parent();
-				path.push_back(dst_node);
-				while(p != 0) {
-					path.insert(path.begin(),p->get_node_value());
-					p = p->get_parent();
-				}
-				searching = false;
-			} else {
-				// Push lowest f node to the closed list so we don't consider it anymore.
-				current->set_on_closed_list(true);
-				foreach(const variant& e, wg->get_edges_from_node(current->get_node_value())) {
-					graph_node<variant, decimal>::graph_node_ptr neighbour_node = wg->get_graph_node(e);
-					decimal g_cost(current->G() + wg->get_weight(current->get_node_value(), e));
-					if(neighbour_node->on_closed_list() || neighbour_node->on_open_list()) {
-						if(g_cost < neighbour_node->G()) {
-							neighbour_node->G(g_cost);
-							neighbour_node->set_parent(current);
-						}
-					} else {
-						// not on open or closed lists.
-						a = e;
-						neighbour_node->set_parent(current);
-						neighbour_node->set_cost(g_cost, heuristic->evaluate(*callable).as_decimal());
-						neighbour_node->set_on_open_list(true);
-						open_list.push(neighbour_node);
-					}
-				}
+			std::reverse(path.begin(), path.end());
+			return variant(&path);
+		}
+
+		for(int e = g.edge_begin[current]; e != g.edge_begin[current+1]; ++e) {
+			const int neighbour = g.edge_to[e];
+			const decimal cost = g_cost[current] + g.edge_weight[e];
+			if(seen[neighbour] && !(cost < g_cost[neighbour])) {
+				continue;
+			}
+
+			if(!seen[neighbour]) {
+				a = g.vertices[neighbour];
+				h_cost[neighbour] = heuristic->evaluate(*callable).as_decimal();
+				seen[neighbour] = true;
 			}
+
+			// The heuristic may not be consistent, so a node can go back on
+			// the open list if a cheaper way to it turns up.
+			g_cost[neighbour] = cost;
+			parent[neighbour] = current;
+			open_list.push(neighbour, cost + h_cost[neighbour]);
 		}
-	} catch (PathfindingException<variant>& e) {
-		std::cerr << e.msg << " " << e.src.to_debug_string() << ", " << e.dest.to_debug_string() << std::endl;
 	}
-	wg->reset_graph();
+
+	std::cerr << "Open list was empty -- no path found. " << src_node.to_debug_string() << ", " << dst_node.to_debug_string() << std::endl;
 	return variant(&path);
 }
 
+namespace {
+int floor_div(int a, int b) {
+	return a >= 0 ? a/b : -((-a + b - 1)/b);
+}
+}
+
 point get_midpoint(const point& src_pt, const int tile_size_x, const int tile_size_y) {
-	return point(int(src_pt.x/tile_size_x)*tile_size_x + tile_size_x/2,
-		int(src_pt.y/tile_size_y)*tile_size_y + tile_size_y/2);
+	return point(floor_div(src_pt.x, tile_size_x)*tile_size_x + tile_size_x/2,
+		floor_div(src_pt.y, tile_size_y)*tile_size_y + tile_size_y/2);
 }
 
 variant point_as_variant_list(const point& pt) {
@@ -284,6 +307,78 @@ bool graph_node_cmp(const typename graph_node<N,T>::graph_node_ptr& lhs,
 	return lhs->F() < rhs->F();
 }
 
+namespace {
+// A* over the cells of the grid with the weights and heuristic given as
+// formulas, which are evaluated with a and b set to the points being
+// considered.
+bool grid_formula_search(const grid_map& grid, 
+	int src, 
+	int dst, 
+	game_logic::expression_ptr heuristic, 
+	game_logic::expression_ptr weight_expr, 
+	game_logic::map_formula_callable_ptr callable, 
+	std::vector<int>* path) 
+{
+	variant& a = callable->add_direct_access("a");
+	variant& b = callable->add_direct_access("b");
+
+	std::vector<double> g_cost(grid.size()), h_cost(grid.size());
+	std::vector<int> parent(grid.size(), -1);
+	std::vector<bool> seen(grid.size());
+	indexed_heap<double> open_list;
+	open_list.resize(grid.size());
+
+	a = point_as_variant_list(grid.cell_pos(src));
+	b = point_as_variant_list(grid.cell_pos(dst));
+	h_cost[src] = heuristic->evaluate(*callable).as_decimal().as_float();
+	seen[src] = true;
+	open_list.push(src, h_cost[src]);
+
+	while(!open_list.empty()) {
+		const int current = open_list.pop();
+		if(current == dst) {
+			path->clear();
+			for(int n = dst; n != -1; n = parent[n]) {
+				path->push_back(n);
+			}
+			std::reverse(path->begin(), path->end());
+			return true;
+		}
+
+		const int x = grid.x(current);
+		const int y = grid.y(current);
+		for(int dy = -1; dy <= 1; ++dy) {
+			for(int dx = -1; dx <= 1; ++dx) {
+				if((dx == 0 && dy == 0) || grid.blocked(x + dx, y + dy)) {
+					continue;
+				}
+
+				const int neighbour = grid.id(x + dx, y + dy);
+				a = point_as_variant_list(grid.cell_pos(current));
+				b = point_as_variant_list(grid.cell_pos(neighbour));
+				const double cost = g_cost[current] + weight_expr->evaluate(*callable).as_decimal().as_float();
+				if(seen[neighbour] && !(cost < g_cost[neighbour])) {
+					continue;
+				}
+
+				if(!seen[neighbour]) {
+					a = point_as_variant_list(grid.cell_pos(neighbour));
+					b = point_as_variant_list(grid.cell_pos(dst));
+					h_cost[neighbour] = heuristic->evaluate(*callable).as_decimal().as_float();
+					seen[neighbour] = true;
+				}
+
+				g_cost[neighbour] = cost;
+				parent[neighbour] = current;
+				open_list.push(neighbour, cost + h_cost[neighbour]);
+			}
+		}
+	}
+
+	return false;
+}
+}
+
 variant a_star_find_path(level_ptr lvl,
 	const point& src_pt1, 
 	const point& dst_pt1, 
@@ -293,11 +388,7 @@ variant a_star_find_path(level_ptr lvl,
 	const int tile_size_x, 
 	const int tile_size_y) 
 {
-	typedef graph_node<point, double>::graph_node_ptr gnp;
 	std::vector<variant> path;
-	std::priority_queue<gnp> open_list;
-	typedef std::map<point, gnp> graph_node_list;
-	graph_node_list node_list;
 	point src_pt(src_pt1), dst_pt(dst_pt1);
 	// Use some outside knowledge to grab the bounding rect for the level
 	const rect& b_rect = level::current().boundaries();
@@ -305,8 +396,6 @@ variant a_star_find_path(level_ptr lvl,
 	clip_pt_to_rect(dst_pt, b_rect);
 	point src(get_midpoint(src_pt, tile_size_x, tile_size_y));
 	point dst(get_midpoint(dst_pt, tile_size_x, tile_size_y));
-	variant& a = callable->add_direct_access("a");
-	variant& b = callable->add_direct_access("b");
 
 	if(src == dst) {
 		return variant(&path);
@@ -316,96 +405,41 @@ variant a_star_find_path(level_ptr lvl,
 		return variant(&path);
 	}
 
-	bool searching = true;
-	try {
-		a = point_as_variant_list(src);
-		b = point_as_variant_list(dst);
-		graph_node<point, double>::graph_node_ptr current = boost::shared_ptr<graph_node<point, double> >(new graph_node<point, double>(src));
-		current->set_cost(0.0, heuristic->evaluate(*callable).as_decimal().as_float());
-		current->set_on_open_list(true);
-		open_list.push(current);
-		node_list[src] = current;
-
-		while(searching) {
-			if(open_list.empty()) {
-				// open list is empty node not found.
-				PathfindingException<point> path_error = {
-					"Open list was empty -- no path found. ", 
-					src, 
-					dst
-				};
-				throw path_error;
-			}
-			current = open_list.top(); open_list.pop();
-			current->set_on_open_list(false);
-
-			//std::cerr << std::endl << "CURRENT: " << *current;
-			//std::cerr << "OPEN_LIST:\n";
-			//graph_node<point, double>::graph_node_ptr g;
-			//foreach(g, open_list) {
-			//	std::cerr << *g; 
-			//}
-
-			if(current->get_node_value() == dst) {
-				// Found the path to our node.
-				searching = false;
-				graph_node<point, double>::graph_node_ptr p = current->get_parent();
-				path.push_back(point_as_variant_list(dst_pt));
-				while(p != 0) {
-					point pt_to_add = p->get_node_value();
-					if(pt_to_add == src) {
-						pt_to_add = src_pt;
-					}
-					path.insert(path.begin(), point_as_variant_list(pt_to_add));
-					p = p->get_parent();
-				}
-			} else {
-				// Push lowest f node to the closed list so we don't consider it anymore.
-				current->set_on_closed_list(true);
-				// Search through all the neighbour nodes connected to this one.
-				// XXX get_neighbours_from_rect should(?) implement a cache of the point to edges
-				foreach(const point& p, get_neighbours_from_rect(current->get_node_value(), tile_size_x, tile_size_y, b_rect)) {
-					if(!lvl->solid(p.x, p.y, tile_size_x, tile_size_y)) {
-						graph_node_list::const_iterator neighbour_node = node_list.find(p);
-						double g_cost = current->G();
-						if(weight_expr) {
-							a = point_as_variant_list(current->get_node_value());
-							b = point_as_variant_list(p);
-							g_cost += weight_expr->evaluate(*callable).as_decimal().as_float();
-						} else {
-							g_cost += calc_weight(p, current->get_node_value());
-						}
-						if(neighbour_node == node_list.end()) {
-							// not on open or closed list (i.e. no mapping for it yet.
-							a = point_as_variant_list(p);
-							b = point_as_variant_list(dst);
-							graph_node<point, double>::graph_node_ptr new_node = boost::shared_ptr<graph_node<point, double> >(new graph_node<point, double>(p));
-							new_node->set_parent(current);
-							new_node->set_cost(g_cost, heuristic->evaluate(*callable).as_decimal().as_float());
-							new_node->set_on_open_list(true);
-							node_list[p] = new_node;
-							open_list.push(new_node);
-						} else if(neighbour_node->second->on_closed_list() || neighbour_node->second->on_open_list()) {
-							// on closed list.
-							if(g_cost < neighbour_node->second->G()) {
-								neighbour_node->second->G(g_cost);
-								neighbour_node->second->set_parent(current);
-							}
-						} else {
-							PathfindingException<point> path_error = {
-								"graph node on list, but not on open or closed lists. ", 
-								p, 
-								dst_pt
-							};
-							throw path_error;
-						}
-					}
-				}
-			}
+	// The nodes searched are the midpoints of tiles which lie inside the
+	// level, and a node is blocked if the tile sized area starting at
+	// its midpoint is solid.
+	point origin;
+	int width, height;
+	if(!get_midpoint_grid_layout(b_rect, tile_size_x, tile_size_y, &origin, &width, &height)) {
+		return variant(&path);
+	}
+
+	level_grid_ptr lg = get_level_grid(*lvl, origin, width, height, tile_size_x, tile_size_y);
+	const grid_map& grid = lg->grid;
+	const int src_cell = grid.cell_at(src);
+	const int dst_cell = grid.cell_at(dst);
+
+	std::vector<int> cells;
+	if(src_cell == dst_cell) {
+		cells.push_back(src_cell);
+		cells.push_back(dst_cell);
+	} else if(grid.blocked(src_cell) || grid.blocked(dst_cell)) {
+		return variant(&path);
+	} else if(weight_expr) {
+		if(!grid_formula_search(grid, src_cell, dst_cell, heuristic, weight_expr, callable, &cells)) {
+			std::cerr << "Open list was empty -- no path found. (" << src.x << "," << src.y << ") : (" << dst.x << "," << dst.y << ")" << std::endl;
+			return variant(&path);
 		}
-	} catch (PathfindingException<point>& e) {
-		std::cerr << e.msg << " (" << e.src.x << "," << e.src.y << ") : (" << e.dest.x << "," << e.dest.y << ")" << std::endl;
+	} else if(!find_grid_path(*lg, src_cell, dst_cell, &cells)) {
+		std::cerr << "Open list was empty -- no path found. (" << src.x << "," << src.y << ") : (" << dst.x << "," << dst.y << ")" << std::endl;
+		return variant(&path);
+	}
+
+	path.push_back(point_as_variant_list(src_pt));
+	for(int n = 1; n < cells.size() - 1; ++n) {
+		path.push_back(point_as_variant_list(grid.cell_pos(cells[n])));
 	}
+	path.push_back(point_as_variant_list(dst_pt));
 	return variant(&path);
 }
 
@@ -413,51 +447,42 @@ variant a_star_find_path(level_ptr lvl,
 variant path_cost_search(weighted_directed_graph_ptr wg, 
 	const variant src_node, 
 	decimal max_cost ) {
-	typedef graph_node<variant, decimal>::graph_node_ptr gnp;
 	std::vector<variant> reachable;
-	std::priority_queue<gnp> open_list;
-
-	bool searching = true;
-	try {
-		graph_node<variant, decimal>::graph_node_ptr current = wg->get_graph_node(src_node);
-		current->set_cost(decimal::from_int(0), decimal::from_int(0));
-		current->set_on_open_list(true);
-		open_list.push(current);
-
-		while(searching && !open_list.empty()) {
-			current = open_list.top(); open_list.pop();
-			current->set_on_open_list(false);
-			if(current->G() <= max_cost) {
-				reachable.push_back(current->get_node_value());
-			}
+	const dense_graph& g = wg->get_dense_graph();
+	const int src = g.id(src_node);
+	if(src == -1) {
+		std::cerr << "weighted_directed_graph: No node found having a value of " << src_node.to_debug_string() << std::endl;
+		return variant(&reachable);
+	}
 
-			// Push lowest f node to the closed list so we don't consider it anymore.
-			current->set_on_closed_list(true);
-			foreach(const variant& e, wg->get_edges_from_node(current->get_node_value())) {
-				graph_node<variant, decimal>::graph_node_ptr neighbour_node = wg->get_graph_node(e);
-				decimal g_cost(wg->get_weight(current->get_node_value(), e) + current->G());
-				if(neighbour_node->on_closed_list() || neighbour_node->on_open_list()) {
-					if(g_cost < neighbour_node->G()) {
-						neighbour_node->G(g_cost);
-						neighbour_node->set_parent(current);
-					}
-				} else {
-					// not on open or closed lists.
-					neighbour_node->set_parent(current);
-					neighbour_node->set_cost(g_cost, decimal::from_int(0));
-					if(g_cost > max_cost) {
-						neighbour_node->set_on_closed_list(true);
-					} else {
-						neighbour_node->set_on_open_list(true);
-						open_list.push(neighbour_node);
-					}
-				}
+	const int nvertices = g.vertices.size();
+	std::vector<decimal> g_cost(nvertices);
+	std::vector<bool> seen(nvertices), closed(nvertices);
+	indexed_heap<decimal> open_list;
+	open_list.resize(nvertices);
+
+	g_cost[src] = decimal::from_int(0);
+	seen[src] = true;
+	open_list.push(src, g_cost[src]);
+
+	while(!open_list.empty()) {
+		const int current = open_list.pop();
+		closed[current] = true;
+		reachable.push_back(g.vertices[current]);
+
+		for(int e = g.edge_begin[current]; e != g.edge_begin[current+1]; ++e) {
+			const int neighbour = g.edge_to[e];
+			const decimal cost = g_cost[current] + g.edge_weight[e];
+			if(closed[neighbour] || max_cost < cost || (seen[neighbour] && !(cost < g_cost[neighbour]))) {
+				continue;
 			}
+
+			g_cost[neighbour] = cost;
+			seen[neighbour] = true;
+			open_list.push(neighbour, cost);
 		}
-	} catch (PathfindingException<variant>& e) {
-		std::cerr << e.msg << " " << e.src.to_debug_string() << ", " << e.dest.to_debug_string() << std::endl;
 	}
-	wg->reset_graph();
+
 	return variant(&reachable);
 }
 
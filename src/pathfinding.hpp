@@ -111,8 +111,6 @@ bool graph_node_cmp(const typename graph_node<N,T>::graph_node_ptr& lhs,
 	const typename graph_node<N,T>::graph_node_ptr& rhs);
 template<typename N, typename T> T manhattan_distance(const N& p1, const N& p2);
 
-typedef std::map<variant, graph_node<variant, decimal>::graph_node_ptr > vertex_list;
-
 class directed_graph : public game_logic::formula_callable {
 	DECLARE_CALLABLE(directed_graph);
 	std::vector<variant> vertices_;
@@ -136,48 +134,63 @@ public:
 	}
 };
 
+//A weighted graph with its vertices numbered from zero and the edges
+//from each vertex stored together, so searches over it can keep their
+//state in flat arrays rather than maps keyed on variants.
+struct dense_graph {
+	explicit dense_graph(weighted_directed_graph& wg);
+
+	//the number of a vertex, or -1 if it isn't in the graph.
+	int id(const variant& v) const {
+		std::map<variant, int>::const_iterator i = ids.find(v);
+		return i == ids.end() ? -1 : i->second;
+	}
+
+	std::vector<variant> vertices;
+	std::map<variant, int> ids;
+
+	//the edges from vertex n are those from edge_begin[n] up to
+	//edge_begin[n+1]. Edges with no weight aren't included.
+	std::vector<int> edge_begin;
+	std::vector<int> edge_to;
+	std::vector<decimal> edge_weight;
+};
+
 class weighted_directed_graph : public game_logic::formula_callable {
 	DECLARE_CALLABLE(weighted_directed_graph);
 	edge_weights weights_;
 	directed_graph_ptr dg_;
-	vertex_list graph_node_list_;
+	boost::shared_ptr<dense_graph> dense_;
 public:
 	weighted_directed_graph(directed_graph_ptr dg, edge_weights* weights) 
 		: dg_(dg)
 	{
 		weights_.swap(*weights);
-		foreach(const variant& v, dg->get_vertices()) {
-			graph_node_list_[v] = boost::shared_ptr<graph_node<variant, decimal> >(new graph_node<variant, decimal>(v));
-		}
+	}
+	std::vector<variant>& get_vertices() {
+		return dg_->get_vertices();
 	}
 	std::vector<variant> get_edges_from_node(const variant node) const {
 		return dg_->get_edges_from_node(node);
 	}
-	decimal get_weight(const variant& src, const variant& dest) const {
+	const decimal* find_weight(const variant& src, const variant& dest) const {
 		edge_weights::const_iterator w = weights_.find(graph_edge(src,dest));
-		if(w != weights_.end()) {
-			return w->second;
+		return w != weights_.end() ? &w->second : NULL;
+	}
+	decimal get_weight(const variant& src, const variant& dest) const {
+		const decimal* w = find_weight(src, dest);
+		if(w != NULL) {
+			return *w;
 		}
 		PathfindingException<variant> weighted_graph_error = {"Couldn't find edge weight for nodes.", src, dest};
 		throw weighted_graph_error;
 	}
-	graph_node<variant, decimal>::graph_node_ptr get_graph_node(const variant& src) {
-		vertex_list::const_iterator it = graph_node_list_.find(src);
-		if(it != graph_node_list_.end()) {
-			return it->second;
-		}
-		PathfindingException<variant> src_not_found = {
-			"weighted_directed_graph::get_graph_node() No node found having a value of ",
-			src,
-			variant()
-		};
-		throw src_not_found;
-	}
-	void reset_graph() {
-		std::pair<variant, graph_node<variant, decimal>::graph_node_ptr> p;
-		foreach(p, graph_node_list_) {
-			p.second->reset_node();
+	// Built the first time the graph is searched.
+	const dense_graph& get_dense_graph() {
+		if(!dense_) {
+			dense_.reset(new dense_graph(*this));
 		}
+		return *dense_;
 	}
 };
 
@@ -24,6 +24,7 @@
 #include <cmath>
 #include <chrono>
 
+#include "background_task_pool.hpp"
 #include "graphics.hpp"
 
 #include "psystem2.hpp"
@@ -51,6 +52,9 @@ namespace graphics
 				}
 				return *res;
 			}
+
+			// Fewest particles worth handing to a thread of their own.
+			const size_t particles_per_thread = 8192;
 		}
 
 		void init_physics_parameters(physics_parameters& pp)
@@ -96,6 +100,138 @@ namespace graphics
 			return os;
 		}
 
+		void particle_store::reserve(size_t n)
+		{
+			position.reserve(n);
+			direction.reserve(n);
+			dimensions.reserve(n);
+			color.reserve(n);
+			orientation.reserve(n);
+			time_to_live.reserve(n);
+			mass.reserve(n);
+			velocity.reserve(n);
+			initial_direction.reserve(n);
+			initial_color.reserve(n);
+			initial_time_to_live.reserve(n);
+			emitted_by.reserve(n);
+		}
+
+		void particle_store::clear()
+		{
+			resize(0);
+		}
+
+		void particle_store::resize(size_t n)
+		{
+			position.resize(n);
+			direction.resize(n);
+			dimensions.resize(n);
+			color.resize(n);
+			orientation.resize(n);
+			time_to_live.resize(n);
+			mass.resize(n);
+			velocity.resize(n);
+			initial_direction.resize(n);
+			initial_color.resize(n);
+			initial_time_to_live.resize(n);
+			emitted_by.resize(n);
+		}
+
+		void particle_store::push_back(const particle& p)
+		{
+			position.push_back(p.current.position);
+			direction.push_back(p.current.direction);
+			dimensions.push_back(p.current.dimensions);
+			color.push_back(p.current.color);
+			orientation.push_back(p.current.orientation);
+			time_to_live.push_back(p.current.time_to_live);
+			mass.push_back(p.current.mass);
+			velocity.push_back(p.current.velocity);
+			initial_direction.push_back(p.initial.direction);
+			initial_color.push_back(p.initial.color);
+			initial_time_to_live.push_back(p.initial.time_to_live);
+			emitted_by.push_back(p.emitted_by);
+		}
+
+		particle particle_store::get(size_t n) const
+		{
+			particle p;
+			p.current.position = position[n];
+			p.current.direction = direction[n];
+			p.current.dimensions = dimensions[n];
+			p.current.color = color[n];
+			p.current.orientation = orientation[n];
+			p.current.time_to_live = time_to_live[n];
+			p.current.mass = mass[n];
+			p.current.velocity = velocity[n];
+			// starting values which aren't kept are taken from the current ones.
+			p.initial = p.current;
+			p.initial.direction = initial_direction[n];
+			p.initial.color = initial_color[n];
+			p.initial.time_to_live = initial_time_to_live[n];
+			p.emitted_by = emitted_by[n];
+			return p;
+		}
+
+		void particle_store::set(size_t n, const particle& p)
+		{
+			position[n] = p.current.position;
+			direction[n] = p.current.direction;
+			dimensions[n] = p.current.dimensions;
+			color[n] = p.current.color;
+			orientation[n] = p.current.orientation;
+			time_to_live[n] = p.current.time_to_live;
+			mass[n] = p.current.mass;
+			velocity[n] = p.current.velocity;
+		}
+
+		void particle_store::move_particle(size_t to, size_t from)
+		{
+			position[to] = position[from];
+			direction[to] = direction[from];
+			dimensions[to] = dimensions[from];
+			color[to] = color[from];
+			orientation[to] = orientation[from];
+			time_to_live[to] = time_to_live[from];
+			mass[to] = mass[from];
+			velocity[to] = velocity[from];
+			initial_direction[to] = initial_direction[from];
+			initial_color[to] = initial_color[from];
+			initial_time_to_live[to] = initial_time_to_live[from];
+			emitted_by[to] = emitted_by[from];
+		}
+
+		void particle_store::remove_expired()
+		{
+			const size_t count = size();
+			size_t n = 0;
+			while(n != count && time_to_live[n] >= 0.0f) {
+				++n;
+			}
+			if(n == count) {
+				return;
+			}
+
+			size_t dst = n;
+			for(++n; n != count; ++n) {
+				if(time_to_live[n] >= 0.0f) {
+					move_particle(dst++, n);
+				}
+			}
+			resize(dst);
+		}
+
+		void for_particle_ranges(size_t begin, size_t end, bool parallel, const std::function<void(size_t,size_t)>& fn)
+		{
+			if(!parallel || end - begin < particles_per_thread*2) {
+				fn(begin, end);
+				return;
+			}
+			background_task_pool::parallel_for(int(end - begin), [&](int b, int e) {
+				fn(begin + b, begin + e);
+			}, particles_per_thread);
+		}
+
 		std::ostream& operator<<(std::ostream& os, const particle& p) 
 		{
 			os << "P"<< p.current.position 
@@ -441,8 +577,9 @@ namespace graphics
 			}
 
 			// Decrement the ttl on particles
-			for(auto& p : active_particles_) {
-				p.current.time_to_live -= process_step_time;
+			particle_store& ps = active_particles_;
+			for(float& ttl : ps.time_to_live) {
+				ttl -= process_step_time;
 			}
 			// Decrement the ttl on instanced emitters
 			for(auto e : instanced_emitters_) {
@@ -450,9 +587,7 @@ namespace graphics
 			}
 
 			// Kill end-of-life particles
-			active_particles_.erase(std::remove_if(active_particles_.begin(), active_particles_.end(),
-				[](decltype(active_particles_[0]) p){return p.current.time_to_live < 0.0f;}), 
-				active_particles_.end());
+			ps.remove_expired();
 			// Kill end-of-life emitters
 			instanced_emitters_.erase(std::remove_if(instanced_emitters_.begin(), instanced_emitters_.end(),
 				[](decltype(instanced_emitters_[0]) e){return e->current.time_to_live < 0.0f;}), 
@@ -468,14 +603,24 @@ namespace graphics
 			}
 
 			// update particle positions
-			for(auto& p : active_particles_) {
-				if(max_velocity_ && p.current.velocity*glm::length(p.current.direction) > *max_velocity_) {
-					p.current.direction *= *max_velocity_ / glm::length(p.current.direction);
-				}
-
-				p.current.position += p.current.direction * /*scale_velocity * */ t;
-
-				//std::cerr << p << std::endl;
+			if(!ps.empty()) {
+				glm::vec3* position = &ps.position[0];
+				glm::vec3* direction = &ps.direction[0];
+				const float* velocity = &ps.velocity[0];
+				const float* max_velocity = max_velocity_.get();
+				for_particle_ranges(0, ps.size(), true, [=](size_t begin, size_t end) {
+					if(max_velocity) {
+						for(size_t n = begin; n != end; ++n) {
+							const float len = glm::length(direction[n]);
+							if(velocity[n]*len > *max_velocity) {
+								direction[n] *= *max_velocity / len;
+							}
+						}
+					}
+					for(size_t n = begin; n != end; ++n) {
+						position[n] += direction[n] * /*scale_velocity * */ t;
+					}
+				});
 			}
 
 			//std::cerr << "XXX: Active Particle Count: " << active_particles_.size() << std::endl;
@@ -505,10 +650,12 @@ namespace graphics
 			}
 
 #if defined(USE_SHADERS)
-			shader_->vertex_array(3, GL_FLOAT, GL_FALSE, sizeof(particle), &active_particles_[0].current.position);
-			shader_->color_array(4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(particle), &active_particles_[0].current.color);
-			shader_->vertex_attrib_array(a_dimensions_, 3, GL_FLOAT, GL_FALSE, sizeof(particle), &active_particles_[0].current.dimensions);
-			glDrawArrays(GL_POINTS, 0, active_particles_.size());
+			if(!active_particles_.empty()) {
+				shader_->vertex_array(3, GL_FLOAT, GL_FALSE, 0, &active_particles_.position[0]);
+				shader_->color_array(4, GL_UNSIGNED_BYTE, GL_TRUE, 0, &active_particles_.color[0]);
+				shader_->vertex_attrib_array(a_dimensions_, 3, GL_FLOAT, GL_FALSE, 0, &active_particles_.dimensions[0]);
+				glDrawArrays(GL_POINTS, 0, active_particles_.size());
+			}
 #endif
 			if(material_) {
 				material_->unapply();
@@ -23,6 +23,7 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <random>
 
@@ -78,6 +79,51 @@ namespace graphics
 			emitter* emitted_by;
 		};
 
+		// The particles belonging to a technique, kept as an array per attribute
+		// rather than an array of particle structures. Affectors mostly touch one
+		// or two attributes of every particle, so this keeps what they read packed
+		// together and lets their loops be vectorised. Only the starting values
+		// that something reads are kept.
+		class particle_store
+		{
+		public:
+			size_t size() const { return time_to_live.size(); }
+			bool empty() const { return time_to_live.empty(); }
+			void reserve(size_t n);
+			void clear();
+
+			void push_back(const particle& p);
+			particle get(size_t n) const;
+			void set(size_t n, const particle& p);
+
+			// Drops particles whose time to live has run out. The survivors are
+			// moved down over the gaps in a single pass, so they keep their order.
+			void remove_expired();
+
+			std::vector<glm::vec3> position;
+			std::vector<glm::vec3> direction;
+			std::vector<glm::vec3> dimensions;
+			std::vector<color_vector> color;
+			std::vector<glm::quat> orientation;
+			std::vector<float> time_to_live;
+			std::vector<float> mass;
+			std::vector<float> velocity;
+
+			std::vector<glm::vec3> initial_direction;
+			std::vector<color_vector> initial_color;
+			std::vector<float> initial_time_to_live;
+
+			std::vector<emitter*> emitted_by;
+		private:
+			void move_particle(size_t to, size_t from);
+			void resize(size_t n);
+		};
+
+		// Calls fn(begin, end) over ranges covering [begin, end). If parallel is
+		// set and there are enough particles the ranges are run on worker
+		// threads, otherwise fn is just called once with the whole range.
+		void for_particle_ranges(size_t begin, size_t end, bool parallel, const std::function<void(size_t,size_t)>& fn);
+
 		// General class for emitter objects which encapsulate and exposes physical parameters
 		// Used as a base class for everything that is not 
 		class emit_object : public particle
@@ -158,7 +204,7 @@ namespace graphics
 			void set_parent(particle_system* parent);
 			void set_shader(gles2::program_ptr shader);
 			// Direct access here for *speed* reasons.
-			std::vector<particle>& active_particles() { return active_particles_; }
+			particle_store& active_particles() { return active_particles_; }
 			std::vector<emitter_ptr>& active_emitters() { return instanced_emitters_; }
 			std::vector<affector_ptr>& active_affectors() { return instanced_affectors_; }
 			void add_emitter(emitter_ptr e);
@@ -195,7 +241,7 @@ namespace graphics
 			gles2::program_ptr shader_;
 
 			// List of particles currently active.
-			std::vector<particle> active_particles_;
+			particle_store active_particles_;
 
 			technique();
 		};
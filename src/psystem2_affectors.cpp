@@ -22,10 +22,12 @@
 */
 
 #include "asserts.hpp"
+#include "json_parser.hpp"
 #include "psystem2.hpp"
 #include "psystem2_affectors.hpp"
 #include "psystem2_emitters.hpp"
 #include "psystem2_parameters.hpp"
+#include "unit_test.hpp"
 
 namespace graphics
 {
@@ -38,6 +40,8 @@ namespace graphics
 			virtual ~time_color_affector() {}
 		protected:
 			virtual void internal_apply(particle& p, float t);
+			virtual void internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t);
+			virtual bool is_thread_safe() const { return true; }
 			virtual affector* clone() {
 				return new time_color_affector(*this);
 			}
@@ -50,7 +54,8 @@ namespace graphics
 			typedef std::pair<float,glm::vec4> tc_pair;
 			std::vector<tc_pair> tc_data_;
 
-			std::vector<tc_pair>::iterator find_nearest_color(float dt);
+			std::vector<tc_pair>::const_iterator find_nearest_color(float dt) const;
+			color_vector calculate_color(float ttl_percentage, const color_vector& initial) const;
 
 			time_color_affector();
 		};
@@ -62,6 +67,8 @@ namespace graphics
 			virtual ~jet_affector() {}
 		protected:
 			virtual void internal_apply(particle& p, float t);
+			virtual void internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t);
+			virtual bool is_thread_safe() const { return acceleration_->type() != parameter::PARAMETER_RANDOM; }
 			virtual affector* clone() {
 				return new jet_affector(*this);
 			}
@@ -92,6 +99,8 @@ namespace graphics
 			virtual ~scale_affector() {}
 		protected:
 			virtual void internal_apply(particle& p, float t);
+			virtual void internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t);
+			virtual bool is_thread_safe() const;
 			virtual affector* clone() {
 				return new scale_affector(*this);
 			}
@@ -101,7 +110,7 @@ namespace graphics
 			parameter_ptr scale_z_;
 			parameter_ptr scale_xyz_;
 			bool since_system_start_;
-			float calculate_scale(parameter_ptr s, const particle& p);
+			float calculate_scale(const parameter_ptr& s, float time_to_live, float initial_time_to_live);
 			scale_affector();
 		};
 
@@ -112,6 +121,8 @@ namespace graphics
 			virtual ~vortex_affector() {}
 		protected:
 			virtual void internal_apply(particle& p, float t);
+			virtual void internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t);
+			virtual bool is_thread_safe() const { return true; }
 			virtual affector* clone() {
 				return new vortex_affector(*this);
 			}
@@ -128,6 +139,8 @@ namespace graphics
 			virtual ~gravity_affector()  {}
 		protected:
 			virtual void internal_apply(particle& p, float t);
+			virtual void internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t);
+			virtual bool is_thread_safe() const { return true; }
 			virtual affector* clone() {
 				return new gravity_affector(*this);
 			}
@@ -147,21 +160,20 @@ namespace graphics
 			virtual ~particle_follower_affector() {}
 		protected:
 			virtual void handle_process(float t) {
-				std::vector<particle>& particles = get_technique()->active_particles();
 				// keeps particles following wihin [min_distance, max_distance]
-				if(particles.size() < 1) {
-					return;
-				}
-				prev_particle_ = particles.begin();
-				for(auto p = particles.begin(); p != particles.end(); ++p) {
-					internal_apply(*p, t);
-					prev_particle_ = p;
+				// of the particle before them, so has to go through them in order.
+				particle_store& ps = get_technique()->active_particles();
+				for(size_t n = 1; n < ps.size(); ++n) {
+					follow(ps.position[n-1], ps.position[n]);
 				}
 			}
 			virtual void internal_apply(particle& p, float t) {
-				auto distance = glm::length(p.current.position - prev_particle_->current.position);
+				// only particles are moved, relative to each other, in handle_process().
+			}
+			void follow(const glm::vec3& prev, glm::vec3& position) const {
+				auto distance = glm::length(position - prev);
 				if(distance > min_distance_ && distance < max_distance_) {
-					p.current.position = prev_particle_->current.position + (min_distance_/distance)*(p.current.position-prev_particle_->current.position);
+					position = prev + (min_distance_/distance)*(position-prev);
 				}
 			}
 			virtual affector* clone() {
@@ -170,7 +182,6 @@ namespace graphics
 		private:
 			float min_distance_;
 			float max_distance_;
-			std::vector<particle>::iterator prev_particle_;
 			particle_follower_affector();
 		};
 
@@ -183,26 +194,22 @@ namespace graphics
 			virtual ~align_affector() {}
 		protected:
 			virtual void internal_apply(particle& p, float t) {
-				glm::vec3 distance = prev_particle_->current.position - p.current.position;
-				if(resize_) {
-					p.current.dimensions.y = glm::length(distance);
-				}
-				if(std::abs(glm::length(distance)) > 1e-12) {
-					distance = glm::normalize(distance);
-				}
-				p.current.orientation.x = distance.x;
-				p.current.orientation.y = distance.y;
-				p.current.orientation.z = distance.z;
+				// only particles are aligned, with each other, in handle_process().
 			}
 			virtual void handle_process(float t) {
-				std::vector<particle>& particles = get_technique()->active_particles();
-				if(particles.size() < 1) {
-					return;
-				}
-				prev_particle_ = particles.begin();				
-				for(auto p = particles.begin(); p != particles.end(); ++p) {
-					internal_apply(*p, t);
-					prev_particle_ = p;
+				// each particle points at the one before it, the first one at itself.
+				particle_store& ps = get_technique()->active_particles();
+				for(size_t n = 0; n < ps.size(); ++n) {
+					glm::vec3 distance = ps.position[n == 0 ? 0 : n-1] - ps.position[n];
+					if(resize_) {
+						ps.dimensions[n].y = glm::length(distance);
+					}
+					if(std::abs(glm::length(distance)) > 1e-12) {
+						distance = glm::normalize(distance);
+					}
+					ps.orientation[n].x = distance.x;
+					ps.orientation[n].y = distance.y;
+					ps.orientation[n].z = distance.z;
 				}
 			}
 			virtual affector* clone() {
@@ -210,7 +217,6 @@ namespace graphics
 			}
 		private:
 			bool resize_;			
-			std::vector<particle>::iterator prev_particle_;
 			align_affector();
 		};
 
@@ -247,12 +253,21 @@ namespace graphics
 						get_random_float(-max_deviation_.z, max_deviation_.z));
 				}
 			}
-			void handle_apply(std::vector<particle>& particles, float t) {
+			virtual void internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t) {
+				glm::vec3* v = random_direction_ ? &ps.direction[0] : &ps.position[0];
+				const glm::vec3 s = random_direction_ ? glm::vec3(1.0f) : scale();
+				for(size_t n = begin; n != end; ++n) {
+					v[n] += s * glm::vec3(get_random_float(-max_deviation_.x, max_deviation_.x),
+						get_random_float(-max_deviation_.y, max_deviation_.y),
+						get_random_float(-max_deviation_.z, max_deviation_.z));
+				}
+			}
+			void handle_apply(particle_store& particles, float t) {
 				last_update_time_[0] += t;
 				if(last_update_time_[0] > time_step_) {
 					last_update_time_[0] -= time_step_;
-					for(auto& p : particles) {
-						internal_apply(p, t);
+					if(!particles.empty()) {
+						internal_apply_batch(particles, 0, particles.size(), t);
 					}
 				}
 			}
@@ -340,6 +355,19 @@ namespace graphics
 					p.current.direction = (p.current.direction + force_vector_)/2.0f;
 				}
 			}
+			virtual void internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t) {
+				glm::vec3* direction = &ps.direction[0];
+				if(fa_ == FA_ADD) {
+					for(size_t n = begin; n != end; ++n) {
+						direction[n] += scale_vector_;
+					}
+				} else {
+					for(size_t n = begin; n != end; ++n) {
+						direction[n] = (direction[n] + force_vector_)/2.0f;
+					}
+				}
+			}
+			virtual bool is_thread_safe() const { return true; }
 			virtual affector* clone() {
 				return new sine_force_affector(*this);
 			}
@@ -388,11 +416,56 @@ namespace graphics
 					internal_apply(*e,t);
 				}
 			}
-			for(auto& p : technique_->active_particles()) {
-				ASSERT_LOG(p.emitted_by != NULL, "FATAL: PSYSTEM2: p.emitted_by is null");
-				if(!is_emitter_excluded(p.emitted_by->name())) {
-					internal_apply(p,t);
+			apply_to_particles(technique_->active_particles(), t);
+		}
+
+		void affector::apply_to_particles(particle_store& ps, float t)
+		{
+			const size_t count = ps.size();
+			if(excluded_emitters_.empty()) {
+				for_particle_ranges(0, count, is_thread_safe(), [&](size_t begin, size_t end) {
+					internal_apply_batch(ps, begin, end, t);
+				});
+				return;
+			}
+
+			// Otherwise runs of particles from emitters which aren't excluded
+			// are applied together. Particles from the same emitter tend to be
+			// next to each other, so the last emitter looked up is remembered.
+			emitter* last_emitter = NULL;
+			bool last_excluded = false;
+			auto excluded = [&](size_t n) -> bool {
+				if(ps.emitted_by[n] != last_emitter || last_emitter == NULL) {
+					last_emitter = ps.emitted_by[n];
+					ASSERT_LOG(last_emitter != NULL, "FATAL: PSYSTEM2: p.emitted_by is null");
+					last_excluded = is_emitter_excluded(last_emitter->name());
+				}
+				return last_excluded;
+			};
+
+			size_t n = 0;
+			while(n != count) {
+				while(n != count && excluded(n)) {
+					++n;
+				}
+				const size_t begin = n;
+				while(n != count && !excluded(n)) {
+					++n;
 				}
+				if(begin != n) {
+					for_particle_ranges(begin, n, is_thread_safe(), [&](size_t b, size_t e) {
+						internal_apply_batch(ps, b, e, t);
+					});
+				}
+			}
+		}
+
+		void affector::internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t)
+		{
+			for(size_t n = begin; n != end; ++n) {
+				particle p = ps.get(n);
+				internal_apply(p, t);
+				ps.set(n, p);
 			}
 		}
 
@@ -492,8 +565,24 @@ namespace graphics
 
 		void time_color_affector::internal_apply(particle& p, float t)
 		{
-			glm::vec4 c;
 			float ttl_percentage = 1.0f - p.current.time_to_live / p.initial.time_to_live;
+			p.current.color = calculate_color(ttl_percentage, p.initial.color);
+		}
+
+		void time_color_affector::internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t)
+		{
+			color_vector* color = &ps.color[0];
+			const color_vector* initial_color = &ps.initial_color[0];
+			const float* ttl = &ps.time_to_live[0];
+			const float* initial_ttl = &ps.initial_time_to_live[0];
+			for(size_t n = begin; n != end; ++n) {
+				color[n] = calculate_color(1.0f - ttl[n] / initial_ttl[n], initial_color[n]);
+			}
+		}
+
+		color_vector time_color_affector::calculate_color(float ttl_percentage, const color_vector& initial) const
+		{
+			glm::vec4 c;
 			auto it1 = find_nearest_color(ttl_percentage);
 			auto it2 = it1 + 1;
 			if(it2 != tc_data_.end()) {
@@ -502,20 +591,20 @@ namespace graphics
 				c = it1->second;
 			}
 			if(operation_ == COLOR_OP_SET) {
-				p.current.color = color_vector(color_vector::value_type(c.r*255.0f), 
+				return color_vector(color_vector::value_type(c.r*255.0f), 
 					color_vector::value_type(c.g*255.0f), 
 					color_vector::value_type(c.b*255.0f), 
 					color_vector::value_type(c.a*255.0f));
 			} else {
-				p.current.color = color_vector(color_vector::value_type(c.r*p.initial.color.r), 
-					color_vector::value_type(c.g*p.initial.color.g), 
-					color_vector::value_type(c.b*p.initial.color.b), 
-					color_vector::value_type(c.a*p.initial.color.a));
+				return color_vector(color_vector::value_type(c.r*initial.r), 
+					color_vector::value_type(c.g*initial.g), 
+					color_vector::value_type(c.b*initial.b), 
+					color_vector::value_type(c.a*initial.a));
 			}
 		}
 
 		// Find nearest iterator to the time fraction "dt"
-		std::vector<time_color_affector::tc_pair>::iterator time_color_affector::find_nearest_color(float dt)
+		std::vector<time_color_affector::tc_pair>::const_iterator time_color_affector::find_nearest_color(float dt) const
 		{
 			auto it = tc_data_.begin();
 			for(; it != tc_data_.end(); ++it) {
@@ -550,6 +639,25 @@ namespace graphics
 			}
 		}
 
+		void jet_affector::internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t)
+		{
+			glm::vec3* direction = &ps.direction[0];
+			const glm::vec3* initial_direction = &ps.initial_direction[0];
+			if(acceleration_->type() == parameter::PARAMETER_FIXED) {
+				const float scale = t * acceleration_->get_value(0.0f);
+				for(size_t n = begin; n != end; ++n) {
+					direction[n] += initial_direction[n] * scale;
+				}
+				return;
+			}
+
+			const float* ttl = &ps.time_to_live[0];
+			const float* initial_ttl = &ps.initial_time_to_live[0];
+			for(size_t n = begin; n != end; ++n) {
+				direction[n] += initial_direction[n] * (t * acceleration_->get_value(1.0f - ttl[n]/initial_ttl[n]));
+			}
+		}
+
 		vortex_affector::vortex_affector(particle_system_container* parent, const variant& node)
 			: affector(parent, node), rotation_axis_(1.0f, 0.0f, 0.0f, 0.0f)
 		{
@@ -572,6 +680,19 @@ namespace graphics
 			p.current.direction = rotation_axis_ * p.current.direction;
 		}
 
+		void vortex_affector::internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t)
+		{
+			// rotating by a quaternion is a linear map, so work out its matrix once.
+			const glm::mat3 rotation = glm::toMat3(rotation_axis_);
+			const glm::vec3 centre = position();
+			glm::vec3* pos = &ps.position[0];
+			glm::vec3* direction = &ps.direction[0];
+			for(size_t n = begin; n != end; ++n) {
+				pos[n] = centre + rotation * (pos[n] - centre);
+				direction[n] = rotation * direction[n];
+			}
+		}
+
 		gravity_affector::gravity_affector(particle_system_container* parent, const variant& node)
 			: affector(parent, node), gravity_(float(node["gravity"].as_decimal(decimal(1.0)).as_float()))
 		{
@@ -587,6 +708,22 @@ namespace graphics
 			}
 		}
 
+		void gravity_affector::internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t)
+		{
+			const glm::vec3 centre = position();
+			const float k = gravity_ * mass() * t;
+			const glm::vec3* pos = &ps.position[0];
+			const float* m = &ps.mass[0];
+			glm::vec3* direction = &ps.direction[0];
+			for(size_t n = begin; n != end; ++n) {
+				const glm::vec3 d = centre - pos[n];
+				const float len_sqr = d.x*d.x + d.y*d.y + d.z*d.z;
+				if(len_sqr > 0) {
+					direction[n] += ((k * m[n]) / len_sqr) * d;
+				}
+			}
+		}
+
 		scale_affector::scale_affector(particle_system_container* parent, const variant& node)
 			: affector(parent, node), since_system_start_(node["since_system_start"].as_bool(false))
 		{
@@ -604,21 +741,66 @@ namespace graphics
 			}
 		}
 
-		float scale_affector::calculate_scale(parameter_ptr s, const particle& p)
+		float scale_affector::calculate_scale(const parameter_ptr& s, float time_to_live, float initial_time_to_live)
 		{
 			float scale;
 			if(since_system_start_) {
 				scale = s->get_value(get_technique()->get_particle_system()->elapsed_time());
 			} else {
-				scale = s->get_value(1.0f - p.current.time_to_live / p.initial.time_to_live);
+				scale = s->get_value(1.0f - time_to_live / initial_time_to_live);
 			}
 			return scale;
 		}
 
+		bool scale_affector::is_thread_safe() const
+		{
+			const parameter_ptr* params[] = { &scale_x_, &scale_y_, &scale_z_, &scale_xyz_ };
+			for(auto p : params) {
+				if(*p && (*p)->type() == parameter::PARAMETER_RANDOM) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void scale_affector::internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t)
+		{
+			glm::vec3* dimensions = &ps.dimensions[0];
+			const float* ttl = &ps.time_to_live[0];
+			const float* initial_ttl = &ps.initial_time_to_live[0];
+			if(scale_xyz_) {
+				for(size_t n = begin; n != end; ++n) {
+					const glm::vec3 value = dimensions[n] + calculate_scale(scale_xyz_, ttl[n], initial_ttl[n]);
+					dimensions[n].x = value.x > 0 ? value.x : dimensions[n].x;
+					dimensions[n].y = value.y > 0 ? value.y : dimensions[n].y;
+					dimensions[n].z = value.z > 0 ? value.z : dimensions[n].z;
+				}
+				return;
+			}
+			if(scale_x_) {
+				for(size_t n = begin; n != end; ++n) {
+					const float value = dimensions[n].x + calculate_scale(scale_x_, ttl[n], initial_ttl[n]);
+					dimensions[n].x = value > 0 ? value : dimensions[n].x;
+				}
+			}
+			if(scale_y_) {
+				for(size_t n = begin; n != end; ++n) {
+					const float value = dimensions[n].x + calculate_scale(scale_y_, ttl[n], initial_ttl[n]);
+					dimensions[n].y = value > 0 ? value : dimensions[n].y;
+				}
+			}
+			if(scale_z_) {
+				for(size_t n = begin; n != end; ++n) {
+					const float value = dimensions[n].z + calculate_scale(scale_z_, ttl[n], initial_ttl[n]);
+					dimensions[n].z = value > 0 ? value : dimensions[n].z;
+				}
+			}
+		}
+
 		void scale_affector::internal_apply(particle& p, float t)
 		{
 			if(scale_xyz_) {
-				float calc_scale = calculate_scale(scale_xyz_, p);
+				float calc_scale = calculate_scale(scale_xyz_, p.current.time_to_live, p.initial.time_to_live);
 				float value = p.current.dimensions.x + calc_scale /** affector_scale.x*/;
 				if(value > 0) {
 					p.current.dimensions.x = value;
@@ -633,21 +815,21 @@ namespace graphics
 				}
 			} else {
 				if(scale_x_) {
-					float calc_scale = calculate_scale(scale_x_, p);
+					float calc_scale = calculate_scale(scale_x_, p.current.time_to_live, p.initial.time_to_live);
 					float value = p.current.dimensions.x + calc_scale /** affector_scale.x*/;
 					if(value > 0) {
 						p.current.dimensions.x = value;
 					}
 				}
 				if(scale_y_) {
-					float calc_scale = calculate_scale(scale_y_, p);
+					float calc_scale = calculate_scale(scale_y_, p.current.time_to_live, p.initial.time_to_live);
 					float value = p.current.dimensions.x + calc_scale /** affector_scale.y*/;
 					if(value > 0) {
 						p.current.dimensions.y = value;
 					}
 				}
 				if(scale_z_) {
-					float calc_scale = calculate_scale(scale_z_, p);
+					float calc_scale = calculate_scale(scale_z_, p.current.time_to_live, p.initial.time_to_live);
 					float value = p.current.dimensions.z + calc_scale /** affector_scale.z*/;
 					if(value > 0) {
 						p.current.dimensions.z = value;
@@ -657,3 +839,42 @@ namespace graphics
 		}
 	}
 }
+
+// Runs 100,000 particles through a technique with the given affectors, as a
+// level full of effects would each cycle. No particles expire or get
+// emitted, so this times the affectors and moving the particles.
+BENCHMARK_ARG(psystem2_affectors, const std::string& affectors)
+{
+	using namespace graphics::particles;
+	particle_system_container container(json::parse("{\"systems\": []}", json::JSON_NO_PREPROCESSOR));
+	technique tq(&container, json::parse(
+		"{\"visual_particle_quota\": 100000,"
+		" \"material\": {\"name\": \"benchmark\", \"technique\": {\"pass\": {}}},"
+		" \"affector\": " + affectors + "}", json::JSON_NO_PREPROCESSOR));
+
+	particle_store& ps = tq.active_particles();
+	for(int n = 0; n != 100000; ++n) {
+		particle p;
+		init_physics_parameters(p.initial);
+		p.initial.position = glm::vec3(get_random_float(-100.0f, 100.0f), get_random_float(-100.0f, 100.0f), get_random_float(-100.0f, 100.0f));
+		p.initial.direction = glm::vec3(get_random_float(-1.0f, 1.0f), get_random_float(-1.0f, 1.0f), get_random_float(-1.0f, 1.0f));
+		p.initial.time_to_live = 1000000.0f;
+		p.current = p.initial;
+		p.current.time_to_live = get_random_float(1000.0f, 1000000.0f);
+		p.emitted_by = NULL;
+		ps.push_back(p);
+	}
+
+	BENCHMARK_LOOP {
+		tq.process(1.0f/50.0f);
+	}
+}
+
+BENCHMARK_ARG_CALL(psystem2_affectors, forces,
+	"[{\"type\": \"gravity\", \"gravity\": 0.5, \"position\": [0, 0, 0]},"
+	" {\"type\": \"sine_force\", \"force_vector\": [0, 1, 0], \"min_frequency\": 1, \"max_frequency\": 3},"
+	" {\"type\": \"jet\", \"acceleration\": 0.25}]");
+BENCHMARK_ARG_CALL(psystem2_affectors, appearance,
+	"[{\"type\": \"colour\", \"time_colour\": [{\"time\": 0, \"colour\": [1, 1, 1, 1]}, {\"time\": 0.5, \"colour\": [1, 0.5, 0, 1]}, {\"time\": 1, \"colour\": [1, 0, 0, 0]}]},"
+	" {\"type\": \"scale\", \"scale_xyz\": 0.01},"
+	" {\"type\": \"vortex\", \"rotation_speed\": 1}]");
@@ -49,6 +49,16 @@ namespace graphics
 			//virtual void handle_apply(std::vector<emit_object_ptr>& objs, float t) = 0;
 			virtual void handle_process(float t);
 			virtual void internal_apply(particle& p, float t) = 0;
+			// Applies the affector to particles [begin, end) of ps. By default
+			// each particle is copied out and given to internal_apply(); affectors
+			// override this with loops over just the arrays they use.
+			virtual void internal_apply_batch(particle_store& ps, size_t begin, size_t end, float t);
+			// Whether internal_apply_batch() may be run on different ranges of
+			// particles at the same time, from worker threads.
+			virtual bool is_thread_safe() const { return false; }
+			// Applies the affector to the particles not emitted by an excluded
+			// emitter.
+			void apply_to_particles(particle_store& ps, float t);
 
 			float mass() const { return mass_; }
 			const glm::vec3& position() const { return position_; }
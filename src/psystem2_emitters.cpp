@@ -430,18 +430,10 @@ namespace graphics
 		void emitter::handle_process(float t) 
 		{
 			ASSERT_LOG(technique_ != NULL, "FATAL: PSYSTEM2: technique is null");
-			std::vector<particle>& particles = technique_->active_particles();
-
 			float duration = duration_->get_value(t);
 			if(duration == 0.0f || duration_remaining_ >= 0.0f) {
 				if(emits_type_ == EMITS_VISUAL) {
-					std::vector<particle>::iterator start;
-					std::vector<particle>::iterator end;
-					create_particles(particles, start, end, t);
-					for(auto it = start; it != end; ++it) {
-						internal_create(*it, t);
-					}
-					set_particle_starting_values(start, end);
+					create_particles(technique_->active_particles(), t);
 				} else {
 					if(emits_type_ == EMITS_EMITTER) {
 						size_t cnt = calculate_particles_to_emit(t, technique_->emitter_quota(), technique_->active_emitters().size());
@@ -525,33 +517,21 @@ namespace graphics
 			return cnt;
 		}
 
-		void emitter::create_particles(std::vector<particle>& particles, 
-			std::vector<particle>::iterator& start, 
-			std::vector<particle>::iterator& end, 
-			float t)
+		void emitter::create_particles(particle_store& particles, float t)
 		{
 			ASSERT_LOG(technique_ != NULL, "technique_ is null");
 			size_t cnt = calculate_particles_to_emit(t, technique_->quota(), particles.size());
 
-			// XXX: techincally this shouldn't be needed as we reserve the default quota upon initialising
-			// the particle list. We could hit some pathological case where we allocate particles past
-			// the quota (since it isn't enforced yet). This saves us from start from being invalidated
-			// if push_back were to cause a reallocation.
+			// Particles are put together one at a time, then added to the
+			// technique's arrays.
 			particles.reserve(particles.size() + cnt);
-			start = particles.end();
 			for(size_t n = 0; n != cnt; ++n) {
 				particle p;
 				init_particle(p, t);
+				internal_create(p, t);
+				memcpy(&p.current, &p.initial, sizeof(p.current));
 				particles.push_back(p);
 			}
-			end = particles.end();
-		}
-
-		void emitter::set_particle_starting_values(const std::vector<particle>::iterator& start, const std::vector<particle>::iterator& end)
-		{
-			for(auto p = start; p != end; ++p) {
-				memcpy(&p->current, &p->initial, sizeof(p->current));
-			}
 		}
 
 		void emitter::init_particle(particle& p, float t)
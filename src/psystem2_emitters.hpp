@@ -90,8 +90,7 @@ namespace graphics
 			std::string emits_name_;
 
 			void init_particle(particle& p, float t);
-			void set_particle_starting_values(const std::vector<particle>::iterator& start, const std::vector<particle>::iterator& end);
-			void create_particles(std::vector<particle>& particles, std::vector<particle>::iterator& start, std::vector<particle>::iterator& end, float t);
+			void create_particles(particle_store& particles, float t);
 			size_t calculate_particles_to_emit(float t, size_t quota, size_t current_size);
 
 			float generate_angle() const;
@@ -38,6 +38,7 @@ namespace graphics
 		class particle_system_widget;
 		typedef boost::intrusive_ptr<particle_system_widget> particle_system_widget_ptr;
 
+		class particle_store;
 		class emit_object;
 		typedef std::shared_ptr<emit_object> emit_object_ptr;
 		class particle_system_container;
@@ -0,0 +1,209 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+
+#include "foreach.hpp"
+#include "preferences.hpp"
+#include "rectangle_rotator.hpp"
+#include "sprite_batch.hpp"
+
+#if defined(USE_SHADERS)
+#include "gles2.hpp"
+#endif
+
+namespace graphics
+{
+
+namespace {
+//how many batches back a quad may look for one it can join. Looking
+//further makes the overlap checks more expensive for little gain.
+const int MaxBatchLookBack = 16;
+
+const GLenum DefaultSFactor = GL_SRC_ALPHA;
+const GLenum DefaultDFactor = GL_ONE_MINUS_SRC_ALPHA;
+}
+
+sprite_batch::stats sprite_batch::current_stats_;
+sprite_batch::stats sprite_batch::last_stats_;
+
+sprite_batch::sprite_batch()
+{
+	current_.texture = 0;
+	current_.sfactor = DefaultSFactor;
+	current_.dfactor = DefaultDFactor;
+	current_.col = color(255, 255, 255, 255);
+}
+
+void sprite_batch::set_blend_mode(GLenum sfactor, GLenum dfactor)
+{
+	current_.sfactor = sfactor;
+	current_.dfactor = dfactor;
+}
+
+void sprite_batch::set_color(const color& c)
+{
+	current_.col = c;
+}
+
+void sprite_batch::add(const texture& tex, int x, int y, int w, int h, GLfloat rotate,
+                       GLfloat x1, GLfloat y1, GLfloat x2, GLfloat y2)
+{
+	x &= preferences::xypos_draw_mask;
+	y &= preferences::xypos_draw_mask;
+
+	if(w < 0) {
+		std::swap(x1, x2);
+		w *= -1;
+	}
+
+	if(h < 0) {
+		std::swap(y1, y2);
+		h *= -1;
+	}
+
+	GLshort varray[8] = {
+		GLshort(x), GLshort(y),
+		GLshort(x + w), GLshort(y),
+		GLshort(x), GLshort(y + h),
+		GLshort(x + w), GLshort(y + h),
+	};
+
+	if(rotate != 0) {
+		rotate_rect(x + w/2, y + h/2, rotate, varray);
+	}
+
+	GLshort min_x = varray[0], max_x = varray[0], min_y = varray[1], max_y = varray[1];
+	for(int n = 2; n < 8; n += 2) {
+		min_x = std::min(min_x, varray[n]);
+		max_x = std::max(max_x, varray[n]);
+		min_y = std::min(min_y, varray[n+1]);
+		max_y = std::max(max_y, varray[n+1]);
+	}
+
+	const rect area(min_x, min_y, max_x - min_x, max_y - min_y);
+
+	const int quad = vertex_.size()/8;
+	vertex_.insert(vertex_.end(), varray, varray + 8);
+
+	const GLfloat uvarray[8] = { x1, y1, x2, y1, x1, y2, x2, y2 };
+	uv_.insert(uv_.end(), uvarray, uvarray + 8);
+
+	state st = current_;
+	st.texture = tex.get_id();
+
+	//find a batch with the same state we can join without being drawn
+	//ahead of anything we overlap.
+	for(int n = int(batches_.size()) - 1, checked = 0; n >= 0 && checked < MaxBatchLookBack; --n, ++checked) {
+		batch& b = batches_[n];
+		if(b.st == st) {
+			b.quads.push_back(quad);
+			b.area = rect_union(b.area, area);
+			return;
+		}
+
+		if(rects_intersect(b.area, area)) {
+			break;
+		}
+	}
+
+	batch b;
+	b.st = st;
+	b.area = area;
+	b.quads.push_back(quad);
+	batches_.push_back(b);
+}
+
+void sprite_batch::flush()
+{
+	if(batches_.empty()) {
+		return;
+	}
+
+	GLenum sfactor = DefaultSFactor, dfactor = DefaultDFactor;
+	color col(255, 255, 255, 255);
+	const state* last = NULL;
+
+	foreach(const batch& b, batches_) {
+		if(last != NULL && !(*last == b.st)) {
+			++current_stats_.state_changes;
+		}
+
+		texture::set_current_texture(b.st.texture);
+
+		//whatever was drawn before us may have left a different blend
+		//mode or color set, so always set them for the first batch.
+		if(last == NULL || b.st.sfactor != sfactor || b.st.dfactor != dfactor) {
+			sfactor = b.st.sfactor;
+			dfactor = b.st.dfactor;
+			glBlendFunc(sfactor, dfactor);
+		}
+
+		if(last == NULL || b.st.col.rgba() != col.rgba()) {
+			col = b.st.col;
+			col.set_as_current_color();
+		}
+
+		last = &b.st;
+
+		//expand each quad into two triangles.
+		draw_vertex_.clear();
+		draw_uv_.clear();
+		foreach(int quad, b.quads) {
+			static const int TriangleVertices[] = { 0, 1, 2, 1, 2, 3 };
+			foreach(int v, TriangleVertices) {
+				const int index = quad*8 + v*2;
+				draw_vertex_.push_back(vertex_[index]);
+				draw_vertex_.push_back(vertex_[index+1]);
+				draw_uv_.push_back(uv_[index]);
+				draw_uv_.push_back(uv_[index+1]);
+			}
+		}
+
+#if defined(USE_SHADERS)
+		gles2::active_shader()->prepare_draw();
+		gles2::active_shader()->shader()->vertex_array(2, GL_SHORT, 0, 0, &draw_vertex_.front());
+		gles2::active_shader()->shader()->texture_array(2, GL_FLOAT, 0, 0, &draw_uv_.front());
+#else
+		glVertexPointer(2, GL_SHORT, 0, &draw_vertex_.front());
+		glTexCoordPointer(2, GL_FLOAT, 0, &draw_uv_.front());
+#endif
+		glDrawArrays(GL_TRIANGLES, 0, draw_uv_.size()/2);
+
+		++current_stats_.draw_calls;
+		current_stats_.sprites += b.quads.size();
+	}
+
+	if(sfactor != DefaultSFactor || dfactor != DefaultDFactor) {
+		glBlendFunc(DefaultSFactor, DefaultDFactor);
+	}
+
+	if(col.rgba() != color(255, 255, 255, 255).rgba()) {
+		glColor4ub(255, 255, 255, 255);
+	}
+
+	batches_.clear();
+	vertex_.clear();
+	uv_.clear();
+}
+
+void sprite_batch::begin_frame()
+{
+	last_stats_ = current_stats_;
+	current_stats_ = stats();
+}
+
+}
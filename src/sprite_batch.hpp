@@ -0,0 +1,115 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SPRITE_BATCH_HPP_INCLUDED
+#define SPRITE_BATCH_HPP_INCLUDED
+
+#include <vector>
+
+#include "color_utils.hpp"
+#include "geometry.hpp"
+#include "graphics.hpp"
+#include "texture.hpp"
+
+namespace graphics
+{
+
+//Collects textured quads and draws those that share a texture, blend mode
+//and color together. A quad may be drawn before quads that were added ahead
+//of it, so it can join an earlier batch, but only if it doesn't overlap any
+//of the quads it would jump ahead of, so what ends up on the screen is the
+//same as drawing everything in order.
+class sprite_batch
+{
+public:
+	sprite_batch();
+
+	//the blend mode and color used for quads added after this.
+	void set_blend_mode(GLenum sfactor, GLenum dfactor);
+	void set_color(const color& c);
+
+	//adds a quad. Parameters are the same as queue_blit_texture(), with
+	//texture co-ordinates already translated for the texture.
+	void add(const texture& tex, int x, int y, int w, int h, GLfloat rotate,
+	         GLfloat x1, GLfloat y1, GLfloat x2, GLfloat y2);
+
+	//draws everything added and empties the batch. This must be done before
+	//anything else is drawn.
+	void flush();
+
+	bool empty() const { return batches_.empty(); }
+
+	struct stats {
+		stats() : sprites(0), draw_calls(0), state_changes(0), unbatched(0)
+		{}
+
+		//quads drawn through batches and the draw calls used for them.
+		int sprites, draw_calls;
+
+		//changes of texture, blend mode or color between batches.
+		int state_changes;
+
+		//things drawn without going through a batch.
+		int unbatched;
+	};
+
+	//records something that had to be drawn directly.
+	static void add_unbatched() { ++current_stats_.unbatched; }
+
+	//the stats for the last frame drawn, and a call to mark the start of
+	//a new frame, made once a frame from the main loop.
+	static const stats& last_frame_stats() { return last_stats_; }
+	static void begin_frame();
+
+private:
+	struct state {
+		GLuint texture;
+		GLenum sfactor, dfactor;
+		color col;
+
+		bool operator==(const state& s) const {
+			return texture == s.texture && sfactor == s.sfactor && dfactor == s.dfactor && col.rgba() == s.col.rgba();
+		}
+	};
+
+	struct batch {
+		state st;
+
+		//the area of all the quads in the batch.
+		rect area;
+
+		//indexes into the quad buffers.
+		std::vector<int> quads;
+	};
+
+	state current_;
+	std::vector<batch> batches_;
+
+	//buffers the quads are stored in, four vertices per quad, shared by
+	//all batches.
+	std::vector<GLshort> vertex_;
+	std::vector<GLfloat> uv_;
+
+	//buffers each batch is expanded into, as triangles, when it is drawn.
+	std::vector<GLshort> draw_vertex_;
+	std::vector<GLfloat> draw_uv_;
+
+	static stats current_stats_, last_stats_;
+};
+
+}
+
+#endif
@@ -18,9 +18,11 @@
 #include "concurrent_cache.hpp"
 #include "filesystem.hpp"
 #include "foreach.hpp"
+#include "image_loader.hpp"
 #include "module.hpp"
 #include "preferences.hpp"
 #include "surface_cache.hpp"
+#include "thread.hpp"
 #if defined(__MACOSX__) || TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR || defined(TARGET_BLACKBERRY) || defined(_WIN32) || defined(__ANDROID__)
 	#include <SDL_image.h>
 #else	
@@ -28,9 +30,12 @@
 #endif
 
 #include <assert.h>
+#include <deque>
 #include <iostream>
 #include <map>
 
+PREF_INT(image_staged_max_mb, 64, "Most memory in megabytes kept for images decoded in the background which haven't been used yet");
+
 namespace graphics
 {
 
@@ -51,6 +56,52 @@ surface_map& cache() {
 	return c;
 }
 
+//images decoded in the background which haven't been asked for yet. If
+//they take up too much memory the oldest are dropped, and get loaded
+//synchronously if they're ever used after all.
+struct staged_entry {
+	CacheEntry entry;
+	unsigned int seq;
+	size_t bytes;
+};
+
+threading::mutex staged_mutex;
+std::map<std::string, staged_entry> staged;
+std::deque<std::pair<unsigned int, std::string> > staged_order;
+size_t staged_bytes = 0;
+unsigned int staged_seq = 0;
+
+//the order keeps entries which were since taken or staged again, which are
+//skipped. They're cleared out when they come to outnumber the live ones.
+void erase_staged(std::map<std::string, staged_entry>::iterator i)
+{
+	staged_bytes -= i->second.bytes;
+	staged.erase(i);
+
+	if(staged_order.size() > staged.size()*2 + 16) {
+		std::deque<std::pair<unsigned int, std::string> > order;
+		for(size_t n = 0; n != staged_order.size(); ++n) {
+			std::map<std::string, staged_entry>::const_iterator j = staged.find(staged_order[n].second);
+			if(j != staged.end() && j->second.seq == staged_order[n].first) {
+				order.push_back(staged_order[n]);
+			}
+		}
+		staged_order.swap(order);
+	}
+}
+
+CacheEntry take_staged(const std::string& key)
+{
+	threading::lock lck(staged_mutex);
+	CacheEntry result;
+	std::map<std::string, staged_entry>::iterator i = staged.find(key);
+	if(i != staged.end()) {
+		result = i->second.entry;
+		erase_staged(i);
+	}
+	return result;
+}
+
 const std::string path = "./images/";
 }
 
@@ -96,6 +147,50 @@ surface get_no_cache(data_blob_ptr blob)
 	return surf;
 }
 
+std::string find_image(const std::string& key)
+{
+	if(key.empty() == false && key[0] == '#') {
+		return std::string(preferences::user_data_path()) + "/tmp_images/" + std::string(key.begin()+1, key.end());
+	} else if(sys::file_exists(key)) {
+		return key;
+	} else {
+		return module::map_file(path + key);
+	}
+}
+
+void stage(const std::string& key, const surface& surf, const std::string& fname)
+{
+	threading::lock lck(staged_mutex);
+	std::map<std::string, staged_entry>::iterator i = staged.find(key);
+	if(i != staged.end()) {
+		erase_staged(i);
+	}
+
+	staged_entry& s = staged[key];
+	s.entry.surf = surf;
+	s.entry.fname = fname;
+	s.entry.mod_time = 0;
+	s.seq = ++staged_seq;
+	s.bytes = size_t(surf->h)*surf->pitch;
+	staged_bytes += s.bytes;
+	staged_order.push_back(std::make_pair(s.seq, key));
+
+	while(staged_bytes > size_t(g_image_staged_max_mb)*1024*1024 && !staged_order.empty()) {
+		const std::pair<unsigned int, std::string> oldest = staged_order.front();
+		staged_order.pop_front();
+		i = staged.find(oldest.second);
+		if(i != staged.end() && i->second.seq == oldest.first) {
+			erase_staged(i);
+		}
+	}
+}
+
+bool is_staged(const std::string& key)
+{
+	threading::lock lck(staged_mutex);
+	return staged.count(key) != 0;
+}
+
 surface get_no_cache(const std::string& key, std::string* full_filename)
 {
 	std::string fname = path + key;
@@ -111,23 +206,26 @@ surface get_no_cache(const std::string& key, std::string* full_filename)
 		surf = surface(IMG_Load(module::map_file(fname).c_str()));
 	}
 #else
-	surface surf;
-	if(key.empty() == false && key[0] == '#') {
-		const std::string fname = std::string(preferences::user_data_path()) + "/tmp_images/" + std::string(key.begin()+1, key.end());
-		surf = surface(IMG_Load(fname.c_str()));
-		if(full_filename) {
-			*full_filename = fname;
-		}
-	} else if(sys::file_exists(key)) {
-		surf = surface(IMG_Load(key.c_str()));
+	//use the image if it has been decoded in the background, otherwise
+	//load it now, noting how long that held up the main thread.
+	const CacheEntry staged_entry = take_staged(key);
+	surface surf = staged_entry.surf;
+	if(surf.null() == false) {
 		if(full_filename) {
-			*full_filename = key;
+			*full_filename = staged_entry.fname;
 		}
 	} else {
-		surf = surface(IMG_Load(module::map_file(fname).c_str()));
+		surf = image_loader::take(key, full_filename);
+	}
+
+	if(surf.null()) {
+		const int start_time = SDL_GetTicks();
+		fname = find_image(key);
+		surf = image_loader::load_file(fname, key.empty() || key[0] != '#');
 		if(full_filename) {
-			*full_filename = module::map_file(fname);
+			*full_filename = fname;
 		}
+		image_loader::record_sync_load(SDL_GetTicks() - start_time);
 	}
 #endif // ANDROID
 	//std::cerr << "loading image '" << fname << "'\n";
@@ -163,6 +261,11 @@ void clear_unused()
 void clear()
 {
 	cache().clear();
+
+	threading::lock lck(staged_mutex);
+	staged.clear();
+	staged_order.clear();
+	staged_bytes = 0;
 }
 
 }
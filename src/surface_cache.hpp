@@ -37,6 +37,17 @@ namespace surface_cache
 surface get(const std::string& key);
 surface get_no_cache(const std::string& key, std::string* fname=0);
 surface get_no_cache(data_blob_ptr blob);
+
+//returns the path of the file an image key refers to. May be called from
+//any thread.
+std::string find_image(const std::string& key);
+
+//holds an image decoded in the background until get_no_cache() is first
+//asked for it, when it's handed over and forgotten. The oldest are
+//dropped if too many are waiting.
+void stage(const std::string& key, const surface& surf, const std::string& fname);
+bool is_staged(const std::string& key);
+
 void invalidate_modified(std::vector<std::string>* keys);
 void clear_unused();
 void clear();
@@ -14,11 +14,14 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <boost/unordered_set.hpp>
+
 #include <iostream>
 #include <map>
 #include "graphics.hpp"
 
 #include "asserts.hpp"
+#include "color_table.hpp"
 #include "concurrent_cache.hpp"
 #include "filesystem.hpp"
 #include "foreach.hpp"
@@ -27,10 +30,13 @@
 #include "formula_function.hpp"
 #include "hi_res_timer.hpp"
 #include "module.hpp"
+#include "preferences.hpp"
 #include "surface.hpp"
 #include "surface_cache.hpp"
 #include "surface_formula.hpp"
+#include "thread.hpp"
 #include "unit_test.hpp"
+#include "zlib.h"
 
 using namespace graphics;
 using namespace game_logic;
@@ -45,6 +51,99 @@ cache_map& cache() {
 	return instance;
 }
 
+PREF_BOOL(surface_formula_disk_cache, true, "Keep the results of image formulas on disk so they don't have to be evaluated again in later runs");
+
+//The result of a formula for every color it has been run on. Formulas only
+//see the pixel they are given, so their results can be shared between
+//images and kept between runs.
+struct formula_results {
+	formula_results() : dirty(false) {}
+	std::map<Uint32, Uint32> results;
+
+	//set if there are results which haven't been saved yet.
+	bool dirty;
+};
+
+threading::mutex formula_results_mutex;
+std::map<std::pair<std::string, Uint32>, formula_results> formula_results_cache;
+
+std::string formula_results_fname(const std::string& algo, Uint32 pixel_format)
+{
+	uLong crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, reinterpret_cast<const Bytef*>(algo.c_str()), algo.size());
+	crc = crc32(crc, reinterpret_cast<const Bytef*>(&pixel_format), sizeof(pixel_format));
+
+	char buf[64];
+	sprintf(buf, "%08x.lut", static_cast<unsigned int>(crc));
+	return std::string(preferences::user_data_path()) + "/surface_formula_cache/" + buf;
+}
+
+//the file holds the formula, so hash collisions can be detected, followed by
+//the colors and their results.
+std::string formula_results_header(const std::string& algo, Uint32 pixel_format)
+{
+	std::string header;
+	const Uint32 len = algo.size();
+	header.append(reinterpret_cast<const char*>(&len), sizeof(len));
+	header += algo;
+	header.append(reinterpret_cast<const char*>(&pixel_format), sizeof(pixel_format));
+	return header;
+}
+
+//must be called with formula_results_mutex locked.
+formula_results& get_formula_results(const std::string& algo, Uint32 pixel_format)
+{
+	const std::pair<std::string, Uint32> key(algo, pixel_format);
+	std::map<std::pair<std::string, Uint32>, formula_results>::iterator itor = formula_results_cache.find(key);
+	if(itor != formula_results_cache.end()) {
+		return itor->second;
+	}
+
+	formula_results& results = formula_results_cache[key];
+	if(!g_surface_formula_disk_cache) {
+		return results;
+	}
+
+	const std::string fname = formula_results_fname(algo, pixel_format);
+	if(!sys::file_exists(fname)) {
+		return results;
+	}
+
+	const std::string contents = sys::read_file(fname);
+	const std::string header = formula_results_header(algo, pixel_format);
+	if(contents.compare(0, header.size(), header) != 0) {
+		return results;
+	}
+
+	const Uint32* pairs = reinterpret_cast<const Uint32*>(contents.c_str() + header.size());
+	const int npairs = (contents.size() - header.size())/(sizeof(Uint32)*2);
+	for(int n = 0; n != npairs; ++n) {
+		results.results[pairs[n*2]] = pairs[n*2+1];
+	}
+
+	return results;
+}
+
+//must be called with formula_results_mutex locked.
+void save_formula_results(const std::string& algo, Uint32 pixel_format, const formula_results& results)
+{
+	if(!g_surface_formula_disk_cache) {
+		return;
+	}
+
+	std::string contents = formula_results_header(algo, pixel_format);
+	for(std::map<Uint32, Uint32>::const_iterator i = results.results.begin(); i != results.results.end(); ++i) {
+		contents.append(reinterpret_cast<const char*>(&i->first), sizeof(Uint32));
+		contents.append(reinterpret_cast<const char*>(&i->second), sizeof(Uint32));
+	}
+
+	//written aside and moved into place, so a crash or another instance
+	//never sees a half written file.
+	const std::string fname = formula_results_fname(algo, pixel_format);
+	sys::write_file(fname + ".tmp", contents);
+	sys::move_file(fname + ".tmp", fname);
+}
+
 class rgba_function : public function_expression {
 public:
 	explicit rgba_function(surface surf, const args_list& args)
@@ -117,9 +216,6 @@ void run_formula(surface surf, const std::string& algo)
 {
 	const hi_res_timer timer("run_formula");
 
-	const int ticks = SDL_GetTicks();
-	surface_formula_symbol_table table(surf);
-	game_logic::formula f(variant(algo), &table);
 	bool locked = false;
 	if(SDL_MUSTLOCK(surf.get())) {
 		const int res = SDL_LockSurface(surf.get());
@@ -128,31 +224,65 @@ void run_formula(surface surf, const std::string& algo)
 		}
 	}
 
-	std::map<Uint32, Uint32> pixel_map;
-
 	Uint32* pixels = reinterpret_cast<Uint32*>(surf->pixels);
 	Uint32* end_pixels = pixels + surf->w*surf->h;
 
 	Uint32 AlphaPixel = SDL_MapRGBA(surf->format, 0x6f, 0x6d, 0x51, 0x0);
 
-	int skip = 0;
-	while(pixels != end_pixels) {
-		if(((*pixels)&(~surf->format->Amask)) == AlphaPixel) {
-			++pixels;
+	//find the distinct colors in the image, so the formula is run once
+	//per color rather than once per pixel. Images are mostly long runs of
+	//the same color, which are skipped over.
+	boost::unordered_set<Uint32> colors;
+	for(Uint32* p = pixels; p != end_pixels; ++p) {
+		if(p != pixels && *p == p[-1]) {
 			continue;
 		}
-		std::map<Uint32, Uint32>::const_iterator itor = pixel_map.find(*pixels);
-		if(itor == pixel_map.end()) {
-			pixel_callable p(surf, *pixels);
-			Uint32 result = f.execute(p).as_int();
-			pixel_map[*pixels] = result;
-			*pixels = result;
-		} else {
-			*pixels = itor->second;
+
+		if(((*p)&(~surf->format->Amask)) != AlphaPixel) {
+			colors.insert(*p);
+		}
+	}
+
+	std::map<Uint32, Uint32> mapping;
+	std::vector<Uint32> missing;
+	{
+		threading::lock lck(formula_results_mutex);
+		const formula_results& results = get_formula_results(algo, surf->format->format);
+		foreach(Uint32 c, colors) {
+			std::map<Uint32, Uint32>::const_iterator itor = results.results.find(c);
+			if(itor != results.results.end()) {
+				mapping.insert(*itor);
+			} else {
+				missing.push_back(c);
+			}
+		}
+	}
+
+	if(!missing.empty()) {
+		surface_formula_symbol_table table(surf);
+		game_logic::formula f(variant(algo), &table);
+
+		std::vector<Uint32> missing_results;
+		foreach(Uint32 c, missing) {
+			pixel_callable p(surf, c);
+			const Uint32 result = f.execute(p).as_int();
+			mapping[c] = result;
+			missing_results.push_back(result);
 		}
-		++pixels;
+
+		threading::lock lck(formula_results_mutex);
+		formula_results& results = get_formula_results(algo, surf->format->format);
+		for(int n = 0; n != missing.size(); ++n) {
+			results.results[missing[n]] = missing_results[n];
+		}
+
+		results.dirty = true;
 	}
 
+	color_table lut;
+	lut.init(mapping);
+	lut.map_row(pixels, pixels, end_pixels - pixels);
+
 	if(locked) {
 		SDL_UnlockSurface(surf.get());
 	}
@@ -160,6 +290,17 @@ void run_formula(surface surf, const std::string& algo)
 
 }
 
+void save_surface_formula_results()
+{
+	threading::lock lck(formula_results_mutex);
+	for(std::map<std::pair<std::string, Uint32>, formula_results>::iterator i = formula_results_cache.begin(); i != formula_results_cache.end(); ++i) {
+		if(i->second.dirty) {
+			save_formula_results(i->first.first, i->first.second, i->second);
+			i->second.dirty = false;
+		}
+	}
+}
+
 surface get_surface_formula(surface input, const std::string& algo)
 {
 	if(algo.empty()) {
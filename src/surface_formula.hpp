@@ -25,6 +25,10 @@
 
 graphics::surface get_surface_formula(graphics::surface input, const std::string& algo);
 
+//writes formula results found since the last call to the disk cache. Done
+//once a level has loaded and when the game exits.
+void save_surface_formula_results();
+
 GLuint get_gl_shader(const std::vector<std::string>& vertex_shader,
                      const std::vector<std::string>& fragment_shader);
 
@@ -14,12 +14,17 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <boost/bind.hpp>
+
 #include <map>
 #include <vector>
 
 #include "asserts.hpp"
+#include "background_task_pool.hpp"
+#include "color_table.hpp"
 #include "surface_cache.hpp"
 #include "surface_palette.hpp"
+#include "unit_test.hpp"
 
 namespace graphics
 {
@@ -29,6 +34,7 @@ namespace {
 struct palette_definition {
 	std::string name;
 	std::map<uint32_t, uint32_t> mapping;
+	color_table table;
 };
 
 std::vector<palette_definition> palettes;
@@ -53,9 +59,20 @@ void load_palette_def(const std::string& id)
 		pixels += 2;
 	}
 
+	def.table.init(def.mapping);
+
 	palettes.push_back(def);
 }
 
+void map_palette_rows(const color_table* table, const SDL_Surface* src, SDL_Surface* dst, int begin_row, int end_row)
+{
+	for(int y = begin_row; y < end_row; ++y) {
+		table->map_row(reinterpret_cast<const uint32_t*>(reinterpret_cast<const char*>(src->pixels) + y*src->pitch),
+		               reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(dst->pixels) + y*dst->pitch),
+		               src->w);
+	}
+}
+
 }
 
 int get_palette_id(const std::string& name)
@@ -94,29 +111,17 @@ surface map_palette(surface s, int palette)
 
 	surface result(SDL_CreateRGBSurface(0, s->w, s->h, 32, SURFACE_MASK));
 
-	s = surface(SDL_ConvertSurface(s.get(), result->format, 0));
+	if(s->format->format != result->format->format) {
+		s = surface(SDL_ConvertSurface(s.get(), result->format, 0));
+	}
 
 	ASSERT_LOG(s->format->BytesPerPixel == 4, "SURFACE NOT IN 32bpp PIXEL FORMAT");
 
-	std::cerr << "mapping palette " << palette << "\n";
-
-
-	uint32_t* dst = reinterpret_cast<uint32_t*>(result->pixels);
-	const uint32_t* src = reinterpret_cast<const uint32_t*>(s->pixels);
+	//rows are independent, so big sheets are split between threads.
+	background_task_pool::parallel_for(s->h,
+	    boost::bind(map_palette_rows, &palettes[palette].table, s.get(), result.get(), _1, _2),
+	    std::max(1, 65536/std::max(1, s->w)));
 
-	const std::map<uint32_t,uint32_t>& mapping = palettes[palette].mapping;
-
-	for(int n = 0; n != s->w*s->h; ++n) {
-		std::map<uint32_t,uint32_t>::const_iterator i = mapping.find(*src);
-		if(i != mapping.end()) {
-			*dst = i->second;
-		} else {
-			*dst = *src;
-		}
-
-		++src;
-		++dst;
-	}
 	return result;
 }
 
@@ -126,10 +131,9 @@ color map_palette(const color& c, int palette)
 		return c;
 	}
 
-	const std::map<uint32_t,uint32_t>& mapping = palettes[palette].mapping;
-	std::map<uint32_t,uint32_t>::const_iterator i = mapping.find(c.value());
-	if(i != mapping.end()) {
-		return color(color::convert_pixel_byte_order(i->second));
+	uint32_t value;
+	if(palettes[palette].table.lookup(c.value(), &value)) {
+		return color(color::convert_pixel_byte_order(value));
 	} else {
 		return c;
 	}
@@ -142,4 +146,33 @@ SDL_Color map_palette(const SDL_Color& c, int palette)
 	return res;
 }
 
+UNIT_TEST(color_table)
+{
+	std::map<uint32_t, uint32_t> mapping;
+	for(uint32_t n = 0; n != 100; ++n) {
+		mapping[n*0x01030507] = n;
+	}
+
+	//the largest value can't be used to mark empty slots.
+	mapping[0xFFFFFFFF] = 7;
+
+	color_table table;
+	table.init(mapping);
+
+	for(std::map<uint32_t, uint32_t>::const_iterator i = mapping.begin(); i != mapping.end(); ++i) {
+		CHECK_EQ(table.map(i->first), i->second);
+	}
+
+	CHECK_EQ(table.map(0x01030506), 0x01030506);
+	CHECK_EQ(table.map(0xFFFFFFFE), 0xFFFFFFFE);
+
+	const uint32_t row[] = { 5, 5, 0x01030507, 0x01030507, 5, 0xFFFFFFFF };
+	const uint32_t expected[] = { 5, 5, 1, 1, 5, 7 };
+	uint32_t result[6];
+	table.map_row(row, result, 6);
+	for(int n = 0; n != 6; ++n) {
+		CHECK_EQ(result[n], expected[n]);
+	}
+}
+
 }
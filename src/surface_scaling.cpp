@@ -15,11 +15,16 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <boost/array.hpp>
+#include <boost/bind.hpp>
 #include <boost/cstdint.hpp>
+#include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <string.h>
+#include <vector>
 
 #include "asserts.hpp"
+#include "background_task_pool.hpp"
 #include "foreach.hpp"
 #include "json_parser.hpp"
 #include "string_utils.hpp"
@@ -84,7 +89,10 @@ int calculate_difference(uint32_t sourcePixelOne, uint32_t sourcePixelTwo, uint3
 	
 	
 	
-surface scale_surface_eagle(surface input) {
+namespace {
+//the straightforward versions of the scaling algorithms. The versions
+//used are below; these are kept to check they give the same results.
+surface reference_scale_surface_eagle(surface input) {
 	surface result(surface::create(input->w*2, input->h*2));
 	
 	const uint32_t* in = reinterpret_cast<const uint32_t*>(input->pixels);
@@ -147,6 +155,7 @@ surface scale_surface_eagle(surface input) {
 	
 	return result;
 }
+}
 	
 	
 	
@@ -328,7 +337,8 @@ surface scale_surface_v1(surface input) {
 	return result;
 }
 
-surface scale_surface_newer(surface input) {
+namespace {
+surface reference_scale_surface_newer(surface input) {
 	surface result(surface::create(input->w*2, input->h*2));
 
 	const uint32_t* in = reinterpret_cast<const uint32_t*>(input->pixels);
@@ -365,7 +375,7 @@ x >= 2 && y < input->h-2 ? in[(y+2)*input->w + x-2] : 0, x >= 1 && y < input->h-
 
 
 
-surface scale_surface(surface input) {
+surface reference_scale_surface(surface input) {
 	surface result(surface::create(input->w*2, input->h*2));
 
 	const uint32_t* in = reinterpret_cast<const uint32_t*>(input->pixels);
@@ -555,6 +565,264 @@ surface scale_surface(surface input) {
 
 	return result;
 }
+}
+
+namespace {
+const uint32_t* input_row(const SDL_Surface* s, int y)
+{
+	return reinterpret_cast<const uint32_t*>(reinterpret_cast<const char*>(s->pixels) + y*s->pitch);
+}
+
+uint32_t* output_row(SDL_Surface* s, int y)
+{
+	return reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(s->pixels) + y*s->pitch);
+}
+
+//nearest neighbor scaling of a row into the two output rows for it.
+void scale_row_nearest(const uint32_t* in, uint32_t* top, uint32_t* bottom, int w)
+{
+	for(int x = 0; x != w; ++x) {
+		top[x*2] = top[x*2+1] = bottom[x*2] = bottom[x*2+1] = in[x];
+	}
+}
+
+//rows are independent, so big images are split between threads. The
+//minimum number of rows given to a thread.
+int min_rows_per_thread(const SDL_Surface* s)
+{
+	return std::max(1, 65536/std::max(1, s->w));
+}
+
+//See reference_scale_surface_eagle() for how this works. The edges of
+//the image only get nearest neighbor scaling, so we don't need to check
+//bounds for each pixel.
+void scale_rows_eagle(const SDL_Surface* input, SDL_Surface* result, int begin_row, int end_row)
+{
+	const int w = input->w;
+	for(int y = begin_row; y < end_row; ++y) {
+		const uint32_t* cur = input_row(input, y);
+		uint32_t* top = output_row(result, y*2);
+		uint32_t* bottom = output_row(result, y*2 + 1);
+		scale_row_nearest(cur, top, bottom, w);
+
+		if(y == 0 || y >= input->h - 1) {
+			continue;
+		}
+
+		const uint32_t* up = input_row(input, y - 1);
+		const uint32_t* down = input_row(input, y + 1);
+		for(int x = 1; x < w - 1; ++x) {
+			if(up[x-1] == up[x] && up[x-1] == cur[x-1]) {
+				top[x*2] = up[x-1];
+			}
+
+			if(up[x+1] == up[x] && up[x+1] == cur[x+1]) {
+				top[x*2+1] = up[x+1];
+			}
+
+			if(down[x-1] == down[x] && down[x-1] == cur[x-1]) {
+				bottom[x*2] = down[x-1];
+			}
+
+			if(down[x+1] == down[x] && down[x+1] == cur[x+1]) {
+				bottom[x*2+1] = down[x+1];
+			}
+		}
+	}
+}
+
+//The generated rules read a 5x5 neighborhood, with pixels outside the
+//image being 0. The input is copied into rows with two pixels of 0 on
+//every side so they can be read without checking bounds.
+void scale_rows_newer(const uint32_t* padded, int padded_w, SDL_Surface* result, int w, int begin_row, int end_row)
+{
+	union PixelUnion {
+		uint32_t value;
+		uint8_t rgba[4];
+	};
+
+	for(int y = begin_row; y < end_row; ++y) {
+		//rows y-2 to y+2, pointing at column 0.
+		const uint32_t* rows[5];
+		for(int n = 0; n != 5; ++n) {
+			rows[n] = padded + (y + n)*padded_w + 2;
+		}
+
+		uint32_t* top = output_row(result, y*2);
+		uint32_t* bottom = output_row(result, y*2 + 1);
+
+		for(int x = 0; x != w; ++x) {
+			uint32_t& out0 = top[x*2];
+			uint32_t& out1 = top[x*2+1];
+			uint32_t& out2 = bottom[x*2];
+			uint32_t& out3 = bottom[x*2+1];
+
+			out0 = out1 = out2 = out3 = rows[2][x];
+
+			const uint32_t matrix[] = {
+				rows[0][x-2], rows[0][x-1], rows[0][x], rows[0][x+1], rows[0][x+2],
+				//the original version only reads the up-left pixel from
+				//the second row down, which we keep so the output is the same.
+				rows[1][x-2], y >= 2 ? rows[1][x-1] : 0, rows[1][x], rows[1][x+1], rows[1][x+2],
+				rows[2][x-2], rows[2][x-1], rows[2][x], rows[2][x+1], rows[2][x+2],
+				rows[3][x-2], rows[3][x-1], rows[3][x], rows[3][x+1], rows[3][x+2],
+				rows[4][x-2], rows[4][x-1], rows[4][x], rows[4][x+1], rows[4][x+2],
+			};
+
+#include "surface_scaling_generated.hpp"
+		}
+	}
+}
+
+//See reference_scale_surface() for how this 2xSaI scaling works. Only
+//pixels with a full 4x4 group, starting up and left of them, are
+//interpolated, so we don't need to check bounds for each pixel.
+void scale_rows_2xsai(const SDL_Surface* input, SDL_Surface* result, int begin_row, int end_row)
+{
+	const int w = input->w;
+	for(int y = begin_row; y < end_row; ++y) {
+		const uint32_t* cur = input_row(input, y);
+		uint32_t* top = output_row(result, y*2);
+		uint32_t* bottom = output_row(result, y*2 + 1);
+		scale_row_nearest(cur, top, bottom, w);
+
+		if(y == 0 || y >= input->h - 2) {
+			continue;
+		}
+
+		const uint32_t* row0 = input_row(input, y - 1);
+		const uint32_t* row2 = input_row(input, y + 1);
+		const uint32_t* row3 = input_row(input, y + 2);
+		for(int x = 1; x < w - 2; ++x) {
+			//pN[i] is px[N][i] in reference_scale_surface().
+			const uint32_t* p0 = row0 + x - 1;
+			const uint32_t* p1 = cur + x - 1;
+			const uint32_t* p2 = row2 + x - 1;
+			const uint32_t* p3 = row3 + x - 1;
+
+			if(p1[1] == p2[2] && p1[2] != p2[1]) {
+				if((p1[1] == p0[1] && p1[2] == p2[3]) || (p1[1] == p2[1] && p1[1] == p0[2] && p1[2] != p0[1] && p1[2] == p0[3])) {
+					top[x*2+1] = p1[1];
+				} else if(p1[1] != p0[1]) {
+					top[x*2+1] = interpolate_pixels(p1[1], p1[2]);
+				}
+
+				if((p1[1] == p1[0] && p2[1] == p3[2]) || (p1[1] == p1[2] && p1[1] == p2[0] && p1[0] != p2[1] && p2[1] == p3[0])) {
+					bottom[x*2] = p1[1];
+				} else if(p1[1] != p1[0]) {
+					bottom[x*2] = interpolate_pixels(p1[1], p2[1]);
+				}
+
+				bottom[x*2+1] = p1[1];
+			} else if(p1[2] == p2[1] && p1[1] != p2[2]) {
+				if((p1[2] == p0[2] && p1[1] == p2[0]) || (p1[2] == p0[1] && p1[2] == p2[2] && p1[2] != p0[2] && p1[1] == p0[0])) {
+					top[x*2+1] = p1[2];
+				} else {
+					top[x*2+1] = interpolate_pixels(p1[1], p1[2]);
+				}
+
+				if((p2[1] == p2[0] && p1[1] == p0[2]) || (p2[1] == p1[0] && p2[1] == p2[2] && p1[1] != p2[0] && p1[1] == p0[0])) {
+					bottom[x*2] = p2[1];
+				} else {
+					bottom[x*2] = interpolate_pixels(p1[1], p2[1]);
+				}
+
+				bottom[x*2+1] = p1[2];
+			}
+		}
+	}
+}
+}
+
+surface scale_surface_eagle(surface input)
+{
+	surface result(surface::create(input->w*2, input->h*2));
+	background_task_pool::parallel_for(input->h,
+	    boost::bind(scale_rows_eagle, input.get(), result.get(), _1, _2),
+	    min_rows_per_thread(input.get()));
+	return result;
+}
+
+surface scale_surface_newer(surface input)
+{
+	surface result(surface::create(input->w*2, input->h*2));
+
+	const int padded_w = input->w + 4;
+	std::vector<uint32_t> padded(padded_w*(input->h + 4), 0);
+	for(int y = 0; y != input->h; ++y) {
+		const uint32_t* row = input_row(input.get(), y);
+		std::copy(row, row + input->w, padded.begin() + (y + 2)*padded_w + 2);
+	}
+
+	background_task_pool::parallel_for(input->h,
+	    boost::bind(scale_rows_newer, &padded[0], padded_w, result.get(), int(input->w), _1, _2),
+	    min_rows_per_thread(input.get()));
+	return result;
+}
+
+surface scale_surface(surface input)
+{
+	surface result(surface::create(input->w*2, input->h*2));
+	background_task_pool::parallel_for(input->h,
+	    boost::bind(scale_rows_2xsai, input.get(), result.get(), _1, _2),
+	    min_rows_per_thread(input.get()));
+	return result;
+}
+
+namespace {
+bool surfaces_equal(const surface& a, const surface& b)
+{
+	if(a->w != b->w || a->h != b->h) {
+		return false;
+	}
+
+	for(int y = 0; y != a->h; ++y) {
+		if(memcmp(input_row(a.get(), y), input_row(b.get(), y), a->w*4) != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void check_scaling_matches_reference(surface s)
+{
+	CHECK(surfaces_equal(scale_surface(s), reference_scale_surface(s)), "scale_surface() differs from the reference for " << s->w << "x" << s->h);
+	CHECK(surfaces_equal(scale_surface_eagle(s), reference_scale_surface_eagle(s)), "scale_surface_eagle() differs from the reference for " << s->w << "x" << s->h);
+	CHECK(surfaces_equal(scale_surface_newer(s), reference_scale_surface_newer(s)), "scale_surface_newer() differs from the reference for " << s->w << "x" << s->h);
+}
+}
+
+UNIT_TEST(surface_scaling_matches_reference)
+{
+	//a few colors, some translucent, so the patterns the scalers look
+	//for come up often. The tall image is split between threads.
+	const uint32_t colors[] = { 0xFF000000, 0xFFFFFFFF, 0x80FF8040, 0x00000000, 0xFF2040A0 };
+	const int sizes[][2] = { {1, 1}, {2, 3}, {3, 2}, {5, 4}, {37, 29}, {64, 4096} };
+	unsigned int seed = 1;
+	foreach(const int* size, sizes) {
+		surface s(surface::create(size[0], size[1]));
+		for(int y = 0; y != s->h; ++y) {
+			uint32_t* row = output_row(s.get(), y);
+			for(int x = 0; x != s->w; ++x) {
+				seed = seed*1103515245 + 12345;
+				row[x] = colors[(seed >> 16)%(sizeof(colors)/sizeof(*colors))];
+			}
+		}
+
+		check_scaling_matches_reference(s);
+	}
+
+	//the image the benchmark uses, if we have it.
+	try {
+		surface s(graphics::surface_cache::get("characters/frogatto-spritesheet1.png"));
+		surface target(SDL_CreateRGBSurface(0,s->w,s->h,32,SURFACE_MASK));
+		SDL_SetSurfaceBlendMode(s.get(), SDL_BLENDMODE_NONE);
+		SDL_BlitSurface(s.get(), NULL, target.get(), NULL);
+		check_scaling_matches_reference(target);
+	} catch(load_image_error&) {
+	}
+}
 
 BENCHMARK(surface_scaling)
 {
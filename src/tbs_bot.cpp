@@ -31,7 +31,8 @@ PREF_INT(tbs_bot_delay_ms, 100, "Artificial delay for tbs bots");
 bot::bot(boost::asio::io_service& service, const std::string& host, const std::string& port, variant v)
   : service_(service), timer_(service), host_(host), port_(port), script_(v["script"].as_list()),
     on_create_(game_logic::formula::create_optional_formula(v["on_create"])),
-    on_message_(game_logic::formula::create_optional_formula(v["on_message"]))
+    on_message_(game_logic::formula::create_optional_formula(v["on_message"])),
+    step_(0), passes_left_(1), stopping_(false), stopped_(false), stats_(NULL)
 
 {
 	std::cerr << "CREATE BOT\n";
@@ -50,14 +51,22 @@ void bot::process(const boost::system::error_code& error)
 		std::cerr << "tbs::bot::process cancelled" << std::endl;
 		return;
 	}
+
+	if(stopping_ && !client_ && !internal_client_) {
+		//no request is outstanding and we don't wait on the timer again, so
+		//nothing refers to us any more.
+		stopped_ = true;
+		return;
+	}
+
 	if(on_create_) {
 		execute_command(on_create_->execute(*this));
 		on_create_.reset();
 	}
 
 	if(((!client_ && !preferences::internal_tbs_server()) || (!internal_client_ && preferences::internal_tbs_server()))
-		&& response_.size() < script_.size()) {
-		variant script = script_[response_.size()];
+		&& step_ < script_.size() && !stopping_) {
+		variant script = script_[step_];
 		variant send = script["send"];
 		if(send.is_string()) {
 			send = game_logic::formula(send).execute(*this);
@@ -70,12 +79,22 @@ void bot::process(const boost::system::error_code& error)
 
 		ASSERT_LOG(send.is_map(), "NO REQUEST TO SEND: " << send.write_json() << " IN " << script.write_json());
 		game_logic::map_formula_callable_ptr callable(new game_logic::map_formula_callable(this));
+
+		if(stats_) {
+			++stats_->messages_sent;
+			send_time_ = boost::posix_time::microsec_clock::universal_time();
+		}
+
 		if(preferences::internal_tbs_server()) {
 			internal_client_.reset(new internal_client(session_id));
 			internal_client_->send_request(send, session_id, callable, boost::bind(&bot::handle_response, this, _1, callable));
 		} else {
 			client_.reset(new client(host_, port_, session_id, &service_));
 			client_->set_use_local_cache(false);
+
+			//we drop the client after its first response, so it can't
+			//go on to deliver the rest of a batch.
+			client_->set_accept_batch(false);
 			client_->send_request(send, callable, boost::bind(&bot::handle_response, this, _1, callable));
 		}
 	}
@@ -97,11 +116,24 @@ void bot::handle_response(const std::string& type, game_logic::formula_callable_
 		execute_command(on_message_->execute(*this));
 	}
 
+	if(stats_) {
+		if(type != "message_received") {
+			//count the error and retry this step of the script.
+			++stats_->errors;
+			client_.reset();
+			internal_client_.reset();
+			return;
+		}
+
+		++stats_->messages_received;
+		stats_->latencies_us.push_back((boost::posix_time::microsec_clock::universal_time() - send_time_).total_microseconds());
+	}
+
 	ASSERT_LOG(type != "connection_error", "GOT ERROR BACK WHEN SENDING REQUEST: " << callable->query_value("message").write_json());
 
 	ASSERT_LOG(type == "message_received", "UNRECOGNIZED RESPONSE: " << type);
 
-	variant script = script_[response_.size()];
+	variant script = script_[step_];
 	std::vector<variant> validations;
 	if(script.has_key("validate")) {
 		variant validate = script["validate"];
@@ -125,11 +157,20 @@ void bot::handle_response(const std::string& type, game_logic::formula_callable_
 	m[variant("message")] = callable->query_value("message");
 	m[variant("validations")] = variant(&validations);
 
-	response_.push_back(variant(&m));
 	client_.reset();
 	internal_client_.reset();
 
-	tbs::web_server::set_debug_state(generate_report());
+	if(++step_ == script_.size() && passes_left_ != 1) {
+		step_ = 0;
+		if(passes_left_ > 1) {
+			--passes_left_;
+		}
+	}
+
+	if(!stats_) {
+		response_.push_back(variant(&m));
+		tbs::web_server::set_debug_state(generate_report());
+	}
 }
 
 variant bot::get_value(const std::string& key) const
@@ -18,6 +18,7 @@
 #define TBS_BOT_HPP_INCLUDED
 
 #include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include <string>
@@ -31,6 +32,18 @@
 
 namespace tbs {
 
+//Measurements bots record as they run, used to load test servers.
+struct bot_stats
+{
+	bot_stats() : messages_sent(0), messages_received(0), errors(0)
+	{}
+
+	int messages_sent, messages_received, errors;
+
+	//round trip time of each request in microseconds.
+	std::vector<int> latencies_us;
+};
+
 class bot : public game_logic::formula_callable
 {
 public:
@@ -39,6 +52,21 @@ public:
 
 	void process(const boost::system::error_code& error);
 
+	//records stats for this bot's requests. In this mode errors are
+	//counted and the request retried rather than asserting, and no debug
+	//report is generated.
+	void set_stats(bot_stats* stats) { stats_ = stats; }
+
+	//number of times to run through the script, or 0 to keep running it
+	//for as long as the bot exists. Defaults to once.
+	void set_repeat(int passes) { passes_left_ = passes; }
+
+	//stops sending requests. The bot finishes any request it's waiting on
+	//a response to and then goes quiet; it's only safe to destroy it while
+	//the io_service is still running once stopped() is true.
+	void stop() { stopping_ = true; }
+	bool stopped() const { return stopped_; }
+
 private:
 	void handle_response(const std::string& type, game_logic::formula_callable_ptr callable);
 	variant get_value(const std::string& key) const;
@@ -49,6 +77,13 @@ private:
 	std::string host_, port_;
 	std::vector<variant> script_;
 	std::vector<variant> response_;
+
+	//the step of the script to send next, and how many more times to run
+	//the script after this pass (0 meaning forever).
+	size_t step_;
+	int passes_left_;
+
+	bool stopping_, stopped_;
 	boost::shared_ptr<client> client_;
 	boost::shared_ptr<internal_client> internal_client_;
 
@@ -61,6 +96,9 @@ private:
 
 	std::string message_type_;
 	game_logic::formula_callable_ptr message_callable_;
+
+	bot_stats* stats_;
+	boost::posix_time::ptime send_time_;
 };
 
 }
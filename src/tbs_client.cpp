@@ -18,6 +18,8 @@
 #include <boost/algorithm/string/replace.hpp>
 
 #include "asserts.hpp"
+#include "base64.hpp"
+#include "compress.hpp"
 #include "foreach.hpp"
 #include "json_parser.hpp"
 #include "preferences.hpp"
@@ -32,19 +34,33 @@
 namespace tbs {
 
 PREF_BOOL(tbs_client_prediction, false, "Use client-side prediction for tbs games");
+PREF_BOOL(tbs_client_accept_batch, false, "Allow the tbs server to batch and compress messages it sends to us");
 
 client::client(const std::string& host, const std::string& port,
                int session, boost::asio::io_service* service)
   : http_client(host, port, session, service), use_local_cache_(g_tbs_client_prediction),
-    local_game_cache_(NULL), local_nplayer_(-1)
+    local_game_cache_(NULL), local_nplayer_(-1), accept_batch_(g_tbs_client_accept_batch),
+    alive_(new bool(true))
 {
 }
 
+client::~client()
+{
+	*alive_ = false;
+}
+
 void client::send_request(variant request, game_logic::map_formula_callable_ptr callable, boost::function<void(std::string)> handler)
 {
 	handler_ = handler;
 	callable_ = callable;
 
+	if(accept_batch_ && request.is_map()) {
+		std::map<variant,variant> m = request.as_map();
+		m[variant("accept_batch")] = variant::from_bool(true);
+		m[variant("accept_deflate")] = variant::from_bool(true);
+		request = variant(&m);
+	}
+
 	std::string request_str = game_logic::serialize_doc_with_objects(request);
 	fprintf(stderr, "SEND ((%s))\n", request_str.c_str());
 
@@ -78,43 +94,100 @@ void client::send_request(variant request, game_logic::map_formula_callable_ptr
 void client::recv_handler(const std::string& msg)
 {
 	if(handler_) {
-		variant v = game_logic::deserialize_doc_with_objects(msg);
+		handle_message(msg, handler_, callable_);
+	}
+}
+
+void client::handle_message(const std::string& msg, boost::function<void(std::string)> handler, game_logic::map_formula_callable_ptr callable)
+{
+	variant v = game_logic::deserialize_doc_with_objects(msg);
+
+	//the server may wrap messages up in a batch, or compress them, if
+	//we told it we can handle that.
+	const variant type = v.is_map() ? v["type"] : variant();
+	if(type.is_string() && type.as_string() == "deflate") {
+		const variant encoded = v["data"];
+		const variant size = v["size"];
+		std::vector<char> data;
+
+		//zlib can't inflate to more than about 1032 times the compressed
+		//size, so anything claiming more is corrupt.
+		if(!encoded.is_string() || !size.is_int() || size.as_int() < 0 || size.as_int()/1032 > encoded.as_string().size()) {
+			handle_error("Malformed compressed message from tbs server", handler, callable);
+			return;
+		}
 
-		if(use_local_cache_ && v["type"].as_string() == "game") {
-			local_game_cache_ = new tbs::game(v["game_type"].as_string(), v);
-			local_game_cache_holder_.reset(local_game_cache_);
+		const std::string& str = encoded.as_string();
+		if(!zip::try_decompress_known_size(base64::b64decode(std::vector<char>(str.begin(), str.end())), size.as_int(), &data)) {
+			handle_error("Could not decompress message from tbs server", handler, callable);
+			return;
+		}
 
-			local_nplayer_= v["nplayer"].as_int();
-			std::cerr << "LOCAL: UPDATE CACHE: " << local_game_cache_->state_id() << "\n";
-			v = game_logic::deserialize_doc_with_objects(msg);
+		handle_message(std::string(data.begin(), data.end()), handler, callable);
+		return;
+	} else if(type.is_string() && type.as_string() == "batch") {
+		//deliver the whole batch now, to the handler the batch was sent
+		//to, since the handler may send another request and so be
+		//replaced while we go.
+		const variant messages = v["messages"];
+		bool valid = messages.is_list();
+		for(int n = 0; valid && n != messages.num_elements(); ++n) {
+			valid = messages[n].is_string();
 		}
 
-		//fprintf(stderr, "RECV: (((%s)))\n", msg.c_str());
-		//fprintf(stderr, "SERIALIZE: (((%s)))\n", v.write_json().c_str());
-		callable_->add("message", v);
+		if(!valid) {
+			handle_error("Malformed message batch from tbs server", handler, callable);
+			return;
+		}
 
-//		try {
-			handler_(connection_id_ + "message_received");
-//		} catch(...) {
-//			std::cerr << "ERROR PROCESSING TBS MESSAGE\n";
-//			throw;
-//		}
+		//a handler may release the last reference to us, after which we
+		//must stop.
+		const boost::shared_ptr<bool> alive = alive_;
+		for(int n = 0; n != messages.num_elements() && *alive; ++n) {
+			handle_message(messages[n].as_string(), handler, callable);
+		}
+		return;
+	}
+
+	if(use_local_cache_ && v["type"].as_string() == "game") {
+		local_game_cache_ = new tbs::game(v["game_type"].as_string(), v);
+		local_game_cache_holder_.reset(local_game_cache_);
+
+		local_nplayer_= v["nplayer"].as_int();
+		std::cerr << "LOCAL: UPDATE CACHE: " << local_game_cache_->state_id() << "\n";
+		v = game_logic::deserialize_doc_with_objects(msg);
 	}
+
+	//fprintf(stderr, "RECV: (((%s)))\n", msg.c_str());
+	//fprintf(stderr, "SERIALIZE: (((%s)))\n", v.write_json().c_str());
+	callable->add("message", v);
+
+//	try {
+		handler(connection_id_ + "message_received");
+//	} catch(...) {
+//		std::cerr << "ERROR PROCESSING TBS MESSAGE\n";
+//		throw;
+//	}
 }
 
 void client::error_handler(const std::string& err)
 {
 	std::cerr << "ERROR IN TBS CLIENT: " << err << (handler_ ? " SENDING TO HANDLER...\n" : " NO HANDLER\n");
 	if(handler_) {
-		variant v;
-		try {
-			v = json::parse(err, json::JSON_NO_PREPROCESSOR);
-		} catch(const json::parse_error&) {
-			std::cerr << "Unable to parse message \"" << err << "\" assuming it is a string." << std::endl;
-		}
-		callable_->add("error", v.is_null() ? variant(err) : v);
-		handler_(connection_id_ + "connection_error");
+		handle_error(err, handler_, callable_);
+	}
+}
+
+void client::handle_error(const std::string& err, boost::function<void(std::string)> handler, game_logic::map_formula_callable_ptr callable)
+{
+	variant v;
+	try {
+		v = json::parse(err, json::JSON_NO_PREPROCESSOR);
+	} catch(const json::parse_error&) {
+		std::cerr << "Unable to parse message \"" << err << "\" assuming it is a string." << std::endl;
 	}
+	callable->add("error", v.is_null() ? variant(err) : v);
+	handler(connection_id_ + "connection_error");
 }
 
 variant client::get_value(const std::string& key) const
@@ -37,6 +37,7 @@ class client : public http_client
 {
 public:
 	client(const std::string& host, const std::string& port, int session=-1, boost::asio::io_service* service=NULL);
+	~client();
 
 	void send_request(variant request, 
 		game_logic::map_formula_callable_ptr callable, 
@@ -46,12 +47,18 @@ public:
 	void set_id(const std::string& id);
 
 	void set_use_local_cache(bool value) { use_local_cache_ = value; }
+
+	//whether to ask the server to batch and compress the messages it sends
+	//us. Every message in a batch goes to the handler the batch was sent to.
+	void set_accept_batch(bool value) { accept_batch_ = value; }
 private:
 	boost::function<void(std::string)> handler_;
 	game_logic::map_formula_callable_ptr callable_;
 
 	void recv_handler(const std::string& msg);
+	void handle_message(const std::string& msg, boost::function<void(std::string)> handler, game_logic::map_formula_callable_ptr callable);
 	void error_handler(const std::string& err);
+	void handle_error(const std::string& err, boost::function<void(std::string)> handler, game_logic::map_formula_callable_ptr callable);
 	variant get_value(const std::string& key) const;
 
 	std::string connection_id_;
@@ -62,6 +69,12 @@ private:
 	int local_nplayer_;
 
 	std::vector<std::string> local_responses_;
+
+	bool accept_batch_;
+
+	//set to false when we're destroyed, so delivering a batch can tell if
+	//a handler released us.
+	boost::shared_ptr<bool> alive_;
 };
 
 }
@@ -102,6 +102,11 @@ void game::reload_game_types()
 	all_types() = generate_game_types();
 }
 
+void game::preload_game_types()
+{
+	all_types();
+}
+
 namespace {
 game* current_game = NULL;
 
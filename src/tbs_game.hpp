@@ -41,6 +41,7 @@ public:
 	};
 
 	static void reload_game_types();
+	static void preload_game_types();
 	static boost::intrusive_ptr<game> create(const variant& v);
 	static game* current();
 
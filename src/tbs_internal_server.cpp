@@ -129,7 +129,7 @@ namespace tbs
 
 			client_info& cli_info = clients[info.session_id];
 			if(cli_info.msg_queue.empty() == false) {
-				messages.push_back(std::pair<send_function,variant>(send_fn, game_logic::deserialize_doc_with_objects(cli_info.msg_queue.front())));
+				messages.push_back(std::pair<send_function,variant>(send_fn, game_logic::deserialize_doc_with_objects(*cli_info.msg_queue.front())));
 				cli_info.msg_queue.pop_front();
 			} else if(send_heartbeat) {
 				if(!cli_info.game) {
@@ -166,7 +166,7 @@ namespace tbs
 	}
 
 
-	void internal_server::queue_msg(int session_id, const std::string& msg, bool has_priority)
+	void internal_server::queue_msg(int session_id, message_ptr msg, bool has_priority)
 	{
 		if(session_id == -1) {
 			return;
@@ -195,9 +195,9 @@ namespace tbs
 	void internal_server::finish_socket(send_function send_fn, client_info& cli_info)
 	{
 		if(cli_info.msg_queue.empty() == false) {
-			const std::string msg = cli_info.msg_queue.front();
+			const message_ptr msg = cli_info.msg_queue.front();
 			cli_info.msg_queue.pop_front();
-			send_fn(game_logic::deserialize_doc_with_objects(msg));
+			send_fn(game_logic::deserialize_doc_with_objects(*msg));
 		}
 	}
 }
@@ -67,7 +67,8 @@ namespace tbs
 		
 		socket_info& create_socket_info(send_function send_fn);
 		void disconnect(int session_id);
-		void queue_msg(int session_id, const std::string& msg, bool has_priority);
+		using server_base::queue_msg;
+		void queue_msg(int session_id, message_ptr msg, bool has_priority);
 
 		std::list<std::pair<send_function, socket_info> > connections_;
 		std::deque<boost::tuple<send_function,variant,int> > msg_queue_;
@@ -0,0 +1,406 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//This file is designed to only work on Linux.
+#ifdef __linux__
+
+#include <algorithm>
+#include <deque>
+#include <stdio.h>
+
+#include <boost/intrusive_ptr.hpp>
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "asserts.hpp"
+#include "filesystem.hpp"
+#include "foreach.hpp"
+#include "formatter.hpp"
+#include "json_parser.hpp"
+#include "module.hpp"
+#include "preferences.hpp"
+#include "tbs_bot.hpp"
+#include "tbs_internal_server.hpp"
+#include "unit_test.hpp"
+#include "variant_utils.hpp"
+
+namespace {
+
+double seconds_since(const boost::posix_time::ptime& start)
+{
+	return (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()/1000000.0;
+}
+
+//The number of bots that should be running t seconds into the test. The
+//schedule is a list of [seconds, bots] points which we interpolate
+//between linearly.
+int bots_wanted(const std::vector<std::pair<double, int> >& schedule, double t)
+{
+	if(schedule.empty()) {
+		return 0;
+	}
+
+	if(t <= schedule.front().first) {
+		return schedule.front().second;
+	}
+
+	for(int n = 1; n < schedule.size(); ++n) {
+		if(t < schedule[n].first) {
+			const double ratio = (t - schedule[n-1].first)/(schedule[n].first - schedule[n-1].first);
+			return schedule[n-1].second + static_cast<int>(ratio*(schedule[n].second - schedule[n-1].second));
+		}
+	}
+
+	return schedule.back().second;
+}
+
+struct process_usage {
+	process_usage() : cpu_ticks(0), rss_kb(0) {}
+	long cpu_ticks;
+	int rss_kb;
+};
+
+bool read_process_usage(pid_t pid, process_usage* result)
+{
+	const std::string stat = sys::read_file(formatter() << "/proc/" << pid << "/stat");
+	if(stat.empty()) {
+		return false;
+	}
+
+	//the process name is in parentheses and may contain spaces, so
+	//count fields from after it. utime and stime are fields 14 and 15.
+	const std::string::size_type paren = stat.rfind(')');
+	if(paren == std::string::npos) {
+		return false;
+	}
+
+	long utime = 0, stime = 0;
+	if(sscanf(stat.c_str() + paren + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime) != 2) {
+		return false;
+	}
+
+	result->cpu_ticks = utime + stime;
+
+	const std::string status = sys::read_file(formatter() << "/proc/" << pid << "/status");
+	const std::string::size_type rss = status.find("VmRSS:");
+	if(rss != std::string::npos) {
+		result->rss_kb = atoi(status.c_str() + rss + 6);
+	}
+
+	return true;
+}
+
+variant latency_report(std::vector<int> latencies)
+{
+	variant_builder result;
+	result.add("count", static_cast<int>(latencies.size()));
+	if(latencies.empty()) {
+		return result.build();
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	int64_t total = 0;
+	foreach(int n, latencies) {
+		total += n;
+	}
+
+	result.add("mean_us", static_cast<int>(total/latencies.size()));
+	result.add("p50_us", latencies[latencies.size()*50/100]);
+	result.add("p90_us", latencies[latencies.size()*90/100]);
+	result.add("p99_us", latencies[latencies.size()*99/100]);
+	result.add("max_us", latencies.back());
+
+	//histogram with power of two sized buckets.
+	std::vector<variant> histogram;
+	std::vector<int>::const_iterator i = latencies.begin();
+	for(int limit = 128; i != latencies.end(); limit *= 2) {
+		std::vector<int>::const_iterator end = std::upper_bound(i, static_cast<std::vector<int>::const_iterator>(latencies.end()), limit);
+		if(end != i) {
+			variant_builder bucket;
+			bucket.add("max_us", limit);
+			bucket.add("count", static_cast<int>(end - i));
+			histogram.push_back(bucket.build());
+		}
+
+		i = end;
+	}
+
+	result.add("histogram", variant(&histogram));
+	return result.build();
+}
+
+pid_t launch_server(int port)
+{
+	ASSERT_LOG(!preferences::argv().empty(), "Cannot find executable to launch server");
+	const std::string cmd = preferences::argv().front();
+
+	std::vector<std::string> args;
+	args.push_back(cmd);
+	args.push_back("--module=" + module::get_module_name());
+	args.push_back("--utility=tbs_server");
+	args.push_back("--port");
+	args.push_back(formatter() << port);
+
+	std::vector<char*> cstr_argv;
+	foreach(std::string& s, args) {
+		cstr_argv.push_back(&s[0]);
+	}
+
+	cstr_argv.push_back(NULL);
+
+	const pid_t pid = fork();
+	ASSERT_LOG(pid >= 0, "Failed to fork server");
+
+	if(pid == 0) {
+		execv(cmd.c_str(), &cstr_argv[0]);
+		fprintf(stderr, "EXEC FAILED!\n");
+		_exit(0);
+	}
+
+	return pid;
+}
+
+//waits for a server to start accepting connections.
+bool wait_for_server(const std::string& host, int port, int timeout_ms)
+{
+	boost::asio::io_service io_service;
+	boost::asio::ip::tcp::resolver resolver(io_service);
+	boost::asio::ip::tcp::resolver::query query(host, formatter() << port);
+
+	for(int waited = 0; waited < timeout_ms; waited += 100) {
+		boost::system::error_code error;
+		boost::asio::ip::tcp::resolver::iterator endpoint = resolver.resolve(query, error);
+		if(!error) {
+			boost::asio::ip::tcp::socket socket(io_service);
+			boost::asio::connect(socket, endpoint, error);
+			if(!error) {
+				return true;
+			}
+		}
+
+		usleep(100000);
+	}
+
+	return false;
+}
+
+}
+
+//Runs many tbs bots against a server and writes out a JSON report of
+//latency, throughput and server resource usage. The config looks like:
+//
+//  { host: "localhost", port: 23456, bot: "data/tbs_test/bot.cfg",
+//    schedule: [[0, 10], [30, 1000]], duration: 60, repeat: 0 }
+//
+//where schedule gives the number of bots to be running at each point in
+//time, and repeat is how many times each bot runs its script, with 0
+//(the default) running it over and over until the test ends. When the
+//schedule ramps down, bots are stopped and released once they've had
+//the response to the request they're waiting on. With --launch-server a
+//tbs_server is started locally on the port, otherwise --server-pid may
+//be given to measure an already running one.
+//If the internal tbs server is enabled the bots run against it in process.
+COMMAND_LINE_UTILITY(tbs_load_test) {
+	std::string config_fname, output_fname = "tbs_load_report.json", label;
+	bool should_launch_server = false;
+	pid_t server_pid = -1;
+
+	std::deque<std::string> arguments(args.begin(), args.end());
+	while(arguments.empty() == false) {
+		std::string arg = arguments.front();
+		arguments.pop_front();
+
+		if(arg == "--launch-server") {
+			should_launch_server = true;
+			continue;
+		}
+
+		ASSERT_LOG(!arguments.empty(), "Need another argument after " << arg);
+		const std::string value = arguments.front();
+		arguments.pop_front();
+
+		if(arg == "--config") {
+			config_fname = value;
+		} else if(arg == "--output") {
+			output_fname = value;
+		} else if(arg == "--label") {
+			label = value;
+		} else if(arg == "--server-pid") {
+			server_pid = atoi(value.c_str());
+		} else {
+			ASSERT_LOG(false, "Unrecognized argument: " << arg);
+		}
+	}
+
+	ASSERT_LOG(!config_fname.empty(), "Must provide --config");
+
+	const variant config = json::parse_from_file(config_fname);
+	const std::string host = config["host"].as_string_default("localhost");
+	const int port = config["port"].as_int(23456);
+	const double duration = config["duration"].as_decimal(decimal::from_int(60)).as_float();
+	const int sample_ms = config["sample_ms"].as_int(1000);
+	const int repeat = config["repeat"].as_int(0);
+	ASSERT_LOG(repeat >= 0, "repeat must not be negative: " << repeat);
+
+	variant bot_config = config["bot"];
+	if(bot_config.is_string()) {
+		bot_config = json::parse_from_file(bot_config.as_string());
+	}
+
+	std::vector<std::pair<double, int> > schedule;
+	if(config["schedule"].is_list()) {
+		foreach(const variant& point, config["schedule"].as_list()) {
+			schedule.push_back(std::pair<double, int>(point[0].as_decimal().as_float(), point[1].as_int()));
+		}
+	} else {
+		schedule.push_back(std::pair<double, int>(0.0, config["bots"].as_int(1)));
+	}
+
+	const bool in_process = preferences::internal_tbs_server();
+	const tbs::internal_server_manager internal_server_manager_scope(in_process);
+
+	if(in_process) {
+		server_pid = getpid();
+	} else if(should_launch_server) {
+		server_pid = launch_server(port);
+		ASSERT_LOG(wait_for_server(host, port, 30000), "Server did not start listening on port " << port);
+	}
+
+	const long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+	boost::asio::io_service io_service;
+	tbs::bot_stats stats;
+	std::vector<boost::intrusive_ptr<tbs::bot> > bots;
+
+	//bots we've stopped that are still waiting on a response.
+	std::vector<boost::intrusive_ptr<tbs::bot> > stopping_bots;
+
+	std::vector<variant> samples;
+	process_usage start_usage, last_usage;
+	int peak_rss_kb = 0;
+	int last_messages = 0;
+	double last_sample_time = 0.0;
+
+	if(server_pid > 0) {
+		read_process_usage(server_pid, &start_usage);
+		last_usage = start_usage;
+	}
+
+	const boost::posix_time::ptime start_time = boost::posix_time::microsec_clock::universal_time();
+
+	for(double t = 0.0; t < duration; t = seconds_since(start_time)) {
+		const int nwanted = bots_wanted(schedule, t);
+		while(bots.size() < nwanted) {
+			bots.push_back(boost::intrusive_ptr<tbs::bot>(new tbs::bot(io_service, host, formatter() << port, bot_config)));
+			bots.back()->set_stats(&stats);
+			bots.back()->set_repeat(repeat);
+		}
+
+		while(bots.size() > nwanted) {
+			bots.back()->stop();
+			stopping_bots.push_back(bots.back());
+			bots.pop_back();
+		}
+
+		for(std::vector<boost::intrusive_ptr<tbs::bot> >::iterator i = stopping_bots.begin(); i != stopping_bots.end(); ) {
+			if((*i)->stopped()) {
+				i = stopping_bots.erase(i);
+			} else {
+				++i;
+			}
+		}
+
+		size_t nhandlers = 0;
+		try {
+			const assert_recover_scope recover_scope;
+			if(in_process) {
+				tbs::internal_server::process();
+			}
+
+			nhandlers = io_service.poll();
+			io_service.reset();
+		} catch(validation_failure_exception& e) {
+			++stats.errors;
+			io_service.reset();
+		}
+
+		if(t - last_sample_time >= sample_ms/1000.0) {
+			variant_builder sample;
+			sample.add("time", t);
+			sample.add("bots", static_cast<int>(bots.size()));
+			sample.add("messages_per_second", (stats.messages_received - last_messages)/(t - last_sample_time));
+
+			process_usage usage;
+			if(server_pid > 0 && read_process_usage(server_pid, &usage)) {
+				const double cpu_seconds = double(usage.cpu_ticks - last_usage.cpu_ticks)/ticks_per_second;
+				sample.add("server_cpu_percent", 100.0*cpu_seconds/(t - last_sample_time));
+				sample.add("server_rss_kb", usage.rss_kb);
+				peak_rss_kb = std::max(peak_rss_kb, usage.rss_kb);
+				last_usage = usage;
+			}
+
+			samples.push_back(sample.build());
+			last_messages = stats.messages_received;
+			last_sample_time = t;
+		}
+
+		if(nhandlers == 0) {
+			usleep(1000);
+		}
+	}
+
+	const double elapsed = seconds_since(start_time);
+
+	variant_builder report;
+	report.add("label", label);
+	report.add("config", config);
+	report.add_value("in_process", variant::from_bool(in_process));
+	report.add("duration", elapsed);
+	report.add("bots", static_cast<int>(bots.size()));
+	report.add("messages_sent", stats.messages_sent);
+	report.add("messages_received", stats.messages_received);
+	report.add("errors", stats.errors);
+	report.add("messages_per_second", stats.messages_received/elapsed);
+	report.add("latency", latency_report(stats.latencies_us));
+
+	if(server_pid > 0) {
+		variant_builder server;
+		server.add("pid", static_cast<int>(server_pid));
+		server.add("cpu_seconds", double(last_usage.cpu_ticks - start_usage.cpu_ticks)/ticks_per_second);
+		server.add("peak_rss_kb", peak_rss_kb);
+		report.add("server", server.build());
+	}
+
+	report.add("samples", variant(&samples));
+
+	sys::write_file(output_fname, report.build().write_json());
+	fprintf(stderr, "Wrote load test report to %s: %d messages, %d errors, %.1f messages/second\n", output_fname.c_str(), stats.messages_received, stats.errors, stats.messages_received/elapsed);
+
+	bots.clear();
+	stopping_bots.clear();
+
+	if(should_launch_server && !in_process && server_pid > 0) {
+		kill(server_pid, SIGTERM);
+		waitpid(server_pid, NULL, 0);
+	}
+}
+
+#endif // __linux__
@@ -44,6 +44,7 @@
 #include "tbs_bot.hpp"
 #include "tbs_server.hpp"
 #include "tbs_web_server.hpp"
+#include "tbs_worker_pool.hpp"
 #include "unit_test.hpp"
 #include "utils.hpp"
 #include "uuid.hpp"
@@ -97,10 +98,11 @@ bool username_valid(const std::string& username)
 class matchmaking_server : public http::web_server
 {
 public:
-	matchmaking_server(boost::asio::io_service& io_service, int port)
+	matchmaking_server(boost::asio::io_service& io_service, int port, boost::shared_ptr<worker_pool> workers)
 	  : http::web_server(io_service, port),
 	    io_service_(io_service), port_(port),
 		timer_(io_service), db_timer_(io_service),
+		workers_(workers),
 		time_ms_(0), terminated_servers_(0)
 	{
 		db_client_ = db_client::create();
@@ -111,11 +113,20 @@ public:
 		timer_.expires_from_now(boost::posix_time::milliseconds(1000));
 		timer_.async_wait(boost::bind(&matchmaking_server::heartbeat, this, boost::asio::placeholders::error));
 
-		for(int i = 0; i != 256; ++i) {
-			available_ports_.push_back(21156+i);
+		//the first ports are taken by the worker pool.
+		const int first_port = workers_ ? workers_->num_workers() : 0;
+		for(int i = first_port; i < 256; ++i) {
+			available_ports_.push_back(BasePort+i);
+		}
+
+		if(workers_) {
+			workers_->start(io_service, boost::bind(&matchmaking_server::game_created, this, _1),
+			                boost::bind(&matchmaking_server::game_create_failed, this, _1));
 		}
 	}
 
+	static const int BasePort = 21156;
+
 	~matchmaking_server()
 	{
 		timer_.cancel();
@@ -142,7 +153,9 @@ public:
 			}
 		} else if(pid > 0) {
 			auto itor = servers_.find(pid);
-			if(itor == servers_.end()) {
+			if(workers_ && workers_->worker_exited(pid)) {
+				fprintf(stderr, "Worker exited. %d workers running\n", workers_->num_workers());
+			} else if(itor == servers_.end()) {
 				fprintf(stderr, "ERROR: unknown pid exited: %d\n", (int)pid);
 			} else {
 				available_ports_.push_back(itor->second.port);
@@ -159,7 +172,7 @@ public:
 		variant_builder heartbeat_message;
 		heartbeat_message.add("type", "heartbeat");
 		heartbeat_message.add("users", sessions_.size());
-		heartbeat_message.add("games", servers_.size());
+		heartbeat_message.add("games", servers_.size() + (workers_ ? workers_->num_games() : 0));
 		std::string heartbeat_msg = heartbeat_message.build().write_json();
 
 		for(auto& p : sessions_) {
@@ -386,32 +399,27 @@ public:
 					}
 				}
 
-				if(match_sessions.size() == 2 && !available_ports_.empty()) {
+				if(match_sessions.size() == 2 && workers_ && workers_->num_workers() > 0) {
+					//hand the game off to the least loaded worker.
+					variant game = build_game(match_sessions);
+					if(workers_->assign_game(game) == -1) {
+						fprintf(stderr, "ERROR: ALL WORKERS AT CAPACITY\n");
+						for(int i : match_sessions) {
+							sessions_[i].game_pending = 0;
+							sessions_[i].queued_for_game = true;
+						}
+					}
+
+				} else if(match_sessions.size() == 2 && !available_ports_.empty()) {
 					//spawn off a server to play this game.
 					std::string fname = formatter() << "/tmp/anura_tbs_server." << match_sessions.front();
 					std::string fname_out = formatter() << "/tmp/anura.out." << match_sessions.front();
 
-					variant_builder game;
-					game.add("game_type", "citadel");
-					
-					std::vector<variant> users;
-					for(int i : match_sessions) {
-						SessionInfo& session_info = sessions_[i];
-						session_info.game_pending = time_ms_;
-						session_info.queued_for_game = false;
-
-						variant_builder user;
-						user.add("user", session_info.user_id);
-						user.add("session_id", session_info.session_id);
-						users.push_back(user.build());
-					}
-
-					variant users_info(&users);
-
-					game.add("users", users_info);
+					variant game_info = build_game(match_sessions);
+					variant users_info = game_info["users"];
 
 					variant_builder server_config;
-					server_config.add("game", game.build());
+					server_config.add("game", game_info);
 
 					server_config.add("matchmaking_host", "localhost");
 					server_config.add("matchmaking_port", port_);
@@ -496,33 +504,7 @@ public:
 					}
 				}
 			} else if(request_type == "server_created_game") {
-				fprintf(stderr, "Notified of game up on server\n");
-
-				variant_builder msg;
-				msg.add("type", "match_made");
-				msg.add("game_id", doc["game_id"].as_int());
-				msg.add("port", doc["port"].as_int());
-
-				variant msg_variant = msg.build();
-
-				for(variant user : doc["game"]["users"].as_list()) {
-					int session_id = user["session_id"].as_int();
-					auto itor = sessions_.find(session_id);
-					if(itor == sessions_.end()) {
-						fprintf(stderr, "ERROR: Session not found: %d\n", session_id);
-					} else {
-						itor->second.game_pending = 0;
-						itor->second.game_port = doc["port"].as_int();
-						itor->second.game_details = msg_variant.write_json();
-						fprintf(stderr, "Queued game message for session %d\n", session_id);
-
-						if(itor->second.current_socket) {
-							send_msg(itor->second.current_socket, "text/json", itor->second.game_details, "");
-							itor->second.current_socket.reset();
-						}
-					}
-				}
-
+				game_created(doc);
 				send_msg(socket, "text/json", "{ \"type\": \"ok\" }", "");
 			} else if(request_type == "query_status") {
 				variant response = build_status();
@@ -552,6 +534,70 @@ public:
 	}
 
 private:
+	variant build_game(const std::vector<int>& match_sessions) {
+		variant_builder game;
+		game.add("game_type", "citadel");
+
+		std::vector<variant> users;
+		for(int i : match_sessions) {
+			SessionInfo& session_info = sessions_[i];
+			session_info.game_pending = time_ms_;
+			session_info.queued_for_game = false;
+
+			variant_builder user;
+			user.add("user", session_info.user_id);
+			user.add("session_id", session_info.session_id);
+			users.push_back(user.build());
+		}
+
+		game.add("users", variant(&users));
+
+		return game.build();
+	}
+
+	//called when a game server, either forked or from the worker pool,
+	//tells us it has a game up.
+	void game_created(variant doc) {
+		fprintf(stderr, "Notified of game up on server\n");
+
+		variant_builder msg;
+		msg.add("type", "match_made");
+		msg.add("game_id", doc["game_id"].as_int());
+		msg.add("port", doc["port"].as_int());
+
+		variant msg_variant = msg.build();
+
+		for(variant user : doc["game"]["users"].as_list()) {
+			int session_id = user["session_id"].as_int();
+			auto itor = sessions_.find(session_id);
+			if(itor == sessions_.end()) {
+				fprintf(stderr, "ERROR: Session not found: %d\n", session_id);
+			} else {
+				itor->second.game_pending = 0;
+				itor->second.game_port = doc["port"].as_int();
+				itor->second.game_details = msg_variant.write_json();
+				fprintf(stderr, "Queued game message for session %d\n", session_id);
+
+				if(itor->second.current_socket) {
+					send_msg(itor->second.current_socket, "text/json", itor->second.game_details, "");
+					itor->second.current_socket.reset();
+				}
+			}
+		}
+	}
+
+	//called when a worker couldn't start a game. The players go back
+	//in the queue to be matched again.
+	void game_create_failed(variant game) {
+		for(variant user : game["users"].as_list()) {
+			auto itor = sessions_.find(user["session_id"].as_int());
+			if(itor != sessions_.end()) {
+				itor->second.game_pending = 0;
+				itor->second.queued_for_game = true;
+			}
+		}
+	}
+
 	variant build_status() const {
 
 		variant_builder doc;
@@ -574,6 +620,10 @@ private:
 
 		doc.add("servers", variant(&servers));
 
+		if(workers_) {
+			doc.add("workers", workers_->get_status());
+		}
+
 		std::map<variant,variant> sessions;
 		for(auto p : sessions_) {
 			variant_builder s;
@@ -606,6 +656,8 @@ private:
 
 	db_client_ptr db_client_;
 
+	boost::shared_ptr<worker_pool> workers_;
+
 	struct SessionInfo {
 		SessionInfo() : game_pending(0), game_port(0), queued_for_game(false) {}
 		int session_id;
@@ -644,6 +696,8 @@ private:
 
 COMMAND_LINE_UTILITY(tbs_matchmaking_server) {
 	int port = 23456;
+	int nworkers = 0;
+	int games_per_worker = 64;
 
 	std::deque<std::string> arguments(args.begin(), args.end());
 	while(arguments.empty() == false) {
@@ -654,13 +708,29 @@ COMMAND_LINE_UTILITY(tbs_matchmaking_server) {
 			ASSERT_LOG(!arguments.empty(), "Need another argument after --port");
 			port = atoi(arguments.front().c_str());
 			arguments.pop_front();
+		} else if(arg == "--workers") {
+			ASSERT_LOG(!arguments.empty(), "Need another argument after --workers");
+			nworkers = atoi(arguments.front().c_str());
+			arguments.pop_front();
+		} else if(arg == "--games-per-worker") {
+			ASSERT_LOG(!arguments.empty(), "Need another argument after --games-per-worker");
+			games_per_worker = atoi(arguments.front().c_str());
+			arguments.pop_front();
 		} else {
 			ASSERT_LOG(false, "Unrecognized argument: " << arg);
 		}
 	}
 
+	//workers have to be forked before we create our io_service. Load
+	//everything they need first so they all start out warm.
+	boost::shared_ptr<worker_pool> workers;
+	if(nworkers > 0) {
+		preload_game_server_caches();
+		workers.reset(new worker_pool(nworkers, matchmaking_server::BasePort, games_per_worker));
+	}
+
 	boost::asio::io_service io_service;
-	matchmaking_server server(io_service, port);
+	matchmaking_server server(io_service, port, workers);
 	io_service.run();
 }
 
@@ -52,7 +52,7 @@ server::game_info::~game_info()
 	}
 }
 
-server::client_info::client_info() : nplayer(0), last_contact(0)
+server::client_info::client_info() : nplayer(0), last_contact(0), accepts_batch(false), accepts_deflate(false)
 {}
 
 server::server(boost::asio::io_service& io_service)
@@ -98,9 +98,7 @@ void server::close_ajax(socket_ptr socket, client_info& cli_info)
 			}
 		}
 
-		const std::string msg = cli_info.msg_queue.front();
-		cli_info.msg_queue.pop_front();
-		send_msg(socket, msg);
+		send_msg(socket, pop_messages(cli_info));
 
 		foreach(socket_ptr socket, keepalive_sockets) {
 			send_msg(socket, "{ \"type\": \"keepalive\" }");
@@ -111,28 +109,46 @@ void server::close_ajax(socket_ptr socket, client_info& cli_info)
 	}
 }
 
-void server::queue_msg(int session_id, const std::string& msg, bool has_priority)
+void server::queue_msg(int session_id, message_ptr msg, bool has_priority)
 {
 	if(session_id == -1) {
 		return;
 	}
 
-	std::map<int, socket_ptr>::iterator itor = sessions_to_waiting_connections_.find(session_id);
-	if(itor != sessions_to_waiting_connections_.end()) {
-		const int session_id = itor->first;
+	//if the client is waiting on a connection, hold off writing until the
+	//current request is done so everything it generates goes out together.
+	if(sessions_to_waiting_connections_.count(session_id)) {
+		sessions_to_flush_.insert(session_id);
+	}
+
+	server_base::queue_msg(session_id, msg, has_priority);
+}
+
+void server::flush_queued_messages(std::map<int, client_info>& clients)
+{
+	foreach(int session_id, sessions_to_flush_) {
+		std::map<int, socket_ptr>::iterator itor = sessions_to_waiting_connections_.find(session_id);
+		if(itor == sessions_to_waiting_connections_.end()) {
+			continue;
+		}
+
+		client_info& cli_info = clients[session_id];
+		if(cli_info.msg_queue.empty()) {
+			continue;
+		}
+
 		const socket_ptr sock = itor->second;
 		waiting_connections_.erase(sock);
-		sessions_to_waiting_connections_.erase(session_id);
-		send_msg(sock, msg);
-		return;
+		sessions_to_waiting_connections_.erase(itor);
+		send_msg(sock, pop_messages(cli_info));
 	}
 
-	server_base::queue_msg(session_id, msg, has_priority);
+	sessions_to_flush_.clear();
 }
 
 void server::send_msg(socket_ptr socket, const variant& msg)
 {
-	send_msg(socket, msg.write_json(true, variant::JSON_COMPLIANT));
+	send_msg(socket, msg.write_json(false, variant::JSON_COMPLIANT));
 }
 
 void server::send_msg(socket_ptr socket, const char* msg)
@@ -156,18 +172,19 @@ void server::send_msg(socket_ptr socket, const std::string& msg)
 		"Content-Type: application/json\r\n"
 		"Content-Length: " << std::dec << (int)msg.size() << "\r\n"
 		"Last-Modified: " << get_http_datetime() << "\r\n\r\n";
-	std::string header = buf.str();
+	const int header_size = buf.tellp();
+	buf << msg;
 
-	boost::shared_ptr<std::string> str_buf(new std::string(header.empty() ? msg : (header + msg)));
+	boost::shared_ptr<std::string> str_buf(new std::string(buf.str()));
 	boost::asio::async_write(*socket, boost::asio::buffer(*str_buf),
-			                         boost::bind(&server::handle_send, this, socket, _1, _2, str_buf, session_id));
+			                         boost::bind(&server::handle_send, this, socket, _1, _2, str_buf, session_id, header_size));
 }
 
-void server::handle_send(socket_ptr socket, const boost::system::error_code& e, size_t nbytes, boost::shared_ptr<std::string> buf, int session_id)
+void server::handle_send(socket_ptr socket, const boost::system::error_code& e, size_t nbytes, boost::shared_ptr<std::string> buf, int session_id, int header_size)
 {
 	if(e) {
 		std::cerr << "ERROR SENDING DATA: " << e.message() << std::endl;
-		queue_msg(session_id, *buf, true); //re-queue the message.
+		queue_msg(session_id, buf->substr(header_size), true); //re-queue the message.
 	}
 
 	disconnect(socket);
@@ -210,8 +227,7 @@ void server::heartbeat_internal(int send_heartbeat, std::map<int, client_info>&
 
 		client_info& cli_info = clients[info.session_id];
 		if(cli_info.msg_queue.empty() == false) {
-			messages.push_back(std::pair<socket_ptr,std::string>(socket, cli_info.msg_queue.front()));
-			cli_info.msg_queue.pop_front();
+			messages.push_back(std::pair<socket_ptr,std::string>(socket, pop_messages(cli_info)));
 
 		sessions_to_waiting_connections_.erase(info.session_id);
 		} else if(send_heartbeat) {
@@ -22,6 +22,7 @@
 
 #include <deque>
 #include <map>
+#include <set>
 #include <vector>
 
 #include <boost/array.hpp>
@@ -49,16 +50,22 @@ private:
 	void send_msg(socket_ptr socket, const variant& msg);
 	void send_msg(socket_ptr socket, const char* msg);
 	void send_msg(socket_ptr socket, const std::string& msg);
-	void handle_send(socket_ptr socket, const boost::system::error_code& e, size_t nbytes, boost::shared_ptr<std::string> buf, int session_id);
+	void handle_send(socket_ptr socket, const boost::system::error_code& e, size_t nbytes, boost::shared_ptr<std::string> buf, int session_id, int header_size);
 	virtual void heartbeat_internal(int send_heartbeat, std::map<int, client_info>& clients);
+	virtual void flush_queued_messages(std::map<int, client_info>& clients);
 
 	socket_info& get_socket_info(socket_ptr socket);
 
 	void disconnect(socket_ptr socket);
 
-	virtual void queue_msg(int session_id, const std::string& msg, bool has_priority=false);
+	using server_base::queue_msg;
+	virtual void queue_msg(int session_id, message_ptr msg, bool has_priority=false);
 
 	std::map<int, socket_ptr> sessions_to_waiting_connections_;
+
+	//sessions with a waiting connection that have had messages queued
+	//while handling the current request.
+	std::set<int> sessions_to_flush_;
 	std::map<socket_ptr, std::string> waiting_connections_;
 
 	std::map<socket_ptr, socket_info> connections_;
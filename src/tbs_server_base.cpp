@@ -17,6 +17,8 @@
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 
+#include "base64.hpp"
+#include "compress.hpp"
 #include "filesystem.hpp"
 #include "foreach.hpp"
 #include "formatter.hpp"
@@ -40,8 +42,15 @@ namespace tbs
 		}
 	}
 
+	PREF_INT(tbs_server_delay_ms, 100, "");
+	PREF_INT(tbs_server_heartbeat_freq, 10, "");
+	PREF_INT(tbs_server_status_interval_ms, 500, "Minimum time between lobby status broadcasts from the tbs server");
+	PREF_INT(tbs_server_max_batch_size, 64, "Maximum number of messages the tbs server will coalesce into one response");
+	PREF_INT(tbs_server_compress_threshold, 4096, "Responses at least this many bytes long are deflate-compressed for tbs clients which accept it");
+
 	server_base::server_base(boost::asio::io_service& io_service)
-		: timer_(io_service), nheartbeat_(0), scheduled_write_(0), status_id_(0)
+		: timer_(io_service), nheartbeat_(0), scheduled_write_(0), status_id_(0),
+		  status_dirty_(false), last_status_heartbeat_(0)
 	{
 		heartbeat(boost::asio::error::timed_out);
 	}
@@ -194,6 +203,8 @@ namespace tbs
 		}
 
 		client_info& cli_info = client_itor->second;
+		cli_info.accepts_batch = msg["accept_batch"].as_bool(false);
+		cli_info.accepts_deflate = msg["accept_deflate"].as_bool(false);
 		
 		if(socket_info_fn) {
 			socket_info& info = socket_info_fn();
@@ -206,13 +217,41 @@ namespace tbs
 		if(close_fn) {
 			close_fn(cli_info);
 		}
+
+		flush_queued_messages(clients_);
 	}
 
 	void server_base::status_change()
 	{
-		++status_id_;
+		status_dirty_ = true;
+	}
+
+	void server_base::flush_status(bool force)
+	{
+		if(!force && (!status_dirty_ || (nheartbeat_ - last_status_heartbeat_)*g_tbs_server_delay_ms < g_tbs_server_status_interval_ms)) {
+			return;
+		}
+
+		status_dirty_ = false;
+		last_status_heartbeat_ = nheartbeat_;
+
+		variant games = create_games_list();
+		std::string games_str = games.write_json(false, variant::JSON_COMPLIANT);
+		if(games_str != last_status_games_) {
+			++status_id_;
+			last_status_games_.swap(games_str);
+		} else if(!force) {
+			//nothing clients can see has changed, so leave them waiting.
+			return;
+		}
+
 		if(!status_fns_.empty()) {
-			variant msg = create_lobby_msg();
+			variant_builder value;
+			value.add("type", "lobby");
+			value.add("status_id", status_id_);
+			value.set("games", games);
+
+			const variant msg = value.build();
 			foreach(send_function send_fn, status_fns_) {
 				send_fn(msg);
 			}
@@ -226,15 +265,19 @@ namespace tbs
 		variant_builder value;
 		value.add("type", "lobby");
 		value.add("status_id", status_id_);
+		value.set("games", create_games_list());
+
+		return value.build();
+	}
 
+	variant server_base::create_games_list() const
+	{
 		std::vector<variant> games;
 		foreach(game_info_ptr g, games_) {
 			games.push_back(create_game_info_msg(g));
 		}
 
-		value.set("games", variant(&games));
-
-		return value.build();
+		return variant(&games);
 	}
 
 	variant server_base::create_game_info_msg(game_info_ptr g) const
@@ -278,7 +321,7 @@ namespace tbs
 						g->clients.clear();
 						//TODO: remove joining clients from the game nicely.
 					} else {
-						const std::string msg = create_game_info_msg(g).write_json(true, variant::JSON_COMPLIANT);
+						const message_ptr msg(new std::string(create_game_info_msg(g).write_json(false, variant::JSON_COMPLIANT)));
 						foreach(int client, g->clients) {
 							queue_msg(client, msg);
 						}
@@ -312,10 +355,13 @@ namespace tbs
 		std::vector<game::message> game_response;
 		info.game_state->swap_outgoing_messages(game_response);
 		foreach(game::message& msg, game_response) {
+			boost::shared_ptr<std::string> contents(new std::string);
+			contents->swap(msg.contents);
+
 			if(msg.recipients.empty()) {
 				foreach(int session_id, info.clients) {
 					if(session_id != -1) {
-						queue_msg(session_id, msg.contents);
+						queue_msg(session_id, contents);
 					}
 				}
 			} else {
@@ -326,11 +372,11 @@ namespace tbs
 					}
 
 					if(player >= 0) {
-						queue_msg(info.clients[player], msg.contents);
+						queue_msg(info.clients[player], contents);
 					} else {
 						//A message for observers
 						for(size_t n = info.game_state->players().size(); n < info.clients.size(); ++n) {
-							queue_msg(info.clients[n], msg.contents);
+							queue_msg(info.clients[n], contents);
 						}
 					}
 				}
@@ -372,6 +418,11 @@ namespace tbs
 	}
 
 	void server_base::queue_msg(int session_id, const std::string& msg, bool has_priority)
+	{
+		queue_msg(session_id, message_ptr(new std::string(msg)), has_priority);
+	}
+
+	void server_base::queue_msg(int session_id, message_ptr msg, bool has_priority)
 	{
 		if(session_id == -1) {
 			return;
@@ -384,8 +435,42 @@ namespace tbs
 		}
 	}
 
-	PREF_INT(tbs_server_delay_ms, 100, "");
-	PREF_INT(tbs_server_heartbeat_freq, 10, "");
+	std::string server_base::pop_messages(client_info& cli_info)
+	{
+		ASSERT_LOG(cli_info.msg_queue.empty() == false, "pop_messages called with no messages queued");
+
+		std::string result;
+		if(!cli_info.accepts_batch || cli_info.msg_queue.size() == 1) {
+			result = *cli_info.msg_queue.front();
+			cli_info.msg_queue.pop_front();
+		} else {
+			//messages may carry their own serialized objects, so they are
+			//framed as strings rather than spliced into the frame.
+			std::vector<variant> messages;
+			while(cli_info.msg_queue.empty() == false && static_cast<int>(messages.size()) < g_tbs_server_max_batch_size) {
+				messages.push_back(variant(*cli_info.msg_queue.front()));
+				cli_info.msg_queue.pop_front();
+			}
+
+			variant_builder frame;
+			frame.add("type", "batch");
+			frame.set("messages", variant(&messages));
+			result = frame.build().write_json(false, variant::JSON_COMPLIANT);
+		}
+
+		if(cli_info.accepts_deflate && static_cast<int>(result.size()) >= g_tbs_server_compress_threshold) {
+			const std::vector<char> compressed = base64::b64encode(zip::compress(std::vector<char>(result.begin(), result.end())));
+			if(compressed.size() < result.size()) {
+				variant_builder frame;
+				frame.add("type", "deflate");
+				frame.add("size", static_cast<int>(result.size()));
+				frame.add("data", std::string(compressed.begin(), compressed.end()));
+				result = frame.build().write_json(false, variant::JSON_COMPLIANT);
+			}
+		}
+
+		return result;
+	}
 
 	void server_base::heartbeat(const boost::system::error_code& error)
 	{
@@ -401,7 +486,12 @@ namespace tbs
 			g->game_state->process();
 		}
 
+		flush_queued_messages(clients_);
+
 		nheartbeat_++;
+
+		flush_status(false);
+
 		if(nheartbeat_ <= 1 || nheartbeat_%g_tbs_server_heartbeat_freq != 0) {
 			return;
 		}
@@ -432,7 +522,9 @@ namespace tbs
 		heartbeat_internal(send_heartbeat, clients_);
 
 		if(send_heartbeat) {
-			status_change();
+			//clients waiting on status get a response even if nothing has
+			//changed, so their connections don't time out.
+			flush_status(true);
 		}
 
 		if(nheartbeat_ >= scheduled_write_) {
@@ -19,8 +19,11 @@
 #define TBS_SERVER_VIRT_HPP_INCLUDED
 
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 
+#include <deque>
 #include <map>
+#include <string>
 #include <vector>
 
 #include "tbs_game.hpp"
@@ -30,6 +33,10 @@ namespace tbs
 {
 	typedef boost::function<void(variant)> send_function;
 
+	//a serialized message. Messages going to several clients are serialized
+	//once and the same string is shared between their queues.
+	typedef boost::shared_ptr<const std::string> message_ptr;
+
 	struct exit_exception {};
 
 	class server_base
@@ -55,6 +62,9 @@ namespace tbs
 		typedef boost::shared_ptr<game_info> game_info_ptr;
 
 		game_info_ptr create_game(variant msg);
+
+		int num_games() const { return games_.size(); }
+		int num_clients() const { return clients_.size(); }
 	protected:
 
 		struct client_info 
@@ -68,7 +78,12 @@ namespace tbs
 
 			int session_id;
 
-			std::deque<std::string> msg_queue;
+			//whether the client has told us it can unpack batched and
+			//deflate-compressed frames.
+			bool accepts_batch;
+			bool accepts_deflate;
+
+			std::deque<message_ptr> msg_queue;
 		};
 
 		struct socket_info 
@@ -85,16 +100,29 @@ namespace tbs
 			int session_id, 
 			const variant& msg);
 
-		virtual void queue_msg(int session_id, const std::string& msg, bool has_priority=false);
+		void queue_msg(int session_id, const std::string& msg, bool has_priority=false);
+		virtual void queue_msg(int session_id, message_ptr msg, bool has_priority=false);
+
+		//removes the client's queued messages and returns what should be
+		//written to it. Clients that accept batches get everything queued in
+		//a single frame, and large frames are compressed for clients that
+		//accept it. Must only be called when the queue is not empty.
+		std::string pop_messages(client_info& cli_info);
 
 		virtual void heartbeat_internal(int send_heartbeat, std::map<int, client_info>& clients) = 0;
 
+		//called once a request has been handled, so messages queued while
+		//handling it can be written out together.
+		virtual void flush_queued_messages(std::map<int, client_info>& clients) {}
+
 		variant create_heartbeat_packet(const client_info& cli_info);
 
 	private:
 		variant create_lobby_msg() const;
+		variant create_games_list() const;
 		variant create_game_info_msg(game_info_ptr g) const;
 		void status_change();
+		void flush_status(bool force);
 		void quit_games(int session_id);
 		void flush_game_messages(game_info& info);
 		void schedule_write();
@@ -105,6 +133,12 @@ namespace tbs
 		int scheduled_write_;
 		int status_id_;
 
+		//lobby status is broadcast at most once per
+		//tbs_server_status_interval_ms, and only when it has changed.
+		bool status_dirty_;
+		int last_status_heartbeat_;
+		std::string last_status_games_;
+
 		std::map<int, client_info> clients_;
 		std::vector<game_info_ptr> games_;
 
@@ -55,6 +55,8 @@ web_server::web_server(server& serv, boost::asio::io_service& io_service, int po
 	: http::web_server(io_service, port), server_(serv), timer_(io_service)
 {
 	web_server_instance = this;
+	g_service = &io_service;
+	g_listening_port = port;
 	timer_.expires_from_now(boost::posix_time::milliseconds(1000));
 	timer_.async_wait(boost::bind(&web_server::heartbeat, this, boost::asio::placeholders::error));
 }
@@ -238,8 +240,6 @@ COMMAND_LINE_UTILITY(tbs_server) {
 	boost::asio::io_service io_service;
 
 	std::cerr << "tbs_server(): Listening on port " << std::dec << port << std::endl;
-	tbs::g_service = &io_service;
-	tbs::g_listening_port = port;
 
 	tbs::server s(io_service);
 	tbs::web_server ws(s, io_service, port);
@@ -0,0 +1,508 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//This file is designed to only work on Linux.
+#ifdef __linux__
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <istream>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "asserts.hpp"
+#include "foreach.hpp"
+#include "formatter.hpp"
+#include "formula_object.hpp"
+#include "json_parser.hpp"
+#include "preferences.hpp"
+#include "tbs_server.hpp"
+#include "tbs_web_server.hpp"
+#include "tbs_worker_pool.hpp"
+#include "variant_utils.hpp"
+
+namespace tbs {
+
+namespace {
+
+PREF_INT(tbs_worker_load_report_ms, 1000, "How often tbs worker processes report their load to the matchmaking server");
+
+//The worker's end of the channel to the matchmaking server. Receives game
+//assignments and periodically reports how loaded this worker is.
+class worker_connection
+{
+public:
+	worker_connection(boost::asio::io_service& io_service, server& serv, int port, int fd)
+	  : io_service_(io_service), server_(serv), port_(port),
+	    socket_(io_service), timer_(io_service)
+	{
+		socket_.assign(boost::asio::local::stream_protocol(), fd);
+		start_receive();
+		report_load(boost::system::error_code());
+	}
+
+	~worker_connection()
+	{
+		timer_.cancel();
+	}
+
+private:
+	void start_receive()
+	{
+		boost::asio::async_read_until(socket_, read_buf_, '\n',
+		  boost::bind(&worker_connection::handle_receive, this,
+		    boost::asio::placeholders::error,
+		    boost::asio::placeholders::bytes_transferred));
+	}
+
+	void handle_receive(const boost::system::error_code& error, size_t nbytes)
+	{
+		if(error) {
+			//the matchmaking server has gone away, so shut down.
+			fprintf(stderr, "Worker lost connection to matchmaking server: %s\n", error.message().c_str());
+			io_service_.stop();
+			return;
+		}
+
+		std::istream is(&read_buf_);
+		std::string line;
+		std::getline(is, line);
+
+		variant msg;
+		try {
+			msg = json::parse(line, json::JSON_NO_PREPROCESSOR);
+		} catch(json::parse_error& e) {
+			fprintf(stderr, "Worker received bad message: %s\n", line.c_str());
+		}
+
+		if(msg.is_map() && msg["type"].as_string() == "create_game") {
+			create_game(msg["game"]);
+		}
+
+		start_receive();
+	}
+
+	void create_game(variant game)
+	{
+		server_base::game_info_ptr g = server_.create_game(game);
+
+		variant_builder response;
+		if(g) {
+			response.add("type", "game_created");
+			response.add("game", game);
+			response.add("game_id", g->game_state->game_id());
+			response.add("port", port_);
+		} else {
+			response.add("type", "create_game_failed");
+			response.add("game", game);
+		}
+
+		send(response.build());
+		send_load();
+	}
+
+	void report_load(const boost::system::error_code& error)
+	{
+		if(error == boost::asio::error::operation_aborted) {
+			return;
+		}
+
+		send_load();
+
+		timer_.expires_from_now(boost::posix_time::milliseconds(g_tbs_worker_load_report_ms));
+		timer_.async_wait(boost::bind(&worker_connection::report_load, this, boost::asio::placeholders::error));
+	}
+
+	void send_load()
+	{
+		variant_builder msg;
+		msg.add("type", "load");
+		msg.add("games", server_.num_games());
+		msg.add("clients", server_.num_clients());
+		send(msg.build());
+	}
+
+	void send(const variant& msg)
+	{
+		//messages are small so we write them synchronously rather than
+		//queueing them up.
+		const std::string buf = msg.write_json() + "\n";
+		boost::system::error_code error;
+		boost::asio::write(socket_, boost::asio::buffer(buf), error);
+		if(error) {
+			fprintf(stderr, "Worker could not write to matchmaking server: %s\n", error.message().c_str());
+			io_service_.stop();
+		}
+	}
+
+	boost::asio::io_service& io_service_;
+	server& server_;
+	int port_;
+	boost::asio::local::stream_protocol::socket socket_;
+	boost::asio::streambuf read_buf_;
+	boost::asio::deadline_timer timer_;
+};
+
+void run_worker(int port, int fd)
+{
+	boost::asio::io_service io_service;
+	server s(io_service);
+	web_server ws(s, io_service, port);
+	worker_connection connection(io_service, s, port, fd);
+
+	fprintf(stderr, "Worker %d listening on port %d\n", static_cast<int>(getpid()), port);
+
+	for(;;) {
+		try {
+			//an error in one game shouldn't take down every other game
+			//hosted by this worker.
+			const assert_recover_scope recover_scope;
+			io_service.run();
+			break;
+		} catch(validation_failure_exception& e) {
+			fprintf(stderr, "ERROR IN WORKER: %s\n", e.msg.c_str());
+			io_service.reset();
+		} catch(exit_exception&) {
+			break;
+		}
+	}
+}
+
+}
+
+struct worker_pool::worker_info
+{
+	worker_info() : pid(-1), port(0), fd(-1), games(0), clients(0), games_hosted(0)
+	{}
+
+	//the number of games hosted plus the number it hasn't confirmed yet.
+	int load() const { return games + pending.size(); }
+
+	pid_t pid;
+	int port;
+
+	//our end of the channel, or -1 once the worker has been given up on.
+	int fd;
+
+	boost::shared_ptr<boost::asio::local::stream_protocol::socket> socket;
+	boost::asio::streambuf read_buf;
+
+	//load as last reported by the worker.
+	int games, clients;
+
+	//games we have assigned to the worker that it hasn't confirmed yet,
+	//in the order they were sent.
+	std::deque<variant> pending;
+
+	int games_hosted;
+};
+
+worker_pool::worker_pool(int nworkers, int base_port, int max_games_per_worker)
+  : max_games_per_worker_(max_games_per_worker), io_service_(NULL)
+{
+	for(int n = 0; n != nworkers; ++n) {
+		worker_ptr w(new worker_info);
+		w->port = base_port + n;
+		spawn_worker(w);
+		workers_.push_back(w);
+	}
+}
+
+worker_pool::~worker_pool()
+{
+	//closing our end of the channel tells the workers to exit.
+	foreach(const worker_ptr& w, workers_) {
+		if(w->socket) {
+			boost::system::error_code error;
+			w->socket->close(error);
+		} else if(w->fd >= 0) {
+			close(w->fd);
+		}
+	}
+}
+
+void worker_pool::spawn_worker(worker_ptr w)
+{
+	int fds[2];
+	ASSERT_LOG(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "Could not create socket pair for tbs worker: " << errno);
+
+	const pid_t pid = fork();
+	ASSERT_LOG(pid >= 0, "FAILED TO FORK TBS WORKER");
+
+	if(pid == 0) {
+		//child. Close everything inherited from the matchmaking server,
+		//including the other workers' channels and, when respawning, its
+		//listening socket.
+		const int max_fd = sysconf(_SC_OPEN_MAX);
+		for(int fd = STDERR_FILENO+1; fd < max_fd; ++fd) {
+			if(fd != fds[1]) {
+				close(fd);
+			}
+		}
+
+		const std::string fname_out = formatter() << "/tmp/anura_tbs_worker.out." << w->port;
+		const int fd = open(fname_out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if(fd >= 0) {
+			dup2(fd, STDERR_FILENO);
+		}
+
+		try {
+			run_worker(w->port, fds[1]);
+		} catch(...) {
+			fprintf(stderr, "Worker exiting with an exception\n");
+		}
+
+		_exit(0);
+	}
+
+	//parent
+	close(fds[1]);
+
+	fprintf(stderr, "Forked tbs worker %d on port %d\n", static_cast<int>(pid), w->port);
+
+	w->pid = pid;
+	w->fd = fds[0];
+	w->games = w->clients = 0;
+	w->pending.clear();
+	w->read_buf.consume(w->read_buf.size());
+}
+
+void worker_pool::connect_worker(worker_ptr w)
+{
+	w->socket.reset(new boost::asio::local::stream_protocol::socket(*io_service_));
+	w->socket->assign(boost::asio::local::stream_protocol(), w->fd);
+	start_receive(w);
+}
+
+void worker_pool::start(boost::asio::io_service& io_service, game_created_fn created_fn, game_failed_fn failed_fn)
+{
+	io_service_ = &io_service;
+	game_created_fn_ = created_fn;
+	game_failed_fn_ = failed_fn;
+
+	foreach(const worker_ptr& w, workers_) {
+		connect_worker(w);
+	}
+}
+
+int worker_pool::assign_game(const variant& game)
+{
+	worker_ptr best;
+	foreach(const worker_ptr& w, workers_) {
+		if(w->fd < 0 || w->load() >= max_games_per_worker_) {
+			continue;
+		}
+
+		if(!best || w->load() < best->load() ||
+		   (w->load() == best->load() && w->clients < best->clients)) {
+			best = w;
+		}
+	}
+
+	if(!best) {
+		return -1;
+	}
+
+	variant_builder msg;
+	msg.add("type", "create_game");
+	msg.add("game", game);
+	if(!send_message(best, msg.build())) {
+		return -1;
+	}
+
+	best->pending.push_back(game);
+	return best->port;
+}
+
+bool worker_pool::worker_exited(pid_t pid)
+{
+	foreach(const worker_ptr& w, workers_) {
+		if(w->pid == pid) {
+			fprintf(stderr, "ERROR: tbs worker %d on port %d exited\n", static_cast<int>(pid), w->port);
+			remove_worker(w);
+
+			//the games it was hosting are gone, but bring up a new
+			//worker on the same port so the pool doesn't shrink.
+			spawn_worker(w);
+			if(io_service_) {
+				connect_worker(w);
+			}
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int worker_pool::num_workers() const
+{
+	return workers_.size();
+}
+
+int worker_pool::num_games() const
+{
+	int result = 0;
+	foreach(const worker_ptr& w, workers_) {
+		result += w->load();
+	}
+
+	return result;
+}
+
+variant worker_pool::get_status() const
+{
+	std::vector<variant> result;
+	foreach(const worker_ptr& w, workers_) {
+		variant_builder info;
+		info.add("pid", static_cast<int>(w->pid));
+		info.add("port", w->port);
+		info.add("games", w->games);
+		info.add("clients", w->clients);
+		info.add("pending", static_cast<int>(w->pending.size()));
+		info.add("games_hosted", w->games_hosted);
+		result.push_back(info.build());
+	}
+
+	return variant(&result);
+}
+
+void worker_pool::start_receive(worker_ptr w)
+{
+	boost::asio::async_read_until(*w->socket, w->read_buf, '\n',
+	  boost::bind(&worker_pool::handle_receive, this, w, w->pid,
+	    boost::asio::placeholders::error,
+	    boost::asio::placeholders::bytes_transferred));
+}
+
+void worker_pool::handle_receive(worker_ptr w, pid_t pid, const boost::system::error_code& error, size_t nbytes)
+{
+	//ignore anything for a worker that has since been replaced.
+	if(error == boost::asio::error::operation_aborted || w->pid != pid || w->fd < 0) {
+		return;
+	}
+
+	if(error) {
+		fprintf(stderr, "ERROR: lost connection to tbs worker %d: %s\n", static_cast<int>(w->pid), error.message().c_str());
+		remove_worker(w);
+		return;
+	}
+
+	std::istream is(&w->read_buf);
+	std::string line;
+	std::getline(is, line);
+
+	try {
+		handle_message(w, json::parse(line, json::JSON_NO_PREPROCESSOR));
+	} catch(json::parse_error& e) {
+		fprintf(stderr, "ERROR: bad message from tbs worker %d: %s\n", static_cast<int>(w->pid), line.c_str());
+	}
+
+	start_receive(w);
+}
+
+void worker_pool::handle_message(worker_ptr w, const variant& msg)
+{
+	const std::string& type = msg["type"].as_string();
+	if(type == "load") {
+		w->games = msg["games"].as_int();
+		w->clients = msg["clients"].as_int();
+	} else if(type == "game_created") {
+		if(!w->pending.empty()) {
+			w->pending.pop_front();
+		}
+
+		++w->games;
+		++w->games_hosted;
+
+		if(game_created_fn_) {
+			game_created_fn_(msg);
+		}
+	} else if(type == "create_game_failed") {
+		if(!w->pending.empty()) {
+			w->pending.pop_front();
+		}
+
+		fprintf(stderr, "ERROR: tbs worker %d could not create game: %s\n", static_cast<int>(w->pid), msg["game"].write_json().c_str());
+
+		if(game_failed_fn_) {
+			game_failed_fn_(msg["game"]);
+		}
+	} else {
+		fprintf(stderr, "ERROR: unknown message from tbs worker %d: %s\n", static_cast<int>(w->pid), type.c_str());
+	}
+}
+
+bool worker_pool::send_message(worker_ptr w, const variant& msg)
+{
+	const std::string buf = msg.write_json() + "\n";
+	boost::system::error_code error;
+	boost::asio::write(*w->socket, boost::asio::buffer(buf), error);
+	if(error) {
+		fprintf(stderr, "ERROR: could not write to tbs worker %d: %s\n", static_cast<int>(w->pid), error.message().c_str());
+		remove_worker(w);
+		return false;
+	}
+
+	return true;
+}
+
+void worker_pool::remove_worker(worker_ptr w)
+{
+	if(w->fd < 0) {
+		return;
+	}
+
+	if(w->socket) {
+		boost::system::error_code error;
+		w->socket->close(error);
+		w->socket.reset();
+	} else {
+		close(w->fd);
+	}
+
+	w->fd = -1;
+
+	//make sure the worker goes away, so it's reaped and replaced.
+	kill(w->pid, SIGKILL);
+
+	std::deque<variant> failed;
+	failed.swap(w->pending);
+	w->games = w->clients = 0;
+
+	if(game_failed_fn_) {
+		foreach(const variant& game, failed) {
+			game_failed_fn_(game);
+		}
+	}
+}
+
+void preload_game_server_caches()
+{
+	game::preload_game_types();
+	game_logic::formula_object::load_all_classes();
+}
+
+}
+
+#endif // __linux__
@@ -0,0 +1,103 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TBS_WORKER_POOL_HPP_INCLUDED
+#define TBS_WORKER_POOL_HPP_INCLUDED
+
+//This file is designed to only work on Linux.
+#ifdef __linux__
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "variant.hpp"
+
+namespace tbs {
+
+//A pool of pre-forked game server processes used by the matchmaking server.
+//The workers are forked once at startup, after game types and classes have
+//been loaded, so they start with warm caches and can each host many games.
+//Games are assigned to workers over a unix socket, and workers report their
+//load back over the same socket so assignment can go to the least loaded one.
+class worker_pool
+{
+public:
+	//called with the worker's message when it has created a game. The message
+	//has the same form as a server_created_game request.
+	typedef boost::function<void(variant)> game_created_fn;
+
+	//called with the game when a worker could not create it, either
+	//because it refused or because it died before confirming it.
+	typedef boost::function<void(variant)> game_failed_fn;
+
+	//forks nworkers processes listening on ports base_port, base_port+1, ...
+	//This must be called before the parent creates its io_service.
+	worker_pool(int nworkers, int base_port, int max_games_per_worker);
+	~worker_pool();
+
+	//begins receiving messages from the workers.
+	void start(boost::asio::io_service& io_service, game_created_fn created_fn, game_failed_fn failed_fn);
+
+	//assigns the game to the least loaded worker. Returns the port the game
+	//will be hosted on, or -1 if every worker is at capacity.
+	int assign_game(const variant& game);
+
+	//called when a child process has been reaped. Returns true if it was
+	//one of our workers, in which case a new worker is forked in its place.
+	bool worker_exited(pid_t pid);
+
+	int num_workers() const;
+	int num_games() const;
+
+	variant get_status() const;
+
+private:
+	worker_pool(const worker_pool&);
+	void operator=(const worker_pool&);
+
+	struct worker_info;
+	typedef boost::shared_ptr<worker_info> worker_ptr;
+
+	void start_receive(worker_ptr w);
+	void handle_receive(worker_ptr w, pid_t pid, const boost::system::error_code& error, size_t nbytes);
+	void handle_message(worker_ptr w, const variant& msg);
+	bool send_message(worker_ptr w, const variant& msg);
+	void remove_worker(worker_ptr w);
+	void spawn_worker(worker_ptr w);
+	void connect_worker(worker_ptr w);
+
+	std::vector<worker_ptr> workers_;
+	int max_games_per_worker_;
+	boost::asio::io_service* io_service_;
+	game_created_fn game_created_fn_;
+	game_failed_fn game_failed_fn_;
+};
+
+//Loads the game types and classes the game servers use so they are shared
+//by every worker forked afterwards.
+void preload_game_server_caches();
+
+}
+
+#endif // __linux__
+
+#endif
@@ -104,6 +104,7 @@ namespace {
 	bool graphics_initialized = false;
 
 	unsigned int current_texture = 0;
+	unsigned int bind_count = 0;
 
 	unsigned int get_texture_id() {
 		unsigned int result = 0;
@@ -518,6 +519,7 @@ void texture::set_current_texture(unsigned int id)
 
 	glBindTexture(GL_TEXTURE_2D,id);
 	current_texture = id;
+	++bind_count;
 }
 
 void texture::set_as_current_texture() const
@@ -531,6 +533,7 @@ void texture::set_as_current_texture() const
 	}
 
 	current_texture = id;
+	++bind_count;
 
 	glBindTexture(GL_TEXTURE_2D,id);
 }
@@ -540,6 +543,11 @@ unsigned int texture::get_current_texture()
 	return current_texture;
 }
 
+unsigned int texture::get_bind_count()
+{
+	return bind_count;
+}
+
 texture texture::get(data_blob_ptr blob)
 {
 	ASSERT_LOG(blob != NULL, "NULL data_blob passed to texture::get()");
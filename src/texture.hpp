@@ -68,6 +68,9 @@ public:
 	unsigned int get_id() const;
 	static void set_current_texture(unsigned int id);
 	static unsigned int get_current_texture();
+
+	//the number of times a texture has been bound. Useful for profiling.
+	static unsigned int get_bind_count();
 	void set_as_current_texture() const;
 	bool valid() const { return id_ != NULL; }
 
@@ -0,0 +1,562 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <boost/weak_ptr.hpp>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "asserts.hpp"
+#include "foreach.hpp"
+#include "preferences.hpp"
+#include "raster.hpp"
+#include "surface.hpp"
+#include "texture_atlas.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+
+namespace graphics {
+namespace texture_atlas {
+
+namespace {
+PREF_BOOL(texture_atlas, true, "Pack object frames and gui elements into shared textures when a level is loaded");
+PREF_INT(texture_atlas_page_size, 2048, "Width and height of texture atlas pages");
+PREF_INT(texture_atlas_max_pages, 8, "Maximum number of texture atlas pages before the least recently used is evicted");
+PREF_INT(texture_atlas_max_area, 512, "Images wider or taller than this are not put in a texture atlas");
+
+//border put around each region so filtering doesn't pick up pixels from
+//its neighbors. The edge pixels of the region are copied out into it, so
+//anything sampled just outside the region is the same as at its edge.
+const int Padding = 2;
+
+//packs rectangles into horizontal shelves. Rectangles should be inserted
+//tallest first to make good use of the space.
+class shelf_packer
+{
+public:
+	explicit shelf_packer(int size) : size_(size), top_(0)
+	{}
+
+	bool insert(int w, int h, int* x, int* y)
+	{
+		if(w > size_ || h > size_) {
+			return false;
+		}
+
+		shelf* best = NULL;
+		foreach(shelf& s, shelves_) {
+			if(s.h >= h && size_ - s.used >= w && (!best || s.h < best->h)) {
+				best = &s;
+			}
+		}
+
+		if(!best) {
+			if(top_ + h > size_) {
+				return false;
+			}
+
+			shelf s = { top_, h, 0 };
+			shelves_.push_back(s);
+			top_ += h;
+			best = &shelves_.back();
+		}
+
+		*x = best->used;
+		*y = best->y;
+		best->used += w;
+		return true;
+	}
+
+private:
+	struct shelf {
+		int y, h, used;
+	};
+
+	int size_, top_;
+	std::vector<shelf> shelves_;
+};
+
+}
+
+struct page
+{
+	explicit page(int size)
+	  : packer(size), surf(SDL_CreateRGBSurface(0, size, size, 32, SURFACE_MASK)),
+	    dirty(false)
+	{}
+
+	//adds an area which has changed since the page was last uploaded.
+	void mark_dirty(const rect& r) {
+		dirty_area = dirty ? rect_union(dirty_area, r) : r;
+		dirty = true;
+	}
+
+	unsigned int last_used() const {
+		unsigned int result = 0;
+		foreach(const boost::weak_ptr<region>& r, regions) {
+			region_ptr p = r.lock();
+			if(p && p->last_used() > result) {
+				result = p->last_used();
+			}
+		}
+
+		return result;
+	}
+
+	int live_area() const {
+		int result = 0;
+		foreach(const boost::weak_ptr<region>& r, regions) {
+			region_ptr p = r.lock();
+			if(p) {
+				result += p->area().w()*p->area().h();
+			}
+		}
+
+		return result;
+	}
+
+	shelf_packer packer;
+
+	//we keep a copy of the pixels so we can add to the page after it
+	//has been uploaded.
+	surface surf;
+	texture tex;
+
+	std::vector<boost::weak_ptr<region> > regions;
+	bool dirty;
+	rect dirty_area;
+};
+
+namespace {
+typedef boost::shared_ptr<page> page_ptr;
+
+struct region_key {
+	region_key(const texture& t, const rect& r) : tex(t), x(r.x()), y(r.y()), w(r.w()), h(r.h())
+	{}
+
+	texture tex;
+	int x, y, w, h;
+
+	bool operator<(const region_key& k) const {
+		if(tex != k.tex) {
+			return tex < k.tex;
+		}
+
+		if(x != k.x) {
+			return x < k.x;
+		}
+
+		if(y != k.y) {
+			return y < k.y;
+		}
+
+		if(w != k.w) {
+			return w < k.w;
+		}
+
+		return h < k.h;
+	}
+};
+
+threading::mutex atlas_mutex;
+std::map<region_key, boost::weak_ptr<region> > region_index;
+std::vector<boost::weak_ptr<region> > pending_regions;
+
+//regions whose page was evicted. They are packed again if they are
+//drawn after being evicted.
+std::vector<boost::weak_ptr<region> > dormant_regions;
+
+std::vector<page_ptr> pages;
+int num_evictions = 0;
+
+//copies the edges of the w x h area at x, y out into the padding around it.
+void extrude_edges(const surface& s, int x, int y, int w, int h)
+{
+	Uint32* pixels = reinterpret_cast<Uint32*>(s->pixels);
+	const int pitch = s->pitch/4;
+	for(int row = y; row != y + h; ++row) {
+		Uint32* p = pixels + row*pitch;
+		for(int n = 1; n <= Padding; ++n) {
+			p[x - n] = p[x];
+			p[x + w - 1 + n] = p[x + w - 1];
+		}
+	}
+
+	//the rows above and below, which takes care of the corners too.
+	const int row_bytes = (w + Padding*2)*4;
+	for(int n = 1; n <= Padding; ++n) {
+		memcpy(pixels + (y - n)*pitch + x - Padding, pixels + y*pitch + x - Padding, row_bytes);
+		memcpy(pixels + (y + h - 1 + n)*pitch + x - Padding, pixels + (y + h - 1)*pitch + x - Padding, row_bytes);
+	}
+}
+
+//puts the page's pixels in its texture. Once the texture has been made
+//only the area which changed is uploaded.
+void upload_page(page& p)
+{
+	if(!p.tex.valid() || preferences::use_16bpp_textures() || preferences::use_pretty_scaling()) {
+		p.tex = texture::get_no_cache(p.surf);
+		return;
+	}
+
+	const rect& r = p.dirty_area;
+	std::vector<Uint32> buf(r.w()*r.h());
+	for(int row = 0; row != r.h(); ++row) {
+		memcpy(&buf[row*r.w()], reinterpret_cast<const char*>(p.surf->pixels) + (r.y() + row)*p.surf->pitch + r.x()*4, r.w()*4);
+	}
+
+	p.tex.set_as_current_texture();
+	glTexSubImage2D(GL_TEXTURE_2D, 0, r.x(), r.y(), r.w(), r.h(), GL_RGBA, GL_UNSIGNED_BYTE, &buf[0]);
+}
+
+bool region_taller(const region_ptr& a, const region_ptr& b)
+{
+	if(a->area().h() != b->area().h()) {
+		return a->area().h() > b->area().h();
+	}
+
+	return a->area().w() > b->area().w();
+}
+
+void evict_page(page_ptr p)
+{
+	foreach(const boost::weak_ptr<region>& r, p->regions) {
+		region_ptr reg = r.lock();
+		if(reg) {
+			reg->evict();
+			threading::lock lck(atlas_mutex);
+			dormant_regions.push_back(reg);
+		}
+	}
+
+	pages.erase(std::remove(pages.begin(), pages.end(), p), pages.end());
+	++num_evictions;
+}
+
+//evicts the least recently drawn page which isn't in 'keep'.
+bool evict_least_recently_used(const std::set<page*>& keep)
+{
+	page_ptr best;
+	unsigned int best_used = 0;
+	foreach(const page_ptr& p, pages) {
+		if(keep.count(p.get())) {
+			continue;
+		}
+
+		const unsigned int used = p->last_used();
+		if(!best || used < best_used) {
+			best = p;
+			best_used = used;
+		}
+	}
+
+	if(!best) {
+		return false;
+	}
+
+	evict_page(best);
+	return true;
+}
+}
+
+unsigned int region::clock_ = 0;
+
+region::region(const texture& src, const rect& area)
+  : src_(src), area_(area), page_(NULL),
+    scale_x_(1.0), scale_y_(1.0), offset_x_(0.0), offset_y_(0.0),
+    last_used_(0), evicted_at_(0)
+{}
+
+const texture& region::page_texture() const
+{
+	return page_->tex;
+}
+
+void region::place(page* p, int x, int y)
+{
+	page_ = p;
+
+	const GLfloat size = GLfloat(p->surf->w);
+	scale_x_ = GLfloat(src_.width())/size;
+	scale_y_ = GLfloat(src_.height())/size;
+	offset_x_ = GLfloat(x - area_.x())/size;
+	offset_y_ = GLfloat(y - area_.y())/size;
+}
+
+void region::evict()
+{
+	page_ = NULL;
+	evicted_at_ = clock_;
+}
+
+bool accepts(int w, int h)
+{
+	return g_texture_atlas && w > 0 && h > 0 &&
+	       w <= g_texture_atlas_max_area && h <= g_texture_atlas_max_area &&
+	       g_texture_atlas_max_area + Padding*2 <= g_texture_atlas_page_size;
+}
+
+region_ptr request(const texture& src, const rect& area)
+{
+	threading::lock lck(atlas_mutex);
+	boost::weak_ptr<region>& entry = region_index[region_key(src, area)];
+	region_ptr result = entry.lock();
+	if(!result) {
+		result.reset(new region(src, area));
+		entry = result;
+		pending_regions.push_back(result);
+	}
+
+	return result;
+}
+
+void flush_pending()
+{
+	std::vector<region_ptr> regions;
+	{
+		threading::lock lck(atlas_mutex);
+		foreach(const boost::weak_ptr<region>& r, pending_regions) {
+			region_ptr reg = r.lock();
+			if(reg && !reg->placed()) {
+				regions.push_back(reg);
+			}
+		}
+
+		pending_regions.clear();
+
+		std::vector<boost::weak_ptr<region> > still_dormant;
+		foreach(const boost::weak_ptr<region>& r, dormant_regions) {
+			region_ptr reg = r.lock();
+			if(!reg || reg->placed()) {
+				continue;
+			}
+
+			if(reg->used_since_evicted()) {
+				regions.push_back(reg);
+			} else {
+				still_dormant.push_back(reg);
+			}
+		}
+
+		dormant_regions.swap(still_dormant);
+
+		for(std::map<region_key, boost::weak_ptr<region> >::iterator i = region_index.begin(); i != region_index.end(); ) {
+			if(i->second.expired()) {
+				region_index.erase(i++);
+			} else {
+				++i;
+			}
+		}
+	}
+
+	//anything queued to draw may point at a page we are about to change.
+	flush_blit_texture();
+
+	//pages whose regions have all gone away can be freed.
+	for(int n = 0; n < pages.size(); ) {
+		if(pages[n]->live_area() == 0) {
+			pages.erase(pages.begin() + n);
+		} else {
+			++n;
+		}
+	}
+
+	if(regions.empty()) {
+		return;
+	}
+
+	std::sort(regions.begin(), regions.end(), region_taller);
+
+	std::map<texture, surface> sources;
+	std::set<page*> changed_pages;
+	int npacked = 0;
+
+	foreach(const region_ptr& reg, regions) {
+		surface& src = sources[reg->source()];
+		if(!src) {
+			src = texture(reg->source()).get_surface();
+			if(!src) {
+				//we can't read this texture back, so leave it on its own.
+				continue;
+			}
+		}
+
+		const int w = reg->area().w() + Padding*2;
+		const int h = reg->area().h() + Padding*2;
+
+		page* target = NULL;
+		int x = 0, y = 0;
+		foreach(const page_ptr& p, pages) {
+			if(p->packer.insert(w, h, &x, &y)) {
+				target = p.get();
+				break;
+			}
+		}
+
+		if(target == NULL) {
+			if(pages.size() >= g_texture_atlas_max_pages && !evict_least_recently_used(changed_pages)) {
+				//every page is in use by this level. Try again if it is
+				//still being drawn when the next level loads.
+				reg->evict();
+				threading::lock lck(atlas_mutex);
+				dormant_regions.push_back(reg);
+				continue;
+			}
+
+			pages.push_back(page_ptr(new page(g_texture_atlas_page_size)));
+			target = pages.back().get();
+			const bool inserted = target->packer.insert(w, h, &x, &y);
+			ASSERT_LOG(inserted, "Could not fit " << w << "x" << h << " region in empty texture atlas page");
+		}
+
+		SDL_Rect src_rect = { reg->area().x(), reg->area().y(), reg->area().w(), reg->area().h() };
+		SDL_Rect dst_rect = { x + Padding, y + Padding, reg->area().w(), reg->area().h() };
+		SDL_SetSurfaceBlendMode(src.get(), SDL_BLENDMODE_NONE);
+		SDL_BlitSurface(src.get(), &src_rect, target->surf.get(), &dst_rect);
+		extrude_edges(target->surf, x + Padding, y + Padding, reg->area().w(), reg->area().h());
+
+		reg->place(target, x + Padding, y + Padding);
+		target->regions.push_back(reg);
+		target->mark_dirty(rect(x, y, w, h));
+		changed_pages.insert(target);
+		++npacked;
+	}
+
+	foreach(const page_ptr& p, pages) {
+		if(p->dirty) {
+			upload_page(*p);
+			p->dirty = false;
+		}
+	}
+
+	const stats s = get_stats();
+	fprintf(stderr, "Texture atlas: packed %d regions; %d pages; %d%% occupancy\n", npacked, s.pages, static_cast<int>(s.occupancy*100));
+}
+
+void clear()
+{
+	flush_blit_texture();
+
+	while(!pages.empty()) {
+		evict_page(pages.back());
+	}
+}
+
+stats get_stats()
+{
+	stats result;
+	result.pages = pages.size();
+	result.regions = 0;
+	result.evictions = num_evictions;
+
+	int64_t area = 0;
+	foreach(const page_ptr& p, pages) {
+		area += p->live_area();
+		foreach(const boost::weak_ptr<region>& r, p->regions) {
+			if(!r.expired()) {
+				++result.regions;
+			}
+		}
+	}
+
+	const int64_t page_area = int64_t(g_texture_atlas_page_size)*g_texture_atlas_page_size;
+	result.occupancy = pages.empty() ? 0.0 : float(double(area)/double(page_area*pages.size()));
+
+	{
+		threading::lock lck(atlas_mutex);
+		result.pending = pending_regions.size();
+	}
+
+	return result;
+}
+
+}
+}
+
+UNIT_TEST(texture_atlas_shelf_packer)
+{
+	graphics::texture_atlas::shelf_packer packer(64);
+
+	std::vector<rect> placed;
+	int x = 0, y = 0;
+	while(packer.insert(20, 10, &x, &y)) {
+		const rect r(x, y, 20, 10);
+		CHECK_LE(r.x2(), 64);
+		CHECK_LE(r.y2(), 64);
+		foreach(const rect& other, placed) {
+			CHECK(!rects_intersect(r, other), "packed rects overlap");
+		}
+		placed.push_back(r);
+	}
+
+	//three per shelf and six shelves.
+	CHECK_EQ(placed.size(), 18);
+
+	//a short rect still fits in the space at the bottom.
+	CHECK(packer.insert(64, 4, &x, &y), "could not use space at bottom of page");
+	CHECK(!packer.insert(65, 1, &x, &y), "packed rect wider than page");
+}
+
+BENCHMARK(texture_atlas_pack)
+{
+	//sprite-like sizes from a fixed seed so runs are comparable.
+	std::vector<std::pair<int,int> > sizes;
+	unsigned int seed = 12345;
+	for(int n = 0; n != 2000; ++n) {
+		seed = seed*1103515245 + 12345;
+		const int w = 16 + (seed >> 16)%112;
+		seed = seed*1103515245 + 12345;
+		const int h = 16 + (seed >> 16)%112;
+		sizes.push_back(std::pair<int,int>(w, h));
+	}
+
+	std::sort(sizes.begin(), sizes.end(), [](const std::pair<int,int>& a, const std::pair<int,int>& b) { return a.second > b.second; });
+
+	const int PageSize = 2048;
+	int npages = 0;
+	int64_t area = 0;
+	BENCHMARK_LOOP {
+		std::vector<graphics::texture_atlas::shelf_packer> packers;
+		area = 0;
+		for(int n = 0; n != sizes.size(); ++n) {
+			const int w = sizes[n].first + graphics::texture_atlas::Padding*2;
+			const int h = sizes[n].second + graphics::texture_atlas::Padding*2;
+			int x, y;
+			bool inserted = false;
+			foreach(graphics::texture_atlas::shelf_packer& p, packers) {
+				if(p.insert(w, h, &x, &y)) {
+					inserted = true;
+					break;
+				}
+			}
+
+			if(!inserted) {
+				packers.push_back(graphics::texture_atlas::shelf_packer(PageSize));
+				packers.back().insert(w, h, &x, &y);
+			}
+
+			area += sizes[n].first*sizes[n].second;
+		}
+
+		npages = packers.size();
+	}
+
+	fprintf(stderr, "texture atlas: %d regions in %d pages, %d%% occupancy\n", static_cast<int>(sizes.size()), npages, static_cast<int>(area*100/(int64_t(PageSize)*PageSize*std::max(npages, 1))));
+}
@@ -0,0 +1,109 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TEXTURE_ATLAS_HPP_INCLUDED
+#define TEXTURE_ATLAS_HPP_INCLUDED
+
+#include <boost/shared_ptr.hpp>
+
+#include "geometry.hpp"
+#include "texture.hpp"
+
+//Packs areas of textures that are drawn often into shared atlas pages at
+//load time, so that things like the frames of every object on a level can
+//be drawn without switching texture between each one.
+namespace graphics {
+namespace texture_atlas {
+
+struct page;
+
+//An area of a source texture which has been requested to go in an atlas.
+//Until the area has been placed in a page, or after its page has been
+//evicted, the owner should just draw from the source texture.
+class region
+{
+public:
+	region(const texture& src, const rect& area);
+
+	bool placed() const { return page_ != NULL; }
+
+	//the texture of the page this region is in. Only valid if placed().
+	const texture& page_texture() const;
+
+	//maps a texture co-ordinate in the source texture to the equivalent
+	//co-ordinate in the page texture. Only valid if placed().
+	GLfloat map_x(GLfloat x) const { return x*scale_x_ + offset_x_; }
+	GLfloat map_y(GLfloat y) const { return y*scale_y_ + offset_y_; }
+
+	//marks the region as used, for deciding which pages to evict.
+	void touch() { last_used_ = ++clock_; }
+	unsigned int last_used() const { return last_used_; }
+	bool used_since_evicted() const { return last_used_ > evicted_at_; }
+
+	const texture& source() const { return src_; }
+	const rect& area() const { return area_; }
+
+	//called by the atlas when the region is put in or taken out of a page.
+	void place(page* p, int x, int y);
+	void evict();
+
+private:
+	texture src_;
+	rect area_;
+
+	page* page_;
+	GLfloat scale_x_, scale_y_, offset_x_, offset_y_;
+
+	unsigned int last_used_, evicted_at_;
+
+	static unsigned int clock_;
+};
+
+typedef boost::shared_ptr<region> region_ptr;
+
+//returns true if the atlas is enabled and an area of this size may be packed.
+bool accepts(int w, int h);
+
+//requests that the given area of a texture be put in an atlas. Returns the
+//existing region if the area has already been requested. The region is
+//placed the next time flush_pending() is called. May be called from
+//any thread.
+region_ptr request(const texture& src, const rect& area);
+
+//packs all pending regions into pages, evicting the least recently used
+//pages if we go over the page limit. Must be called from the main thread,
+//and is done when a level is loaded.
+void flush_pending();
+
+//drops all pages. Regions fall back to their source textures.
+void clear();
+
+struct stats {
+	int pages;
+	int regions;
+	int pending;
+	int evictions;
+
+	//fraction of the area of all pages that live regions occupy.
+	float occupancy;
+};
+
+stats get_stats();
+
+}
+}
+
+#endif
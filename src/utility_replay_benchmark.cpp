@@ -0,0 +1,214 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <boost/intrusive_ptr.hpp>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "asserts.hpp"
+#include "controls.hpp"
+#include "draw_scene.hpp"
+#include "filesystem.hpp"
+#include "foreach.hpp"
+#include "json_parser.hpp"
+#include "level.hpp"
+#include "unit_test.hpp"
+#include "variant_utils.hpp"
+
+namespace {
+
+double ticks_to_us(Uint64 ticks)
+{
+	return ticks*1000000.0/SDL_GetPerformanceFrequency();
+}
+
+//the value at the given percentile of a sorted list.
+double percentile(const std::vector<double>& sorted, int pct)
+{
+	if(sorted.empty()) {
+		return 0.0;
+	}
+
+	int index = (sorted.size()*pct)/100;
+	if(index >= sorted.size()) {
+		index = sorted.size() - 1;
+	}
+
+	return sorted[index];
+}
+
+void print_phase(const char* name, Uint64 ticks, Uint64 total, int ncycles)
+{
+	fprintf(stderr, "  %-32s %10.1fus/cycle %5.1f%%\n", name, ticks_to_us(ticks)/ncycles, total ? (100.0*ticks)/total : 0.0);
+}
+
+bool compare_object_times(const std::pair<std::string, Uint64>& a, const std::pair<std::string, Uint64>& b)
+{
+	return a.second > b.second;
+}
+
+}
+
+//Runs a level with recorded controls without drawing anything, and reports
+//how long each cycle took to process. The checksum of game state for every
+//cycle can be written out, and later runs checked against it, so this
+//catches simulation that isn't deterministic as well as slowdowns.
+UTILITY(replay_benchmark)
+{
+	std::string replay_file, level_file, golden_file;
+	int ncycles = -1;
+	bool write_golden = false;
+
+	foreach(const std::string& arg, args) {
+		if(arg.compare(0, 9, "--replay=") == 0) {
+			replay_file = arg.substr(9);
+		} else if(arg.compare(0, 8, "--level=") == 0) {
+			level_file = arg.substr(8);
+		} else if(arg.compare(0, 9, "--cycles=") == 0) {
+			ncycles = atoi(arg.c_str() + 9);
+		} else if(arg.compare(0, 9, "--golden=") == 0) {
+			golden_file = arg.substr(9);
+		} else if(arg == "--write-golden") {
+			write_golden = true;
+		} else {
+			std::cerr << "replay_benchmark usage: [--replay=<file written with --record-replay>] [--level=<level>] [--cycles=<n>] [--golden=<checksum file>] [--write-golden]\n"
+			             "  The level's own replay_data is played if no replay file is given.\n";
+			return;
+		}
+	}
+
+	variant replay_controls;
+	if(!replay_file.empty()) {
+		const variant replay = json::parse(sys::read_file(replay_file), json::JSON_NO_PREPROCESSOR);
+		if(level_file.empty()) {
+			level_file = replay["level"].as_string();
+		}
+
+		replay_controls = replay["controls"];
+	}
+
+	ASSERT_LOG(!level_file.empty(), "replay_benchmark: no level given");
+
+	boost::intrusive_ptr<level> lvl(new level(level_file));
+	lvl->finish_loading();
+	lvl->set_as_current_level();
+
+	if(replay_controls.is_null()) {
+		ASSERT_LOG(!lvl->replay_data().empty(), "replay_benchmark: level " << level_file << " has no replay_data and no replay file was given");
+		replay_controls = json::parse(lvl->replay_data(), json::JSON_NO_PREPROCESSOR);
+	}
+
+	if(ncycles < 0) {
+		ncycles = replay_controls.num_elements();
+	}
+
+	controls::play_back_controls(replay_controls);
+
+	level::phase_timings timings;
+	level::set_phase_timings(&timings);
+
+	std::vector<double> cycle_us;
+	std::vector<int> checksums;
+	Uint64 total_ticks = 0;
+
+	last_draw_position() = screen_position();
+
+	for(int n = 0; n < ncycles; ++n) {
+		//the camera decides which objects are active, so keep it following
+		//the player the way it would if the level were being drawn.
+		update_camera_position(*lvl, last_draw_position(), NULL, false);
+
+		const Uint64 start = SDL_GetPerformanceCounter();
+		lvl->process();
+		const Uint64 ticks = SDL_GetPerformanceCounter() - start;
+
+		total_ticks += ticks;
+		cycle_us.push_back(ticks_to_us(ticks));
+		checksums.push_back(controls::get_checksum(lvl->cycle()));
+
+		if(level::current_ptr() != lvl.get()) {
+			std::cerr << "replay_benchmark: level changed after " << (n+1) << " cycles; stopping\n";
+			break;
+		}
+	}
+
+	level::set_phase_timings(NULL);
+	controls::play_back_controls(variant());
+
+	ncycles = cycle_us.size();
+	if(ncycles == 0) {
+		std::cerr << "replay_benchmark: no cycles run\n";
+		return;
+	}
+
+	std::vector<double> sorted = cycle_us;
+	std::sort(sorted.begin(), sorted.end());
+
+	fprintf(stderr, "REPLAY BENCHMARK: %s, %d cycles\n", level_file.c_str(), ncycles);
+	fprintf(stderr, "  cycle time: mean %.1fus p50 %.1fus p90 %.1fus p99 %.1fus max %.1fus\n",
+	        ticks_to_us(total_ticks)/ncycles, percentile(sorted, 50),
+	        percentile(sorted, 90), percentile(sorted, 99), sorted.back());
+
+	print_phase("activation", timings.activation, total_ticks, ncycles);
+	print_phase("collisions", timings.collisions, total_ticks, ncycles);
+	print_phase("water", timings.water, total_ticks, ncycles);
+
+	std::vector<std::pair<std::string, Uint64> > objects(timings.object_types.begin(), timings.object_types.end());
+	std::sort(objects.begin(), objects.end(), compare_object_times);
+
+	Uint64 object_ticks = 0;
+	for(int n = 0; n != objects.size(); ++n) {
+		object_ticks += objects[n].second;
+	}
+
+	print_phase("objects", object_ticks, total_ticks, ncycles);
+	for(int n = 0; n != objects.size(); ++n) {
+		print_phase(("  " + objects[n].first).c_str(), objects[n].second, total_ticks, ncycles);
+	}
+
+	if(golden_file.empty()) {
+		return;
+	}
+
+	if(write_golden) {
+		std::vector<variant> v;
+		foreach(int sum, checksums) {
+			v.push_back(variant(sum));
+		}
+
+		variant_builder golden;
+		golden.add("level", level_file);
+		golden.add("checksums", variant(&v));
+		sys::write_file(golden_file, golden.build().write_json());
+		fprintf(stderr, "WROTE %d CHECKSUMS TO %s\n", ncycles, golden_file.c_str());
+		return;
+	}
+
+	const variant golden = json::parse(sys::read_file(golden_file), json::JSON_NO_PREPROCESSOR);
+	const variant golden_sums = golden["checksums"];
+	ASSERT_LOG(golden_sums.num_elements() >= ncycles, "replay_benchmark: golden run in " << golden_file << " only has " << golden_sums.num_elements() << " cycles, " << ncycles << " were run");
+
+	for(int n = 0; n != ncycles; ++n) {
+		ASSERT_LOG(golden_sums[n].as_int() == checksums[n], "replay_benchmark: DESYNC at cycle " << (n+1) << ": checksum " << checksums[n] << " golden run has " << golden_sums[n].as_int());
+	}
+
+	fprintf(stderr, "CHECKSUMS MATCH GOLDEN RUN FOR %d CYCLES\n", ncycles);
+}
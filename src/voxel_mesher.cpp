@@ -0,0 +1,316 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "asserts.hpp"
+#include "unit_test.hpp"
+#include "voxel_mesher.hpp"
+
+namespace voxel
+{
+	namespace
+	{
+		//the axis each face is on and which way along it the face points.
+		const int FaceAxis[MESH_NUM_FACES] = { 2, 0, 1, 2, 0, 1 };
+		const int FaceSign[MESH_NUM_FACES] = { 1, 1, 1, -1, -1, -1 };
+	}
+
+	dense_voxels::dense_voxels()
+	{
+		min_[0] = min_[1] = min_[2] = 0;
+		size_[0] = size_[1] = size_[2] = 0;
+	}
+
+	void dense_voxels::set(int x, int y, int z, unsigned index)
+	{
+		ASSERT_LOG(index <= 0xFFFF, "Too many kinds of voxel in one box: " << index);
+		if(!contains(x, y, z)) {
+			if(index == 0) {
+				return;
+			}
+
+			reserve(x, y, z, 1, 1, 1);
+		}
+
+		cells_[cell(x, y, z)] = uint16_t(index);
+	}
+
+	void dense_voxels::reserve(int x, int y, int z, int size_x, int size_y, int size_z)
+	{
+		int new_min[3] = { x, y, z };
+		int new_max[3] = { x + size_x, y + size_y, z + size_z };
+		if(!cells_.empty()) {
+			for(int n = 0; n != 3; ++n) {
+				new_min[n] = std::min(new_min[n], min_[n]);
+				new_max[n] = std::max(new_max[n], min_[n] + size_[n]);
+			}
+		}
+
+		if(!cells_.empty() && new_min[0] == min_[0] && new_min[1] == min_[1] && new_min[2] == min_[2]
+		   && new_max[0] == min_[0] + size_[0] && new_max[1] == min_[1] + size_[1] && new_max[2] == min_[2] + size_[2]) {
+			return;
+		}
+
+		dense_voxels grown;
+		for(int n = 0; n != 3; ++n) {
+			grown.min_[n] = new_min[n];
+			grown.size_[n] = new_max[n] - new_min[n];
+		}
+		grown.cells_.resize(grown.size_[0]*grown.size_[1]*grown.size_[2]);
+
+		for(int vz = 0; vz < size_[2]; ++vz) {
+			for(int vy = 0; vy < size_[1]; ++vy) {
+				const uint16_t* src = &cells_[size_[0]*(vy + size_[1]*vz)];
+				std::copy(src, src + size_[0], &grown.cells_[grown.cell(min_[0], min_[1] + vy, min_[2] + vz)]);
+			}
+		}
+
+		std::swap(min_, grown.min_);
+		std::swap(size_, grown.size_);
+		cells_.swap(grown.cells_);
+	}
+
+	void greedy_mesh(const dense_voxels& voxels, const std::vector<bool>& opaque, bool merge, std::vector<voxel_quad>* quads)
+	{
+		const int size[3] = { voxels.size_x(), voxels.size_y(), voxels.size_z() };
+		const int origin[3] = { voxels.min_x(), voxels.min_y(), voxels.min_z() };
+		const int stride[3] = { 1, size[0], size[0]*size[1] };
+		const std::vector<uint16_t>& cells = voxels.cells();
+		if(cells.empty()) {
+			return;
+		}
+
+		std::vector<uint16_t> mask;
+		for(int face = 0; face != MESH_NUM_FACES; ++face) {
+			//the mask is a slice through the box across the face's axis,
+			//with the two other axes as its columns and rows.
+			const int axis = FaceAxis[face];
+			const int u = (axis + 1)%3;
+			const int v = (axis + 2)%3;
+			const int neighbour_offset = FaceSign[face]*stride[axis];
+			mask.resize(size[u]*size[v]);
+
+			for(int slice = 0; slice != size[axis]; ++slice) {
+				const bool has_neighbour = slice + FaceSign[face] >= 0 && slice + FaceSign[face] < size[axis];
+				bool any = false;
+				for(int j = 0; j != size[v]; ++j) {
+					int cell = slice*stride[axis] + j*stride[v];
+					for(int i = 0; i != size[u]; ++i, cell += stride[u]) {
+						const uint16_t index = cells[cell];
+						uint16_t m = 0;
+						if(index) {
+							const uint16_t neighbour = has_neighbour ? cells[cell + neighbour_offset] : 0;
+							if(neighbour == 0 || !opaque[neighbour]) {
+								m = index;
+								any = true;
+							}
+						}
+
+						mask[j*size[u] + i] = m;
+					}
+				}
+
+				if(!any) {
+					continue;
+				}
+
+				for(int j = 0; j != size[v]; ++j) {
+					for(int i = 0; i != size[u]; ) {
+						uint16_t* row = &mask[j*size[u]];
+						const uint16_t m = row[i];
+						if(m == 0) {
+							++i;
+							continue;
+						}
+
+						int width = 1;
+						int height = 1;
+						if(merge) {
+							while(i + width < size[u] && row[i + width] == m) {
+								++width;
+							}
+
+							for(; j + height < size[v]; ++height) {
+								const uint16_t* next = &mask[(j + height)*size[u] + i];
+								if(std::find_if(next, next + width, [m](uint16_t c) { return c != m; }) != next + width) {
+									break;
+								}
+							}
+						}
+
+						for(int h = 0; h != height; ++h) {
+							std::fill(&mask[(j + h)*size[u] + i], &mask[(j + h)*size[u] + i] + width, 0);
+						}
+
+						int pos[3];
+						pos[axis] = origin[axis] + slice;
+						pos[u] = origin[u] + i;
+						pos[v] = origin[v] + j;
+
+						voxel_quad q;
+						q.face = MESH_FACE(face);
+						q.x = pos[0];
+						q.y = pos[1];
+						q.z = pos[2];
+						q.size[axis] = 1;
+						q.size[u] = width;
+						q.size[v] = height;
+						q.index = m;
+						quads->push_back(q);
+
+						i += width;
+					}
+				}
+			}
+		}
+	}
+
+	void get_face_vertices(MESH_FACE face, float x, float y, float z, float sx, float sy, float sz, float* out)
+	{
+		const float x2 = x + sx;
+		const float y2 = y + sy;
+		const float z2 = z + sz;
+		switch(face) {
+		case MESH_FRONT: {
+			const float v[18] = { x,y,z2, x2,y,z2, x2,y2,z2, x2,y2,z2, x,y2,z2, x,y,z2 };
+			std::copy(v, v + 18, out);
+			break;
+		}
+		case MESH_RIGHT: {
+			const float v[18] = { x2,y2,z2, x2,y,z2, x2,y2,z, x2,y2,z, x2,y,z2, x2,y,z };
+			std::copy(v, v + 18, out);
+			break;
+		}
+		case MESH_TOP: {
+			const float v[18] = { x2,y2,z2, x2,y2,z, x,y2,z2, x,y2,z2, x2,y2,z, x,y2,z };
+			std::copy(v, v + 18, out);
+			break;
+		}
+		case MESH_BACK: {
+			const float v[18] = { x2,y,z, x,y,z, x,y2,z, x,y2,z, x2,y2,z, x2,y,z };
+			std::copy(v, v + 18, out);
+			break;
+		}
+		case MESH_LEFT: {
+			const float v[18] = { x,y2,z2, x,y2,z, x,y,z2, x,y,z2, x,y2,z, x,y,z };
+			std::copy(v, v + 18, out);
+			break;
+		}
+		case MESH_BOTTOM: {
+			const float v[18] = { x2,y,z2, x,y,z2, x2,y,z, x2,y,z, x,y,z2, x,y,z };
+			std::copy(v, v + 18, out);
+			break;
+		}
+		default: ASSERT_LOG(false, "get_face_vertices unexpected facing value: " << face);
+		}
+	}
+}
+
+namespace {
+
+//rolling hills of a few kinds of voxel, like the terrain chunks make.
+voxel::dense_voxels terrain_voxels(int size)
+{
+	voxel::dense_voxels voxels;
+	voxels.reserve(0, 0, 0, size, size, size);
+	for(int x = 0; x != size; ++x) {
+		for(int z = 0; z != size; ++z) {
+			const int height = int(size/2 + sin(x*0.13)*size/6 + cos(z*0.09)*size/6);
+			for(int y = 0; y < height; ++y) {
+				voxels.set(x, y, z, y < height - 3 ? 1 : (y < height - 1 ? 2 : 3));
+			}
+		}
+	}
+
+	return voxels;
+}
+
+//every visible unit face, as face, x, y, z.
+std::vector<std::vector<int> > unit_faces(const std::vector<voxel::voxel_quad>& quads)
+{
+	std::vector<std::vector<int> > result;
+	for(int n = 0; n != quads.size(); ++n) {
+		const voxel::voxel_quad& q = quads[n];
+		for(int z = q.z; z != q.z + q.size[2]; ++z) {
+			for(int y = q.y; y != q.y + q.size[1]; ++y) {
+				for(int x = q.x; x != q.x + q.size[0]; ++x) {
+					std::vector<int> f;
+					f.push_back(q.face);
+					f.push_back(x);
+					f.push_back(y);
+					f.push_back(z);
+					f.push_back(q.index);
+					result.push_back(f);
+				}
+			}
+		}
+	}
+
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+}
+
+UNIT_TEST(voxel_greedy_mesh) {
+	voxel::dense_voxels voxels = terrain_voxels(24);
+	voxels.set(-3, 30, 2, 4);
+	voxels.set(5, 5, 5, 0);
+
+	std::vector<bool> opaque(5, true);
+	opaque[4] = false;
+
+	std::vector<voxel::voxel_quad> merged, faces;
+	voxel::greedy_mesh(voxels, opaque, true, &merged);
+	voxel::greedy_mesh(voxels, opaque, false, &faces);
+
+	//merging must cover exactly the faces there are without it.
+	CHECK_EQ(unit_faces(faces) == unit_faces(merged), true);
+	CHECK_LT(merged.size()*4, faces.size());
+
+	//the lone voxel outside the hills shows all of its faces.
+	int lone_faces = 0;
+	for(int n = 0; n != merged.size(); ++n) {
+		if(merged[n].index == 4) {
+			++lone_faces;
+		}
+	}
+	CHECK_EQ(lone_faces, 6);
+}
+
+BENCHMARK(voxel_greedy_mesh) {
+	static const voxel::dense_voxels voxels = terrain_voxels(64);
+	static const std::vector<bool> opaque(4, true);
+	std::vector<voxel::voxel_quad> quads;
+	BENCHMARK_LOOP {
+		quads.clear();
+		voxel::greedy_mesh(voxels, opaque, true, &quads);
+	}
+}
+
+BENCHMARK(voxel_face_mesh) {
+	static const voxel::dense_voxels voxels = terrain_voxels(64);
+	static const std::vector<bool> opaque(4, true);
+	std::vector<voxel::voxel_quad> quads;
+	BENCHMARK_LOOP {
+		quads.clear();
+		voxel::greedy_mesh(voxels, opaque, false, &quads);
+	}
+}
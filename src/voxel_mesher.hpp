@@ -0,0 +1,104 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXEL_MESHER_HPP_INCLUDED
+#define VOXEL_MESHER_HPP_INCLUDED
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace voxel
+{
+	//the directions a face can point in, in the order chunks draw them.
+	enum MESH_FACE {
+		MESH_FRONT,		// +z
+		MESH_RIGHT,		// +x
+		MESH_TOP,		// +y
+		MESH_BACK,		// -z
+		MESH_LEFT,		// -x
+		MESH_BOTTOM,	// -y
+		MESH_NUM_FACES,
+	};
+
+	//A box of voxels stored as one palette index per voxel, with 0 meaning
+	//the voxel is empty. What an index stands for is up to the owner of
+	//the box. The box grows to hold any voxel which is set.
+	class dense_voxels
+	{
+	public:
+		dense_voxels();
+
+		int min_x() const { return min_[0]; }
+		int min_y() const { return min_[1]; }
+		int min_z() const { return min_[2]; }
+		int size_x() const { return size_[0]; }
+		int size_y() const { return size_[1]; }
+		int size_z() const { return size_[2]; }
+		bool empty() const { return cells_.empty(); }
+
+		bool contains(int x, int y, int z) const {
+			return x >= min_[0] && y >= min_[1] && z >= min_[2] && x < min_[0] + size_[0] && y < min_[1] + size_[1] && z < min_[2] + size_[2];
+		}
+
+		unsigned get(int x, int y, int z) const {
+			return contains(x, y, z) ? cells_[cell(x, y, z)] : 0;
+		}
+
+		void set(int x, int y, int z, unsigned index);
+
+		//makes the box hold at least the given area, so setting voxels in
+		//it doesn't have to grow it one voxel at a time.
+		void reserve(int x, int y, int z, int size_x, int size_y, int size_z);
+
+		//the cells, with x varying fastest and then y.
+		const std::vector<uint16_t>& cells() const { return cells_; }
+
+	private:
+		int cell(int x, int y, int z) const {
+			return (x - min_[0]) + size_[0]*((y - min_[1]) + size_[1]*(z - min_[2]));
+		}
+
+		int min_[3];
+		int size_[3];
+		std::vector<uint16_t> cells_;
+	};
+
+	//one rectangle of faces of voxels which share a palette index. x, y
+	//and z are the voxel at its lowest corner, and size is how many voxels
+	//it covers along each axis, which is 1 along the way it faces.
+	struct voxel_quad
+	{
+		MESH_FACE face;
+		int x, y, z;
+		int size[3];
+		unsigned index;
+	};
+
+	//Finds the faces of the voxels which can be seen: those whose neighbour
+	//is empty or isn't opaque. opaque gives whether each palette index is.
+	//Faces next to each other with the same index are merged into as few
+	//rectangles as can be found a row at a time, unless merge is false in
+	//which case each face is its own quad.
+	void greedy_mesh(const dense_voxels& voxels, const std::vector<bool>& opaque, bool merge, std::vector<voxel_quad>* quads);
+
+	//writes the two triangles, as 18 floats, of a face pointing the given
+	//way on the box at x,y,z with the given size. The triangles are wound
+	//the same way for every face, as chunks and voxel models draw them.
+	void get_face_vertices(MESH_FACE face, float x, float y, float z, float size_x, float size_y, float size_z, float* out);
+}
+
+#endif
@@ -16,7 +16,12 @@
 */
 #if defined(USE_SHADERS) && defined(USE_ISOMAP)
 
+#include <algorithm>
+#include <cmath>
+
+#include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 
 #include <glm/gtx/rotate_vector.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -25,9 +30,13 @@
 
 #include "graphics.hpp"
 #include "json_parser.hpp"
+#include "preferences.hpp"
 #include "variant_utils.hpp"
+#include "voxel_mesher.hpp"
 #include "voxel_model.hpp"
 
+PREF_INT(voxel_animation_cache_samples, 1000, "Most samples of each voxel model animation to keep, at one per 0.02 seconds of the animation");
+
 
 namespace voxel {
 
@@ -345,6 +354,8 @@ Animation read_animation(const variant& v)
 		result.duration = -1.0;
 	}
 
+	result.period = v.has_key("period") ? v["period"].as_decimal().as_float() : -1.0f;
+
 	for(variant t : v["transforms"].as_list()) {
 		AnimationTransform transform;
 		transform.children_only = t["children_only"].as_bool(false);
@@ -396,16 +407,179 @@ variant write_animation(const Animation& anim)
 		result[variant("duration")] = variant(decimal(anim.duration));
 	}
 
+	if(anim.period > 0.0) {
+		result[variant("period")] = variant(decimal(anim.period));
+	}
+
 	return variant(&result);
 }
 
+namespace
+{
+	// how far apart in time the samples of an animation are kept.
+	const GLfloat AnimationSampleTime = 0.02f;
+
+	// the voxel_mesher face for each of voxel_model's faces.
+	const MESH_FACE MeshFaces[] = { MESH_LEFT, MESH_RIGHT, MESH_TOP, MESH_BOTTOM, MESH_BACK, MESH_FRONT };
+}
+
+struct LayerMesh : private boost::noncopyable
+{
+	LayerMesh() : vbo(0) {
+		aabb[0] = glm::vec3(std::numeric_limits<float>::max(),std::numeric_limits<float>::max(),std::numeric_limits<float>::max());
+		aabb[1] = glm::vec3(std::numeric_limits<float>::min(),std::numeric_limits<float>::min(),std::numeric_limits<float>::min());
+	}
+
+	~LayerMesh() {
+		glDeleteBuffers(1, &vbo);
+	}
+
+	GLuint vbo;
+	size_t vattrib_offsets[6];
+	size_t cattrib_offsets[6];
+	size_t num_vertices[6];
+	glm::vec3 aabb[2];
+};
+
+// Everything about a model file which is the same for every model made
+// from it. Meshes are only kept while a model is using them, and the
+// transforms of each layer are kept for each sample of an animation as it
+// gets played.
+struct ModelCache
+{
+	variant node;
+	Model model;
+	std::map<std::string, boost::shared_ptr<Animation> > animations;
+	std::map<std::string, boost::weak_ptr<const LayerMesh> > meshes;
+	std::map<std::string, std::vector<std::vector<glm::mat4> > > samples;
+};
+
+namespace
+{
+	boost::shared_ptr<ModelCache> get_model_cache(const std::string& fname)
+	{
+		static std::map<std::string, boost::shared_ptr<ModelCache> > cache;
+
+		// parsing gives back the same node while the file is unchanged.
+		const variant node = json::parse_from_file(fname);
+		boost::shared_ptr<ModelCache>& result = cache[fname];
+		if(result && &result->node.as_map() == &node.as_map()) {
+			return result;
+		}
+
+		result.reset(new ModelCache);
+		result->node = node;
+		result->model = read_model(node);
+		for(const Animation& anim : result->model.animations) {
+			result->animations[anim.name].reset(new Animation(anim));
+		}
+
+		return result;
+	}
+
+	// side is -1 for only the voxels left of x=0, 1 for the rest, and 0
+	// for all of them.
+	boost::shared_ptr<const LayerMesh> build_layer_mesh(const Layer& layer, int side)
+	{
+		boost::shared_ptr<LayerMesh> result(new LayerMesh);
+
+		dense_voxels voxels;
+		std::vector<graphics::color> colors(1);
+		std::map<uint32_t, int> color_index;
+		for(const VoxelPair& p : layer.map) {
+			if(side != 0 && (p.first[0] < 0) != (side < 0)) {
+				continue;
+			}
+
+			const graphics::color& c = p.second.color;
+			const uint32_t key = (uint32_t(c.r()) << 24) | (uint32_t(c.g()) << 16) | (uint32_t(c.b()) << 8) | uint32_t(c.a());
+			std::map<uint32_t, int>::iterator itor = color_index.find(key);
+			if(itor == color_index.end()) {
+				itor = color_index.insert(std::pair<uint32_t, int>(key, int(colors.size()))).first;
+				colors.push_back(c);
+			}
+
+			voxels.set(p.first[0], p.first[1], p.first[2], itor->second);
+		}
+
+		if(voxels.empty() == false) {
+			result->aabb[0] = glm::vec3(voxels.min_x(), voxels.min_y(), voxels.min_z());
+			result->aabb[1] = result->aabb[0] + glm::vec3(voxels.size_x(), voxels.size_y(), voxels.size_z());
+		}
+
+		// any voxel hides the faces next to it, whatever its color.
+		std::vector<voxel_quad> quads;
+		greedy_mesh(voxels, std::vector<bool>(colors.size(), true), true, &quads);
+
+		std::vector<GLfloat> varray[6];
+		std::vector<GLubyte> carray[6];
+		for(const voxel_quad& q : quads) {
+			const int face = std::find(MeshFaces, MeshFaces + 6, q.face) - MeshFaces;
+			GLfloat vertices[18];
+			get_face_vertices(q.face, GLfloat(q.x), GLfloat(q.y), GLfloat(q.z), GLfloat(q.size[0]), GLfloat(q.size[1]), GLfloat(q.size[2]), vertices);
+			varray[face].insert(varray[face].end(), vertices, vertices + 18);
+
+			// colors are all the same per vertex.
+			const graphics::color& c = colors[q.index];
+			for(int n = 0; n != 6; ++n) {
+				carray[face].push_back(c.r());
+				carray[face].push_back(c.g());
+				carray[face].push_back(c.b());
+				carray[face].push_back(c.a());
+			}
+		}
+
+		glGenBuffers(1, &result->vbo);
+
+		size_t total_size = 0;
+		for(int n = 0; n != 6; ++n) {
+			result->vattrib_offsets[n] = total_size;
+			total_size += varray[n].size() * sizeof(GLfloat);
+			result->num_vertices[n] = varray[n].size() / 3;
+		}
+		for(int n = 0; n != 6; ++n) {
+			result->cattrib_offsets[n] = total_size;
+			total_size += carray[n].size() * sizeof(uint8_t);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, result->vbo);
+		glBufferData(GL_ARRAY_BUFFER, total_size, NULL, GL_STATIC_DRAW);
+		for(int n = 0; n != 6; ++n) {
+			if(!varray[n].empty()) {
+				glBufferSubData(GL_ARRAY_BUFFER, result->vattrib_offsets[n], varray[n].size()*sizeof(GLfloat), &varray[n][0]);
+			}
+		}
+		for(int n = 0; n != 6; ++n) {
+			if(!carray[n].empty()) {
+				glBufferSubData(GL_ARRAY_BUFFER, result->cattrib_offsets[n], carray[n].size()*sizeof(uint8_t), &carray[n][0]);
+			}
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		return result;
+	}
+
+	boost::shared_ptr<const LayerMesh> get_layer_mesh(ModelCache& cache, const LayerType& layer_type, const Layer& layer, int side)
+	{
+		const std::string key = layer_type.name + ":" + layer.name + ":" + (side < 0 ? "left" : (side > 0 ? "right" : ""));
+		boost::weak_ptr<const LayerMesh>& cached = cache.meshes[key];
+		boost::shared_ptr<const LayerMesh> result = cached.lock();
+		if(!result) {
+			result = build_layer_mesh(layer, side);
+			cached = result;
+		}
+
+		return result;
+	}
+}
+
 voxel_model::voxel_model(const variant& node)
   : name_(node["model"].as_string()), anim_time_(0.0), old_anim_time_(0.0),
     invalidated_(false), model_(1.0f), proto_model_(1.0f)
 {
 	aabb_[0] = glm::vec3(std::numeric_limits<float>::max(),std::numeric_limits<float>::max(),std::numeric_limits<float>::max());
 	aabb_[1] = glm::vec3(std::numeric_limits<float>::min(),std::numeric_limits<float>::min(),std::numeric_limits<float>::min());
-	Model base(read_model(json::parse_from_file(name_)));
+	cache_ = get_model_cache(name_);
+	const Model& base = cache_->model;
 
 	attachment_points_ = base.attachment_points;
 
@@ -421,30 +595,17 @@ voxel_model::voxel_model(const variant& node)
 		ASSERT_LOG(variation_itor != layer_type.variations.end(), "Could not find variation of layer " << layer_type.name << " name " << variation_name.as_string() << " in model " << name_);
 
 		if(layer_type.symmetric) {
-			Layer left;
-			Layer right;
-			left.name = right.name = variation_itor->second.name;
-			for(const VoxelPair& p : variation_itor->second.map) {
-				if(p.first[0] < 0) {
-					left.map.insert(p);
-				} else {
-					right.map.insert(p);
-				}
-			}
-
-			children_.push_back(voxel_model_ptr(new voxel_model(left, layer_type)));
+			children_.push_back(voxel_model_ptr(new voxel_model(layer_type, get_layer_mesh(*cache_, layer_type, variation_itor->second, -1))));
 			children_.back()->name_ = "left_" + layer_type.name;
-			children_.push_back(voxel_model_ptr(new voxel_model(right, layer_type)));
+			children_.push_back(voxel_model_ptr(new voxel_model(layer_type, get_layer_mesh(*cache_, layer_type, variation_itor->second, 1))));
 			children_.back()->name_ = "right_" + layer_type.name;
 
 		} else {
-			children_.push_back(voxel_model_ptr(new voxel_model(variation_itor->second, layer_type)));
+			children_.push_back(voxel_model_ptr(new voxel_model(layer_type, get_layer_mesh(*cache_, layer_type, variation_itor->second, 0))));
 		}
 	}
 
-	for(const Animation& anim : base.animations) {
-		animations_[anim.name].reset(new Animation(anim));
-	}
+	animations_ = cache_->animations;
 
 	for(auto child : children_) {
 		if(child->aabb_[0].x < aabb_[0].x) { aabb_[0].x = child->aabb_[0].x; }
@@ -456,52 +617,18 @@ voxel_model::voxel_model(const variant& node)
 	}
 }
 
-voxel_model::voxel_model(const Layer& layer, const LayerType& layer_type)
-  : name_(layer_type.name), invalidated_(false), model_(1.0f), proto_model_(1.0f)
+voxel_model::voxel_model(const LayerType& layer_type, boost::shared_ptr<const LayerMesh> mesh)
+  : name_(layer_type.name), anim_time_(0.0), old_anim_time_(0.0),
+    invalidated_(false), mesh_(mesh), model_(1.0f), proto_model_(1.0f)
 {
-	aabb_[0] = glm::vec3(std::numeric_limits<float>::max(),std::numeric_limits<float>::max(),std::numeric_limits<float>::max());
-	aabb_[1] = glm::vec3(std::numeric_limits<float>::min(),std::numeric_limits<float>::min(),std::numeric_limits<float>::min());
+	aabb_[0] = mesh->aabb[0];
+	aabb_[1] = mesh->aabb[1];
 
 	for(const std::pair<std::string, VoxelPos>& pivot : layer_type.pivots) {
 		glm::vec3 point = glm::vec3(pivot.second) + glm::vec3(0.5f);
 
 		pivots_.push_back(std::pair<std::string, glm::vec3>(pivot.first, point));
 	}
-
-	vbo_id_.reset(new GLuint, [](GLuint* id){glDeleteBuffers(1, id); delete id;});
-	glGenBuffers(1, vbo_id_.get());
-
-	std::vector<GLfloat> varray[6];
-	std::vector<GLubyte> carray[6];
-
-	for(auto p : layer.map) {
-		for(int n = FACE_LEFT; n != MAX_FACES; ++n) {
-			glm::ivec3 pos = glm::ivec3(normal_vectors()[n]) + p.first;
-			if(layer.map.find(pos) == layer.map.end()) {
-				add_face(n, p, varray[n], carray[n]);
-			}
-		}
-	}
-
-	size_t total_size = 0;
-	for(int n = FACE_LEFT; n != MAX_FACES; ++n) {
-		vattrib_offsets_[n] = total_size;
-		total_size += varray[n].size() * sizeof(GLfloat);
-		num_vertices_[n] = varray[n].size() / 3;
-	}
-	for(int n = FACE_LEFT; n != MAX_FACES; ++n) {
-		cattrib_offsets_[n] = total_size;
-		total_size += carray[n].size() * sizeof(uint8_t);
-	}
-	glBindBuffer(GL_ARRAY_BUFFER, *vbo_id_);
-	glBufferData(GL_ARRAY_BUFFER, total_size, NULL, GL_STATIC_DRAW);
-	for(int n = FACE_LEFT; n != MAX_FACES; ++n) {
-		glBufferSubData(GL_ARRAY_BUFFER, vattrib_offsets_[n], varray[n].size()*sizeof(GLfloat), &varray[n][0]);
-	}
-	for(int n = FACE_LEFT; n != MAX_FACES; ++n) {
-		glBufferSubData(GL_ARRAY_BUFFER, cattrib_offsets_[n], carray[n].size()*sizeof(uint8_t), &carray[n][0]);
-	}
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 void voxel_model::get_bounding_box(glm::vec3& b1, glm::vec3& b2)
@@ -510,87 +637,6 @@ void voxel_model::get_bounding_box(glm::vec3& b1, glm::vec3& b2)
 	b2 = aabb_[1];
 }
 
-void voxel_model::add_face(int face, const VoxelPair& p, std::vector<GLfloat>& varray, std::vector<GLubyte>& carray)
-{
-	// update bounding box.
-	if(p.first.x < aabb_[0].x) { aabb_[0].x = p.first.x; }
-	if(p.first.y < aabb_[0].y) { aabb_[0].y = p.first.y; }
-	if(p.first.z < aabb_[0].z) { aabb_[0].z = p.first.z; }
-	if(p.first.x+1 > aabb_[1].x) { aabb_[1].x = p.first.x+1; }
-	if(p.first.y+1 > aabb_[1].y) { aabb_[1].y = p.first.y+1; }
-	if(p.first.z+1 > aabb_[1].z) { aabb_[1].z = p.first.z+1; }
-
-	add_vertex_data(face, GLfloat(p.first.x), GLfloat(p.first.y), GLfloat(p.first.z), varray);
-	// colors are all the same per vertex.
-	for(int n = 0; n != 6; ++n) {
-		carray.push_back(p.second.color.r());
-		carray.push_back(p.second.color.g());
-		carray.push_back(p.second.color.b());
-		carray.push_back(p.second.color.a());
-	}
-}
-
-void voxel_model::add_vertex_data(int face, GLfloat x, GLfloat y, GLfloat z, std::vector<GLfloat>& varray)
-{
-	switch(face) {
-	case FACE_FRONT:
-		varray.push_back(x); varray.push_back(y); varray.push_back(z+1);
-		varray.push_back(x+1); varray.push_back(y); varray.push_back(z+1);
-		varray.push_back(x+1); varray.push_back(y+1); varray.push_back(z+1);
-
-		varray.push_back(x+1); varray.push_back(y+1); varray.push_back(z+1);
-		varray.push_back(x); varray.push_back(y+1); varray.push_back(z+1);
-		varray.push_back(x); varray.push_back(y); varray.push_back(z+1);
-		break;
-	case FACE_RIGHT:
-		varray.push_back(x+1); varray.push_back(y+1); varray.push_back(z+1);
-		varray.push_back(x+1); varray.push_back(y); varray.push_back(z+1);
-		varray.push_back(x+1); varray.push_back(y+1); varray.push_back(z);
-
-		varray.push_back(x+1); varray.push_back(y+1); varray.push_back(z);
-		varray.push_back(x+1); varray.push_back(y); varray.push_back(z+1);
-		varray.push_back(x+1); varray.push_back(y); varray.push_back(z);
-		break;
-	case FACE_TOP:
-		varray.push_back(x+1); varray.push_back(y+1); varray.push_back(z+1);
-		varray.push_back(x+1); varray.push_back(y+1); varray.push_back(z);
-		varray.push_back(x); varray.push_back(y+1); varray.push_back(z+1);
-
-		varray.push_back(x); varray.push_back(y+1); varray.push_back(z+1);
-		varray.push_back(x+1); varray.push_back(y+1); varray.push_back(z);
-		varray.push_back(x); varray.push_back(y+1); varray.push_back(z);
-		break;
-	case FACE_BACK:
-		varray.push_back(x+1); varray.push_back(y); varray.push_back(z);
-		varray.push_back(x); varray.push_back(y); varray.push_back(z);
-		varray.push_back(x); varray.push_back(y+1); varray.push_back(z);
-
-		varray.push_back(x); varray.push_back(y+1); varray.push_back(z);
-		varray.push_back(x+1); varray.push_back(y+1); varray.push_back(z);
-		varray.push_back(x+1); varray.push_back(y); varray.push_back(z);
-		break;
-	case FACE_LEFT:
-		varray.push_back(x); varray.push_back(y+1); varray.push_back(z+1);
-		varray.push_back(x); varray.push_back(y+1); varray.push_back(z);
-		varray.push_back(x); varray.push_back(y); varray.push_back(z+1);
-
-		varray.push_back(x); varray.push_back(y); varray.push_back(z+1);
-		varray.push_back(x); varray.push_back(y+1); varray.push_back(z);
-		varray.push_back(x); varray.push_back(y); varray.push_back(z);
-		break;
-	case FACE_BOTTOM:
-		varray.push_back(x+1); varray.push_back(y); varray.push_back(z+1);
-		varray.push_back(x); varray.push_back(y); varray.push_back(z+1);
-		varray.push_back(x+1); varray.push_back(y); varray.push_back(z);
-
-		varray.push_back(x+1); varray.push_back(y); varray.push_back(z);
-		varray.push_back(x); varray.push_back(y); varray.push_back(z+1);
-		varray.push_back(x); varray.push_back(y); varray.push_back(z);
-		break;
-	default: ASSERT_LOG(false, "voxel_model::add_vertex_data unexpected facing value: " << face);
-	}
-}
-
 voxel_model_ptr voxel_model::get_child(const std::string& id) const
 {
 	for(const voxel_model_ptr& child : children_) {
@@ -708,6 +754,12 @@ void voxel_model::process_animation(GLfloat advance)
 
 	anim_time_ += advance;
 
+	// a looping animation which repeats is kept within its first cycle,
+	// once it's done transitioning from the last one.
+	if(!old_anim_ && anim_->duration <= 0 && anim_->period > 0 && anim_time_ >= anim_->period) {
+		anim_time_ = fmod(anim_time_, anim_->period);
+	}
+
 	const GLfloat TransitionTime = 0.5f;
 	GLfloat ratio = 1.0f;
 
@@ -724,6 +776,45 @@ void voxel_model::process_animation(GLfloat advance)
 		}
 	}
 
+	// once the transition is over, the cached samples of the animation can
+	// be used instead of working out every layer's transforms.
+	if(!old_anim_ && cache_) {
+		auto cached = cache_->animations.find(anim_->name);
+		if(cached != cache_->animations.end() && cached->second == anim_) {
+			std::vector<std::vector<glm::mat4> >& samples = cache_->samples[anim_->name];
+			const GLfloat pos = anim_->transforms.empty() ? 0.0f : anim_time_/AnimationSampleTime;
+			const size_t index = size_t(pos);
+			if(index + 1 < size_t(g_voxel_animation_cache_samples)) {
+				if(index + 1 >= samples.size()) {
+					samples.resize(index + 2);
+				}
+
+				for(size_t n = index; n <= index + 1; ++n) {
+					if(samples[n].empty()) {
+						sample_animation(*anim_, n*AnimationSampleTime, &samples[n]);
+					}
+				}
+
+				// blend the samples either side of the time, so it plays
+				// smoothly whatever the time falls on.
+				const GLfloat blend = pos - GLfloat(index);
+				const std::vector<glm::mat4>& before = samples[index];
+				const std::vector<glm::mat4>& after = samples[index + 1];
+				std::vector<glm::mat4> transforms(before.size());
+				for(size_t n = 0; n != transforms.size(); ++n) {
+					transforms[n] = before[n]*(1.0f - blend) + after[n]*blend;
+				}
+
+				set_layer_transforms(transforms);
+			} else {
+				std::vector<glm::mat4> transforms;
+				sample_animation(*anim_, anim_time_, &transforms);
+				set_layer_transforms(transforms);
+			}
+			return;
+		}
+	}
+
 	clear_transforms();
 
 	game_logic::map_formula_callable_ptr callable(new game_logic::map_formula_callable);
@@ -767,6 +858,86 @@ void voxel_model::process_animation(GLfloat advance)
 	generate_geometry();
 }
 
+void voxel_model::sample_animation(const Animation& anim, GLfloat time, std::vector<glm::mat4>* transforms) const
+{
+	// two for each layer: one for the layer, and one for what's attached to
+	// it, which children_only transforms also move.
+	transforms->assign(children_.size()*2, glm::mat4(1.0f));
+
+	game_logic::map_formula_callable_ptr callable(new game_logic::map_formula_callable);
+	callable->add("time", variant(decimal(time)));
+
+	for(const AnimationTransform& transform : anim.transforms) {
+		size_t layer = 0;
+		while(layer != children_.size() && children_[layer]->name() != transform.layer) {
+			++layer;
+		}
+		ASSERT_LOG(layer != children_.size(), "Could not find child in model: " << transform.layer);
+
+		glm::mat4 m(1.0f);
+		if(transform.translation_formula) {
+			const variant result = transform.translation_formula->execute(*callable);
+			m = glm::translate(glm::mat4(1.0f), variant_to_vec3(result));
+		}
+
+		if(transform.pivot_src.empty() == false) {
+			const glm::vec3* p1 = NULL;
+			const glm::vec3* p2 = NULL;
+			for(const std::pair<std::string, glm::vec3>& p : children_[layer]->pivots_) {
+				if(p.first == transform.pivot_src) {
+					p1 = &p.second;
+				}
+				if(p.first == transform.pivot_dst) {
+					p2 = &p.second;
+				}
+			}
+			ASSERT_LOG(p1 && p2, "Illegal pivot specification: " << transform.pivot_src << " - " << transform.pivot_dst);
+
+			GLfloat rotation = 0.0;
+			if(transform.rotation_formula) {
+				rotation = transform.rotation_formula->execute(*callable).as_decimal().as_float();
+			}
+
+			m = glm::translate(glm::mat4(1.0f), *p1)
+				* glm::rotate(glm::mat4(1.0f), rotation, glm::normalize(*p2 - *p1))
+				* glm::translate(glm::mat4(1.0f), -*p1)
+				* m;
+		}
+
+		(*transforms)[layer*2 + 1] = m * (*transforms)[layer*2 + 1];
+		if(!transform.children_only) {
+			(*transforms)[layer*2] = m * (*transforms)[layer*2];
+		}
+	}
+}
+
+void voxel_model::set_layer_transforms(const std::vector<glm::mat4>& transforms)
+{
+	rotation_.clear();
+	invalidated_ = false;
+	model_ = proto_model_;
+
+	for(size_t n = 0; n != children_.size(); ++n) {
+		voxel_model& layer = *children_[n];
+		layer.rotation_.clear();
+		layer.invalidated_ = false;
+		layer.model_ = transforms[n*2] * layer.proto_model_;
+		for(const voxel_model_ptr& child : layer.children_) {
+			child->set_attached_transform(transforms[n*2 + 1]);
+		}
+	}
+}
+
+void voxel_model::set_attached_transform(const glm::mat4& transform)
+{
+	rotation_.clear();
+	invalidated_ = false;
+	model_ = transform * proto_model_;
+	for(const voxel_model_ptr& child : children_) {
+		child->set_attached_transform(transform);
+	}
+}
+
 void voxel_model::accumulate_rotation(const std::string& pivot_a, const std::string& pivot_b, GLfloat rotation, glm::vec3 translation, bool children_only)
 {
 	invalidated_ = true;
@@ -821,7 +992,7 @@ void voxel_model::draw(graphics::lighting_ptr lighting, camera_callable_ptr came
 	for(auto child : children_) {
 		child->draw(lighting, camera, model);
 	}
-	if(vbo_id_) {
+	if(mesh_) {
 		GLint cur_program;
 		glGetIntegerv(GL_CURRENT_PROGRAM, &cur_program);
 
@@ -850,16 +1021,16 @@ void voxel_model::draw(graphics::lighting_ptr lighting, camera_callable_ptr came
 			lighting->set_modelview_matrix(mdl, camera->view_mat());
 		}
 
-		glBindBuffer(GL_ARRAY_BUFFER, *vbo_id_);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh_->vbo);
 		glEnableVertexAttribArray(a_position);
 		glEnableVertexAttribArray(a_color);
 		for(int n = FACE_LEFT; n != MAX_FACES; ++n) {
 			if(u_normal != -1) {
 				glUniform3fv(u_normal, 1, glm::value_ptr(normal_vectors()[n]));
 			}
-			glVertexAttribPointer(a_position, 3, GL_FLOAT, GL_FALSE, 0, reinterpret_cast<const GLfloat*>(vattrib_offsets_[n]));
-			glVertexAttribPointer(a_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, reinterpret_cast<const GLfloat*>(cattrib_offsets_[n]));
-			glDrawArrays(GL_TRIANGLES, 0, num_vertices_[n]);
+			glVertexAttribPointer(a_position, 3, GL_FLOAT, GL_FALSE, 0, reinterpret_cast<const GLfloat*>(mesh_->vattrib_offsets[n]));
+			glVertexAttribPointer(a_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, reinterpret_cast<const GLfloat*>(mesh_->cattrib_offsets[n]));
+			glDrawArrays(GL_TRIANGLES, 0, mesh_->num_vertices[n]);
 		}
 		glDisableVertexAttribArray(a_color);
 		glDisableVertexAttribArray(a_position);
@@ -93,6 +93,10 @@ struct Animation {
 	std::string name;
 	std::vector<AnimationTransform> transforms;
 	GLfloat duration;
+
+	// A looping animation may say it repeats after this long, so its time
+	// can be wrapped and only one cycle of it sampled. Zero or less if not.
+	GLfloat period;
 };
 
 Animation read_animation(const variant& v);
@@ -138,6 +142,11 @@ LayerType read_layer_type(const variant& v);
 Model read_model(const variant& v);
 variant write_model(const Model& model);
 
+// The mesh of one variation of a layer, and what's shared by every model
+// loaded from the same file.
+struct LayerMesh;
+struct ModelCache;
+
 class voxel_model;
 typedef boost::intrusive_ptr<voxel_model> voxel_model_ptr;
 typedef boost::intrusive_ptr<const voxel_model> const_voxel_model_ptr;
@@ -146,13 +155,10 @@ class voxel_model : public game_logic::formula_callable
 {
 public:
 	explicit voxel_model(const variant& node);
-	voxel_model(const Layer& layer, const LayerType& layer_type);
+	voxel_model(const LayerType& layer_type, boost::shared_ptr<const LayerMesh> mesh);
 
 	voxel_model_ptr get_child(const std::string& id) const;
 
-	void add_face(int face, const VoxelPair& p, std::vector<GLfloat>& varray, std::vector<GLubyte>& carray);
-	void add_vertex_data(int face, GLfloat x, GLfloat y, GLfloat z, std::vector<GLfloat>& varray);
-
 	void attach_child(voxel_model_ptr child, const std::string& src_attachment, const std::string& dst_attachment);
 
 	std::string current_animation() const { return anim_ ? anim_->name : ""; }
@@ -186,6 +192,13 @@ private:
 	void calculate_transforms();
 	void apply_transforms();
 
+	// Each layer's transform at a time in an animation, for the layer
+	// itself and for what's attached to it, and setting the layers to
+	// them.
+	void sample_animation(const Animation& anim, GLfloat time, std::vector<glm::mat4>* transforms) const;
+	void set_layer_transforms(const std::vector<glm::mat4>& transforms);
+	void set_attached_transform(const glm::mat4& transform);
+
 	void reset_geometry();
 	void generate_geometry();
 	void translate_geometry(const glm::vec3& amount, bool children_only=false);
@@ -216,11 +229,8 @@ private:
 
 	bool invalidated_;
 
-	typedef boost::shared_ptr<GLuint> vbo_ptr;
-	vbo_ptr vbo_id_;
-	size_t vattrib_offsets_[6];
-	size_t cattrib_offsets_[6];
-	size_t num_vertices_[6];
+	boost::shared_ptr<const LayerMesh> mesh_;
+	boost::shared_ptr<ModelCache> cache_;
 
 	glm::vec3 aabb_[2];
 
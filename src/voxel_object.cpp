@@ -118,12 +118,7 @@ namespace voxel
 	{
 		//profile::manager pman("voxel_object::draw");
 		if(model_) {
-			model_matrix_ = 
-				  glm::translate(glm::mat4(1.0f), translation_)
-				* glm::scale(glm::mat4(1.0f), scale_)
-				* glm::rotate(glm::mat4(1.0f), rotation_.x, glm::vec3(1,0,0))
-				* glm::rotate(glm::mat4(1.0f), rotation_.z, glm::vec3(0,0,1))
-				* glm::rotate(glm::mat4(1.0f), rotation_.y, glm::vec3(0,1,0));
+			model_matrix_ = calculate_model_matrix();
 			model_->draw(lighting, camera, model_matrix_);
 		}
 
@@ -131,16 +126,39 @@ namespace voxel
 		}
 	}
 
+	glm::mat4 voxel_object::calculate_model_matrix() const
+	{
+		return glm::translate(glm::mat4(1.0f), translation_)
+			* glm::scale(glm::mat4(1.0f), scale_)
+			* glm::rotate(glm::mat4(1.0f), rotation_.x, glm::vec3(1,0,0))
+			* glm::rotate(glm::mat4(1.0f), rotation_.z, glm::vec3(0,0,1))
+			* glm::rotate(glm::mat4(1.0f), rotation_.y, glm::vec3(0,1,0));
+	}
+
+	bool voxel_object::get_world_bounds(glm::vec3* b1, glm::vec3* b2) const
+	{
+		if(!model_) {
+			return false;
+		}
+
+		glm::vec3 m1, m2;
+		model_->get_bounding_box(m1, m2);
+
+		// A rotated box is bounded by all its corners, not just two.
+		const glm::mat4 model = calculate_model_matrix();
+		for(int n = 0; n != 8; ++n) {
+			const glm::vec4 corner = model * glm::vec4(n&1 ? m2.x : m1.x, n&2 ? m2.y : m1.y, n&4 ? m2.z : m1.z, 1.0f);
+			const glm::vec3 c(corner);
+			*b1 = n == 0 ? c : glm::min(*b1, c);
+			*b2 = n == 0 ? c : glm::max(*b2, c);
+		}
+		return true;
+	}
+
 	bool voxel_object::pt_in_object(const glm::vec3& pt)
 	{
-		if(model_) {
-			glm::vec3 b1;
-			glm::vec3 b2;
-			model_->get_bounding_box(b1, b2);
-			glm::vec4 bb1 = model_matrix_ * glm::vec4(b1,1.0f);
-			glm::vec4 bb2 = model_matrix_ * glm::vec4(b2,1.0f);
-			//std::cerr << "pt_in_object: " << pt.x << "," << pt.y << "," << pt.z << " : " << b1.x << "," << b1.y << "," << b1.z << ":" << b2.x << "," << b2.y << "," << b2.z << " : " << std::endl;
-			//std::cerr << "pt_in_object: " << bb1.x << "," << bb1.y << "," << bb1.z << ":" << bb2.x << "," << bb2.y << "," << bb2.z << std::endl;
+		glm::vec3 bb1, bb2;
+		if(get_world_bounds(&bb1, &bb2)) {
 			if(pt.x >= bb1.x && pt.x <= bb2.x && pt.y >= bb1.y && pt.y <= bb2.y && pt.z >= bb1.z && pt.z <= bb2.z) {
 				return true;
 			}
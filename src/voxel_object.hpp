@@ -85,6 +85,10 @@ public:
 
 	bool pt_in_object(const glm::vec3& pt);
 
+	// The box around the model as it's placed now, in world coordinates.
+	// Returns false if there's no model.
+	bool get_world_bounds(glm::vec3* b1, glm::vec3* b2) const;
+
 	void set_event_arg(variant v);
 
 	bool is_mouseover_object() const { return is_mouseover_; }
@@ -97,6 +101,8 @@ protected:
 private:
 	DECLARE_CALLABLE(voxel_object);
 
+	glm::mat4 calculate_model_matrix() const;
+
 	std::string type_;
 
 	bool paused_;
@@ -0,0 +1,373 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "foreach.hpp"
+#include "unit_test.hpp"
+#include "voxel_query.hpp"
+
+namespace voxel
+{
+	namespace
+	{
+		//a box covering more cells than this is checked by every query
+		//instead.
+		const int MaxCellsPerBox = 512;
+
+		int cell_coord(float f, float cell_size)
+		{
+			return int(floor(f/cell_size));
+		}
+
+		struct collect_cell
+		{
+			explicit collect_cell(std::vector<glm::ivec3>* cells) : cells_(cells)
+			{}
+
+			bool operator()(int x, int y, int z) const {
+				cells_->push_back(glm::ivec3(x, y, z));
+				return false;
+			}
+
+			std::vector<glm::ivec3>* cells_;
+		};
+	}
+
+	const int heightfield::NoHeight;
+	const int heightfield::TileWidth;
+
+	heightfield::heightfield() : tile_x_(0), tile_z_(0), tiles_w_(0), tiles_d_(0)
+	{}
+
+	void heightfield::set(int x, int z, int height)
+	{
+		const int tx = floor_tile(x)/TileWidth;
+		const int tz = floor_tile(z)/TileWidth;
+		if(tiles_.empty() || tx < tile_x_ || tz < tile_z_ || tx >= tile_x_ + tiles_w_ || tz >= tile_z_ + tiles_d_) {
+			if(height == NoHeight) {
+				return;
+			}
+
+			//lay the tiles out again to cover the new one.
+			const int x1 = tiles_.empty() ? tx : std::min(tx, tile_x_);
+			const int z1 = tiles_.empty() ? tz : std::min(tz, tile_z_);
+			const int x2 = tiles_.empty() ? tx + 1 : std::max(tx + 1, tile_x_ + tiles_w_);
+			const int z2 = tiles_.empty() ? tz + 1 : std::max(tz + 1, tile_z_ + tiles_d_);
+
+			std::vector<std::vector<int> > tiles((x2 - x1)*(z2 - z1));
+			for(int j = 0; j != tiles_d_; ++j) {
+				for(int i = 0; i != tiles_w_; ++i) {
+					tiles[(tile_z_ + j - z1)*(x2 - x1) + (tile_x_ + i - x1)].swap(tiles_[j*tiles_w_ + i]);
+				}
+			}
+
+			tiles_.swap(tiles);
+			tile_x_ = x1;
+			tile_z_ = z1;
+			tiles_w_ = x2 - x1;
+			tiles_d_ = z2 - z1;
+		}
+
+		std::vector<int>& t = tiles_[(tz - tile_z_)*tiles_w_ + (tx - tile_x_)];
+		if(t.empty()) {
+			if(height == NoHeight) {
+				return;
+			}
+			t.resize(TileWidth*TileWidth, NoHeight);
+		}
+
+		t[(x - floor_tile(x))*TileWidth + (z - floor_tile(z))] = height;
+	}
+
+	bool ray_hits_box(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& box_min, const glm::vec3& box_max, float* distance)
+	{
+		float t_enter = 0.0f;
+		float t_exit = std::numeric_limits<float>::infinity();
+		for(int n = 0; n != 3; ++n) {
+			if(direction[n] == 0.0f) {
+				if(origin[n] < box_min[n] || origin[n] > box_max[n]) {
+					return false;
+				}
+				continue;
+			}
+
+			float t1 = (box_min[n] - origin[n])/direction[n];
+			float t2 = (box_max[n] - origin[n])/direction[n];
+			if(t1 > t2) {
+				std::swap(t1, t2);
+			}
+
+			t_enter = std::max(t_enter, t1);
+			t_exit = std::min(t_exit, t2);
+			if(t_enter > t_exit) {
+				return false;
+			}
+		}
+
+		*distance = t_enter;
+		return true;
+	}
+
+	aabb_grid::aabb_grid(float cell_size) : cell_size_(cell_size)
+	{}
+
+	void aabb_grid::clear()
+	{
+		boxes_.clear();
+		cells_.clear();
+		large_.clear();
+	}
+
+	uint64_t aabb_grid::cell_key(int x, int y, int z) const
+	{
+		return (uint64_t(uint32_t(x) & 0x1FFFFF) << 42) | (uint64_t(uint32_t(y) & 0x1FFFFF) << 21) | uint64_t(uint32_t(z) & 0x1FFFFF);
+	}
+
+	void aabb_grid::add(int id, const glm::vec3& box_min, const glm::vec3& box_max)
+	{
+		const box b = { id, box_min, box_max };
+		boxes_.push_back(b);
+		insert_box(boxes_.size() - 1);
+	}
+
+	void aabb_grid::move(int index, const glm::vec3& box_min, const glm::vec3& box_max)
+	{
+		erase_box(index);
+		boxes_[index].min = box_min;
+		boxes_[index].max = box_max;
+		insert_box(index);
+	}
+
+	bool aabb_grid::box_cells(const box& b, glm::ivec3* c1, glm::ivec3* c2) const
+	{
+		*c1 = glm::ivec3(cell_coord(b.min.x, cell_size_), cell_coord(b.min.y, cell_size_), cell_coord(b.min.z, cell_size_));
+		*c2 = glm::ivec3(cell_coord(b.max.x, cell_size_), cell_coord(b.max.y, cell_size_), cell_coord(b.max.z, cell_size_));
+		return int64_t(c2->x - c1->x + 1)*(c2->y - c1->y + 1)*(c2->z - c1->z + 1) <= MaxCellsPerBox;
+	}
+
+	void aabb_grid::insert_box(int index)
+	{
+		glm::ivec3 c1, c2;
+		if(!box_cells(boxes_[index], &c1, &c2)) {
+			large_.push_back(index);
+			return;
+		}
+
+		for(int z = c1.z; z <= c2.z; ++z) {
+			for(int y = c1.y; y <= c2.y; ++y) {
+				for(int x = c1.x; x <= c2.x; ++x) {
+					cells_[cell_key(x, y, z)].push_back(index);
+				}
+			}
+		}
+	}
+
+	void aabb_grid::erase_box(int index)
+	{
+		glm::ivec3 c1, c2;
+		if(!box_cells(boxes_[index], &c1, &c2)) {
+			large_.erase(std::remove(large_.begin(), large_.end(), index), large_.end());
+			return;
+		}
+
+		for(int z = c1.z; z <= c2.z; ++z) {
+			for(int y = c1.y; y <= c2.y; ++y) {
+				for(int x = c1.x; x <= c2.x; ++x) {
+					auto it = cells_.find(cell_key(x, y, z));
+					if(it == cells_.end()) {
+						continue;
+					}
+
+					it->second.erase(std::remove(it->second.begin(), it->second.end(), index), it->second.end());
+					if(it->second.empty()) {
+						cells_.erase(it);
+					}
+				}
+			}
+		}
+	}
+
+	void aabb_grid::find_at_point(const glm::vec3& pt, std::vector<int>* ids) const
+	{
+		std::vector<int> found;
+		auto it = cells_.find(cell_key(cell_coord(pt.x, cell_size_), cell_coord(pt.y, cell_size_), cell_coord(pt.z, cell_size_)));
+		if(it != cells_.end()) {
+			found = it->second;
+		}
+		found.insert(found.end(), large_.begin(), large_.end());
+		std::sort(found.begin(), found.end());
+
+		foreach(int index, found) {
+			const box& b = boxes_[index];
+			if(pt.x >= b.min.x && pt.x <= b.max.x && pt.y >= b.min.y && pt.y <= b.max.y && pt.z >= b.min.z && pt.z <= b.max.z) {
+				ids->push_back(b.id);
+			}
+		}
+	}
+
+	void aabb_grid::find_on_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance, std::vector<std::pair<float, int> >* hits) const
+	{
+		//the cells the ray passes through, walked in cell units.
+		std::vector<glm::ivec3> cells;
+		ray_hit unused;
+		cast_ray(origin/cell_size_, direction/cell_size_, max_distance, collect_cell(&cells), &unused);
+
+		std::vector<int> found(large_);
+		foreach(const glm::ivec3& c, cells) {
+			auto it = cells_.find(cell_key(c.x, c.y, c.z));
+			if(it != cells_.end()) {
+				found.insert(found.end(), it->second.begin(), it->second.end());
+			}
+		}
+
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+
+		const size_t first = hits->size();
+		foreach(int index, found) {
+			const box& b = boxes_[index];
+			float distance = 0.0f;
+			if(ray_hits_box(origin, direction, b.min, b.max, &distance) && distance <= max_distance) {
+				hits->push_back(std::pair<float, int>(distance, b.id));
+			}
+		}
+
+		std::stable_sort(hits->begin() + first, hits->end());
+	}
+}
+
+namespace {
+
+struct solid_set
+{
+	explicit solid_set(const std::vector<glm::ivec3>* voxels, std::vector<glm::ivec3>* visited=NULL) : voxels_(voxels), visited_(visited)
+	{}
+
+	bool operator()(int x, int y, int z) const {
+		if(visited_) {
+			visited_->push_back(glm::ivec3(x, y, z));
+		}
+		return std::find(voxels_->begin(), voxels_->end(), glm::ivec3(x, y, z)) != voxels_->end();
+	}
+
+	const std::vector<glm::ivec3>* voxels_;
+	std::vector<glm::ivec3>* visited_;
+};
+
+struct heightfield_solid
+{
+	explicit heightfield_solid(const voxel::heightfield& h) : h_(h)
+	{}
+
+	bool operator()(int x, int y, int z) const {
+		return h_.is_solid(x, y, z);
+	}
+
+	const voxel::heightfield& h_;
+};
+
+}
+
+UNIT_TEST(voxel_heightfield) {
+	voxel::heightfield h;
+	CHECK_EQ(h.get(0, 0), voxel::heightfield::NoHeight);
+	h.set(3, 4, 7);
+	h.set(-20, 40, 2);
+	h.set(100, -33, -5);
+	CHECK_EQ(h.get(3, 4), 7);
+	CHECK_EQ(h.get(-20, 40), 2);
+	CHECK_EQ(h.get(100, -33), -5);
+	CHECK_EQ(h.get(4, 4), voxel::heightfield::NoHeight);
+	CHECK_EQ(h.get(-1000, 4), voxel::heightfield::NoHeight);
+	CHECK_EQ(h.is_solid(3, 7, 4), true);
+	CHECK_EQ(h.is_solid(3, 8, 4), false);
+	CHECK_EQ(h.is_solid(4, -100, 4), false);
+}
+
+UNIT_TEST(voxel_cast_ray) {
+	std::vector<glm::ivec3> solid;
+	solid.push_back(glm::ivec3(5, 0, 0));
+	solid.push_back(glm::ivec3(-3, 2, 1));
+
+	voxel::ray_hit hit;
+	CHECK_EQ(voxel::cast_ray(glm::vec3(0.5f, 0.5f, 0.5f), glm::vec3(1, 0, 0), 100.0f, solid_set(&solid), &hit), true);
+	CHECK_EQ(hit.voxel == glm::ivec3(5, 0, 0), true);
+	CHECK_EQ(hit.normal == glm::ivec3(-1, 0, 0), true);
+	CHECK_EQ(hit.distance, 4.5f);
+
+	//too short to reach it, or pointing away.
+	CHECK_EQ(voxel::cast_ray(glm::vec3(0.5f, 0.5f, 0.5f), glm::vec3(1, 0, 0), 4.0f, solid_set(&solid), &hit), false);
+	CHECK_EQ(voxel::cast_ray(glm::vec3(0.5f, 0.5f, 0.5f), glm::vec3(-1, 0, 0), 50.0f, solid_set(&solid), &hit), false);
+
+	//diagonally, into negative coordinates, visiting voxels which share faces.
+	std::vector<glm::ivec3> visited;
+	CHECK_EQ(voxel::cast_ray(glm::vec3(0.5f, 0.5f, 0.5f), glm::vec3(-3.5f, 2.0f, 0.6f), 2.0f, solid_set(&solid, &visited), &hit), true);
+	CHECK_EQ(hit.voxel == glm::ivec3(-3, 2, 1), true);
+	for(int n = 1; n < visited.size(); ++n) {
+		const glm::ivec3 d = visited[n] - visited[n-1];
+		CHECK_EQ(abs(d.x) + abs(d.y) + abs(d.z), 1);
+	}
+
+	voxel::heightfield h;
+	for(int x = 0; x != 20; ++x) {
+		h.set(x, 0, x == 10 ? 5 : 0);
+	}
+	CHECK_EQ(voxel::cast_ray(glm::vec3(0.5f, 2.5f, 0.5f), glm::vec3(1, 0, 0), 30.0f, heightfield_solid(h), &hit), true);
+	CHECK_EQ(hit.voxel == glm::ivec3(10, 2, 0), true);
+	CHECK_EQ(voxel::cast_ray(glm::vec3(0.5f, 6.5f, 0.5f), glm::vec3(1, 0, 0), 30.0f, heightfield_solid(h), &hit), false);
+}
+
+UNIT_TEST(voxel_aabb_grid) {
+	voxel::aabb_grid grid(4.0f);
+	grid.add(10, glm::vec3(0, 0, 0), glm::vec3(1, 1, 1));
+	grid.add(11, glm::vec3(-9, 0, 0), glm::vec3(-7, 2, 1));
+	grid.add(12, glm::vec3(5, 0, 0), glm::vec3(6, 1, 1));
+	grid.add(13, glm::vec3(-1000, -1000, -1000), glm::vec3(1000, -999, 1000));
+
+	std::vector<int> ids;
+	grid.find_at_point(glm::vec3(0.5f, 0.5f, 0.5f), &ids);
+	CHECK_EQ(ids.size(), 1);
+	CHECK_EQ(ids[0], 10);
+
+	ids.clear();
+	grid.find_at_point(glm::vec3(3, -999.5f, 200), &ids);
+	CHECK_EQ(ids.size(), 1);
+	CHECK_EQ(ids[0], 13);
+
+	std::vector<std::pair<float, int> > hits;
+	grid.find_on_ray(glm::vec3(-20, 0.5f, 0.5f), glm::vec3(1, 0, 0), 40.0f, &hits);
+	CHECK_EQ(hits.size(), 3);
+	CHECK_EQ(hits[0].second, 11);
+	CHECK_EQ(hits[0].first, 11.0f);
+	CHECK_EQ(hits[1].second, 10);
+	CHECK_EQ(hits[2].second, 12);
+
+	hits.clear();
+	grid.find_on_ray(glm::vec3(-20, 0.5f, 0.5f), glm::vec3(1, 0, 0), 15.0f, &hits);
+	CHECK_EQ(hits.size(), 1);
+
+	//a moved box is only found where it is now.
+	grid.move(0, glm::vec3(20, 0, 0), glm::vec3(21, 1, 1));
+	ids.clear();
+	grid.find_at_point(glm::vec3(0.5f, 0.5f, 0.5f), &ids);
+	CHECK_EQ(ids.size(), 0);
+	grid.find_at_point(glm::vec3(20.5f, 0.5f, 0.5f), &ids);
+	CHECK_EQ(ids.size(), 1);
+	CHECK_EQ(ids[0], 10);
+}
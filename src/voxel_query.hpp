@@ -0,0 +1,190 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXEL_QUERY_HPP_INCLUDED
+#define VOXEL_QUERY_HPP_INCLUDED
+
+#include <boost/unordered_map.hpp>
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "asserts.hpp"
+
+namespace voxel
+{
+	//The height of the highest voxel in each column of a world, kept in
+	//dense square tiles. Only tiles with a column in them are allocated,
+	//and finding a column takes no hashing.
+	class heightfield
+	{
+	public:
+		static const int NoHeight = INT_MIN;
+		static const int TileWidth = 16;
+
+		heightfield();
+
+		//the height of the column at x, z, or NoHeight if it's empty.
+		int get(int x, int z) const {
+			const std::vector<int>* t = tile(x, z);
+			return t ? (*t)[(x - floor_tile(x))*TileWidth + (z - floor_tile(z))] : NoHeight;
+		}
+
+		bool is_solid(int x, int y, int z) const {
+			const int h = get(x, z);
+			return h != NoHeight && y <= h;
+		}
+
+		void set(int x, int z, int height);
+
+		//the area which may have columns in it, in voxels.
+		int min_x() const { return tile_x_*TileWidth; }
+		int min_z() const { return tile_z_*TileWidth; }
+		int size_x() const { return tiles_w_*TileWidth; }
+		int size_z() const { return tiles_d_*TileWidth; }
+	private:
+		static int floor_tile(int n) {
+			return (n >= 0 ? n/TileWidth : -((-n + TileWidth - 1)/TileWidth))*TileWidth;
+		}
+
+		const std::vector<int>* tile(int x, int z) const {
+			const int tx = floor_tile(x)/TileWidth - tile_x_;
+			const int tz = floor_tile(z)/TileWidth - tile_z_;
+			if(tx < 0 || tz < 0 || tx >= tiles_w_ || tz >= tiles_d_) {
+				return NULL;
+			}
+			const std::vector<int>& t = tiles_[tz*tiles_w_ + tx];
+			return t.empty() ? NULL : &t;
+		}
+
+		int tile_x_, tile_z_, tiles_w_, tiles_d_;
+		std::vector<std::vector<int> > tiles_;
+	};
+
+	struct ray_hit
+	{
+		//the voxel hit, the face it was entered through, as the direction
+		//that face points, and how far along the ray it was entered, in
+		//lengths of the ray's direction.
+		glm::ivec3 voxel;
+		glm::ivec3 normal;
+		float distance;
+	};
+
+	//Walks the voxels a ray passes through, in order, with Amanatides and
+	//Woo's 3D DDA, until solid(x, y, z) is true of one or the ray has gone
+	//max_distance. Voxel x, y, z covers [x, x+1) along each axis. If the
+	//ray starts in a solid voxel that voxel is hit, with a normal of 0.
+	template<typename Solid>
+	bool cast_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance, Solid solid, ray_hit* hit)
+	{
+		ASSERT_LOG(max_distance < std::numeric_limits<float>::infinity(), "cast_ray: max_distance must be finite");
+
+		glm::ivec3 voxel(int(floor(origin.x)), int(floor(origin.y)), int(floor(origin.z)));
+		glm::ivec3 step(0);
+		glm::vec3 t_max(std::numeric_limits<float>::infinity());
+		glm::vec3 t_delta(std::numeric_limits<float>::infinity());
+		for(int n = 0; n != 3; ++n) {
+			if(direction[n] > 0.0f) {
+				step[n] = 1;
+				t_max[n] = (float(voxel[n] + 1) - origin[n])/direction[n];
+				t_delta[n] = 1.0f/direction[n];
+			} else if(direction[n] < 0.0f) {
+				step[n] = -1;
+				t_max[n] = (origin[n] - float(voxel[n]))/-direction[n];
+				t_delta[n] = -1.0f/direction[n];
+			}
+		}
+
+		glm::ivec3 normal(0);
+		float t = 0.0f;
+		while(t <= max_distance) {
+			if(solid(voxel.x, voxel.y, voxel.z)) {
+				hit->voxel = voxel;
+				hit->normal = normal;
+				hit->distance = t;
+				return true;
+			}
+
+			const int axis = t_max.x < t_max.y ? (t_max.x < t_max.z ? 0 : 2) : (t_max.y < t_max.z ? 1 : 2);
+			t = t_max[axis];
+			voxel[axis] += step[axis];
+			t_max[axis] += t_delta[axis];
+			normal = glm::ivec3(0);
+			normal[axis] = -step[axis];
+		}
+
+		return false;
+	}
+
+	//where along the ray it enters the box, or 0 if it starts in it.
+	//Returns false if it misses.
+	bool ray_hits_box(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& box_min, const glm::vec3& box_max, float* distance);
+
+	//Finds which of a set of boxes a point or ray touches, by putting each
+	//box in the cells of a uniform grid it overlaps. Boxes are known by an
+	//id, so the caller keeps whatever they stand for.
+	class aabb_grid
+	{
+	public:
+		explicit aabb_grid(float cell_size=4.0f);
+
+		void clear();
+		void add(int id, const glm::vec3& box_min, const glm::vec3& box_max);
+		bool empty() const { return boxes_.empty(); }
+
+		//moves the box which was the index'th added.
+		void move(int index, const glm::vec3& box_min, const glm::vec3& box_max);
+
+		//the ids of the boxes which contain pt, in the order they were added.
+		void find_at_point(const glm::vec3& pt, std::vector<int>* ids) const;
+
+		//the boxes the ray enters within max_distance, nearest first, with
+		//how far along the ray each is entered.
+		void find_on_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance, std::vector<std::pair<float, int> >* hits) const;
+	private:
+		struct box
+		{
+			int id;
+			glm::vec3 min, max;
+		};
+
+		uint64_t cell_key(int x, int y, int z) const;
+
+		//the range of cells the box covers, or false if it covers too many
+		//to be put in cells.
+		bool box_cells(const box& b, glm::ivec3* c1, glm::ivec3* c2) const;
+		void insert_box(int index);
+		void erase_box(int index);
+
+		float cell_size_;
+		std::vector<box> boxes_;
+
+		//the boxes in each cell, and boxes too big to be put in cells which
+		//are always checked.
+		boost::unordered_map<uint64_t, std::vector<int> > cells_;
+		std::vector<int> large_;
+	};
+}
+
+#endif
@@ -0,0 +1,414 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include "compress.hpp"
+#include "filesystem.hpp"
+#include "foreach.hpp"
+#include "unit_test.hpp"
+#include "voxel_region.hpp"
+
+namespace voxel
+{
+	namespace region_file
+	{
+		namespace
+		{
+			const char Magic[4] = { 'V', 'X', 'R', 'G' };
+			const uint32_t Version = 1;
+
+			//magic, version and the number of chunks, and then for each
+			//chunk its x, y, z, offset and size.
+			const int HeaderSize = 12;
+			const int EntrySize = 20;
+
+			void write_u32(std::string* out, uint32_t n)
+			{
+				for(int i = 0; i != 4; ++i) {
+					out->push_back(char((n >> (i*8)) & 0xFF));
+				}
+			}
+
+			void write_u16(std::string* out, uint16_t n)
+			{
+				out->push_back(char(n & 0xFF));
+				out->push_back(char(n >> 8));
+			}
+
+			//reads little endian numbers from a buffer, remembering if it
+			//ever runs off the end.
+			class reader
+			{
+			public:
+				reader(const char* begin, const char* end) : p_(begin), end_(end), ok_(true)
+				{}
+
+				bool ok() const { return ok_; }
+
+				uint32_t u32() {
+					return uint32_t(get()) | (uint32_t(get()) << 8) | (uint32_t(get()) << 16) | (uint32_t(get()) << 24);
+				}
+
+				uint16_t u16() {
+					const uint16_t lo = get();
+					return lo | uint16_t(get() << 8);
+				}
+
+				int i32() { return int(u32()); }
+
+				std::string str(uint32_t len) {
+					if(uint32_t(end_ - p_) < len) {
+						ok_ = false;
+						return std::string();
+					}
+					std::string res(p_, p_ + len);
+					p_ += len;
+					return res;
+				}
+			private:
+				uint8_t get() {
+					if(p_ == end_) {
+						ok_ = false;
+						return 0;
+					}
+					return uint8_t(*p_++);
+				}
+
+				const char* p_;
+				const char* end_;
+				bool ok_;
+			};
+
+			int floor_div(int n, int d)
+			{
+				return n >= 0 ? n/d : -((-n + d - 1)/d);
+			}
+
+			struct entry
+			{
+				int x, y, z;
+				uint32_t offset, size;
+			};
+
+			bool read_table(std::istream& in, std::vector<entry>* entries)
+			{
+				char header[HeaderSize];
+				if(!in.read(header, HeaderSize) || !std::equal(Magic, Magic + 4, header)) {
+					return false;
+				}
+
+				reader r(header + 4, header + HeaderSize);
+				const uint32_t version = r.u32();
+				const uint32_t count = r.u32();
+				if(version != Version || count > RegionSize*RegionSize*RegionSize) {
+					return false;
+				}
+
+				std::string table(count*EntrySize, 0);
+				if(count && !in.read(&table[0], table.size())) {
+					return false;
+				}
+
+				reader t(table.data(), table.data() + table.size());
+				for(uint32_t n = 0; n != count; ++n) {
+					entry e;
+					e.x = t.i32();
+					e.y = t.i32();
+					e.z = t.i32();
+					e.offset = t.u32();
+					e.size = t.u32();
+					entries->push_back(e);
+				}
+
+				return t.ok();
+			}
+
+			uint64_t stream_size(std::istream& in)
+			{
+				in.seekg(0, std::ios_base::end);
+				const std::streamoff size = in.tellg();
+				in.seekg(0);
+				return size > 0 ? uint64_t(size) : 0;
+			}
+
+			bool read_blob(std::istream& in, uint64_t file_size, const entry& e, std::string* data)
+			{
+				if(uint64_t(e.offset) + e.size > file_size) {
+					return false;
+				}
+
+				data->resize(e.size);
+				in.seekg(e.offset);
+				return e.size == 0 || in.read(&(*data)[0], e.size);
+			}
+		}
+
+		void get_region(int chunk_x, int chunk_y, int chunk_z, int* region_x, int* region_y, int* region_z)
+		{
+			*region_x = floor_div(chunk_x, RegionSize);
+			*region_y = floor_div(chunk_y, RegionSize);
+			*region_z = floor_div(chunk_z, RegionSize);
+		}
+
+		std::string get_path(const std::string& dir, int region_x, int region_y, int region_z)
+		{
+			std::ostringstream s;
+			s << dir << "/r." << region_x << "." << region_y << "." << region_z << ".vxr";
+			return s.str();
+		}
+
+		std::string encode_chunk(const stored_chunk& chunk)
+		{
+			std::string raw;
+			write_u32(&raw, chunk.palette.size());
+			foreach(const std::string& type, chunk.palette) {
+				write_u32(&raw, type.size());
+				raw += type;
+			}
+
+			const dense_voxels& v = chunk.voxels;
+			write_u32(&raw, v.min_x());
+			write_u32(&raw, v.min_y());
+			write_u32(&raw, v.min_z());
+			write_u32(&raw, v.size_x());
+			write_u32(&raw, v.size_y());
+			write_u32(&raw, v.size_z());
+
+			//runs of the same index, which is most of a chunk of terrain.
+			std::string runs;
+			uint32_t nruns = 0;
+			const std::vector<uint16_t>& cells = v.cells();
+			for(size_t n = 0; n != cells.size(); ) {
+				size_t end = n + 1;
+				while(end != cells.size() && cells[end] == cells[n]) {
+					++end;
+				}
+				write_u16(&runs, cells[n]);
+				write_u32(&runs, end - n);
+				++nruns;
+				n = end;
+			}
+
+			write_u32(&raw, nruns);
+			raw += runs;
+
+			const std::vector<char> compressed = zip::compress(std::vector<char>(raw.begin(), raw.end()));
+			std::string res;
+			write_u32(&res, raw.size());
+			res.insert(res.end(), compressed.begin(), compressed.end());
+			return res;
+		}
+
+		bool decode_chunk(const std::string& data, int chunk_size, stored_chunk* chunk)
+		{
+			//zlib can't shrink anything by more than about 1032 to 1, so a
+			//bigger size is garbage rather than something to allocate.
+			reader header(data.data(), data.data() + data.size());
+			const uint32_t raw_size = header.u32();
+			if(!header.ok() || data.size() <= 4 || raw_size == 0 || raw_size/1032 > data.size() - 4) {
+				return false;
+			}
+
+			std::vector<char> raw;
+			if(!zip::try_decompress_known_size(std::vector<char>(data.begin() + 4, data.end()), raw_size, &raw)) {
+				return false;
+			}
+
+			reader r(&raw[0], &raw[0] + raw.size());
+
+			chunk->palette.clear();
+			const uint32_t npalette = r.u32();
+			if(npalette > 0xFFFF) {
+				return false;
+			}
+
+			for(uint32_t n = 0; n != npalette && r.ok(); ++n) {
+				chunk->palette.push_back(r.str(r.u32()));
+			}
+
+			int min[3], size[3];
+			for(int n = 0; n != 3; ++n) {
+				min[n] = r.i32();
+			}
+			for(int n = 0; n != 3; ++n) {
+				size[n] = r.i32();
+			}
+
+			if(!r.ok()) {
+				return false;
+			}
+
+			//the voxels have to fit in the chunk.
+			for(int n = 0; n != 3; ++n) {
+				if(size[n] < 0 || size[n] > chunk_size || (size[n] && (min[n] < 0 || min[n] > chunk_size - size[n]))) {
+					return false;
+				}
+			}
+
+			chunk->voxels = dense_voxels();
+			const int64_t ncells = int64_t(size[0])*size[1]*size[2];
+			if(ncells > 0) {
+				chunk->voxels.reserve(min[0], min[1], min[2], size[0], size[1], size[2]);
+			}
+
+			const uint32_t nruns = r.u32();
+			int64_t cell = 0;
+			for(uint32_t n = 0; n != nruns && r.ok(); ++n) {
+				const uint16_t index = r.u16();
+				const uint32_t len = r.u32();
+				if(cell + len > ncells || index > npalette) {
+					return false;
+				}
+
+				if(index) {
+					for(int64_t c = cell; c != cell + len; ++c) {
+						const int x = int(c % size[0]);
+						const int y = int((c / size[0]) % size[1]);
+						const int z = int(c / (int64_t(size[0])*size[1]));
+						chunk->voxels.set(min[0] + x, min[1] + y, min[2] + z, index);
+					}
+				}
+				cell += len;
+			}
+
+			return r.ok() && cell == ncells;
+		}
+
+		bool read_chunk(const std::string& path, int x, int y, int z, int chunk_size, stored_chunk* chunk)
+		{
+			std::ifstream in(path.c_str(), std::ios_base::binary);
+			if(!in) {
+				return false;
+			}
+
+			const uint64_t file_size = stream_size(in);
+			std::vector<entry> entries;
+			if(!read_table(in, &entries)) {
+				return false;
+			}
+
+			foreach(const entry& e, entries) {
+				if(e.x == x && e.y == y && e.z == z) {
+					std::string data;
+					if(!read_blob(in, file_size, e, &data) || !decode_chunk(data, chunk_size, chunk)) {
+						std::cerr << "Region file " << path << " has a bad chunk at " << x << "," << y << "," << z << std::endl;
+						return false;
+					}
+					chunk->x = x;
+					chunk->y = y;
+					chunk->z = z;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		void write_chunks(const std::string& path, const std::vector<stored_chunk_ptr>& chunks)
+		{
+			std::map<std::vector<int>, std::string> blobs;
+			{
+				std::ifstream in(path.c_str(), std::ios_base::binary);
+				const uint64_t file_size = in ? stream_size(in) : 0;
+				std::vector<entry> entries;
+				if(in && read_table(in, &entries)) {
+					foreach(const entry& e, entries) {
+						std::vector<int> key;
+						key.push_back(e.x);
+						key.push_back(e.y);
+						key.push_back(e.z);
+						if(!read_blob(in, file_size, e, &blobs[key])) {
+							std::cerr << "Region file " << path << " is truncated, rewriting it" << std::endl;
+							blobs.erase(key);
+							break;
+						}
+					}
+				}
+			}
+
+			foreach(const stored_chunk_ptr& c, chunks) {
+				std::vector<int> key;
+				key.push_back(c->x);
+				key.push_back(c->y);
+				key.push_back(c->z);
+				blobs[key] = encode_chunk(*c);
+			}
+
+			std::string data(Magic, Magic + 4);
+			write_u32(&data, Version);
+			write_u32(&data, blobs.size());
+
+			uint32_t offset = HeaderSize + EntrySize*blobs.size();
+			typedef std::pair<const std::vector<int>, std::string> blob_pair;
+			foreach(const blob_pair& b, blobs) {
+				write_u32(&data, b.first[0]);
+				write_u32(&data, b.first[1]);
+				write_u32(&data, b.first[2]);
+				write_u32(&data, offset);
+				write_u32(&data, b.second.size());
+				offset += b.second.size();
+			}
+
+			foreach(const blob_pair& b, blobs) {
+				data += b.second;
+			}
+
+			const std::string tmp = path + ".tmp";
+			sys::write_file(tmp, data);
+			sys::move_file(tmp, path);
+		}
+	}
+}
+
+UNIT_TEST(voxel_region_chunk_encoding) {
+	voxel::stored_chunk chunk;
+	chunk.palette.push_back("\"grass\"");
+	chunk.palette.push_back("[10,200,10,255]");
+	for(int x = 0; x != 16; ++x) {
+		for(int z = 0; z != 9; ++z) {
+			for(int y = 0; y < 3 + (x*z)%5; ++y) {
+				chunk.voxels.set(x, y, z, y == 0 ? 2 : 1);
+			}
+		}
+	}
+
+	const std::string data = voxel::region_file::encode_chunk(chunk);
+	voxel::stored_chunk decoded;
+	CHECK_EQ(voxel::region_file::decode_chunk(data, 16, &decoded), true);
+	CHECK_EQ(decoded.palette == chunk.palette, true);
+	CHECK_EQ(decoded.voxels.min_x(), chunk.voxels.min_x());
+	CHECK_EQ(decoded.voxels.size_y(), chunk.voxels.size_y());
+	CHECK_EQ(decoded.voxels.cells() == chunk.voxels.cells(), true);
+
+	//so much the same as its neighbours that it should pack down well.
+	CHECK_LT(data.size()*8, chunk.voxels.cells().size()*sizeof(uint16_t));
+
+	//corrupt chunks are turned down rather than crashing.
+	CHECK_EQ(voxel::region_file::decode_chunk(data, 8, &decoded), false);
+	CHECK_EQ(voxel::region_file::decode_chunk(data.substr(0, data.size()/2), 16, &decoded), false);
+	CHECK_EQ(voxel::region_file::decode_chunk(std::string(4, '\0') + data.substr(4), 16, &decoded), false);
+	CHECK_EQ(voxel::region_file::decode_chunk(std::string(4, '\xff') + data.substr(4), 16, &decoded), false);
+
+	int rx, ry, rz;
+	voxel::region_file::get_region(-1, 7, 8, &rx, &ry, &rz);
+	CHECK_EQ(rx, -1);
+	CHECK_EQ(ry, 0);
+	CHECK_EQ(rz, 1);
+}
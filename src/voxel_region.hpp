@@ -0,0 +1,74 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef VOXEL_REGION_HPP_INCLUDED
+#define VOXEL_REGION_HPP_INCLUDED
+
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+#include <vector>
+
+#include "voxel_mesher.hpp"
+
+namespace voxel
+{
+	//a chunk as it's kept in a region file. x, y and z are the chunk's
+	//place in chunks, rather than voxels, and palette holds the JSON of the
+	//tile type of each palette index from 1 up.
+	struct stored_chunk
+	{
+		stored_chunk() : x(0), y(0), z(0) {}
+
+		int x, y, z;
+		dense_voxels voxels;
+		std::vector<std::string> palette;
+	};
+
+	typedef boost::shared_ptr<stored_chunk> stored_chunk_ptr;
+
+	//Region files hold the chunks of a RegionSize^3 block of chunks. Each
+	//chunk is run length encoded and compressed on its own, and the file
+	//starts with a table of where each chunk is, so one chunk can be read
+	//without reading the rest. None of these use any state of their own,
+	//so they can be called from any thread.
+	namespace region_file
+	{
+		const int RegionSize = 8;
+
+		void get_region(int chunk_x, int chunk_y, int chunk_z, int* region_x, int* region_y, int* region_z);
+		std::string get_path(const std::string& dir, int region_x, int region_y, int region_z);
+
+		//the chunk's voxels are in its own coordinates, from 0 up to
+		//chunk_size on each axis. Decoding returns false if the data is
+		//corrupt or doesn't fit in a chunk of that size.
+		std::string encode_chunk(const stored_chunk& chunk);
+		bool decode_chunk(const std::string& data, int chunk_size, stored_chunk* chunk);
+
+		//reads the chunk at x, y, z from the file into chunk. Returns false
+		//if there's no such file, it doesn't have the chunk, or the chunk
+		//is corrupt.
+		bool read_chunk(const std::string& path, int x, int y, int z, int chunk_size, stored_chunk* chunk);
+
+		//adds the chunks to the file, replacing any it has in the same
+		//places. Later chunks in the list replace earlier ones. The file is
+		//written to the side and then moved over the old one, so it can be
+		//read from while it's being written.
+		void write_chunks(const std::string& path, const std::vector<stored_chunk_ptr>& chunks);
+	}
+}
+
+#endif